@@ -20,12 +20,21 @@
 #include <signal.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <tree_sitter/api.h>
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** Defines ***/
 
 #define CYPHER_VERSION      "1.8.6"
@@ -34,6 +43,8 @@
 #define CTRL_KEY(k)         ((k) & 0x1f)
 #define is_cntrl(k)         (((unsigned char)(k)) < 32 || ((unsigned char)(k)) == 127)
 #define is_alnum(k)         (((k) >= 'a' && (k) <= 'z') || ((k) >= 'A' && (k) <= 'Z') || ((k) >= '0' && (k) <= '9'))
+#define to_lower(k)         (((k) >= 'A' && (k) <= 'Z') ? (k) + ('a' - 'A') : (k))
+#define is_xdigit(k)        (((k) >= 'a' && (k) <= 'f') || ((k) >= 'A' && (k) <= 'F') || ((k) >= '0' && (k) <= '9'))
 #define RGB_RED(c)          (((c) >> 16) & MASK_8BIT)
 #define RGB_GREEN(c)        (((c) >> 8) & MASK_8BIT)
 #define RGB_BLUE(c)         ((c) & MASK_8BIT)
@@ -48,11 +59,16 @@
 #define PARSE_DEBOUNCE_MS       50
 #define STATUS_LENGTH           256
 #define INIT_UNDO_REDO_CAP      128
+#define INIT_UNDO_BRANCH_CAP    8
+#define INIT_EDIT_BATCH_CAP     64
+#define INIT_DIRTY_RANGE_CAP    64
 #define BUFFER_SIZE_32          32
 #define BUFFER_SIZE_128         128
 #define BUFFER_SIZE_256         256
 #define BUFFER_SIZE_1024        1024
 #define BUFFER_SIZE_4096        4096
+#define READ_BUFFER_SIZE        65536
+#define PASTE_MARKER_RETRIES    3
 #define BUFFER_SIZE_PADDING     64
 #define STATUS_MSG_TIMEOUT_SEC  5
 #define MARGIN                  3
@@ -61,6 +77,55 @@
 #define ALLOC_PADDING           256
 #define GROWTH_THRESHOLD        8192
 #define GROWTH_STEP             4096
+#define BRACKET_FAMILIES        3
+#define BRACKET_BLOCK_SIZE      256
+#define MAX_HIGHLIGHT_PASSES    8
+#define PASS_CACHE_SLOTS        256
+#define FNV_OFFSET_64           1469598103934665603ULL
+#define FNV_PRIME_64            1099511628211ULL
+#define BENCH_RUNS              5
+#define BENCH_PIECE_SPAN        (64 * 1024)
+#define MATCH_BLOCK_SIZE        512
+#define MAX_SEARCH_THREADS      64
+#define SEARCH_PARALLEL_MIN     (4 * 1024 * 1024)
+#define FIND_PREFIX_CACHE_LIMIT (1 << 22)
+#define SCAN_SLICE_MS           16
+#define FIND_QUERY_SLICE        (64 * 1024)
+#define FIND_SPAN_COST          (MATCH_BLOCK_SIZE * 16)
+#define REPLACE_PROGRESS_MS     100
+#define REPLACE_PROGRESS_STEP   1024
+#define PROJECT_MAX_HITS        100000
+#define PROJECT_PREVIEW_LEN     160
+#define PROJECT_MMAP_MIN        (1024 * 1024)
+#define PROJECT_BINARY_PROBE    8192
+#define UNDO_MEMORY_DEFAULT     (64 * 1024 * 1024)
+#define UNDO_PACK_MIN           256
+#define UNDO_BATCH_MIN          16
+#define ADD_COMPACT_MIN         (1024 * 1024)
+#define SAVE_CHUNK_SIZE         (1024 * 1024)
+#define LZ_HASH_BITS            12
+#define LZ_MIN_MATCH            4
+#define LZ_MAX_OFFSET           65535
+#define UNDO_FILE_MAGIC         "CYUNDO1"
+#define UNDO_FILE_VERSION       2
+#define RX_MAX_GROUPS           10
+#define RX_MAX_INSTS            4096
+#define RX_MAX_REPEAT           1000
+#define RX_DFA_MAX_STATES       2048
+#define RX_DFA_TABLE_SIZE       4096
+#define RX_END                  256
+#define RX_UNKNOWN              (-1)
+#define RX_MATCHED              (-2)
+#define RX_ACCEL_BASE           (-3)
+#define RX_MAX_ACCEL            3
+#define RX_PREV_NL              1
+#define RX_PREV_WORD            2
+
+#ifdef __APPLE__
+#define STAT_MTIME_NSEC(st)     ((st)->st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st)     ((st)->st_mtim.tv_nsec)
+#endif
 
 #define NEW_LINE                "\r\n"
 #define ESCAPE_CHAR             '\x1b'
@@ -79,6 +144,8 @@
 #define FG_DEFAULT              "\x1b[39m"
 #define LIGHT_GRAY_BG_COLOR     "\x1b[48;2;60;60;60m"
 #define DARK_GRAY_BG_COLOR      "\x1b[48;2;15;15;15m"
+#define CURRENT_MATCH_BG_COLOR  "\x1b[48;2;110;80;20m"
+#define CARET_BG_COLOR          "\x1b[48;2;150;150;150m"
 #define RESET_BG_COLOR          "\x1b[49m"
 #define REMOVE_GRAPHICS         "\x1b[m"
 #define INVERTED_COLORS         "\x1b[7m"
@@ -98,6 +165,7 @@
 #define MASK_8BIT               0xFF
 #define MASK_6BIT               0x3F
 #define MOUSE_BTN_MASK          3
+#define MOUSE_ALT_MASK          8
 
 #define UTF8_ASCII_MAX          0x7F
 #define UTF8_CONT_MASK          0xC0
@@ -148,6 +216,8 @@ typedef enum {
     ALT_ARROW_DOWN,
     ALT_SHIFT_ARROW_UP,
     ALT_SHIFT_ARROW_DOWN,
+    ALT_SHIFT_ARROW_LEFT,
+    ALT_SHIFT_ARROW_RIGHT,
     CTRL_SLASH,
     MOUSE_SCROLL_UP = 2000,
     MOUSE_SCROLL_DOWN,
@@ -156,6 +226,8 @@ typedef enum {
     MOUSE_LEFT_CLICK,
     MOUSE_DRAG,
     MOUSE_LEFT_RELEASE,
+    MOUSE_BLOCK_CLICK,
+    MOUSE_BLOCK_DRAG,
     PASTE_START = 3000,
     PASTE_END
 } EditorKey;
@@ -167,9 +239,17 @@ typedef enum {
 
 typedef enum {
     CMD_INSERT,
-    CMD_DELETE
+    CMD_DELETE,
+    CMD_BULK
 } CommandType;
 
+typedef enum {
+    UNDO_RAW,
+    UNDO_PACKED,
+    UNDO_SPILLED,
+    UNDO_MAPPED
+} UndoStorage;
+
 typedef enum {
     INDENT_NONE,
     INDENT_EXTRA,
@@ -186,17 +266,40 @@ typedef enum {
     RIGHT
 } ScrollDirection;
 
+typedef enum {
+    DECOR_NONE = 0,
+    DECOR_BRACKET,
+    DECOR_MATCH,
+    DECOR_SELECTION,
+    DECOR_CURRENT_MATCH,
+    DECOR_CARET,
+    DECOR_KINDS
+} DecorationKind;
+
+typedef enum {
+    PASS_TARGET_NONE = 0,
+    PASS_TARGET_STRING,
+    PASS_TARGET_COMMENT
+} PassTarget;
+
 typedef struct {
     BufferSource source;
     size_t start;
     size_t length;
 } Piece;
 
+typedef struct {
+    size_t offset;
+    size_t old_len;
+    size_t new_len;
+} ReplaceSpan;
+
 typedef struct {
     char *orig_buf;
     char *add_buf;
     size_t add_len;
     size_t add_capacity;
+    size_t add_kept;    // add_len right after the last compaction
     Piece *pieces;
     size_t num_pieces;
     size_t piece_capacity;
@@ -206,12 +309,30 @@ typedef struct {
     bool offsets_dirty;
 } PieceTable;
 
+typedef struct {
+    int refs;
+    Piece *pieces;
+    size_t num_pieces;
+    size_t logical_size;
+} PieceSnapshot;
+
+typedef struct {
+    Piece **refs;
+    size_t count;
+    size_t capacity;
+} PieceRefs;
+
 typedef struct {
     char *comment_str;
     char **extensions;
     int num_exts;
 } CommentMapping;
 
+typedef struct {
+    char opener;
+    char *closer;
+} SurroundPair;
+
 typedef struct {
     int x;
     int y;
@@ -219,6 +340,12 @@ typedef struct {
     int preferred_x;
 } EditorCursor;
 
+typedef struct {
+    size_t *offsets;
+    int count;
+    int capacity;
+} EditorCarets;
+
 typedef struct {
     int screen_rows;
     int screen_cols;
@@ -227,37 +354,228 @@ typedef struct {
     volatile sig_atomic_t resized;
 } EditorView;
 
+typedef struct {
+    size_t base;            // offsets are kept relative to the first bracket, a shift only moves this
+    size_t *offsets;
+    signed char *steps;     // +1 opens, -1 closes, 0 sits in a string or comment
+    int count;
+    int capacity;
+    int sum;
+    int min_prefix;
+    int max_suffix;
+} BracketBlock;
+
+typedef struct {
+    BracketBlock *blocks;
+    int num_blocks;
+    int capacity;
+    int owed_from;          // blocks from here on still owe the shift below
+    long owed_shift;
+    int *seg_sum;
+    int *seg_min_prefix;
+    int *seg_max_suffix;
+    int seg_leaves;
+    bool seg_dirty;
+} BracketFamily;
+
+typedef struct {
+    BracketFamily families[BRACKET_FAMILIES];
+    bool valid;
+} BracketIndex;
+
+typedef struct {
+    size_t start;
+    size_t end;     // inclusive, an empty edit still marks its line
+} DirtyRange;
+
+typedef struct {
+    DirtyRange *ranges;
+    size_t count;
+    size_t capacity;
+    bool all;
+} DirtyRanges;
+
 typedef struct {
     PieceTable pt;
+    BracketIndex brackets;
     size_t *line_offsets;
     int num_lines;
     int line_capacity;
     char *filename;
     bool dirty;
+    DirtyRanges edited;     // text touched since the last save
+    unsigned long generation;   // bumped on every change to the text
     int save_times;
     int quit_times;
 } EditorBuffer;
 
 typedef struct {
     bool active;
+    bool block;     // sx and ex are render columns while set
     int sx;
     int sy;
     int ex;
     int ey;
     char *clipboard;
     bool is_pasting;
-    int paste_len;
+    size_t paste_len;
     size_t paste_capacity;
     char *paste_buf;
+    long paste_start;   // micros, for the throughput in the status message
 } EditorSelection;
 
+typedef struct {
+    const char *needle;
+    size_t len;
+    size_t skip[256];
+    bool ignore_case;
+    bool whole_word;
+    unsigned char first_alt;
+    unsigned char last_alt;
+} SearchPattern;
+
+typedef enum {
+    RX_SET,
+    RX_SPLIT,
+    RX_JMP,
+    RX_SAVE,
+    RX_BOL,
+    RX_EOL,
+    RX_WORDB,
+    RX_NWORDB,
+    RX_MATCH
+} RegexOp;
+
+typedef struct {
+    RegexOp op;
+    int x;
+    int y;
+} RegexInst;
+
+typedef enum {
+    RXN_EMPTY,
+    RXN_SET,
+    RXN_CAT,
+    RXN_ALT,
+    RXN_REPEAT,
+    RXN_GROUP,
+    RXN_ASSERT
+} RegexNodeType;
+
+typedef struct {
+    RegexNodeType type;
+    int left;
+    int right;
+    int min;
+    int max;
+    bool greedy;
+    int arg;
+} RegexNode;
+
+typedef struct {
+    int pcs;
+    int num_pcs;
+    uint8_t flags;
+    uint32_t hash;
+    int accel_len;
+    uint8_t accel[RX_MAX_ACCEL];
+} RegexDfaState;
+
+typedef struct {
+    RegexInst *prog;
+    int num_insts;
+    int insts_cap;
+    uint32_t (*sets)[8];
+    int num_sets;
+    int sets_cap;
+    int num_groups;
+    bool bol_asserts;
+    bool word_asserts;
+
+    // lazily built dfa, flushed when it outgrows RX_DFA_MAX_STATES
+    RegexDfaState *states;
+    int num_states;
+    int states_cap;
+    int *trans;
+    int8_t *eol_match;
+    int *pool;
+    int pool_len;
+    int pool_cap;
+    int *table;
+    int start_states[4];
+    unsigned epoch;
+
+    // scratch for closures and the pike vm
+    int *stack;
+    int *list;
+    int *step;
+    unsigned *marks;
+    unsigned mark_gen;
+    int *threads[2];
+    size_t *thread_caps[2];
+} Regex;
+
+typedef struct {
+    const char *src;
+    size_t pos;
+    RegexNode *nodes;
+    int num_nodes;
+    int capacity;
+    Regex *re;
+    const char *error;
+} RegexParser;
+
+typedef struct {
+    size_t first_offset;
+    size_t last_offset;
+    uint8_t *deltas;
+    int bytes;
+    int capacity;
+    int count;
+    int first;
+} MatchBlock;
+
+typedef struct {
+    MatchBlock *blocks;
+    int num_blocks;
+    int capacity;
+    int total;
+    int owed_from;      // blocks from here on still owe the two deltas below
+    long owed_offset;
+    int owed_first;
+} MatchStore;
+
+typedef struct {
+    size_t query_len;
+    MatchStore matches;
+} PrefixMatches;
+
 typedef struct {
     bool active;
     char *query;
-    int *match_lines;
-    int *match_cols;
-    int num_matches;
+    MatchStore matches;
     int current_idx;
+    PrefixMatches *prefixes;
+    int num_prefixes;
+    int prefix_capacity;
+    long prefix_entries;
+    bool scanning;
+    bool scan_wrapped;
+    size_t scan_cursor;
+    size_t scan_origin;
+    size_t scan_pos;
+    SearchPattern scan_pattern;
+    MatchStore scan_head;
+    bool use_regex;
+    bool ignore_case;
+    bool whole_word;
+    bool regex_ok;
+    Regex regex;
+    const char *regex_error;
+    bool use_query;
+    TSQuery *ts_query;
+    TSQueryCursor *ts_cursor;
+    char query_error[BUFFER_SIZE_128];
 } EditorFinder;
 
 typedef struct {
@@ -282,14 +600,39 @@ typedef struct {
     char *language;
 } LangMapping;
 
+typedef enum {
+    QUERY_PENDING,
+    QUERY_READY,
+    QUERY_FAILED,
+    QUERY_MISSING
+} QueryState;
+
+typedef struct {
+    char *name;
+    char *query_path;
+    void *lib;
+    const TSLanguage *language;
+    TSQuery *query;
+    QueryState query_state;
+    uint32_t query_error_offset;
+    long load_us;
+    long compile_us;
+    pthread_t worker;
+    bool worker_running;
+    bool timings_reported;
+} LanguageEntry;
+
 typedef struct {
     TSParser *parser;
     TSTree *tree;
     TSQuery *query;
     TSQueryCursor *query_cursor;
-    void *language_lib;
+    LanguageEntry *language;
     uint32_t *theme_colors;
+    uint8_t *capture_targets;
     uint32_t theme_color_count;
+    uint32_t pass_colors[MAX_HIGHLIGHT_PASSES];
+    uint32_t pass_mask;
     ThemeRule *theme_rules;
     int num_theme_rules;
     uint32_t default_fg;
@@ -298,10 +641,13 @@ typedef struct {
     bool needs_reparse;
     CommentMapping *comment_mappings;
     int num_comment_mappings;
+    SurroundPair *surround_pairs;
+    int num_surround_pairs;
 } EditorTS;
 
 typedef struct {
     EditorCursor cursor;
+    EditorCarets carets;
     EditorView view;
     EditorBuffer buf;
     EditorSelection sel;
@@ -322,10 +668,66 @@ typedef struct {
     char *text;
     size_t len;
     size_t capacity;
+    Piece *pieces;
+    size_t num_pieces;
+    size_t piece_capacity;
     EditorCursor cursor;
     int transaction_id;
+    ReplaceSpan *spans;
+    size_t num_spans;
+    char *new_text;
+    size_t new_len;
+    bool shared_text;
+    UndoStorage storage;
+    char *packed;
+    size_t packed_len;
+    size_t unpacked_len;
+    bool compressed;
+    bool flip_on_load;  // a mapped bulk entry was saved facing the other way
+    off_t spill_offset;
 } EditCommand;
 
+typedef struct {
+    int id;
+    int parent;
+    int base;
+    EditCommand *cmds;
+    int num_cmds;
+    int position;
+    int save_point;
+    PieceSnapshot *snap;
+    EditorCursor cursor;
+    time_t parked;
+} UndoBranch;
+
+typedef struct {
+    size_t offset;
+    size_t old_len;
+    size_t new_len;
+    size_t text_start;
+} BatchEdit;
+
+typedef struct {
+    bool active;
+    BatchEdit *edits;
+    size_t num_edits;
+    size_t capacity;
+    char *text;
+    size_t text_len;
+    size_t text_capacity;
+    EditorCursor cursor;
+    bool join;      // merge into the undo entry on top instead of adding one
+} EditBatch;
+
+typedef struct {
+    size_t start;   // offsets between the two merged batches
+    size_t end;
+    const char *old_text;
+    size_t old_len;
+    const char *new_text;
+    size_t new_len;
+} ComposeSpan;
+
 typedef struct {
     EditCommand *undo_stack;
     int undo_capacity;
@@ -336,9 +738,73 @@ typedef struct {
     long last_edit_time;
     int current_transaction_id;
     bool in_transaction;
+    int typing_entry;   // undo entry of the multi-cursor typing burst the next caret edit may join
+    int typing_kind;
+    long typing_time;
     int save_point;
+    size_t memory_budget;
+    size_t raw_bytes;
+    size_t packed_bytes;
+    size_t spilled_bytes;
+    int pack_floor;
+    int spill_floor;
+    int redo_pack_floor;    // redo entries below these are packed or spilled already
+    int redo_spill_floor;
+    int spill_fd;
+    off_t spill_size;
+    const unsigned char *map;
+    size_t map_len;
+    size_t mapped_bytes;
+    bool base_pending;      // the loaded history was matched by the file's stamp, its hash is checked on first use
+    bool base_mismatch;
+    uint64_t base_hash;
+    size_t base_len;
+    int saved_entries;      // leading entries of the line the undo file still holds as they are
+    int file_entries;
+    off_t file_end;
+    UndoBranch *branches;
+    int num_branches;
+    int branch_capacity;
+    int line_id;
+    int next_branch_id;
+    PieceSnapshot *tip;
+    EditorCursor tip_cursor;
+    EditBatch batch;
 } EditorUndoRedo;
 
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t path_len;
+    uint64_t content_hash;
+    uint64_t content_len;
+    uint64_t file_dev;
+    uint64_t file_ino;
+    int64_t file_mtime;
+    int64_t file_mtime_nsec;
+    uint64_t data_end;
+    int32_t num_undo;
+    int32_t num_redo;
+    int32_t save_point;
+    int32_t transaction_id;
+} UndoFileHeader;
+
+typedef struct {
+    uint8_t type;
+    uint8_t compressed;
+    uint8_t shared_text;
+    uint8_t undone;     // written while on the redo side of the line
+    int32_t transaction_id;
+    uint64_t offset;
+    uint64_t len;
+    uint64_t new_len;
+    uint64_t num_spans;
+    uint64_t data_offset;
+    uint64_t data_len;
+    uint64_t unpacked_len;
+    int32_t cursor[4];
+} UndoFileEntry;
+
 typedef struct {
     char *b;
     int len;
@@ -346,11 +812,170 @@ typedef struct {
     bool valid;
 } RowCache;
 
+typedef struct {
+    int start;
+    int end;
+    DecorationKind kind;
+} Decoration;
+
+typedef struct {
+    int col;
+    int delta;
+    DecorationKind kind;
+} DecorationEvent;
+
+typedef struct {
+    size_t start;
+    size_t end;
+    PassTarget target;
+} PassRegion;
+
+typedef bool (*SearchEmitFn)(size_t, void *);
+
+typedef struct {
+    PieceTable *pt;
+    const SearchPattern *pat;
+    size_t from;
+    size_t to;
+    size_t *hits;
+    size_t count;
+    size_t capacity;
+} SearchChunk;
+
+typedef struct {
+    char *pattern;
+    int flags;
+    bool negate;
+    bool dir_only;
+    bool anchored;
+    bool any_depth;
+} IgnoreRule;
+
+typedef struct IgnoreList {
+    struct IgnoreList *parent;
+    size_t base_len;
+    IgnoreRule *rules;
+    int num_rules;
+} IgnoreList;
+
+typedef struct {
+    char *path;
+    IgnoreList *ignore;
+    bool is_dir;
+} ProjectJob;
+
+typedef struct {
+    const char *path;
+    int line;
+    int col;
+    char *preview;
+} ProjectHit;
+
+typedef struct {
+    char *root;
+    size_t root_len;
+    const char *query;
+    SearchPattern pattern;
+    bool use_regex;
+    bool ignore_case;
+    bool whole_word;
+    bool count_only;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ProjectJob *jobs;
+    int num_jobs;
+    int jobs_capacity;
+    int pending;
+    bool stop;
+    IgnoreList **ignores;
+    int num_ignores;
+    char **files;
+    int num_files;
+    int files_capacity;
+    ProjectHit *hits;
+    int num_hits;
+    int hits_capacity;
+    bool truncated;
+    size_t files_searched;
+    size_t bytes_searched;
+    size_t total_matches;
+    pthread_t workers[MAX_SEARCH_THREADS];
+    int num_workers;
+    long start_us;
+    long elapsed_us;
+} ProjectSearch;
+
+typedef struct {
+    ProjectSearch *ps;
+    char *buf;
+    size_t buf_capacity;
+    Regex regex;
+    bool regex_ok;
+    const char *data;
+    size_t size;
+    const char *path;
+    size_t line_start;
+    int line;
+    ProjectHit *hits;
+    int num_hits;
+    int hits_capacity;
+} ProjectWorker;
+
+typedef struct {
+    PieceTable *pt;
+    size_t piece;
+    size_t offset;
+} PieceCursor;
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint8_t pass;
+} PassSpan;
+
+typedef struct {
+    int row;
+    unsigned long generation;   // buffer generation the spans were last checked against
+    uint64_t layout;            // passes and region bounds, known without reading the line
+    uint64_t hash;
+    PassSpan *spans;
+    int num_spans;
+    int capacity;
+    bool valid;
+} PassCacheEntry;
+
+typedef struct {
+    const char *theme_key;
+    const char *languages;  // comma separated, NULL for every language
+    PassTarget target;
+    void (*scan)(PassCacheEntry *, int, const char *, size_t, size_t);
+} HighlightPass;
+
 /*** Global Data ***/
 
 static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static RowCache *g_prev_frame = NULL;
 static int g_prev_frame_rows = 0;
+static Decoration *g_decorations = NULL;
+static int g_num_decorations = 0;
+static int g_decorations_cap = 0;
+static int *g_decor_row_start = NULL;
+static int g_decor_rows_cap = 0;
+static PassRegion *g_pass_regions = NULL;
+static int g_num_pass_regions = 0;
+static int g_pass_regions_cap = 0;
+static PassCacheEntry g_pass_cache[PASS_CACHE_SLOTS];
+static const char *g_decoration_bg[DECOR_KINDS] = {
+    RESET_BG_COLOR, LIGHT_GRAY_BG_COLOR, LIGHT_GRAY_BG_COLOR, LIGHT_GRAY_BG_COLOR, CURRENT_MATCH_BG_COLOR, CARET_BG_COLOR
+};
+static LanguageEntry **g_languages = NULL;
+static int g_num_languages = 0;
+static pthread_mutex_t g_languages_lock = PTHREAD_MUTEX_INITIALIZER;
+static char g_read_buf[READ_BUFFER_SIZE];
+static ssize_t g_read_len = 0;
+static ssize_t g_read_pos = 0;
+static char g_project_prompt[STATUS_LENGTH];
+static char *g_project_query = NULL;
 EditorConfig E;
 EditorUndoRedo history;
 
@@ -372,6 +997,10 @@ int getCursorPosition(int *, int *);
 
 // input parsing
 int editorReadByte(char *);
+void editorAppendPaste(const char *, size_t);
+void editorReadPaste(void);
+void editorSetPasteStatusMsg(const char *);
+bool editorInputPending(void);
 static void editorConsumeEscapeTail(bool);
 int editorReadKey(void);
 void editorProcessStandardKey(int);
@@ -379,17 +1008,26 @@ bool editorProcessKeypress(void);
 char *editorPrompt(char *, void (*)(const char *, int), char *);
 
 // output rendering
-bool editorEvaluateMatchPredicates(TSQueryMatch *);
+char *editorReadCaptureText(TSQueryMatch *, uint32_t);
+bool editorEvaluateMatchPredicates(TSQuery *, TSQueryMatch *);
 void editorApplyMatchColors(TSQueryMatch *, size_t, size_t, uint32_t *, uint16_t *);
 void editorUpdateSyntaxColors(size_t, size_t, uint32_t *, uint16_t *);
 void editorGetNormalizedSelection(int *, int *, int *, int *);
-int editorFindFirstMatchOnRow(int);
-bool editorIsCharInFindMatch(int, int, int);
 void editorGetBracketSpan(int *, int *, int *, int *, bool *);
-bool editorIsCharInBracketSpan(int, int, int, int, int, int, bool);
-bool editorIsCharSelected(int, int, int, int, int, int);
-void highlightFormatSpecifiers(size_t, size_t, uint32_t *);
-void editorDrawSingleRow(AppendBuffer *, int, size_t, uint32_t *);
+int compareDecorationEvents(const void *, const void *);
+void editorFlattenDecorations(DecorationEvent *, int);
+void editorBuildDecorations(int, int);
+void editorAddPassRegion(size_t, size_t, PassTarget);
+int comparePassRegions(const void *, const void *);
+void passCacheAppend(PassCacheEntry *, int, size_t, size_t);
+uint64_t hashBytes(uint64_t, const void *, size_t);
+void highlightPrintfFormats(PassCacheEntry *, int, const char *, size_t, size_t);
+void highlightEscapeSequences(PassCacheEntry *, int, const char *, size_t, size_t);
+void highlightTodoMarkers(PassCacheEntry *, int, const char *, size_t, size_t);
+int editorNumHighlightPasses(void);
+bool editorPassAppliesTo(const char *, const char *);
+void editorRunHighlightPasses(size_t, size_t, uint32_t *);
+void editorDrawSingleRow(AppendBuffer *, int, size_t, uint32_t *, const Decoration *, int);
 void editorRefreshScreen(void);
 void editorDrawRows(AppendBuffer *);
 void editorSetStatusMsg(const char *);
@@ -414,9 +1052,20 @@ void editorJumpCallback(const char *, int);
 // piece table
 void ptInit(PieceTable *, const char *, size_t);
 void ptFree(PieceTable *);
+size_t ptAppendAdd(PieceTable *, const char *, size_t);
 void ptInsert(PieceTable *, size_t, const char *, size_t);
+void ptInsertPieces(PieceTable *, size_t, const Piece *, size_t, size_t);
 void ptDelete(PieceTable *, size_t, size_t);
 void ptSquash(PieceTable *);
+void ptCoalesce(PieceTable *);
+void ptTakePieces(PieceTable *, size_t *, size_t *, size_t, Piece *, size_t *);
+Piece *ptCopyPieces(PieceTable *, size_t, size_t, size_t *);
+void ptReadPieces(PieceTable *, const Piece *, size_t, char *);
+void ptReplaceSpans(PieceTable *, const ReplaceSpan *, size_t, const char *, size_t, bool);
+void ptSpliceSpans(PieceTable *, const ReplaceSpan *, size_t, const Piece *, const size_t *);
+PieceSnapshot *ptSnapshot(PieceTable *);
+void ptRestore(PieceTable *, const PieceSnapshot *);
+void ptReleaseSnapshot(PieceSnapshot *);
 void ptRebuildOffsets(PieceTable *);
 bool ptFindPiece(PieceTable *, size_t, size_t *, size_t *);
 void ptReadLogical(PieceTable *, size_t, size_t, char *);
@@ -428,6 +1077,7 @@ size_t editorGetLogicalOffset(EditorBuffer *, int, int);
 void editorOffsetToRowCol(EditorBuffer *, size_t, int *, int *);
 void editorInsertLineOffsets(EditorBuffer *, size_t, const char *, size_t);
 void editorDeleteLineOffsets(EditorBuffer *, size_t, const char *, size_t);
+void editorReplaceLineOffsets(EditorBuffer *, const ReplaceSpan *, size_t, const char *, bool);
 
 // line editing
 int getLineIndentation(const char *, size_t);
@@ -445,12 +1095,39 @@ void editorInsertTab(void);
 void editorMoveToLineStart(void);
 void editorMoveToLineEnd(void);
 void editorLoadCommentConfig(const char *);
+void editorLoadSurroundConfig(const char *);
+const char *editorGetSurroundCloser(char);
+bool editorSurroundSelection(char, const char *);
 const char *editorGetCommentString(void);
 void editorGetCommentToggleBounds(int *, int *);
 bool editorShouldUncommentBlock(int, int, const char *, size_t);
 void editorApplyCommentToggle(int, int, const char *, size_t, bool);
 void editorToggleComment(void);
 
+// multi-cursor
+void editorClearCarets(void);
+void editorAddCaret(size_t);
+void editorNormalizeCarets(void);
+int editorCaretLowerBound(size_t);
+size_t *editorCaretPositions(int *, int *);
+void editorStoreCarets(size_t *, int, int);
+void editorCaretsMapBatch(void);
+void editorAddCursorsToLines(void);
+void editorAddCursorAtNextMatch(void);
+void editorAddCursorsAtMatches(void);
+void editorCaretsEdit(int, const char *, size_t);
+void editorCaretsMove(int);
+bool editorMultiCursorKey(int);
+
+// block selection
+void editorGetNormalizedBlock(int *, int *, int *, int *);
+bool editorBlockRowRange(int, int, int, int *, int *);
+void editorBlockCursor(void);
+void editorClearBlock(void);
+void editorBlockReplace(const char *, size_t, DeleteDirection, bool);
+void editorBlockPaste(const char *, size_t);
+bool editorBlockSelectionKey(int);
+
 // clipboard
 void editorSelectText(int);
 void editorSelectAll(void);
@@ -461,29 +1138,252 @@ void editorCutSelection(void);
 void editorCutLine(void);
 void clipboardCopyToSystem(const char *, int);
 
+// search engine
+uint32_t searchFoldCodepoint(uint32_t);
+uint32_t searchOtherCase(uint32_t);
+bool searchEqualFold(const char *, const char *, size_t);
+void searchCompile(SearchPattern *, const char *, size_t, bool, bool);
+const char *searchBlock(const SearchPattern *, const char *, size_t);
+const char *searchBlockFold(const SearchPattern *, const char *, size_t);
+bool searchIsWholeWord(PieceTable *, const char *, size_t, size_t, size_t, size_t);
+size_t ptSearch(PieceTable *, const SearchPattern *, size_t, size_t, SearchEmitFn, void *);
+bool searchChunkCollect(size_t, void *);
+bool searchFirstHit(size_t, void *);
+void *searchChunkWorker(void *);
+int editorSearchThreads(void);
+size_t ptSearchParallel(PieceTable *, const SearchPattern *, size_t, size_t, int, SearchEmitFn, void *);
+bool editorAppendMatch(size_t, void *);
+char *editorBenchLoad(const char *, size_t *);
+int editorBenchSearch(const char *, const char *);
+int editorBenchRegex(const char *, const char *);
+bool searchHasBorder(const char *, size_t, bool);
+
+// regex engine
+void ptCursorInit(PieceCursor *, PieceTable *, size_t);
+int ptCursorNext(PieceCursor *);
+bool regexIsWord(int);
+void regexSetClass(uint32_t *, char);
+int regexAddSet(Regex *, const uint32_t *);
+int regexNewNode(RegexParser *, RegexNodeType);
+int regexParseEscapedChar(RegexParser *);
+int regexParseClass(RegexParser *);
+bool regexParseCount(RegexParser *, int *, int *);
+int regexParseAtom(RegexParser *);
+int regexParseRepeat(RegexParser *);
+int regexParseCat(RegexParser *);
+int regexParseAlt(RegexParser *);
+int regexEmit(Regex *, RegexOp, int, int);
+void regexCompileNode(Regex *, const RegexNode *, int);
+bool regexCompile(Regex *, const char *, const char **);
+void regexFree(Regex *);
+void regexFoldCase(Regex *);
+unsigned regexNextMark(Regex *);
+uint8_t regexFlagsBefore(Regex *, int);
+uint8_t regexFlagsAt(Regex *, PieceTable *, size_t);
+int regexClosure(Regex *, const int *, int, uint8_t, int, int *, bool *);
+int regexCompareInts(const void *, const void *);
+void regexDfaFlush(Regex *);
+int regexDfaState(Regex *, const int *, int, uint8_t);
+int regexDfaStep(Regex *, int, int);
+void regexDfaAccel(Regex *, int);
+int regexDfaAccelState(Regex *, int);
+int regexDfaStart(Regex *, uint8_t);
+size_t regexAccelScan(const uint8_t *, int, const unsigned char *, size_t);
+bool regexDfaEolMatch(Regex *, int);
+size_t regexDfaFindEnd(Regex *, PieceTable *, size_t, size_t, size_t *);
+void regexAddThread(Regex *, int *, int *, size_t *, int, size_t *, size_t, uint8_t, int);
+bool regexPike(Regex *, PieceTable *, size_t, size_t, size_t *);
+size_t regexSearch(PieceTable *, Regex *, size_t, size_t, SearchEmitFn, void *);
+char *regexExpand(Regex *, PieceTable *, size_t, const char *, size_t *);
+
+// match store
+void matchStoreClear(MatchStore *);
+void matchStoreRenumber(MatchStore *, int);
+void matchStoreSettle(MatchStore *, int);
+void matchStoreDefer(MatchStore *, int, long, int);
+size_t matchStoreFirstOffset(const MatchStore *, int);
+size_t matchStoreLastOffset(const MatchStore *, int);
+int matchStoreFirstIndex(const MatchStore *, int);
+void matchBlockPutByte(MatchBlock *, uint8_t);
+void matchBlockPutGap(MatchBlock *, size_t);
+size_t matchBlockNextGap(const MatchBlock *, int *);
+int matchBlockDecode(const MatchBlock *, size_t *);
+void matchBlockEncode(MatchBlock *, const size_t *, int);
+int matchStoreBlockOf(MatchStore *, int);
+size_t matchStoreGet(MatchStore *, int);
+int matchStoreLowerBound(MatchStore *, size_t);
+MatchBlock *matchStoreNewBlock(MatchStore *, int);
+void matchStoreAppend(MatchStore *, size_t);
+void matchStoreInsert(MatchStore *, size_t);
+void matchStoreRemoveRange(MatchStore *, size_t, size_t);
+void matchStoreShift(MatchStore *, size_t, long);
+void matchStorePrepend(MatchStore *, MatchStore *);
+void matchStoreRefine(MatchStore *, MatchStore *, PieceTable *, const char *, size_t, size_t, bool);
+
 // find & replace
-void editorBuildMatchList(const char *);
+void editorFindSelectFrom(size_t);
+void editorFindStartScan(const char *);
+void editorFindStopScan(void);
+void editorFindMergeScan(void);
+bool editorFindScanStep(long);
+void editorFindFinishScan(void);
+void editorClearPrefixCache(void);
+void editorUpdateMatchList(const char *, const char *);
+bool editorFindCompileRegex(const char *);
+bool editorFindCompileQuery(const char *);
+void editorFindFreeQuery(void);
+int compareOffsets(const void *, const void *);
+bool editorFindQueryRange(size_t, size_t, MatchStore *);
+size_t editorFindQueryMatchLength(size_t);
+size_t editorFindMatchLength(size_t);
+void editorFindToggleRegex(const char *);
+void editorFindToggleQuery(const char *);
+void editorFindToggleOption(const char *, bool *, const char *);
+bool editorFindModeKey(const char *, int);
+bool editorInsertMatch(size_t, void *);
+void editorFindTrackEdit(size_t, size_t, size_t);
+void editorFindDropRegion(MatchStore *, size_t *, size_t *, size_t, size_t, size_t, size_t);
+void editorFindDropEdit(size_t, size_t, size_t);
+void editorFindRescanRegion(MatchStore *, size_t, size_t, size_t, size_t);
+void editorFindRescanEdit(size_t, size_t);
+void editorFindRestartScan(void);
+void editorFindTrackSpans(const ReplaceSpan *, size_t);
 void editorFind(void);
 void editorFindCallback(const char *, int);
 void editorReplace(void);
 void editorReplaceCallback(const char *, int);
 bool editorReplaceCurrent(const char *, const char *);
+bool editorReplaceProgress(const char *, size_t, size_t, long *);
+bool editorReplaceFinishScan(void);
 int editorReplaceAll(const char *);
 void editorCenterViewOnMatch(void);
 void editorResetFind(void);
 
+// project search
+IgnoreList *projectLoadIgnore(ProjectSearch *, const char *, size_t, IgnoreList *);
+bool projectIgnoreRuleMatch(const IgnoreRule *, const char *, bool);
+bool projectIsIgnored(const IgnoreList *, const char *, bool);
+void projectPushJobs(ProjectSearch *, ProjectJob *, int);
+bool projectNextJob(ProjectSearch *, ProjectJob *);
+void projectFinishJob(ProjectSearch *);
+void projectScanDir(ProjectSearch *, ProjectJob *);
+bool projectCollectHit(size_t, void *);
+void projectSearchFile(ProjectWorker *, const char *);
+void *projectSearchWorker(void *);
+void projectSearchStart(ProjectSearch *, const char *, const char *, int, bool);
+bool projectSearchRunning(ProjectSearch *);
+int compareProjectHits(const void *, const void *);
+void projectSearchFinish(ProjectSearch *, bool);
+void projectSearchFree(ProjectSearch *);
+void editorProjectPromptText(void);
+void editorProjectSearchCallback(const char *, int);
+int editorAppendClipped(AppendBuffer *, const char *, int, int);
+void editorDrawProjectResults(ProjectSearch *, int, int);
+int editorProjectResults(ProjectSearch *);
+void editorOpenProjectHit(const ProjectHit *, const char *);
+void editorProjectSearch(void);
+bool benchRunRipgrep(const char *, const char *, size_t *, long *);
+int editorBenchProject(const char *, const char *);
+
 // undo-redo
 void freeEditCommand(EditCommand *);
+void editCommandAddPieces(EditCommand *, const Piece *, size_t, bool);
+char *editCommandText(EditCommand *);
 void editorBeginMacro(void);
 void editorEndMacro(void);
-void recordCommand(CommandType, size_t, const char *, size_t, EditorCursor);
+void editorBeginBatch(void);
+void editorBatchReplace(size_t, size_t, const char *, size_t);
+int compareBatchEdits(const void *, const void *);
+void editorCommitBatch(void);
+void recordCommand(CommandType, size_t, const Piece *, size_t, size_t, EditorCursor);
+void recordBulkCommand(ReplaceSpan *, size_t, char *, size_t, char *, size_t, bool, EditorCursor);
+size_t composeSpanText(const ComposeSpan *, size_t, const ComposeSpan *, size_t, size_t, size_t, bool, char *);
+bool editorMergeBulkCommand(const ReplaceSpan *, size_t, const char *, const char *);
+void editorInvertBulkCommand(EditCommand *);
+void editorDocumentInsert(size_t, const char *, size_t, const Piece *, size_t);
+void editorDocumentDelete(size_t, const char *, size_t);
+void editorDocumentReplaceSpans(const ReplaceSpan *, size_t, const char *, size_t, bool, const Piece *, const size_t *);
+void editorDocumentRestore(const PieceSnapshot *);
+void editorDocumentRebuild(void);
+bool editorApplyGroup(EditCommand *, int, bool, bool *);
 void executeInsert(size_t, const char *, size_t);
 void executeDelete(size_t, size_t);
 void editorUndo(void);
 void editorRedo(void);
 
+// undo memory
+size_t lzCompressBound(size_t);
+size_t lzPutLength(unsigned char *, size_t, size_t);
+bool lzGetLength(const unsigned char *, size_t, size_t *, size_t *);
+size_t lzEmitSequence(unsigned char *, size_t, const unsigned char *, size_t, size_t, size_t);
+size_t lzCompress(const unsigned char *, size_t, unsigned char *);
+bool lzDecompress(const unsigned char *, size_t, unsigned char *, size_t);
+size_t editorUndoBudget(void);
+size_t editCommandBytes(EditCommand *);
+void editCommandAccount(EditCommand *, bool);
+bool editCommandPack(EditCommand *);
+bool editCommandSpill(EditCommand *);
+unsigned char *editCommandUnpack(EditCommand *);
+bool editCommandLoad(EditCommand *);
+bool editorWriteAt(int, const unsigned char *, size_t, off_t);
+void editorTrimUndoMemory(void);
+void pieceRefsAdd(PieceRefs *, Piece *, size_t);
+int comparePieceRefs(const void *, const void *);
+void editorCompactAddBuffer(void);
+void editorCloseUndoFiles(void);
+void editorUndoMemoryText(char *, size_t);
+
+// undo persistence
+char *editorUndoFilePath(const char *, char *, size_t, bool);
+unsigned char *editCommandPayload(EditCommand *, size_t *);
+EditCommand *editorLineEntry(int);
+void editorHistoryChangedFrom(int);
+bool editorCheckUndoBase(void);
+void editorClearHistory(void);
+bool editorPackUndoRecord(EditCommand *, bool, unsigned char **, size_t *, size_t *, off_t);
+bool editorUndoFileMatches(int, const char *);
+void editorSaveUndoHistory(const char *, uint64_t, size_t, const struct stat *);
+void editorLoadUndoHistory(const char *, const struct stat *);
+
+// undo tree
+UndoBranch *editorAddBranch(void);
+int editorFindBranch(int);
+void editCommandFlip(EditCommand *);
+void editorParkRedo(void);
+void editorFreeBranches(void);
+PieceSnapshot *editorSwitchBranch(int, PieceSnapshot *, EditorCursor *);
+void editorJumpToBranch(int);
+int editorUndoTreeOrder(int, int, int *, int *, int);
+void editorDrawUndoTree(const int *, const int *, int, int, int);
+void editorUndoTree(void);
+
 // bracket highlighting
 char getMatchingBracket(char);
+int getBracketFamily(char);
+signed char bracketStep(char, size_t);
+void bracketIndexBuild(BracketIndex *, PieceTable *);
+void bracketIndexFree(BracketIndex *);
+void bracketIndexInsert(BracketIndex *, size_t, const char *, size_t);
+void bracketIndexDelete(BracketIndex *, size_t, size_t);
+void bracketIndexClassify(BracketIndex *, PieceTable *, size_t, size_t);
+void bracketBlockReserve(BracketBlock *, int);
+void bracketBlockSummarize(BracketBlock *);
+int bracketBlockLowerBound(BracketBlock *, size_t);
+BracketBlock *bracketFamilyNewBlock(BracketFamily *, int);
+void bracketFamilyRemoveBlock(BracketFamily *, int);
+void bracketFamilySettle(BracketFamily *, int);
+void bracketFamilyDefer(BracketFamily *, int, long);
+void bracketFamilyLocate(BracketFamily *, size_t, int *, int *);
+void bracketFamilyShift(BracketFamily *, int, int, long);
+void bracketFamilyInsertAt(BracketFamily *, int, int, const size_t *, const signed char *, int);
+void bracketFamilyBuildTree(BracketFamily *);
+void bracketFamilyPullNode(BracketFamily *, int);
+void bracketFamilyUpdateTree(BracketFamily *, int);
+int bracketFamilySeekForward(BracketFamily *, int, int, int, int, int *);
+int bracketFamilySeekBackward(BracketFamily *, int, int, int, int, int *);
+bool bracketIndexFindMatch(BracketIndex *, PieceTable *, size_t, char, size_t *);
+bool editorIsBracketLeaf(TSNode, char);
+bool editorFindMatchingBracketInTree(size_t, char, size_t *);
 bool findMatchingBracketPosition(int, int, int *, int *);
 void editorJumpToMatchingBracket(void);
 void updateMatchBracket(void);
@@ -497,6 +1397,10 @@ void editorMouseLeftRelease(void);
 // file i/o
 void editorReadFromPipe(int, const char *);
 void editorOpen(const char *);
+bool editorSwitchFile(const char *);
+void dirtyRangesClear(DirtyRanges *);
+void dirtyRangesApply(DirtyRanges *, const ReplaceSpan *, size_t);
+void dirtyRangesTrackEdit(DirtyRanges *, size_t, size_t, size_t);
 void editorSave(void);
 void editorEmergencySave(void);
 void editorHandleCrash(int);
@@ -504,6 +1408,7 @@ void editorHandleCrash(int);
 // utility
 bool isWordChar(int);
 long currentMillis(void);
+long currentMicros(void);
 char getClosingChar(char);
 void clampCursorPosition(void);
 void humanReadableSize(size_t, char *, size_t);
@@ -518,7 +1423,8 @@ int editorLineRxToCx(const char *, int, int);
 char *editorReadFileIntoString(const char *);
 void getEditorDirectory(char *, size_t);
 void getEditorClipboardCmd(void);
-void editorTrimTrailingWhitespace(void);
+bool editorTrimLine(int);
+void editorTrimTrailingWhitespace(bool);
 void editorUpdateWindowTitle(void);
 int editorGetGutterWidth(void);
 
@@ -537,11 +1443,16 @@ void editorInitTreeSitter(void);
 void editorEditTreeSitter(size_t, size_t, size_t, const char *);
 void editorParseTreeSitter(void);
 const char *readPieceTable(void *, uint32_t, TSPoint, uint32_t *);
+uint32_t editorResolveThemeColor(const char *, uint32_t);
+PassTarget editorCaptureTarget(const char *, uint32_t);
 void editorLoadTheme(TSQuery *);
 void editorLoadThemeConfig(const char *);
 void editorLoadTSConfig(const char *);
 const char *editorGetLanguageName(const char *);
-TSLanguage *editorLoadLanguage(const char *);
+LanguageEntry *editorLoadLanguage(const char *);
+void *editorCompileQueryWorker(void *);
+bool editorPollLanguage(void);
+void editorFreeLanguageRegistry(void);
 void editorDebugSyntaxUnderCursor(void);
 bool editorIsOffsetInStringOrComment(size_t);
 void editorFreeTreeSitter(void);
@@ -549,6 +1460,13 @@ void editorFreeTreeSitter(void);
 /*** Main ***/
 
 int main(int argc, char *argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "--bench-search") == 0)
+        return editorBenchSearch(argv[2], argv[3]);
+    if (argc >= 4 && strcmp(argv[1], "--bench-regex") == 0)
+        return editorBenchRegex(argv[2], argv[3]);
+    if (argc >= 4 && strcmp(argv[1], "--bench-project") == 0)
+        return editorBenchProject(argv[2], argv[3]);
+
     int pipe_fd = -1;
     if (!isatty(STDIN_FILENO)) {
         pipe_fd = dup(STDIN_FILENO);
@@ -608,17 +1526,26 @@ int main(int argc, char *argv[]) {
             needs_refresh = true;
         }
 
+        if (editorPollLanguage())
+            needs_refresh = true;
+
         if (E.ts.needs_reparse && (currentMillis() - history.last_edit_time >= PARSE_DEBOUNCE_MS)) {
             editorParseTreeSitter();
             E.ts.needs_reparse = false;
+            updateMatchBracket();
             needs_refresh = true;
         }
 
+        if (E.find.scanning && editorFindScanStep(SCAN_SLICE_MS))
+            needs_refresh = true;
+
         if (needs_refresh && !E.sel.is_pasting) {
             editorRefreshScreen();
             needs_refresh = false;
         }
 
+        // keep scanning instead of blocking on the terminal while no key is waiting
+        if (E.find.scanning && !editorInputPending()) continue;
         if (editorProcessKeypress()) needs_refresh = true;
     }
 
@@ -638,6 +1565,7 @@ void editorInit() {
     E.buf.line_offsets = NULL;
     E.buf.num_lines = 0;
     E.buf.line_capacity = 0;
+    E.buf.brackets.valid = false;
     E.buf.filename = NULL;
     E.buf.dirty = false;
     E.buf.save_times = SAVE_TIMES;
@@ -654,10 +1582,14 @@ void editorInit() {
     E.sel.paste_buf = NULL;
     E.find.active = false;
     E.find.query = NULL;
-    E.find.match_lines = NULL;
-    E.find.match_cols = NULL;
-    E.find.num_matches = 0;
+    memset(&E.find.matches, 0, sizeof(MatchStore));
     E.find.current_idx = -1;
+    E.find.prefixes = NULL;
+    E.find.num_prefixes = 0;
+    E.find.prefix_capacity = 0;
+    E.find.prefix_entries = 0;
+    E.find.scanning = false;
+    memset(&E.find.scan_head, 0, sizeof(MatchStore));
     E.sys.status_msg[0] = '\0';
     E.sys.status_msg_time = 0;
     E.sys.bracket_x = 0;
@@ -669,7 +1601,7 @@ void editorInit() {
     E.ts.tree = NULL;
     E.ts.query = NULL;
     E.ts.query_cursor = NULL;
-    E.ts.language_lib = NULL;
+    E.ts.language = NULL;
     E.ts.theme_colors = NULL;
     E.ts.theme_color_count = 0;
     E.ts.lang_mappings = NULL;
@@ -682,6 +1614,10 @@ void editorInit() {
     history.redo_capacity = INIT_UNDO_REDO_CAP;
     history.redo_stack = safeMalloc(sizeof(EditCommand) * history.redo_capacity);
     history.redo_top = -1;
+    history.memory_budget = editorUndoBudget();
+    history.spill_fd = -1;
+    history.line_id = 1;
+    history.next_branch_id = 2;
     history.last_edit_time = 0;
     history.current_transaction_id = 0;
     history.in_transaction = false;
@@ -706,14 +1642,21 @@ void editorInit() {
     char comment_path[PATH_MAX + BUFFER_SIZE_PADDING];
     snprintf(comment_path, sizeof(comment_path), "%s/configs/comments.config", exe_dir);
     editorLoadCommentConfig(comment_path);
+
+    char surround_path[PATH_MAX + BUFFER_SIZE_PADDING];
+    snprintf(surround_path, sizeof(surround_path), "%s/configs/surround.config", exe_dir);
+    editorLoadSurroundConfig(surround_path);
 }
 
 void editorCleanup() {
     E.sys.clipboard_cmd = NULL;
 
     ptFree(&E.buf.pt);
+    bracketIndexFree(&E.buf.brackets);
     free(E.buf.line_offsets);
     free(E.buf.filename);
+    free(E.buf.edited.ranges);
+    E.buf.edited.ranges = NULL;
     E.buf.num_lines = 0;
     E.buf.line_offsets = NULL;
     E.buf.filename = NULL;
@@ -724,7 +1667,10 @@ void editorCleanup() {
     E.sel.paste_buf = NULL;
 
     editorResetFind();
+    free(g_project_query);
+    g_project_query = NULL;
     editorFreeTreeSitter();
+    editorFreeLanguageRegistry();
     if (E.ts.theme_rules) {
         for (int i = 0; i < E.ts.num_theme_rules; i++)
             free(E.ts.theme_rules[i].prefix);
@@ -742,12 +1688,12 @@ void editorCleanup() {
         E.ts.num_lang_mappings = 0;
     }
 
-    for (int i = 0; i <= history.undo_top; i++)
-        freeEditCommand(&history.undo_stack[i]);
-    for (int i = 0; i <= history.redo_top; i++)
-        freeEditCommand(&history.redo_stack[i]);
+    editorClearHistory();
     free(history.undo_stack);
     free(history.redo_stack);
+    free(history.batch.edits);
+    free(history.batch.text);
+    free(E.carets.offsets);
 }
 
 void editorQuit() {
@@ -838,23 +1784,92 @@ int getCursorPosition(int *rows, int *cols) {
 }
 
 int editorReadByte(char *c) {
-    static char read_buf[BUFFER_SIZE_4096];
-    static ssize_t buf_len = 0;
-    static ssize_t buf_pos = 0;
-    if (buf_pos >= buf_len) {
-        buf_pos = 0;
-        while ((buf_len = read(STDIN_FILENO, read_buf, sizeof(read_buf))) <= 0) {
-            if (buf_len == -1 && errno == EAGAIN) continue;
-            if (buf_len == -1 && errno == EINTR) return 0;
-            if (buf_len == 0) return 0;
+    if (g_read_pos >= g_read_len) {
+        g_read_pos = 0;
+        while ((g_read_len = read(STDIN_FILENO, g_read_buf, sizeof(g_read_buf))) <= 0) {
+            if (g_read_len == -1 && errno == EAGAIN) continue;
+            if (g_read_len == -1 && errno == EINTR) return 0;
+            if (g_read_len == 0) return 0;
             die("read");
         }
     }
 
-    *c = read_buf[buf_pos++];
+    *c = g_read_buf[g_read_pos++];
     return 1;
 }
 
+void editorAppendPaste(const char *text, size_t len) {
+    if (E.sel.paste_len + len + 1 > E.sel.paste_capacity) {
+        if (E.sel.paste_capacity == 0) E.sel.paste_capacity = BUFFER_SIZE_1024;
+        while (E.sel.paste_len + len + 1 > E.sel.paste_capacity) E.sel.paste_capacity *= 2;
+        E.sel.paste_buf = safeRealloc(E.sel.paste_buf, E.sel.paste_capacity);
+    }
+
+    // terminals send Enter as carriage returns
+    char *dst = E.sel.paste_buf + E.sel.paste_len;
+    memcpy(dst, text, len);
+    for (char *cr = memchr(dst, '\r', len); cr; cr = memchr(cr + 1, '\r', dst + len - cr - 1))
+        *cr = '\n';
+    E.sel.paste_len += len;
+}
+
+void editorReadPaste() {
+    // the pasted bytes are copied a whole read at a time up to the end marker, which is left for editorReadKey
+    static const char marker[] = "\x1b[201~";
+    size_t marker_len = sizeof(marker) - 1;
+    int retries = 0;
+    while (true) {
+        char *chunk = g_read_buf + g_read_pos;
+        size_t avail = g_read_len - g_read_pos;
+        char *end = memmem(chunk, avail, marker, marker_len);
+
+        // a marker cut in two by the read stays in the buffer until the next read completes it
+        size_t held = 0;
+        if (!end)
+            for (size_t k = avail < marker_len - 1 ? avail : marker_len - 1; k > 0 && held == 0; k--)
+                if (memcmp(chunk + avail - k, marker, k) == 0) held = k;
+
+        size_t take = end ? (size_t)(end - chunk) : avail - held;
+        editorAppendPaste(chunk, take);
+        g_read_pos += take;
+        if (end) return;
+
+        memmove(g_read_buf, g_read_buf + g_read_pos, held);
+        g_read_pos = 0;
+        g_read_len = held;
+        ssize_t nread = read(STDIN_FILENO, g_read_buf + held, sizeof(g_read_buf) - held);
+        if (nread > 0) {
+            g_read_len += nread;
+            retries = 0;
+            continue;
+        }
+        // the rest of a cut marker gets a few read timeouts to arrive, EOF or a dead terminal never sends it
+        bool waiting = nread == 0 || errno == EAGAIN || errno == EINTR;
+        if (waiting && held > 0 && ++retries < PASTE_MARKER_RETRIES) continue;
+        return;     // a stalled paste goes on key by key, editorReadKey takes the held bytes from here
+    }
+}
+
+void editorSetPasteStatusMsg(const char *where) {
+    long elapsed = currentMicros() - E.sel.paste_start;
+    if (elapsed < 1) elapsed = 1;
+
+    char sizebuf[BUFFER_SIZE_32];
+    char ratebuf[BUFFER_SIZE_32];
+    humanReadableSize(E.sel.paste_len, sizebuf, sizeof(sizebuf));
+    humanReadableSize((size_t)((double)E.sel.paste_len * 1000000.0 / elapsed), ratebuf, sizeof(ratebuf));
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "Pasted %s%s (%s/s)", sizebuf, where, ratebuf);
+    editorSetStatusMsg(msg);
+}
+
+bool editorInputPending() {
+    if (g_read_pos < g_read_len) return true;
+    int available = 0;
+    return ioctl(STDIN_FILENO, FIONREAD, &available) == 0 && available > 0;
+}
+
 static void editorConsumeEscapeTail(bool already_final) {
     if (already_final) return;
     char c;
@@ -901,6 +1916,8 @@ int editorReadKey() {
 
                         E.cursor.x = x + E.view.col_offset;
                         E.cursor.y = y + E.view.row_offset;
+                        // with Alt held the column is kept as a render column for the block selection
+                        if ((b & MOUSE_ALT_MASK) && seq[i] == 'M') return motion ? MOUSE_BLOCK_DRAG : MOUSE_BLOCK_CLICK;
                         if (!motion && seq[i] == 'M') return MOUSE_LEFT_CLICK;
                         else if (motion && seq[i] == 'M') return MOUSE_DRAG;
                         else if (seq[i] == 'm') return MOUSE_LEFT_RELEASE;
@@ -943,6 +1960,8 @@ int editorReadKey() {
                         switch (seq[4]) {
                             case 'A': return ALT_SHIFT_ARROW_UP;
                             case 'B': return ALT_SHIFT_ARROW_DOWN;
+                            case 'C': return ALT_SHIFT_ARROW_RIGHT;
+                            case 'D': return ALT_SHIFT_ARROW_LEFT;
                         }
                     }
                     if (seq[3] == '3') {
@@ -1026,44 +2045,9 @@ void editorProcessStandardKey(int ch) {
     if (E.sel.is_pasting) E.sel.paste_len++;
 
     if (E.sel.active) {
-        char closing = getClosingChar(ch);
-        if (closing != 0) {
-            char *selected = editorGetSelectedText(NULL);
-            if (selected) {
-                int selected_len = strlen(selected);
-                editorBeginMacro();
-                editorDeleteSelectedText();
-                editorInsertChar(ch);
-
-                int sel_start_x = E.cursor.x;
-                int sel_start_y = E.cursor.y;
-
-                bool was_pasting = E.sel.is_pasting;
-                E.sel.is_pasting = true;
-                for (int i = 0; i < selected_len; i++) {
-                    if (selected[i] == '\n')
-                        editorInsertNewline();
-                    else if (selected[i] != '\r')
-                        editorInsertChar(selected[i]);
-                }
-
-                int sel_end_x = E.cursor.x;
-                int sel_end_y = E.cursor.y;
-                E.sel.is_pasting = was_pasting;
-                editorEndMacro();
-
-                E.sel.active = true;
-                E.sel.sx = sel_start_x;
-                E.sel.sy = sel_start_y;
-                E.sel.ex = sel_end_x;
-                E.sel.ey = sel_end_y;
-
-                if (!was_pasting)
-                    editorParseTreeSitter();
-                free(selected);
-                return;
-            }
-        }
+        // an empty selection has nothing to wrap, the opener is typed as usual
+        const char *closer = editorGetSurroundCloser(ch);
+        if (closer && editorSurroundSelection(ch, closer)) return;
     }
 
     bool stepped_over = false;
@@ -1091,18 +2075,18 @@ bool editorProcessKeypress() {
         E.buf.quit_times = QUIT_TIMES;
 
     if (E.sel.is_pasting && ch != PASTE_END) {
-        if (ch == '\r') ch = '\n';
-        if (ch > 255) return true;
-
-        if ((size_t)E.sel.paste_len + 1 >= E.sel.paste_capacity) {
-            E.sel.paste_capacity = E.sel.paste_capacity == 0 ? BUFFER_SIZE_1024 : E.sel.paste_capacity * 2;
-            E.sel.paste_buf = safeRealloc(E.sel.paste_buf, E.sel.paste_capacity);
+        // only reached when the bulk reader ran out of input mid paste, it takes over again after this key
+        if (ch <= 255) {
+            char c = ch;
+            editorAppendPaste(&c, 1);
         }
-
-        E.sel.paste_buf[E.sel.paste_len++] = (char)ch;
+        editorReadPaste();
         return true;
     }
 
+    if (editorBlockSelectionKey(ch)) return true;
+    if (editorMultiCursorKey(ch)) return true;
+
     switch (ch) {
         case CTRL_KEY('d'):     // debug tree-sitter
             editorDebugSyntaxUnderCursor();
@@ -1129,6 +2113,11 @@ bool editorProcessKeypress() {
             editorReplace();
             break;
 
+        case CTRL_KEY('p'):     // project search
+            editorProjectSearch();
+            updateMatchBracket();
+            break;
+
         case CTRL_KEY('c'):     // copy
             editorCopySelection();
             break;
@@ -1144,23 +2133,19 @@ bool editorProcessKeypress() {
         case PASTE_START:       // paste
             E.sel.is_pasting = true;
             E.sel.paste_len = 0;
+            E.sel.paste_start = currentMicros();
             editorBeginMacro();
+            editorReadPaste();
             break;
         case PASTE_END:
             E.sel.is_pasting = false;
             if (E.sel.paste_len > 0) {
                 if (E.sel.active) editorDeleteSelectedText();
 
+                // the whole paste goes in as one piece, the cursor lands at its end
                 size_t offset = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
                 executeInsert(offset, E.sel.paste_buf, E.sel.paste_len);
-                for (int i = 0; i < E.sel.paste_len; i++) {
-                    if (E.sel.paste_buf[i] == '\n') {
-                        E.cursor.y++;
-                        E.cursor.x = 0;
-                    } else {
-                        E.cursor.x++;
-                    }
-                }
+                editorOffsetToRowCol(&E.buf, offset + E.sel.paste_len, &E.cursor.y, &E.cursor.x);
                 E.cursor.preferred_x = E.cursor.x;
             }
 
@@ -1168,13 +2153,7 @@ bool editorProcessKeypress() {
             editorParseTreeSitter();
             updateMatchBracket();
 
-            {
-                char sizebuf[BUFFER_SIZE_32];
-                humanReadableSize(E.sel.paste_len, sizebuf, sizeof(sizebuf));
-                char msg[STATUS_LENGTH];
-                snprintf(msg, sizeof(msg), "Pasted %s", sizebuf);
-                editorSetStatusMsg(msg);
-            }
+            editorSetPasteStatusMsg("");
             break;
 
         case CTRL_KEY('a'):     // select all
@@ -1198,6 +2177,11 @@ bool editorProcessKeypress() {
             updateMatchBracket();
             break;
 
+        case CTRL_KEY('u'):     // undo tree
+            editorUndoTree();
+            updateMatchBracket();
+            break;
+
         case CTRL_KEY('e'):     // center viewport
             E.view.row_offset = E.cursor.y - (E.view.screen_rows / 2);
             if (E.view.row_offset < 0) E.view.row_offset = 0;
@@ -1400,6 +2384,8 @@ bool editorProcessKeypress() {
         case ESCAPE_CHAR:
             if (E.sel.active)
                 E.sel.active = false;
+            else if (E.find.active)
+                editorResetFind();
             break;
 
         default:
@@ -1445,6 +2431,11 @@ char *editorPrompt(char *prompt, void (*callback)(const char *, int), char *init
             needs_refresh = false;
         }
 
+        if (E.find.scanning && !editorInputPending()) {
+            if (editorFindScanStep(SCAN_SLICE_MS)) editorRefreshScreen();
+            continue;
+        }
+
         int ch = editorReadKey();
         if (ch == 0) continue;
         needs_refresh = true;
@@ -1478,51 +2469,69 @@ char *editorPrompt(char *prompt, void (*callback)(const char *, int), char *init
     }
 }
 
-bool editorEvaluateMatchPredicates(TSQueryMatch *match) {
+char *editorReadCaptureText(TSQueryMatch *match, uint32_t capture_id) {
+    for (uint16_t c = 0; c < match->capture_count; c++) {
+        if (match->captures[c].index != capture_id) continue;
+        uint32_t n_start = ts_node_start_byte(match->captures[c].node);
+        uint32_t n_len = ts_node_end_byte(match->captures[c].node) - n_start;
+
+        char *node_text = safeMalloc(n_len + 1);
+        ptReadLogical(&E.buf.pt, n_start, n_len, node_text);
+        node_text[n_len] = '\0';
+        return node_text;
+    }
+    return NULL;
+}
+
+bool editorEvaluateMatchPredicates(TSQuery *query, TSQueryMatch *match) {
     uint32_t step_count = 0;
-    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(E.ts.query, match->pattern_index, &step_count);
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(query, match->pattern_index, &step_count);
 
     if (step_count == 0) return true;
 
     for (uint32_t i = 0; i < step_count; ) {
-        if (steps[i].type == TSQueryPredicateStepTypeString) {
+        if (steps[i].type == TSQueryPredicateStepTypeString && i + 2 < step_count && steps[i + 1].type == TSQueryPredicateStepTypeCapture) {
             uint32_t len;
-            const char *pred_name = ts_query_string_value_for_id(E.ts.query, steps[i].value_id, &len);
-            if (strncmp(pred_name, "match?", len) == 0 && i + 2 < step_count) {
-                if (steps[i + 1].type == TSQueryPredicateStepTypeCapture && steps[i + 2].type == TSQueryPredicateStepTypeString) {
-                    uint32_t capture_id = steps[i + 1].value_id;
-                    uint32_t regex_len;
-                    const char *regex_str = ts_query_string_value_for_id(E.ts.query, steps[i + 2].value_id, &regex_len);
-
-                    TSNode target_node;
-                    bool found_node = false;
-                    for (uint16_t c = 0; c < match->capture_count; c++) {
-                        if (match->captures[c].index == capture_id) {
-                            target_node = match->captures[c].node;
-                            found_node = true;
-                            break;
-                        }
-                    }
-
-                    if (found_node) {
-                        uint32_t n_start = ts_node_start_byte(target_node);
-                        uint32_t n_end = ts_node_end_byte(target_node);
-                        uint32_t n_len = n_end - n_start;
-
-                        char *node_text = safeMalloc(n_len + 1);
-                        ptReadLogical(&E.buf.pt, n_start, n_len, node_text);
-
-                        regex_t regex;
-                        if (regcomp(&regex, regex_str, REG_EXTENDED | REG_NOSUB) == 0) {
-                            if (regexec(&regex, node_text, 0, NULL, 0) == REG_NOMATCH) {
-                                free(node_text);
-                                regfree(&regex);
-                                return false;
-                            }
+            const char *pred_name = ts_query_string_value_for_id(query, steps[i].value_id, &len);
+            if (strncmp(pred_name, "match?", len) == 0 && steps[i + 2].type == TSQueryPredicateStepTypeString) {
+                uint32_t regex_len;
+                const char *regex_str = ts_query_string_value_for_id(query, steps[i + 2].value_id, &regex_len);
+                char *node_text = editorReadCaptureText(match, steps[i + 1].value_id);
+
+                if (node_text) {
+                    regex_t regex;
+                    if (regcomp(&regex, regex_str, REG_EXTENDED | REG_NOSUB) == 0) {
+                        if (regexec(&regex, node_text, 0, NULL, 0) == REG_NOMATCH) {
+                            free(node_text);
                             regfree(&regex);
+                            return false;
                         }
-                        free(node_text);
+                        regfree(&regex);
                     }
+                    free(node_text);
+                }
+            } else if (strcmp(pred_name, "eq?") == 0 || strcmp(pred_name, "not-eq?") == 0) {
+                // the second operand is either a string literal or another capture
+                bool negate = pred_name[0] == 'n';
+                char *node_text = editorReadCaptureText(match, steps[i + 1].value_id);
+                char *other_text = NULL;
+                const char *other = NULL;
+                uint32_t other_len = 0;
+                if (steps[i + 2].type == TSQueryPredicateStepTypeString) {
+                    other = ts_query_string_value_for_id(query, steps[i + 2].value_id, &other_len);
+                } else if (steps[i + 2].type == TSQueryPredicateStepTypeCapture) {
+                    other = other_text = editorReadCaptureText(match, steps[i + 2].value_id);
+                    other_len = other_text ? (uint32_t)strlen(other_text) : 0;
+                }
+
+                if (node_text && other) {
+                    bool equal = strlen(node_text) == other_len && memcmp(node_text, other, other_len) == 0;
+                    free(node_text);
+                    free(other_text);
+                    if (equal == negate) return false;
+                } else {
+                    free(node_text);
+                    free(other_text);
                 }
             }
         }
@@ -1542,6 +2551,9 @@ void editorApplyMatchColors(TSQueryMatch *match, size_t start, size_t end, uint3
         if (n_end > end) n_end = end;
         if (n_start >= n_end) continue;
 
+        if (capture.index < E.ts.theme_color_count && E.ts.capture_targets[capture.index] != PASS_TARGET_NONE)
+            editorAddPassRegion(n_start, n_end, E.ts.capture_targets[capture.index]);
+
         uint32_t color = (capture.index < E.ts.theme_color_count) ? E.ts.theme_colors[capture.index] : E.ts.default_fg;
         uint16_t priority = match->pattern_index;
         for (uint32_t b = n_start; b < n_end; b++) {
@@ -1554,6 +2566,7 @@ void editorApplyMatchColors(TSQueryMatch *match, size_t start, size_t end, uint3
 }
 
 void editorUpdateSyntaxColors(size_t start, size_t end, uint32_t *colors, uint16_t *priorities) {
+    g_num_pass_regions = 0;
     if (!E.ts.tree || !E.ts.query || !E.ts.query_cursor) return;
 
     ts_query_cursor_set_byte_range(E.ts.query_cursor, start, end);
@@ -1561,7 +2574,7 @@ void editorUpdateSyntaxColors(size_t start, size_t end, uint32_t *colors, uint16
 
     TSQueryMatch match;
     while (ts_query_cursor_next_match(E.ts.query_cursor, &match))
-        if (editorEvaluateMatchPredicates(&match))
+        if (editorEvaluateMatchPredicates(E.ts.query, &match))
             editorApplyMatchColors(&match, start, end, colors, priorities);
 }
 
@@ -1582,37 +2595,6 @@ void editorGetNormalizedSelection(int *sy, int *sx, int *ey, int *ex) {
     }
 }
 
-int editorFindFirstMatchOnRow(int file_row) {
-    if (!E.find.active || !E.find.query || E.find.num_matches == 0) return -1;
-
-    int low = 0;
-    int high = E.find.num_matches - 1;
-    int first_match_idx = -1;
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-        if (E.find.match_lines[mid] == file_row) {
-            first_match_idx = mid;
-            high = mid - 1;
-        } else if (E.find.match_lines[mid] < file_row) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
-    }
-    return first_match_idx;
-}
-
-bool editorIsCharInFindMatch(int file_row, int cx, int first_match_idx) {
-    if (first_match_idx < 0) return false;
-
-    int query_len = strlen(E.find.query);
-    for (int i = first_match_idx; i < E.find.num_matches; i++) {
-        if (E.find.match_lines[i] != file_row) break;
-        if (cx >= E.find.match_cols[i] && cx < E.find.match_cols[i] + query_len) return true;
-    }
-    return false;
-}
-
 void editorGetBracketSpan(int *sy, int *sx, int *ey, int *ex, bool *active) {
     *active = E.sys.has_bracket;
     if (!E.sys.has_bracket) return;
@@ -1636,74 +2618,358 @@ void editorGetBracketSpan(int *sy, int *sx, int *ey, int *ex, bool *active) {
     *ey = by; *ex = bx;
 }
 
-bool editorIsCharInBracketSpan(int file_row, int cx, int sy, int sx, int ey, int ex, bool active) {
-    if (!active) return false;
-    if (file_row > sy && file_row < ey) return true;
-    if (file_row == sy && file_row == ey && cx >= sx && cx <= ex) return true;
-    if (file_row == sy && file_row < ey && cx >= sx) return true;
-    if (file_row == ey && file_row > sy && cx <= ex) return true;
-    return false;
+int compareDecorationEvents(const void *a, const void *b) {
+    const DecorationEvent *ea = a;
+    const DecorationEvent *eb = b;
+    if (ea->col != eb->col) return ea->col < eb->col ? -1 : 1;
+    return 0;
 }
 
-bool editorIsCharSelected(int file_row, int cx, int sel_y1, int sel_x1, int sel_y2, int sel_x2) {
-    if (!E.sel.active) return false;
+void editorFlattenDecorations(DecorationEvent *events, int num_events) {
+    if (num_events == 0) return;
+    qsort(events, num_events, sizeof(DecorationEvent), compareDecorationEvents);
 
-    if (file_row > sel_y1 && file_row < sel_y2) return true;
-    if (file_row == sel_y1 && file_row == sel_y2 && cx >= sel_x1 && cx < sel_x2) return true;
-    if (file_row == sel_y1 && file_row < sel_y2 && cx >= sel_x1) return true;
-    if (file_row == sel_y2 && file_row > sel_y1 && cx < sel_x2) return true;
+    // sweep the boundaries, the highest priority kind covering a span wins it
+    int row_first = g_num_decorations;
+    int counts[DECOR_KINDS] = {0};
+    int prev_col = events[0].col;
+    int i = 0;
+    while (i < num_events) {
+        int col = events[i].col;
+        if (col > prev_col) {
+            DecorationKind top = DECOR_NONE;
+            for (int k = DECOR_KINDS - 1; k > DECOR_NONE; k--) {
+                if (counts[k] > 0) {
+                    top = k;
+                    break;
+                }
+            }
 
-    return false;
+            if (top != DECOR_NONE) {
+                Decoration *last = g_num_decorations > row_first ? &g_decorations[g_num_decorations - 1] : NULL;
+                if (last && last->kind == top && last->end == prev_col) {
+                    last->end = col;
+                } else {
+                    if (g_num_decorations >= g_decorations_cap) {
+                        g_decorations_cap = g_decorations_cap == 0 ? BUFFER_SIZE_256 : g_decorations_cap * 2;
+                        g_decorations = safeRealloc(g_decorations, sizeof(Decoration) * g_decorations_cap);
+                    }
+                    g_decorations[g_num_decorations++] = (Decoration){ prev_col, col, top };
+                }
+            }
+        }
+
+        for (; i < num_events && events[i].col == col; i++)
+            counts[events[i].kind] += events[i].delta;
+        prev_col = col;
+    }
 }
 
-void highlightFormatSpecifiers(size_t start_byte, size_t end_byte, uint32_t *colors) {
-    if (!E.ts.tree || end_byte <= start_byte) return;
+void editorBuildDecorations(int first_row, int num_rows) {
+    static DecorationEvent *events = NULL;
+    static int events_cap = 0;
 
-    size_t byte_count = end_byte - start_byte;
-    char *text = safeMalloc(byte_count + 1);
-    ptReadLogical(&E.buf.pt, start_byte, byte_count, text);
+    if (num_rows + 1 > g_decor_rows_cap) {
+        g_decor_rows_cap = num_rows + 1;
+        g_decor_row_start = safeRealloc(g_decor_row_start, sizeof(int) * g_decor_rows_cap);
+    }
+    g_num_decorations = 0;
 
-    uint32_t formatColor = 0;
-    for (int r = 0; r < E.ts.num_theme_rules; r++) {
-        if (strcmp(E.ts.theme_rules[r].prefix, "format_specifier") == 0) {
-            formatColor = E.ts.theme_rules[r].color;
-            break;
+    int sel_y1 = 0, sel_x1 = 0, sel_y2 = 0, sel_x2 = 0;
+    if (E.sel.block)
+        editorGetNormalizedBlock(&sel_y1, &sel_x1, &sel_y2, &sel_x2);
+    else
+        editorGetNormalizedSelection(&sel_y1, &sel_x1, &sel_y2, &sel_x2);
+
+    int brk_y1 = 0, brk_x1 = 0, brk_y2 = 0, brk_x2 = 0;
+    bool brk_active = false;
+    editorGetBracketSpan(&brk_y1, &brk_x1, &brk_y2, &brk_x2, &brk_active);
+
+    bool show_matches = E.find.active && E.find.query && E.find.matches.total > 0 && first_row < E.buf.num_lines;
+    int match = show_matches ? matchStoreLowerBound(&E.find.matches, E.buf.line_offsets[first_row]) : 0;
+    int query_len = show_matches ? (int)strlen(E.find.query) : 0;
+    int caret = (E.carets.count > 0 && first_row < E.buf.num_lines) ? editorCaretLowerBound(E.buf.line_offsets[first_row]) : E.carets.count;
+
+    for (int r = 0; r < num_rows; r++) {
+        int file_row = first_row + r;
+        g_decor_row_start[r] = g_num_decorations;
+        if (file_row >= E.buf.num_lines) continue;
+
+        size_t line_start = E.buf.line_offsets[file_row];
+        size_t next_line = (file_row + 1 < E.buf.num_lines) ? E.buf.line_offsets[file_row + 1] : E.buf.pt.logical_size + 1;
+        int row_end = show_matches ? matchStoreLowerBound(&E.find.matches, next_line) : 0;
+        int caret_end = caret < E.carets.count ? editorCaretLowerBound(next_line) : caret;
+
+        int num_events = 0;
+        int needed = 4 + 2 * (row_end - match) + 2 * (caret_end - caret);
+        if (needed > events_cap) {
+            events_cap = needed + BUFFER_SIZE_32;
+            events = safeRealloc(events, sizeof(DecorationEvent) * events_cap);
         }
-    }
 
-    TSNode root = ts_tree_root_node(E.ts.tree);
-    for (size_t i = 0; i < byte_count - 1; i++) {
-        if (text[i] == '%') {
-            size_t j = i + 1;
-            if (text[j] == '%') {
-                i++;
-                continue;
+        if (E.sel.active && E.sel.block && file_row >= sel_y1 && file_row <= sel_y2) {
+            // the block is the same render columns on every row, mapped back to bytes per row
+            int start, end;
+            editorBlockRowRange(file_row, sel_x1, sel_x2, &start, &end);
+            if (start < end) {
+                events[num_events++] = (DecorationEvent){ start, 1, DECOR_SELECTION };
+                events[num_events++] = (DecorationEvent){ end, -1, DECOR_SELECTION };
+            } else if (file_row != E.cursor.y) {
+                events[num_events++] = (DecorationEvent){ start, 1, DECOR_CARET };
+                events[num_events++] = (DecorationEvent){ start + 1, -1, DECOR_CARET };
             }
-
-            while (j < byte_count) {
-                char c = text[j];
-                if (c == '-' || c == '+' || c == ' ' || c == '#' || c == '0' || c == '.' || c == '*' || (c >= '0' && c <= '9'))
-                    j++;
-                else
-                    break;
+        } else if (E.sel.active && file_row >= sel_y1 && file_row <= sel_y2) {
+            int start = (file_row == sel_y1) ? sel_x1 : 0;
+            int end = (file_row == sel_y2) ? sel_x2 : INT_MAX;
+            if (start < end) {
+                events[num_events++] = (DecorationEvent){ start, 1, DECOR_SELECTION };
+                events[num_events++] = (DecorationEvent){ end, -1, DECOR_SELECTION };
             }
+        }
 
-            if (j < byte_count && ((text[j] >= 'a' && text[j] <= 'z') || (text[j] >= 'A' && text[j] <= 'Z'))) {
-                TSNode node = ts_node_descendant_for_byte_range(root, start_byte + i, start_byte + i + 1);
-                const char *nodeType = ts_node_type(node);
-                if (nodeType && strstr(nodeType, "string") != NULL)
-                    for (size_t k = i; k <= j; k++)
-                        colors[k] = formatColor;
-                i = j;
-            }
+        if (brk_active && file_row >= brk_y1 && file_row <= brk_y2) {
+            int start = (file_row == brk_y1) ? brk_x1 : 0;
+            int end = (file_row == brk_y2) ? brk_x2 + 1 : INT_MAX;
+            events[num_events++] = (DecorationEvent){ start, 1, DECOR_BRACKET };
+            events[num_events++] = (DecorationEvent){ end, -1, DECOR_BRACKET };
         }
+
+        for (; match < row_end; match++) {
+            size_t offset = matchStoreGet(&E.find.matches, match);
+            int col = offset - line_start;
+            int len = E.find.use_regex || E.find.use_query ? (int)editorFindMatchLength(offset) : query_len;
+            DecorationKind kind = (match == E.find.current_idx) ? DECOR_CURRENT_MATCH : DECOR_MATCH;
+            events[num_events++] = (DecorationEvent){ col, 1, kind };
+            events[num_events++] = (DecorationEvent){ col + len, -1, kind };
+        }
+
+        for (; caret < caret_end; caret++) {
+            int col = E.carets.offsets[caret] - line_start;
+            events[num_events++] = (DecorationEvent){ col, 1, DECOR_CARET };
+            events[num_events++] = (DecorationEvent){ col + 1, -1, DECOR_CARET };
+        }
+
+        editorFlattenDecorations(events, num_events);
     }
-    free(text);
+    g_decor_row_start[num_rows] = g_num_decorations;
 }
 
-void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint32_t *colors) {
-    static char *line_text = NULL;
-    static size_t line_cap = 0;
+void editorAddPassRegion(size_t start, size_t end, PassTarget target) {
+    if (g_num_pass_regions >= g_pass_regions_cap) {
+        g_pass_regions_cap = g_pass_regions_cap == 0 ? BUFFER_SIZE_256 : g_pass_regions_cap * 2;
+        g_pass_regions = safeRealloc(g_pass_regions, sizeof(PassRegion) * g_pass_regions_cap);
+    }
+    g_pass_regions[g_num_pass_regions++] = (PassRegion){ start, end, target };
+}
+
+int comparePassRegions(const void *a, const void *b) {
+    const PassRegion *ra = a;
+    const PassRegion *rb = b;
+    if (ra->start != rb->start) return ra->start < rb->start ? -1 : 1;
+    if (ra->target != rb->target) return ra->target < rb->target ? -1 : 1;
+    return 0;
+}
+
+void passCacheAppend(PassCacheEntry *entry, int pass, size_t start, size_t end) {
+    if (entry->num_spans >= entry->capacity) {
+        entry->capacity = entry->capacity == 0 ? BUFFER_SIZE_32 : entry->capacity * 2;
+        entry->spans = safeRealloc(entry->spans, sizeof(PassSpan) * entry->capacity);
+    }
+    entry->spans[entry->num_spans++] = (PassSpan){ start, end, pass };
+}
+
+uint64_t hashBytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME_64;
+    }
+    return hash;
+}
+
+void highlightPrintfFormats(PassCacheEntry *entry, int pass, const char *text, size_t start, size_t end) {
+    for (size_t i = start; i + 1 < end; i++) {
+        if (text[i] != '%') continue;
+
+        size_t j = i + 1;
+        if (text[j] == '%') {
+            i++;
+            continue;
+        }
+
+        while (j < end && text[j] != '\0' && strchr("-+ #0.*123456789", text[j])) j++;
+        if (j < end && text[j] != '\0' && strchr("hljztLq", text[j])) {
+            j++;
+            if (j < end && (text[j - 1] == 'h' || text[j - 1] == 'l') && text[j] == text[j - 1]) j++;
+        }
+
+        if (j < end && text[j] != '\0' && strchr("diouxXeEfFgGaAcsprn", text[j])) {
+            passCacheAppend(entry, pass, i, j + 1);
+            i = j;
+        }
+    }
+}
+
+void highlightEscapeSequences(PassCacheEntry *entry, int pass, const char *text, size_t start, size_t end) {
+    for (size_t i = start; i + 1 < end; i++) {
+        if (text[i] != '\\') continue;
+
+        size_t j = i + 1;
+        size_t max_digits = 0;
+        if (text[j] == 'x') max_digits = 2;
+        else if (text[j] == 'u') max_digits = 4;
+        else if (text[j] == 'U') max_digits = 8;
+
+        if (max_digits > 0) {
+            size_t k = j + 1;
+            while (k < end && k - j <= max_digits && is_xdigit(text[k])) k++;
+            j = k - 1;
+        } else if (text[j] >= '0' && text[j] <= '7') {
+            while (j + 1 < end && j - i < 3 && text[j + 1] >= '0' && text[j + 1] <= '7') j++;
+        }
+
+        passCacheAppend(entry, pass, i, j + 1);
+        i = j;
+    }
+}
+
+void highlightTodoMarkers(PassCacheEntry *entry, int pass, const char *text, size_t start, size_t end) {
+    static const char *markers[] = { "TODO", "FIXME", "XXX", "HACK", "NOTE", "BUG" };
+
+    size_t i = start;
+    while (i < end) {
+        if (!(text[i] >= 'A' && text[i] <= 'Z') || (i > start && (is_alnum(text[i - 1]) || text[i - 1] == '_'))) {
+            i++;
+            continue;
+        }
+
+        size_t j = i;
+        while (j < end && text[j] >= 'A' && text[j] <= 'Z') j++;
+        if (j == end || !(is_alnum(text[j]) || text[j] == '_')) {
+            for (size_t m = 0; m < sizeof(markers) / sizeof(markers[0]); m++) {
+                if (strlen(markers[m]) == j - i && strncmp(&text[i], markers[m], j - i) == 0) {
+                    passCacheAppend(entry, pass, i, j);
+                    break;
+                }
+            }
+        }
+        i = j;
+    }
+}
+
+// post-highlight passes, run on the text of captures named @string* or @comment*
+static const HighlightPass g_highlight_passes[] = {
+    { "format_specifier", "c,cpp,python,go,bash,php,ruby,perl,lua", PASS_TARGET_STRING, highlightPrintfFormats },
+    { "character.escape", "c,cpp,java,javascript,typescript,go,rust,python", PASS_TARGET_STRING, highlightEscapeSequences },
+    { "comment.todo", NULL, PASS_TARGET_COMMENT, highlightTodoMarkers },
+};
+
+int editorNumHighlightPasses() {
+    return (int)(sizeof(g_highlight_passes) / sizeof(g_highlight_passes[0]));
+}
+
+bool editorPassAppliesTo(const char *languages, const char *name) {
+    if (!languages) return true;
+    if (!name) return false;
+
+    size_t name_len = strlen(name);
+    const char *p = languages;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len == name_len && strncmp(p, name, len) == 0) return true;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return false;
+}
+
+void editorRunHighlightPasses(size_t start_byte, size_t end_byte, uint32_t *colors) {
+    static char *line_text = NULL;
+    static size_t line_cap = 0;
+
+    if (!E.ts.tree || E.ts.pass_mask == 0 || g_num_pass_regions == 0) return;
+
+    // sort and coalesce, a string can be captured by several patterns
+    qsort(g_pass_regions, g_num_pass_regions, sizeof(PassRegion), comparePassRegions);
+    int n = 0;
+    for (int i = 0; i < g_num_pass_regions; i++) {
+        if (n > 0 && g_pass_regions[n - 1].target == g_pass_regions[i].target && g_pass_regions[i].start <= g_pass_regions[n - 1].end) {
+            if (g_pass_regions[i].end > g_pass_regions[n - 1].end) g_pass_regions[n - 1].end = g_pass_regions[i].end;
+            continue;
+        }
+        g_pass_regions[n++] = g_pass_regions[i];
+    }
+
+    int r = 0;
+    for (int row = E.view.row_offset; row < E.buf.num_lines; row++) {
+        size_t line_start = E.buf.line_offsets[row];
+        if (line_start >= end_byte) break;
+        size_t line_len = editorGetLineLength(&E.buf, row);
+        size_t line_end = line_start + line_len;
+
+        while (r < n && g_pass_regions[r].end <= line_start) r++;
+        if (r >= n) break;
+        if (g_pass_regions[r].start >= line_end) continue;
+
+        // the passes and region bounds are checked first, the text only once the buffer changed
+        uint64_t layout = hashBytes(FNV_OFFSET_64, &E.ts.pass_mask, sizeof(E.ts.pass_mask));
+        for (int k = r; k < n && g_pass_regions[k].start < line_end; k++) {
+            size_t s = (g_pass_regions[k].start > line_start ? g_pass_regions[k].start : line_start) - line_start;
+            size_t e = (g_pass_regions[k].end < line_end ? g_pass_regions[k].end : line_end) - line_start;
+            if (s >= e) continue;
+            layout = hashBytes(layout, &s, sizeof(s));
+            layout = hashBytes(layout, &e, sizeof(e));
+            layout = hashBytes(layout, &g_pass_regions[k].target, sizeof(PassTarget));
+        }
+
+        PassCacheEntry *entry = &g_pass_cache[row % PASS_CACHE_SLOTS];
+        bool known = entry->valid && entry->row == row && entry->layout == layout;
+        if (!known || entry->generation != E.buf.generation) {
+            if (line_len + 1 > line_cap) {
+                line_cap = line_len + BUFFER_SIZE_PADDING;
+                line_text = safeRealloc(line_text, line_cap);
+            }
+            ptReadLogical(&E.buf.pt, line_start, line_len, line_text);
+            line_text[line_len] = '\0';
+
+            // key the line on the text inside its regions, an edit elsewhere keeps its spans
+            uint64_t hash = layout;
+            for (int k = r; k < n && g_pass_regions[k].start < line_end; k++) {
+                size_t s = (g_pass_regions[k].start > line_start ? g_pass_regions[k].start : line_start) - line_start;
+                size_t e = (g_pass_regions[k].end < line_end ? g_pass_regions[k].end : line_end) - line_start;
+                if (s >= e) continue;
+                hash = hashBytes(hash, &line_text[s], e - s);
+            }
+
+            if (!known || entry->hash != hash) {
+                entry->valid = true;
+                entry->row = row;
+                entry->layout = layout;
+                entry->hash = hash;
+                entry->num_spans = 0;
+                for (int k = r; k < n && g_pass_regions[k].start < line_end; k++) {
+                    size_t s = (g_pass_regions[k].start > line_start ? g_pass_regions[k].start : line_start) - line_start;
+                    size_t e = (g_pass_regions[k].end < line_end ? g_pass_regions[k].end : line_end) - line_start;
+                    if (s >= e) continue;
+                    for (int p = 0; p < editorNumHighlightPasses(); p++)
+                        if ((E.ts.pass_mask & (1u << p)) && g_highlight_passes[p].target == g_pass_regions[k].target)
+                            g_highlight_passes[p].scan(entry, p, line_text, s, e);
+                }
+            }
+            entry->generation = E.buf.generation;
+        }
+
+        for (int i = 0; i < entry->num_spans; i++) {
+            PassSpan span = entry->spans[i];
+            for (size_t b = span.start; b < span.end && line_start + b < end_byte; b++)
+                colors[line_start + b - start_byte] = E.ts.pass_colors[span.pass];
+        }
+    }
+}
+
+void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint32_t *colors, const Decoration *decor, int num_decor) {
+    static char *line_text = NULL;
+    static size_t line_cap = 0;
 
     size_t line_len = editorGetLineLength(&E.buf, file_row);
     bool is_current_line = (file_row == E.cursor.y);
@@ -1716,7 +2982,12 @@ void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint
         snprintf(gutter_buf, sizeof(gutter_buf), FG_DARK_GRAY "%*d " FG_DEFAULT, gutter_width - 1, file_row + 1);
     abAppend(ab, gutter_buf, strlen(gutter_buf));
 
+    // a caret past the last character gets a cell of its own
+    bool eol_caret = num_decor > 0 && decor[num_decor - 1].kind == DECOR_CARET && decor[num_decor - 1].end > (int)line_len;
+
     if (line_len == 0) {
+        if (eol_caret && E.view.col_offset == 0)
+            abAppend(ab, CARET_BG_COLOR " " RESET_BG_COLOR, sizeof(CARET_BG_COLOR " " RESET_BG_COLOR) - 1);
         if (is_current_line)
             abAppend(ab, DARK_GRAY_BG_COLOR, sizeof(DARK_GRAY_BG_COLOR) - 1);
         return;
@@ -1734,19 +3005,13 @@ void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint
     size_t line_start_byte = E.buf.line_offsets[file_row];
     ptReadLogical(&E.buf.pt, line_start_byte, line_len, line_text);
 
-    int sel_y1 = 0, sel_x1 = 0, sel_y2 = 0, sel_x2 = 0;
-    editorGetNormalizedSelection(&sel_y1, &sel_x1, &sel_y2, &sel_x2);
-
-    int brk_y1 = 0, brk_x1 = 0, brk_y2 = 0, brk_x2 = 0;
-    bool brk_active = false;
-    editorGetBracketSpan(&brk_y1, &brk_x1, &brk_y2, &brk_x2, &brk_active);
-    int find_first = editorFindFirstMatchOnRow(file_row);
-
+    const char *line_bg = is_current_line ? DARK_GRAY_BG_COLOR : RESET_BG_COLOR;
     if (is_current_line)
         abAppend(ab, DARK_GRAY_BG_COLOR, sizeof(DARK_GRAY_BG_COLOR) - 1);
 
     uint32_t current_fg = DEFAULT_FG_COLOR_HEX;
-    bool current_inv = false;
+    DecorationKind current_kind = DECOR_NONE;
+    int d = 0;
 
     int text_area = E.view.screen_cols - gutter_width;
     int rx = 0;
@@ -1782,17 +3047,12 @@ void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint
         size_t offset = line_start_byte + cx;
         uint32_t color = colors[offset - start_byte];
 
-        bool char_selected = editorIsCharSelected(file_row, cx, sel_y1, sel_x1, sel_y2, sel_x2);
-        bool in_bracket = editorIsCharInBracketSpan(file_row, cx, brk_y1, brk_x1, brk_y2, brk_x2, brk_active);
-        bool in_find = editorIsCharInFindMatch(file_row, cx, find_first);
-
-        bool needs_bg = char_selected || in_bracket || in_find;
-        if (needs_bg != current_inv) {
-            if (needs_bg)
-                abAppend(ab, LIGHT_GRAY_BG_COLOR, sizeof(LIGHT_GRAY_BG_COLOR) - 1);
-            else
-                abAppend(ab, RESET_BG_COLOR, sizeof(RESET_BG_COLOR) - 1);
-            current_inv = needs_bg;
+        while (d < num_decor && decor[d].end <= cx) d++;
+        DecorationKind kind = (d < num_decor && decor[d].start <= cx) ? decor[d].kind : DECOR_NONE;
+        if (kind != current_kind) {
+            const char *bg = (kind == DECOR_NONE) ? line_bg : g_decoration_bg[kind];
+            abAppend(ab, bg, strlen(bg));
+            current_kind = kind;
         }
 
         if (color != current_fg) {
@@ -1816,6 +3076,9 @@ void editorDrawSingleRow(AppendBuffer *ab, int file_row, size_t start_byte, uint
         cx += seq_len;
     }
 
+    if (eol_caret && (size_t)cx >= line_len && rx >= E.view.col_offset && rx - E.view.col_offset < text_area)
+        abAppend(ab, CARET_BG_COLOR " ", sizeof(CARET_BG_COLOR " ") - 1);
+
     abAppend(ab, REMOVE_GRAPHICS, strlen(REMOVE_GRAPHICS));
     if (is_current_line)
         abAppend(ab, DARK_GRAY_BG_COLOR, sizeof(DARK_GRAY_BG_COLOR) - 1);
@@ -1920,7 +3183,8 @@ void editorDrawRows(AppendBuffer *ab) {
     memset(priorities, 0, sizeof(uint16_t) * byte_count);
 
     editorUpdateSyntaxColors(start_byte, end_byte, colors, priorities);
-    highlightFormatSpecifiers(start_byte, end_byte, colors);
+    editorRunHighlightPasses(start_byte, end_byte, colors);
+    editorBuildDecorations(E.view.row_offset, E.view.screen_rows);
 
     for (int y = 0; y < E.view.screen_rows; y++) {
         int file_row = y + E.view.row_offset;
@@ -1931,7 +3195,8 @@ void editorDrawRows(AppendBuffer *ab) {
             snprintf(empty_gutter, sizeof(empty_gutter), FG_DARK_GRAY "%*s " FG_DEFAULT, gutter_width - 1, EMPTY_LINE_SYMBOL);
             abAppend(ab, empty_gutter, strlen(empty_gutter));
         } else {
-            editorDrawSingleRow(ab, file_row, start_byte, colors);
+            int first = g_decor_row_start[y];
+            editorDrawSingleRow(ab, file_row, start_byte, colors, &g_decorations[first], g_decor_row_start[y + 1] - first);
         }
 
         abAppend(ab, CLEAR_LINE, sizeof(CLEAR_LINE) - 1);
@@ -1950,7 +3215,9 @@ void editorDrawStatusBar(AppendBuffer *ab) {
     abAppend(ab, INVERTED_COLORS, sizeof(INVERTED_COLORS) - 1);
     char status[BUFFER_SIZE_1024], rstatus[STATUS_LENGTH], lsuffix[STATUS_LENGTH];
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d", E.cursor.y + 1, E.cursor.x + 1);
+    int rlen = E.carets.count > 0
+        ? snprintf(rstatus, sizeof(rstatus), "%d cursors  %d:%d", E.carets.count + 1, E.cursor.y + 1, E.cursor.x + 1)
+        : snprintf(rstatus, sizeof(rstatus), "%d:%d", E.cursor.y + 1, E.cursor.x + 1);
     int lsuffix_len = snprintf(lsuffix, sizeof(lsuffix), " - %d lines %s", E.buf.num_lines, E.buf.dirty ? "(modified)" : "");
     int max_name_len = E.view.screen_cols - lsuffix_len - rlen - 1;
     if (max_name_len < MIN_FILENAME_LEN) max_name_len = MIN_FILENAME_LEN;
@@ -1987,10 +3254,23 @@ void editorDrawMsgBar(AppendBuffer *ab) {
     const char *lang_name = editorGetLanguageName(E.buf.filename);
     const char *display_lang = lang_name ? lang_name : "";
 
-    char right_buf[BUFFER_SIZE_32];
+    char right_buf[BUFFER_SIZE_128];
     int right_len;
-    if (E.find.active)
-        right_len = snprintf(right_buf, sizeof(right_buf), "%d/%d | %s", E.find.current_idx + 1, E.find.num_matches, display_lang);
+    // whole word only applies to plain text, a regex says \b instead
+    char mode[BUFFER_SIZE_32];
+    if (E.find.use_query)
+        snprintf(mode, sizeof(mode), "query ");
+    else
+        snprintf(mode, sizeof(mode), "%s%s%s", E.find.use_regex ? "regex " : "", E.find.ignore_case ? "icase " : "",
+                 E.find.whole_word && !E.find.use_regex ? "word " : "");
+    if (E.find.active && E.find.use_regex && E.find.regex_error)
+        right_len = snprintf(right_buf, sizeof(right_buf), "bad regex: %s | %s", E.find.regex_error, display_lang);
+    else if (E.find.active && E.find.use_query && E.find.query_error[0] != '\0')
+        right_len = snprintf(right_buf, sizeof(right_buf), "bad query: %s | %s", E.find.query_error, display_lang);
+    else if (E.find.active && E.find.scanning)
+        right_len = snprintf(right_buf, sizeof(right_buf), "%sscanning... %d matches | %s", mode, E.find.matches.total + E.find.scan_head.total, display_lang);
+    else if (E.find.active)
+        right_len = snprintf(right_buf, sizeof(right_buf), "%s%d/%d | %s", mode, E.find.current_idx + 1, E.find.matches.total, display_lang);
     else
         right_len = snprintf(right_buf, sizeof(right_buf), "%s", display_lang);
 
@@ -2046,20 +3326,30 @@ void editorManualScreen() {
         "  Ctrl-Q               - Quit",
         "  Ctrl-F               - Find",
         "  Ctrl-R               - Find & Replace",
+        "  Ctrl-T (in Find)     - Toggle regex search",
+        "  Ctrl-N (in Find)     - Toggle tree-sitter query search",
+        "  Ctrl-K (in Find)     - Toggle case-insensitive search",
+        "  Ctrl-W (in Find)     - Toggle whole word search",
+        "  Ctrl-O (in Find)     - Cursor at every match",
+        "  Ctrl-P               - Search all files in the project",
         "  Ctrl-G or Ctrl-L     - Jump to line",
         "  Ctrl-A               - Select all",
         "  Ctrl-Z               - Undo last major change",
         "  Ctrl-Y               - Redo last major change",
+        "  Ctrl-U               - Browse undo branches",
         "  Ctrl-C               - Copy selected text",
         "  Ctrl-X               - Cut selected text",
         "  Ctrl-V               - Paste from clipboard",
         "  Ctrl-E               - Center viewport",
         "  Ctrl-H               - Show manual",
-        "  Ctrl-D               - Debug Tree-Sitter Capture",
+        "  Ctrl-D               - Debug capture and undo memory",
         "  Ctrl-B               - Jump to matching bracket",
         "  Ctrl-/               - Comment line",
+        "  Ctrl-O               - Cursor at next match / on selected lines",
         "  Alt-Up/Down          - Move row up / down",
         "  Shift-Alt-Up/Down    - Copy row up / down",
+        "  Shift-Alt-Left/Right - Block selection (then Shift-Alt-Up/Down)",
+        "  Alt-Drag             - Block selection",
         "",
         "Press any key to return..."
     };
@@ -2342,6 +3632,7 @@ void ptInit(PieceTable *pt, const char *file_content, size_t content_len) {
     pt->add_capacity = BUFFER_SIZE_1024;
     pt->add_buf = safeMalloc(pt->add_capacity);
     pt->add_len = 0;
+    pt->add_kept = 0;
     pt->piece_capacity = BUFFER_SIZE_128;
     pt->pieces = safeMalloc(sizeof(Piece) * pt->piece_capacity);
     pt->piece_offsets = NULL;
@@ -2364,17 +3655,22 @@ void ptFree(PieceTable *pt) {
     free(pt->piece_offsets);
 }
 
-void ptInsert(PieceTable *pt, size_t offset, const char *text, size_t text_len) {
-    if (text_len == 0 || offset > pt->logical_size) return;
-    pt->offsets_dirty = true;
-
+size_t ptAppendAdd(PieceTable *pt, const char *text, size_t text_len) {
     if (pt->add_len + text_len > pt->add_capacity) {
         while (pt->add_len + text_len > pt->add_capacity) pt->add_capacity *= 2;
         pt->add_buf = safeRealloc(pt->add_buf, pt->add_capacity);
     }
-    size_t new_piece_start = pt->add_len;
+    size_t start = pt->add_len;
     memcpy(pt->add_buf + pt->add_len, text, text_len);
     pt->add_len += text_len;
+    return start;
+}
+
+void ptInsert(PieceTable *pt, size_t offset, const char *text, size_t text_len) {
+    if (text_len == 0 || offset > pt->logical_size) return;
+    pt->offsets_dirty = true;
+
+    size_t new_piece_start = ptAppendAdd(pt, text, text_len);
 
     Piece new_piece = {
         .source = BUFFER_ADD,
@@ -2442,6 +3738,32 @@ void ptInsert(PieceTable *pt, size_t offset, const char *text, size_t text_len)
     pt->logical_size += text_len;
 }
 
+void ptInsertPieces(PieceTable *pt, size_t offset, const Piece *pieces, size_t num_pieces, size_t len) {
+    if (num_pieces == 0 || offset > pt->logical_size) return;
+
+    // the pieces already point at their text, only the list changes
+    size_t piece_idx = pt->num_pieces, piece_offset = 0;
+    if (offset < pt->logical_size) ptFindPiece(pt, offset, &piece_idx, &piece_offset);
+    pt->offsets_dirty = true;
+
+    if (pt->num_pieces + num_pieces + 1 > pt->piece_capacity) {
+        while (pt->num_pieces + num_pieces + 1 > pt->piece_capacity) pt->piece_capacity *= 2;
+        pt->pieces = safeRealloc(pt->pieces, sizeof(Piece) * pt->piece_capacity);
+    }
+    if (piece_offset > 0) {
+        Piece target = pt->pieces[piece_idx];
+        memmove(&pt->pieces[piece_idx + 1], &pt->pieces[piece_idx], sizeof(Piece) * (pt->num_pieces - piece_idx));
+        pt->pieces[piece_idx].length = piece_offset;
+        pt->pieces[piece_idx + 1] = (Piece){target.source, target.start + piece_offset, target.length - piece_offset};
+        pt->num_pieces++;
+        piece_idx++;
+    }
+    memmove(&pt->pieces[piece_idx + num_pieces], &pt->pieces[piece_idx], sizeof(Piece) * (pt->num_pieces - piece_idx));
+    memcpy(&pt->pieces[piece_idx], pieces, sizeof(Piece) * num_pieces);
+    pt->num_pieces += num_pieces;
+    pt->logical_size += len;
+}
+
 void ptDelete(PieceTable *pt, size_t offset, size_t len) {
     if (len == 0 || offset >= pt->logical_size) return;
     if (offset + len > pt->logical_size) len = pt->logical_size - offset;
@@ -2507,6 +3829,7 @@ void ptSquash(PieceTable *pt) {
     pt->add_capacity = BUFFER_SIZE_1024;
     pt->add_buf = safeMalloc(pt->add_capacity);
     pt->add_len = 0;
+    pt->add_kept = 0;
 
     if (pt->piece_capacity > BUFFER_SIZE_128) {
         pt->piece_capacity = BUFFER_SIZE_128;
@@ -2522,6 +3845,151 @@ void ptSquash(PieceTable *pt) {
     pt->offsets_dirty = true;
 }
 
+void ptCoalesce(PieceTable *pt) {
+    // neighbours that continue each other in the same buffer become one piece
+    size_t n = 0;
+    for (size_t i = 0; i < pt->num_pieces; i++) {
+        Piece p = pt->pieces[i];
+        if (p.length == 0) continue;
+        if (n > 0 && pt->pieces[n - 1].source == p.source && pt->pieces[n - 1].start + pt->pieces[n - 1].length == p.start) {
+            pt->pieces[n - 1].length += p.length;
+            continue;
+        }
+        pt->pieces[n++] = p;
+    }
+    if (n != pt->num_pieces) {
+        pt->num_pieces = n;
+        pt->offsets_dirty = true;
+    }
+}
+
+void ptTakePieces(PieceTable *pt, size_t *piece_idx, size_t *piece_offset, size_t len, Piece *out, size_t *out_count) {
+    while (len > 0 && *piece_idx < pt->num_pieces) {
+        Piece p = pt->pieces[*piece_idx];
+        size_t take = p.length - *piece_offset;
+        if (take > len) take = len;
+
+        // a NULL output only skips the text
+        if (out) {
+            Piece *last = *out_count > 0 ? &out[*out_count - 1] : NULL;
+            if (last && last->source == p.source && last->start + last->length == p.start + *piece_offset)
+                last->length += take;
+            else
+                out[(*out_count)++] = (Piece){p.source, p.start + *piece_offset, take};
+        }
+        len -= take;
+        *piece_offset += take;
+        if (*piece_offset == p.length) {
+            (*piece_idx)++;
+            *piece_offset = 0;
+        }
+    }
+}
+
+Piece *ptCopyPieces(PieceTable *pt, size_t offset, size_t len, size_t *count) {
+    size_t piece_idx, piece_offset, end_idx, end_offset;
+    *count = 0;
+    if (len == 0 || !ptFindPiece(pt, offset, &piece_idx, &piece_offset)) return NULL;
+    if (!ptFindPiece(pt, offset + len, &end_idx, &end_offset)) return NULL;
+
+    Piece *pieces = safeMalloc(sizeof(Piece) * (end_idx - piece_idx + 1));
+    ptTakePieces(pt, &piece_idx, &piece_offset, len, pieces, count);
+    return pieces;
+}
+
+void ptReadPieces(PieceTable *pt, const Piece *pieces, size_t num_pieces, char *out_buf) {
+    size_t pos = 0;
+    for (size_t i = 0; i < num_pieces; i++) {
+        const char *source = (pieces[i].source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf;
+        memcpy(out_buf + pos, source + pieces[i].start, pieces[i].length);
+        pos += pieces[i].length;
+    }
+    out_buf[pos] = '\0';
+}
+
+void ptReplaceSpans(PieceTable *pt, const ReplaceSpan *spans, size_t num_spans, const char *text, size_t text_len, bool shared) {
+    if (num_spans == 0) return;
+
+    // the new text is appended once, shared text is referenced by every span
+    size_t text_pos = ptAppendAdd(pt, text, text_len);
+    Piece *inserted = safeMalloc(sizeof(Piece) * num_spans);
+    size_t *counts = safeMalloc(sizeof(size_t) * num_spans);
+    size_t num_inserted = 0;
+    for (size_t i = 0; i < num_spans; i++) {
+        counts[i] = spans[i].new_len > 0 ? 1 : 0;
+        if (counts[i]) inserted[num_inserted++] = (Piece){BUFFER_ADD, text_pos, spans[i].new_len};
+        if (!shared) text_pos += spans[i].new_len;
+    }
+    ptSpliceSpans(pt, spans, num_spans, inserted, counts);
+    free(inserted);
+    free(counts);
+}
+
+void ptSpliceSpans(PieceTable *pt, const ReplaceSpan *spans, size_t num_spans, const Piece *inserted, const size_t *counts) {
+    // span i is replaced by the next counts[i] pieces of inserted, text already in the buffers is only referenced
+    size_t num_inserted = 0;
+    for (size_t i = 0; i < num_spans; i++)
+        num_inserted += counts[i];
+
+    // every span splits at most one piece, so the new list is built in a single pass
+    size_t capacity = pt->num_pieces + num_spans + num_inserted + 1;
+    Piece *pieces = safeMalloc(sizeof(Piece) * capacity);
+    size_t count = 0;
+    size_t piece_idx = 0, piece_offset = 0, pos = 0;
+    size_t new_size = pt->logical_size;
+    for (size_t i = 0; i < num_spans; i++) {
+        const ReplaceSpan *span = &spans[i];
+        ptTakePieces(pt, &piece_idx, &piece_offset, span->offset - pos, pieces, &count);
+        ptTakePieces(pt, &piece_idx, &piece_offset, span->old_len, NULL, NULL);
+        pos = span->offset + span->old_len;
+
+        for (size_t k = 0; k < counts[i]; k++, inserted++) {
+            Piece *last = count > 0 ? &pieces[count - 1] : NULL;
+            if (last && last->source == inserted->source && last->start + last->length == inserted->start)
+                last->length += inserted->length;
+            else
+                pieces[count++] = *inserted;
+        }
+        new_size = new_size - span->old_len + span->new_len;
+    }
+    ptTakePieces(pt, &piece_idx, &piece_offset, pt->logical_size - pos, pieces, &count);
+
+    free(pt->pieces);
+    pt->pieces = pieces;
+    pt->num_pieces = count;
+    pt->piece_capacity = capacity;
+    pt->logical_size = new_size;
+    pt->offsets_dirty = true;
+}
+
+PieceSnapshot *ptSnapshot(PieceTable *pt) {
+    // both text buffers only ever grow, so the piece list alone pins down the document
+    PieceSnapshot *snap = safeMalloc(sizeof(PieceSnapshot));
+    snap->refs = 1;
+    snap->num_pieces = pt->num_pieces;
+    snap->logical_size = pt->logical_size;
+    snap->pieces = safeMalloc(sizeof(Piece) * (pt->num_pieces + 1));
+    memcpy(snap->pieces, pt->pieces, sizeof(Piece) * pt->num_pieces);
+    return snap;
+}
+
+void ptRestore(PieceTable *pt, const PieceSnapshot *snap) {
+    if (snap->num_pieces > pt->piece_capacity) {
+        pt->piece_capacity = snap->num_pieces;
+        pt->pieces = safeRealloc(pt->pieces, sizeof(Piece) * pt->piece_capacity);
+    }
+    memcpy(pt->pieces, snap->pieces, sizeof(Piece) * snap->num_pieces);
+    pt->num_pieces = snap->num_pieces;
+    pt->logical_size = snap->logical_size;
+    pt->offsets_dirty = true;
+}
+
+void ptReleaseSnapshot(PieceSnapshot *snap) {
+    if (!snap || --snap->refs > 0) return;
+    free(snap->pieces);
+    free(snap);
+}
+
 void ptRebuildOffsets(PieceTable *pt) {
     if (pt->num_pieces + 1 > pt->offsets_capacity) {
         pt->offsets_capacity = pt->piece_capacity + 1;
@@ -2595,6 +4063,8 @@ void editorUpdateLineOffsets(EditorBuffer *buf) {
         buf->line_offsets = safeMalloc(sizeof(size_t) * buf->line_capacity);
     }
 
+    // a full rescan follows new or restored text
+    buf->generation++;
     buf->line_offsets[0] = 0;
     buf->num_lines = 1;
 
@@ -2760,7 +4230,49 @@ void editorDeleteLineOffsets(EditorBuffer *buf, size_t offset, const char *delet
     }
 }
 
-int getLineIndentation(const char *line_text, size_t line_len) {
+void editorReplaceLineOffsets(EditorBuffer *buf, const ReplaceSpan *spans, size_t num_spans, const char *text, bool shared) {
+    // one sweep over the old line starts: the ones before each span move by the edits so far,
+    // the ones inside it are replaced by the newlines of its new text
+    size_t added = 0, text_len = 0;
+    for (size_t i = 0; i < num_spans; i++)
+        text_len += spans[i].new_len;
+    if (shared) text_len = spans[0].new_len;
+    for (const char *p = text; (p = memchr(p, '\n', text + text_len - p)) != NULL; p++)
+        added++;
+    if (shared) added *= num_spans;
+
+    size_t capacity = buf->line_capacity;
+    while ((size_t)buf->num_lines + added >= capacity)
+        capacity = capacity == 0 ? BUFFER_SIZE_1024 : capacity * 2;
+    size_t *lines = safeMalloc(sizeof(size_t) * capacity);
+
+    int j = 0, count = 0;
+    long delta = 0;
+    const char *span_text = text;
+    for (size_t i = 0; i < num_spans; i++) {
+        size_t offset = spans[i].offset;
+        while (j < buf->num_lines && buf->line_offsets[j] <= offset)
+            lines[count++] = (size_t)((long)buf->line_offsets[j++] + delta);
+        while (j < buf->num_lines && buf->line_offsets[j] <= offset + spans[i].old_len)
+            j++;
+
+        size_t new_offset = (size_t)((long)offset + delta);
+        const char *end = span_text + spans[i].new_len;
+        for (const char *p = span_text; (p = memchr(p, '\n', end - p)) != NULL; p++)
+            lines[count++] = new_offset + (size_t)(p - span_text) + 1;
+        if (!shared) span_text = end;
+        delta += (long)spans[i].new_len - (long)spans[i].old_len;
+    }
+    while (j < buf->num_lines)
+        lines[count++] = (size_t)((long)buf->line_offsets[j++] + delta);
+
+    free(buf->line_offsets);
+    buf->line_offsets = lines;
+    buf->line_capacity = capacity;
+    buf->num_lines = count;
+}
+
+ int getLineIndentation(const char *line_text, size_t line_len) {
     if (!line_text || E.sel.is_pasting) return 0;
 
     int indent = 0;
@@ -2957,11 +4469,10 @@ void editorMoveRowUp() {
         current_len++;
     }
 
-    editorBeginMacro();
-    executeDelete(prev_start, prev_len + current_len);
-    executeInsert(prev_start, current_text, current_len);
-    executeInsert(prev_start + current_len, prev_text, prev_len);
-    editorEndMacro();
+    editorBeginBatch();
+    editorBatchReplace(prev_start, prev_len + current_len, current_text, current_len);
+    editorBatchReplace(prev_start + prev_len + current_len, 0, prev_text, prev_len);
+    editorCommitBatch();
 
     free(prev_text);
     free(current_text);
@@ -2998,11 +4509,10 @@ void editorMoveRowDown() {
         next_len++;
     }
 
-    editorBeginMacro();
-    executeDelete(current_start, current_len + next_len);
-    executeInsert(current_start, next_text, next_len);
-    executeInsert(current_start + next_len, current_text, current_len);
-    editorEndMacro();
+    editorBeginBatch();
+    editorBatchReplace(current_start, current_len + next_len, next_text, next_len);
+    editorBatchReplace(current_start + current_len + next_len, 0, current_text, current_len);
+    editorCommitBatch();
 
     free(current_text);
     free(next_text);
@@ -3058,7 +4568,7 @@ void editorCopyRowDown() {
 }
 
 void editorIndentSelection() {
-    int sy, sx, ey, ex;
+    int sy = 0, sx = 0, ey = 0, ex = 0;
     editorGetNormalizedSelection(&sy, &sx, &ey, &ex);
 
     if (ex == 0 && ey > sy)
@@ -3067,14 +4577,12 @@ void editorIndentSelection() {
     if (sy < 0) sy = 0;
     if (ey >= E.buf.num_lines) ey = E.buf.num_lines - 1;
 
-    editorBeginMacro();
-    for (int y = sy; y <= ey; y++) {
-        char spaces[TAB_SIZE];
-        memset(spaces, ' ', TAB_SIZE);
-        size_t offset = editorGetLogicalOffset(&E.buf, y, 0);
-        executeInsert(offset, spaces, TAB_SIZE);
-    }
-    editorEndMacro();
+    char spaces[TAB_SIZE];
+    memset(spaces, ' ', TAB_SIZE);
+    editorBeginBatch();
+    for (int y = sy; y <= ey; y++)
+        editorBatchReplace(E.buf.line_offsets[y], 0, spaces, TAB_SIZE);
+    editorCommitBatch();
 
     E.cursor.x += TAB_SIZE;
     E.cursor.preferred_x = E.cursor.x;
@@ -3160,6 +4668,68 @@ void editorLoadCommentConfig(const char *filename) {
     fclose(fp);
 }
 
+void editorLoadSurroundConfig(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) return;
+
+    // one pair per line, the typed opener then '=' then the closing text
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        line[strcspn(line, NEW_LINE)] = '\0';
+        if (line[0] == '\0' || line[1] != '=' || line[2] == '\0') continue;
+
+        E.ts.surround_pairs = safeRealloc(E.ts.surround_pairs, sizeof(SurroundPair) * (E.ts.num_surround_pairs + 1));
+        SurroundPair *pair = &E.ts.surround_pairs[E.ts.num_surround_pairs++];
+        pair->opener = line[0];
+        pair->closer = safeStrdup(line + 2);
+    }
+    free(line);
+    fclose(fp);
+}
+
+const char *editorGetSurroundCloser(char ch) {
+    // without a config the auto-close pairs double as surround pairs
+    if (E.ts.num_surround_pairs == 0) {
+        static char closer[2];
+        closer[0] = getClosingChar(ch);
+        return closer[0] ? closer : NULL;
+    }
+
+    for (int i = 0; i < E.ts.num_surround_pairs; i++)
+        if (E.ts.surround_pairs[i].opener == ch)
+            return E.ts.surround_pairs[i].closer;
+    return NULL;
+}
+
+bool editorSurroundSelection(char opener, const char *closer) {
+    int sy = 0, sx = 0, ey = 0, ex = 0;
+    editorGetNormalizedSelection(&sy, &sx, &ey, &ex);
+    size_t start = editorGetLogicalOffset(&E.buf, sy, sx);
+    size_t end = editorGetLogicalOffset(&E.buf, ey, ex);
+    if (start >= end) return false;
+
+    // only the opener and the closer go in, the selected text is never copied
+    editorBeginBatch();
+    editorBatchReplace(start, 0, &opener, 1);
+    editorBatchReplace(end, 0, closer, strlen(closer));
+    editorCommitBatch();
+
+    E.sel.active = true;
+    E.sel.sy = sy;
+    E.sel.sx = sx + 1;
+    E.sel.ey = ey;
+    E.sel.ex = ey == sy ? ex + 1 : ex;
+    E.cursor.y = E.sel.ey;
+    E.cursor.x = E.sel.ex;
+    E.cursor.preferred_x = E.cursor.x;
+
+    if (!E.sel.is_pasting)
+        editorParseTreeSitter();
+    return true;
+}
+
 const char *editorGetCommentString() {
     if (!E.buf.filename) return NULL;
     const char *ext = strrchr(E.buf.filename, '.');
@@ -3225,7 +4795,7 @@ void editorApplyCommentToggle(int start_y, int end_y, const char *c_str, size_t
                 if (line_len >= (size_t)first_non_space + c_len + 1 && line[first_non_space + c_len] == ' ')
                     delete_len++;
 
-                executeDelete(offset, delete_len);
+                editorBatchReplace(offset, delete_len, NULL, 0);
                 if (y == E.cursor.y && E.cursor.x > first_non_space) {
                     E.cursor.x -= delete_len;
                     if (E.cursor.x < first_non_space) E.cursor.x = first_non_space;
@@ -3237,7 +4807,7 @@ void editorApplyCommentToggle(int start_y, int end_y, const char *c_str, size_t
                 snprintf(insert_buf, sizeof(insert_buf), "%s ", c_str);
 
                 size_t insert_len = strlen(insert_buf);
-                executeInsert(offset, insert_buf, insert_len);
+                editorBatchReplace(offset, 0, insert_buf, insert_len);
                 if (y == E.cursor.y && E.cursor.x >= first_non_space)
                     E.cursor.x += insert_len;
             }
@@ -3255,758 +4825,6946 @@ void editorToggleComment() {
     size_t c_len = strlen(c_str);
     bool should_uncomment = editorShouldUncommentBlock(start_y, end_y, c_str, c_len);
 
-    editorBeginMacro();
+    editorBeginBatch();
     editorApplyCommentToggle(start_y, end_y, c_str, c_len, should_uncomment);
-    editorEndMacro();
+    editorCommitBatch();
 
     E.cursor.preferred_x = E.cursor.x;
 }
 
-void editorSelectText(int ch) {
-    if (!E.sel.active) {
-        E.sel.active = true;
-        E.sel.sx = E.cursor.x;
-        E.sel.sy = E.cursor.y;
-    }
-    editorMoveCursor(ch == SHIFT_ARROW_LEFT ? ARROW_LEFT : ch == SHIFT_ARROW_RIGHT ? ARROW_RIGHT : ch == SHIFT_ARROW_UP ? ARROW_UP : ARROW_DOWN);
-    E.sel.ex = E.cursor.x;
-    E.sel.ey = E.cursor.y;
+void editorClearCarets() {
+    E.carets.count = 0;
 }
 
-void editorSelectAll() {
-    if (E.buf.num_lines > 0) {
-        E.sel.active = true;
-        E.sel.sx = 0;
-        E.sel.sy = 0;
-        E.sel.ey = E.buf.num_lines - 1;
-        E.sel.ex = editorGetLineLength(&E.buf, E.sel.ey);
-        E.cursor.x = E.sel.ex;
-        E.cursor.y = E.sel.ey;
-
-        char msg[STATUS_LENGTH];
-        snprintf(msg, sizeof(msg), "Selected all %d lines", E.buf.num_lines);
-        editorSetStatusMsg(msg);
+void editorAddCaret(size_t offset) {
+    if (E.carets.count >= E.carets.capacity) {
+        E.carets.capacity = E.carets.capacity == 0 ? BUFFER_SIZE_32 : E.carets.capacity * 2;
+        E.carets.offsets = safeRealloc(E.carets.offsets, sizeof(size_t) * E.carets.capacity);
     }
+    E.carets.offsets[E.carets.count++] = offset;
 }
 
-char *editorGetSelectedText(int *len_out) {
-    if (!E.sel.active) {
-        if (len_out) *len_out = 0;
-        return NULL;
+void editorNormalizeCarets() {
+    // carets are kept sorted and unique, the primary cursor is never one of them
+    size_t primary = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
+    if (E.carets.count > 1) qsort(E.carets.offsets, E.carets.count, sizeof(size_t), compareOffsets);
+    int n = 0;
+    for (int i = 0; i < E.carets.count; i++) {
+        size_t offset = E.carets.offsets[i];
+        if (offset > E.buf.pt.logical_size || offset == primary) continue;
+        if (n > 0 && E.carets.offsets[n - 1] == offset) continue;
+        E.carets.offsets[n++] = offset;
     }
+    E.carets.count = n;
+}
 
-    int x1 = E.sel.sx, y1 = E.sel.sy;
-    int x2 = E.sel.ex, y2 = E.sel.ey;
-    if (y1 > y2 || (y1 == y2 && x1 > x2)) {
-        int tmpx = x1;
-        int tmpy = y1;
-        x1 = x2;
-        y1 = y2;
-        x2 = tmpx;
-        y2 = tmpy;
+int editorCaretLowerBound(size_t offset) {
+    int low = 0, high = E.carets.count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (E.carets.offsets[mid] < offset) low = mid + 1;
+        else high = mid;
     }
+    return low;
+}
 
-    size_t start_offset = editorGetLogicalOffset(&E.buf, y1, x1);
-    size_t end_offset = editorGetLogicalOffset(&E.buf, y2, x2);
-    size_t total_len = end_offset - start_offset;
-    if (len_out) *len_out = total_len;
-    if (total_len == 0) return NULL;
-
-    char *buf = safeMalloc(total_len + 1);
-    ptReadLogical(&E.buf.pt, start_offset, total_len, buf);
-
-    return buf;
+size_t *editorCaretPositions(int *count, int *primary_idx) {
+    // every cursor as one sorted array, the primary slotted in where it belongs
+    size_t primary = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
+    int at = editorCaretLowerBound(primary);
+    size_t *pos = safeMalloc(sizeof(size_t) * (E.carets.count + 1));
+    memcpy(pos, E.carets.offsets, sizeof(size_t) * at);
+    pos[at] = primary;
+    memcpy(pos + at + 1, E.carets.offsets + at, sizeof(size_t) * (E.carets.count - at));
+    *count = E.carets.count + 1;
+    *primary_idx = at;
+    return pos;
 }
 
-void editorDeleteSelectedText() {
-    if (!E.sel.active) return;
+void editorStoreCarets(size_t *pos, int count, int primary_idx) {
+    int row, col;
+    editorOffsetToRowCol(&E.buf, pos[primary_idx], &row, &col);
+    E.cursor.y = row;
+    E.cursor.x = col;
+    E.cursor.preferred_x = col;
 
-    int y1 = E.sel.sy, x1 = E.sel.sx;
-    int y2 = E.sel.ey, x2 = E.sel.ex;
-    if (y1 > y2 || (y1 == y2 && x1 > x2)) {
-        int tmpx = x1;
-        int tmpy = y1;
-        x1 = x2;
-        y1 = y2;
-        x2 = tmpx;
-        y2 = tmpy;
+    E.carets.count = 0;
+    for (int i = 0; i < count; i++)
+        if (i != primary_idx) editorAddCaret(pos[i]);
+    editorNormalizeCarets();
+    free(pos);
+}
+
+void editorCaretsMapBatch() {
+    // the queued edits are in the coordinates the carets are in, both are walked once in order
+    EditBatch *batch = &history.batch;
+    if (E.carets.count == 0 || batch->num_edits == 0) return;
+    qsort(batch->edits, batch->num_edits, sizeof(BatchEdit), compareBatchEdits);
+
+    size_t e = 0;
+    long delta = 0;
+    for (int i = 0; i < E.carets.count; i++) {
+        size_t offset = E.carets.offsets[i];
+        while (e < batch->num_edits && batch->edits[e].offset < offset && batch->edits[e].offset + batch->edits[e].old_len <= offset) {
+            delta += (long)batch->edits[e].new_len - (long)batch->edits[e].old_len;
+            e++;
+        }
+        // a caret inside removed text lands where the removal starts
+        if (e < batch->num_edits && batch->edits[e].offset < offset) offset = batch->edits[e].offset;
+        E.carets.offsets[i] = (size_t)((long)offset + delta);
     }
+}
 
-    size_t start_offset = editorGetLogicalOffset(&E.buf, y1, x1);
-    size_t end_offset = editorGetLogicalOffset(&E.buf, y2, x2);
-    size_t length_to_delete = end_offset - start_offset;
-    if (length_to_delete > 0)
-        executeDelete(start_offset, length_to_delete);
+void editorAddCursorsToLines() {
+    int sy = E.cursor.y, sx = 0, ey = E.cursor.y, ex = 0;
+    editorGetNormalizedSelection(&sy, &sx, &ey, &ex);
+    if (ex == 0 && ey > sy) ey--;
 
-    E.cursor.x = x1;
-    E.cursor.y = y1;
-    E.cursor.preferred_x = E.cursor.x;
+    // one cursor per selected line, in the column of the cursor or at the end of shorter lines
+    int col = E.cursor.x;
+    for (int y = sy; y <= ey && y < E.buf.num_lines; y++) {
+        size_t len = editorGetLineLength(&E.buf, y);
+        editorAddCaret(E.buf.line_offsets[y] + ((size_t)col < len ? (size_t)col : len));
+    }
     E.sel.active = false;
-    E.buf.dirty = true;
+    E.cursor.y = ey;
+    E.cursor.x = col;
+    clampCursorPosition();
+    E.cursor.preferred_x = E.cursor.x;
+    editorNormalizeCarets();
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "%d cursors (ESC to clear)", E.carets.count + 1);
+    editorSetStatusMsg(msg);
 }
 
-void editorCopySelection() {
+void editorAddCursorAtNextMatch() {
+    if (E.sel.active && E.sel.sy != E.sel.ey) {
+        editorAddCursorsToLines();
+        return;
+    }
+
+    size_t primary = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
+    if (!E.find.active || !E.find.query || E.find.query[0] == '\0') {
+        // without a search the selection or the word under the cursor becomes one
+        char *needle = NULL;
+        if (E.sel.active) {
+            needle = editorGetSelectedText(NULL);
+        } else if (E.cursor.y < E.buf.num_lines) {
+            size_t line_start = E.buf.line_offsets[E.cursor.y];
+            size_t line_len = editorGetLineLength(&E.buf, E.cursor.y);
+            size_t start = E.cursor.x, end = E.cursor.x;
+            while (start > 0 && isWordChar(ptCharAt(&E.buf.pt, line_start + start - 1))) start--;
+            while (end < line_len && isWordChar(ptCharAt(&E.buf.pt, line_start + end))) end++;
+            if (end > start) {
+                needle = safeMalloc(end - start + 1);
+                ptReadLogical(&E.buf.pt, line_start + start, end - start, needle);
+                needle[end - start] = '\0';
+            }
+        }
+        if (!needle || needle[0] == '\0') {
+            free(needle);
+            editorSetStatusMsg("Nothing to match under the cursor");
+            return;
+        }
+
+        editorResetFind();
+        E.find.use_regex = false;
+        E.find.use_query = false;
+        E.find.query = needle;
+        E.find.active = true;
+        editorFindStartScan(E.find.query);
+    }
+    editorFindFinishScan();
+    MatchStore *ms = &E.find.matches;
+    if (ms->total == 0) {
+        editorSetStatusMsg("No matches");
+        return;
+    }
+    E.sel.active = false;
+
+    // the first press snaps the cursor to the start of the match it sits in
+    int idx = matchStoreLowerBound(ms, primary + 1) - 1;
+    if (E.carets.count == 0 && idx >= 0 && primary < matchStoreGet(ms, idx) + editorFindMatchLength(matchStoreGet(ms, idx)))
+        primary = matchStoreGet(ms, idx);
+
+    // the next match after the newest cursor that isn't one already, wrapping around
+    int next = matchStoreLowerBound(ms, primary + 1);
+    for (int tries = 0; tries < ms->total; tries++, next++) {
+        if (next >= ms->total) next = 0;
+        size_t offset = matchStoreGet(ms, next);
+        int at = editorCaretLowerBound(offset);
+        if (offset == primary || (at < E.carets.count && E.carets.offsets[at] == offset)) continue;
+
+        editorAddCaret(primary);
+        int row, col;
+        editorOffsetToRowCol(&E.buf, offset, &row, &col);
+        E.cursor.y = row;
+        E.cursor.x = col;
+        E.cursor.preferred_x = col;
+        E.find.current_idx = next;
+        editorNormalizeCarets();
+
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "%d cursors (ESC to clear)", E.carets.count + 1);
+        editorSetStatusMsg(msg);
+        return;
+    }
+    editorSetStatusMsg("Every match already has a cursor");
+}
+
+void editorAddCursorsAtMatches() {
+    editorFindFinishScan();
+    MatchStore *ms = &E.find.matches;
+    if (!E.find.active || ms->total == 0) return;
+
+    // the offsets come out of the match store already sorted
+    int current = E.find.current_idx >= 0 ? E.find.current_idx : 0;
+    E.carets.count = 0;
+    matchStoreSettle(ms, ms->num_blocks - 1);
+    for (int b = 0; b < ms->num_blocks; b++) {
+        while (E.carets.count + ms->blocks[b].count > E.carets.capacity) {
+            E.carets.capacity = E.carets.capacity == 0 ? BUFFER_SIZE_32 : E.carets.capacity * 2;
+            E.carets.offsets = safeRealloc(E.carets.offsets, sizeof(size_t) * E.carets.capacity);
+        }
+        matchBlockDecode(&ms->blocks[b], E.carets.offsets + E.carets.count);
+        E.carets.count += ms->blocks[b].count;
+    }
+
+    int row, col;
+    editorOffsetToRowCol(&E.buf, E.carets.offsets[current], &row, &col);
+    E.cursor.y = row;
+    E.cursor.x = col;
+    E.cursor.preferred_x = col;
+    E.sel.active = false;
+    editorNormalizeCarets();
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "%d cursors (Enter to keep, ESC to cancel)", E.carets.count + 1);
+    editorSetStatusMsg(msg);
+}
+
+void editorCaretsEdit(int key, const char *text, size_t len) {
+    int count, primary_idx;
+    size_t *pos = editorCaretPositions(&count, &primary_idx);
+    size_t size = E.buf.pt.logical_size;
+    char *indent = NULL;
+    size_t indent_cap = 0;
+    char spaces[TAB_SIZE];
+    memset(spaces, ' ', TAB_SIZE);
+    E.sel.active = false;
+
+    // every cursor becomes one edit of the batch, its new position falls out of the same sweep
+    editorBeginBatch();
+
+    // a typing burst at the cursors grows one undo entry, within the window a single cursor's typing merges in
+    bool typing = !history.in_transaction && key != PASTE_END;
+    int kind = (key == BACKSPACE || key == DEL_KEY) ? key : 0;
+    long now = currentMillis();
+    history.batch.join = typing && history.typing_entry == history.undo_top && history.typing_kind == kind &&
+                         now - history.typing_time < UNDO_TIMEOUT_MS;
+    long delta = 0;
+    size_t prev_end = 0;
+    for (int i = 0; i < count; i++) {
+        size_t offset = pos[i];
+        size_t start = offset, old_len = 0, advance = 0;
+        const char *ins = text;
+        size_t ins_len = len;
+
+        if (key == BACKSPACE) {
+            ins_len = 0;
+            if (offset > 0) {
+                start = offset - 1;
+                while (start > 0 && utf8IsCont((unsigned char)ptCharAt(&E.buf.pt, start))) start--;
+                char prev_char = ptCharAt(&E.buf.pt, offset - 1);
+                char closing = getClosingChar(prev_char);
+                if (closing != 0 && offset < size && ptCharAt(&E.buf.pt, offset) == closing) {
+                    start = offset - 1;
+                    old_len = 2;
+                } else {
+                    old_len = offset - start;
+                }
+            }
+        } else if (key == DEL_KEY) {
+            ins_len = 0;
+            if (offset < size) {
+                old_len = utf8SeqLen((unsigned char)ptCharAt(&E.buf.pt, offset));
+                if (offset + old_len > size) old_len = 1;
+            }
+        } else if (key == '\r') {
+            // a new line keeps the indentation of the line it was split from
+            int row, col;
+            editorOffsetToRowCol(&E.buf, offset, &row, &col);
+            size_t line_start = E.buf.line_offsets[row];
+            size_t n = 0;
+            while (line_start + n < offset) {
+                char c = ptCharAt(&E.buf.pt, line_start + n);
+                if (c != ' ' && c != '\t') break;
+                n++;
+            }
+            if (n + 2 > indent_cap) {
+                indent_cap = n + BUFFER_SIZE_32;
+                indent = safeRealloc(indent, indent_cap);
+            }
+            indent[0] = '\n';
+            ptReadLogical(&E.buf.pt, line_start, n, indent + 1);
+            ins = indent;
+            ins_len = n + 1;
+            advance = ins_len;
+        } else if (key == '\t') {
+            int row, col;
+            editorOffsetToRowCol(&E.buf, offset, &row, &col);
+            ins = spaces;
+            ins_len = TAB_SIZE - (col % TAB_SIZE);
+            advance = ins_len;
+        } else if (key != PASTE_END && offset < size && strchr(")}]\"'`", key) && ptCharAt(&E.buf.pt, offset) == key) {
+            // a typed closer steps over the one already there, like at a single cursor
+            ins_len = 0;
+            advance = 1;
+        } else {
+            advance = key == PASTE_END ? len : 1;
+        }
+
+        if (i > 0 && start < prev_end) {
+            // this cursor sits inside the previous edit and merges into its cursor
+            pos[i] = pos[i - 1];
+            continue;
+        }
+        editorBatchReplace(start, old_len, ins, ins_len);
+        pos[i] = (size_t)((long)start + delta) + advance;
+        delta += (long)ins_len - (long)old_len;
+        prev_end = start + old_len;
+    }
+    int top = history.undo_top;
+    editorCommitBatch();
+    if (typing && (history.undo_top != top || history.batch.join)) {
+        history.typing_entry = history.undo_top;
+        history.typing_kind = kind;
+        history.typing_time = now;
+    }
+    free(indent);
+    editorStoreCarets(pos, count, primary_idx);
+}
+
+void editorCaretsMove(int key) {
+    int count, primary_idx;
+    size_t *pos = editorCaretPositions(&count, &primary_idx);
+    size_t size = E.buf.pt.logical_size;
+    E.sel.active = false;
+
+    for (int i = 0; i < count; i++) {
+        size_t offset = pos[i];
+        int row, col;
+        editorOffsetToRowCol(&E.buf, offset, &row, &col);
+        size_t line_start = E.buf.line_offsets[row];
+        size_t line_len = editorGetLineLength(&E.buf, row);
+
+        if (key == ARROW_LEFT) {
+            if (offset > 0) offset--;
+            while (offset > 0 && utf8IsCont((unsigned char)ptCharAt(&E.buf.pt, offset))) offset--;
+        } else if (key == ARROW_RIGHT) {
+            if (offset < size) offset += utf8SeqLen((unsigned char)ptCharAt(&E.buf.pt, offset));
+            if (offset > size) offset = size;
+        } else if (key == ARROW_UP || key == ARROW_DOWN) {
+            int target = row + (key == ARROW_UP ? -1 : 1);
+            if (target < 0 || target >= E.buf.num_lines) continue;
+            size_t target_len = editorGetLineLength(&E.buf, target);
+            size_t target_col = (size_t)col < target_len ? (size_t)col : target_len;
+            offset = E.buf.line_offsets[target] + target_col;
+            while (target_col > 0 && utf8IsCont((unsigned char)ptCharAt(&E.buf.pt, offset))) {
+                target_col--;
+                offset--;
+            }
+        } else if (key == HOME_KEY) {
+            // same toggle as the primary cursor, first the indentation and then the line start
+            size_t first = 0;
+            while (first < line_len) {
+                char c = ptCharAt(&E.buf.pt, line_start + first);
+                if (c != ' ' && c != '\t') break;
+                first++;
+            }
+            offset = line_start + ((size_t)col == first ? 0 : first);
+        } else if (key == END_KEY) {
+            offset = line_start + line_len;
+        }
+        pos[i] = offset;
+    }
+    editorStoreCarets(pos, count, primary_idx);
+}
+
+bool editorMultiCursorKey(int ch) {
+    if (ch == CTRL_KEY('o')) {
+        history.typing_time = 0;
+        editorAddCursorAtNextMatch();
+        return true;
+    }
+    if (E.carets.count == 0) return false;
+
+    switch (ch) {
+        case ESCAPE_CHAR:
+            editorClearCarets();
+            editorSetStatusMsg("");
+            return true;
+
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+            // moving the cursors ends the typing burst, the next edit starts its own undo entry
+            history.typing_time = 0;
+            editorCaretsMove(ch);
+            return true;
+
+        case BACKSPACE:
+        case DEL_KEY:
+        case '\t':
+            editorCaretsEdit(ch, NULL, 0);
+            updateMatchBracket();
+            return true;
+        case '\n':
+        case '\r':
+            editorCaretsEdit('\r', NULL, 0);
+            updateMatchBracket();
+            return true;
+
+        case PASTE_END: {
+            E.sel.is_pasting = false;
+            editorEndMacro();
+            if (E.sel.paste_len > 0)
+                editorCaretsEdit(PASTE_END, E.sel.paste_buf, E.sel.paste_len);
+            editorParseTreeSitter();
+            updateMatchBracket();
+
+            char where[BUFFER_SIZE_32];
+            snprintf(where, sizeof(where), " at %d cursors", E.carets.count + 1);
+            editorSetPasteStatusMsg(where);
+            return true;
+        }
+
+        // saving trims trailing whitespace, the carets are carried through the trim
+        case CTRL_KEY('s'):
+            return false;
+
+        // keys that leave the text and the cursors alone
+        case PASTE_START:
+        case CTRL_KEY('e'):
+        case CTRL_KEY('d'):
+        case CTRL_KEY('h'):
+        case CTRL_ARROW_UP:
+        case CTRL_ARROW_DOWN:
+        case MOUSE_SCROLL_UP:
+        case MOUSE_SCROLL_DOWN:
+        case MOUSE_SCROLL_LEFT:
+        case MOUSE_SCROLL_RIGHT:
+            return false;
+    }
+
+    if (ch < 256 && !is_cntrl(ch)) {
+        // typed brackets and quotes are closed at every cursor, like at a single one
+        char pair[2] = { (char)ch, getClosingChar(ch) };
+        editorCaretsEdit(ch, pair, pair[1] ? 2 : 1);
+        updateMatchBracket();
+        return true;
+    }
+
+    // anything else works on the primary cursor alone
+    editorClearCarets();
+    return false;
+}
+
+void editorGetNormalizedBlock(int *y1, int *rx1, int *y2, int *rx2) {
+    *y1 = E.sel.sy < E.sel.ey ? E.sel.sy : E.sel.ey;
+    *y2 = E.sel.sy < E.sel.ey ? E.sel.ey : E.sel.sy;
+    *rx1 = E.sel.sx < E.sel.ex ? E.sel.sx : E.sel.ex;
+    *rx2 = E.sel.sx < E.sel.ex ? E.sel.ex : E.sel.sx;
+    if (*y2 >= E.buf.num_lines) *y2 = E.buf.num_lines - 1;
+}
+
+bool editorBlockRowRange(int row, int rx1, int rx2, int *cx1, int *cx2) {
+    // render columns map to bytes the same way the cursor does, tabs and wide characters included
+    size_t len;
+    char *line = editorGetLine(&E.buf, row, &len);
+    if (!line) {
+        *cx1 = *cx2 = 0;
+        return false;
+    }
+    *cx1 = editorLineRxToCx(line, len, rx1);
+    *cx2 = editorLineRxToCx(line, len, rx2);
+    bool reaches = editorLineCxToRx(line, len, len) >= rx1;
+    free(line);
+    return reaches;
+}
+
+void editorBlockCursor() {
+    // the cursor follows the moving corner of the block
+    E.cursor.y = E.sel.ey;
+    if (E.cursor.y >= E.buf.num_lines) E.cursor.y = E.buf.num_lines > 0 ? E.buf.num_lines - 1 : 0;
+    int cx1, cx2;
+    editorBlockRowRange(E.cursor.y, E.sel.ex, E.sel.ex, &cx1, &cx2);
+    E.cursor.x = cx1;
+    E.cursor.preferred_x = E.cursor.x;
+}
+
+void editorClearBlock() {
+    E.sel.block = false;
+    E.sel.active = false;
+}
+
+void editorBlockReplace(const char *text, size_t len, DeleteDirection dir, bool collapse_only) {
+    int y1, rx1, y2, rx2;
+    editorGetNormalizedBlock(&y1, &rx1, &y2, &rx2);
+    bool empty = rx1 == rx2;
+    int new_rx = rx1;
+    bool new_rx_known = false;
+
+    // every row of the block is one edit of the batch
+    editorBeginBatch();
+    for (int y = y1; y <= y2; y++) {
+        int cx1, cx2;
+        bool reaches = editorBlockRowRange(y, rx1, rx2, &cx1, &cx2);
+        size_t line_start = E.buf.line_offsets[y];
+        size_t start = line_start + cx1, old_len = cx2 - cx1;
+        if (empty && !collapse_only && len == 0) {
+            // a column caret deletes one character on each row long enough to reach it
+            if (!reaches) continue;
+            size_t line_len = editorGetLineLength(&E.buf, y);
+            if (dir == DELETE_BACKWARD) {
+                if (cx1 == 0) continue;
+                start = line_start + cx1 - 1;
+                while (start > line_start && utf8IsCont((unsigned char)ptCharAt(&E.buf.pt, start))) start--;
+                old_len = line_start + cx1 - start;
+                if (reaches && !new_rx_known) {
+                    size_t line_len_out;
+                    char *line = editorGetLine(&E.buf, y, &line_len_out);
+                    new_rx = editorLineCxToRx(line, line_len_out, start - line_start);
+                    new_rx_known = true;
+                    free(line);
+                }
+            } else {
+                if ((size_t)cx1 >= line_len) continue;
+                old_len = utf8SeqLen((unsigned char)ptCharAt(&E.buf.pt, start));
+                if ((size_t)cx1 + old_len > line_len) old_len = line_len - cx1;
+            }
+        }
+        editorBatchReplace(start, old_len, text, len);
+    }
+    editorCommitBatch();
+
+    if (len > 0) new_rx = rx1 + editorLineCxToRx(text, len, len);
+    E.sel.active = true;
+    E.sel.block = true;
+    E.sel.sx = E.sel.ex = new_rx;
+    E.sel.sy = y1;
+    E.sel.ey = y2;
+    editorBlockCursor();
+}
+
+void editorBlockPaste(const char *text, size_t len) {
+    int y1, rx1, y2, rx2;
+    editorGetNormalizedBlock(&y1, &rx1, &y2, &rx2);
+    int rows = y2 - y1 + 1;
+    int text_lines = 1;
+    for (size_t i = 0; i < len; i++)
+        if (text[i] == '\n' && i + 1 < len) text_lines++;
+
+    if (text_lines != rows) {
+        // text that doesn't split into one line per row goes in whole on every row
+        if (text_lines == 1)
+            editorBlockReplace(text, len, DELETE_FORWARD, false);
+        else {
+            editorBlockReplace(NULL, 0, DELETE_FORWARD, true);
+            editorBeginBatch();
+            for (int y = y1; y <= y2; y++) {
+                int cx1, cx2;
+                editorBlockRowRange(y, rx1, rx1, &cx1, &cx2);
+                editorBatchReplace(E.buf.line_offsets[y] + cx1, 0, text, len);
+            }
+            editorCommitBatch();
+            editorClearBlock();
+        }
+        return;
+    }
+
+    // one line of the text per row, the block ends up after the widest one
+    editorBeginBatch();
+    const char *line = text;
+    int widest = 0;
+    for (int y = y1; y <= y2; y++) {
+        const char *end = memchr(line, '\n', len - (line - text));
+        size_t line_len = end ? (size_t)(end - line) : len - (line - text);
+        int cx1, cx2;
+        editorBlockRowRange(y, rx1, rx2, &cx1, &cx2);
+        editorBatchReplace(E.buf.line_offsets[y] + cx1, cx2 - cx1, line, line_len);
+        int width = editorLineCxToRx(line, line_len, line_len);
+        if (width > widest) widest = width;
+        line = end ? end + 1 : text + len;
+    }
+    editorCommitBatch();
+    E.sel.active = true;
+    E.sel.block = true;
+    E.sel.sx = E.sel.ex = rx1 + widest;
+    E.sel.sy = y1;
+    E.sel.ey = y2;
+    editorBlockCursor();
+}
+
+bool editorBlockSelectionKey(int ch) {
+    if (ch == ALT_SHIFT_ARROW_LEFT || ch == ALT_SHIFT_ARROW_RIGHT || ch == MOUSE_BLOCK_CLICK || ch == MOUSE_BLOCK_DRAG ||
+        (E.sel.block && (ch == ALT_SHIFT_ARROW_UP || ch == ALT_SHIFT_ARROW_DOWN))) {
+        if (ch == MOUSE_BLOCK_CLICK || ch == MOUSE_BLOCK_DRAG) {
+            // the mouse reports render columns, the rows are clamped to the text
+            int rx = E.cursor.x;
+            int row = E.cursor.y < E.buf.num_lines ? E.cursor.y : E.buf.num_lines - 1;
+            if (row < 0) row = 0;
+            if (ch == MOUSE_BLOCK_CLICK || !E.sel.block) {
+                E.sel.sx = rx;
+                E.sel.sy = row;
+            }
+            E.sel.ex = rx;
+            E.sel.ey = row;
+        } else if (!E.sel.block) {
+            // the block starts at the cursor, wherever a linear selection was
+            size_t len;
+            char *line = editorGetLine(&E.buf, E.cursor.y, &len);
+            int rx = line ? editorLineCxToRx(line, len, E.cursor.x) : 0;
+            free(line);
+            E.sel.sx = E.sel.ex = rx;
+            E.sel.sy = E.sel.ey = E.cursor.y;
+        }
+        if (ch == ALT_SHIFT_ARROW_LEFT && E.sel.ex > 0) E.sel.ex--;
+        else if (ch == ALT_SHIFT_ARROW_RIGHT) E.sel.ex++;
+        else if (ch == ALT_SHIFT_ARROW_UP && E.sel.ey > 0) E.sel.ey--;
+        else if (ch == ALT_SHIFT_ARROW_DOWN && E.sel.ey < E.buf.num_lines - 1) E.sel.ey++;
+
+        editorClearCarets();
+        E.sel.active = true;
+        E.sel.block = true;
+        editorBlockCursor();
+        return true;
+    }
+    if (!E.sel.block) return false;
+
+    switch (ch) {
+        case ESCAPE_CHAR:
+            editorClearBlock();
+            return true;
+
+        case MOUSE_LEFT_RELEASE:
+            if (E.sel.sx == E.sel.ex && E.sel.sy == E.sel.ey) editorClearBlock();
+            editorBlockCursor();
+            return true;
+
+        case CTRL_KEY('o'): {
+            // a cursor on every row of the block, in the column of its moving edge
+            int y1, rx1, y2, rx2;
+            editorGetNormalizedBlock(&y1, &rx1, &y2, &rx2);
+            editorClearCarets();
+            for (int y = y1; y <= y2; y++) {
+                int cx1, cx2;
+                editorBlockRowRange(y, E.sel.ex, E.sel.ex, &cx1, &cx2);
+                editorAddCaret(E.buf.line_offsets[y] + cx1);
+            }
+            editorBlockCursor();
+            editorClearBlock();
+            editorNormalizeCarets();
+            char msg[STATUS_LENGTH];
+            snprintf(msg, sizeof(msg), "%d cursors (ESC to clear)", E.carets.count + 1);
+            editorSetStatusMsg(msg);
+            return true;
+        }
+
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            return false;
+
+        case BACKSPACE:
+            editorBlockReplace(NULL, 0, DELETE_BACKWARD, false);
+            updateMatchBracket();
+            return true;
+        case DEL_KEY:
+            editorBlockReplace(NULL, 0, DELETE_FORWARD, false);
+            updateMatchBracket();
+            return true;
+
+        case PASTE_END: {
+            E.sel.is_pasting = false;
+            editorEndMacro();
+            if (E.sel.paste_len > 0)
+                editorBlockPaste(E.sel.paste_buf, E.sel.paste_len);
+            editorParseTreeSitter();
+            updateMatchBracket();
+
+            editorSetPasteStatusMsg(" into the block");
+            return true;
+        }
+
+        // keys that leave the text and the block alone
+        case PASTE_START:
+        case CTRL_KEY('s'):
+        case CTRL_KEY('e'):
+        case CTRL_KEY('d'):
+        case CTRL_KEY('h'):
+        case CTRL_ARROW_UP:
+        case CTRL_ARROW_DOWN:
+        case MOUSE_SCROLL_UP:
+        case MOUSE_SCROLL_DOWN:
+        case MOUSE_SCROLL_LEFT:
+        case MOUSE_SCROLL_RIGHT:
+            return false;
+    }
+
+    if (ch < 256 && !is_cntrl(ch)) {
+        // a multi-byte character arrives one byte per key, it goes in once complete so the column moves by its width
+        static char pending[4];
+        static int pending_len = 0;
+        if (pending_len > 0 && !utf8IsCont((unsigned char)ch)) pending_len = 0;
+        pending[pending_len++] = ch;
+        if (pending_len < utf8SeqLen((unsigned char)pending[0]) && pending_len < (int)sizeof(pending)) return true;
+
+        editorBlockReplace(pending, pending_len, DELETE_FORWARD, false);
+        pending_len = 0;
+        updateMatchBracket();
+        return true;
+    }
+
+    editorClearBlock();
+    return false;
+}
+
+void editorSelectText(int ch) {
     if (!E.sel.active) {
-        editorSetStatusMsg("No selection to copy");
+        E.sel.active = true;
+        E.sel.sx = E.cursor.x;
+        E.sel.sy = E.cursor.y;
+    }
+    editorMoveCursor(ch == SHIFT_ARROW_LEFT ? ARROW_LEFT : ch == SHIFT_ARROW_RIGHT ? ARROW_RIGHT : ch == SHIFT_ARROW_UP ? ARROW_UP : ARROW_DOWN);
+    E.sel.ex = E.cursor.x;
+    E.sel.ey = E.cursor.y;
+}
+
+void editorSelectAll() {
+    if (E.buf.num_lines > 0) {
+        E.sel.active = true;
+        E.sel.sx = 0;
+        E.sel.sy = 0;
+        E.sel.ey = E.buf.num_lines - 1;
+        E.sel.ex = editorGetLineLength(&E.buf, E.sel.ey);
+        E.cursor.x = E.sel.ex;
+        E.cursor.y = E.sel.ey;
+
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "Selected all %d lines", E.buf.num_lines);
+        editorSetStatusMsg(msg);
+    }
+}
+
+char *editorGetSelectedText(int *len_out) {
+    if (!E.sel.active) {
+        if (len_out) *len_out = 0;
+        return NULL;
+    }
+
+    if (E.sel.block) {
+        // the part of every row inside the block, one row per line
+        int y1, rx1, y2, rx2;
+        editorGetNormalizedBlock(&y1, &rx1, &y2, &rx2);
+        size_t total_len = 0, capacity = BUFFER_SIZE_256;
+        char *buf = safeMalloc(capacity);
+        for (int y = y1; y <= y2; y++) {
+            int cx1, cx2;
+            editorBlockRowRange(y, rx1, rx2, &cx1, &cx2);
+            size_t len = cx2 - cx1;
+            if (total_len + len + 2 > capacity) {
+                while (total_len + len + 2 > capacity) capacity *= 2;
+                buf = safeRealloc(buf, capacity);
+            }
+            ptReadLogical(&E.buf.pt, E.buf.line_offsets[y] + cx1, len, buf + total_len);
+            total_len += len;
+            if (y < y2) buf[total_len++] = '\n';
+        }
+        buf[total_len] = '\0';
+        if (len_out) *len_out = total_len;
+        if (total_len == 0) {
+            free(buf);
+            return NULL;
+        }
+        return buf;
+    }
+
+    int x1 = E.sel.sx, y1 = E.sel.sy;
+    int x2 = E.sel.ex, y2 = E.sel.ey;
+    if (y1 > y2 || (y1 == y2 && x1 > x2)) {
+        int tmpx = x1;
+        int tmpy = y1;
+        x1 = x2;
+        y1 = y2;
+        x2 = tmpx;
+        y2 = tmpy;
+    }
+
+    size_t start_offset = editorGetLogicalOffset(&E.buf, y1, x1);
+    size_t end_offset = editorGetLogicalOffset(&E.buf, y2, x2);
+    size_t total_len = end_offset - start_offset;
+    if (len_out) *len_out = total_len;
+    if (total_len == 0) return NULL;
+
+    char *buf = safeMalloc(total_len + 1);
+    ptReadLogical(&E.buf.pt, start_offset, total_len, buf);
+
+    return buf;
+}
+
+void editorDeleteSelectedText() {
+    if (!E.sel.active) return;
+    if (E.sel.block) {
+        // the block shrinks to a column at its left edge
+        editorBlockReplace(NULL, 0, DELETE_FORWARD, true);
+        return;
+    }
+
+    int y1 = E.sel.sy, x1 = E.sel.sx;
+    int y2 = E.sel.ey, x2 = E.sel.ex;
+    if (y1 > y2 || (y1 == y2 && x1 > x2)) {
+        int tmpx = x1;
+        int tmpy = y1;
+        x1 = x2;
+        y1 = y2;
+        x2 = tmpx;
+        y2 = tmpy;
+    }
+
+    size_t start_offset = editorGetLogicalOffset(&E.buf, y1, x1);
+    size_t end_offset = editorGetLogicalOffset(&E.buf, y2, x2);
+    size_t length_to_delete = end_offset - start_offset;
+    if (length_to_delete > 0)
+        executeDelete(start_offset, length_to_delete);
+
+    E.cursor.x = x1;
+    E.cursor.y = y1;
+    E.cursor.preferred_x = E.cursor.x;
+    E.sel.active = false;
+    E.buf.dirty = true;
+}
+
+void editorCopySelection() {
+    if (!E.sel.active) {
+        editorSetStatusMsg("No selection to copy");
+        return;
+    }
+
+    free(E.sel.clipboard);
+    int len;
+    E.sel.clipboard = editorGetSelectedText(&len);
+
+    if (E.sel.clipboard) {
+        char sizebuf[BUFFER_SIZE_32];
+        humanReadableSize(len, sizebuf, sizeof(sizebuf));
+
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "Copied %s", sizebuf);
+        editorSetStatusMsg(msg);
+        clipboardCopyToSystem(E.sel.clipboard, len);
+    }
+}
+
+void editorCutSelection() {
+    if (!E.sel.active) {
+        editorSetStatusMsg("No selection to cut");
+        return;
+    }
+
+    free(E.sel.clipboard);
+    int len;
+    E.sel.clipboard = editorGetSelectedText(&len);
+    if (!E.sel.clipboard) return;
+
+    clipboardCopyToSystem(E.sel.clipboard, len);
+    editorDeleteSelectedText();
+
+    char sizebuf[BUFFER_SIZE_32];
+    humanReadableSize(strlen(E.sel.clipboard), sizebuf, sizeof(sizebuf));
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "Cut %s", sizebuf);
+    editorSetStatusMsg(msg);
+}
+
+void editorCutLine() {
+    if (E.cursor.y >= E.buf.num_lines) return;
+
+    size_t start_offset = editorGetLogicalOffset(&E.buf, E.cursor.y, 0);
+    size_t line_len = editorGetLineLength(&E.buf, E.cursor.y);
+
+    size_t delete_len = line_len;
+    if (E.cursor.y < E.buf.num_lines - 1) delete_len += 1;
+
+    char *line_content = safeMalloc(delete_len + 1);
+    ptReadLogical(&E.buf.pt, start_offset, delete_len, line_content);
+
+    free(E.sel.clipboard);
+    E.sel.clipboard = line_content;
+    clipboardCopyToSystem(E.sel.clipboard, delete_len);
+
+    executeDelete(start_offset, delete_len);
+    if (E.cursor.y >= E.buf.num_lines && E.buf.num_lines > 0)
+        E.cursor.y = E.buf.num_lines - 1;
+
+    int current_len = editorGetLineLength(&E.buf, E.cursor.y);
+    E.cursor.x = E.cursor.x > current_len ? current_len : E.cursor.x;
+    E.cursor.preferred_x = E.cursor.x;
+
+    E.buf.dirty = true;
+    char sizebuf[BUFFER_SIZE_32];
+    humanReadableSize(delete_len, sizebuf, sizeof(sizebuf));
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "Cut %s", sizebuf);
+    editorSetStatusMsg(msg);
+}
+
+void clipboardCopyToSystem(const char *data, int len) {
+    if (!data || len <= 0) return;
+
+    if (E.sys.use_osc52) {
+        size_t output_len = 4 * ((len + 2) / 3);
+        char *b64_data = safeMalloc(output_len + 1);
+        base64Encode(data, len, b64_data);
+        if (write(STDOUT_FILENO, OSC52_HEADER, sizeof(OSC52_HEADER) - 1) != -1 &&
+            write(STDOUT_FILENO, b64_data, output_len) != -1 &&
+            write(STDOUT_FILENO, OSC_FOOTER, sizeof(OSC_FOOTER) - 1) != -1) {
+            free(b64_data);
+            return;
+        }
+        free(b64_data);
+    }
+
+    if (E.sys.clipboard_cmd != NULL) {
+        FILE *pipe = popen(E.sys.clipboard_cmd, "w");
+        if (pipe != NULL) {
+            fwrite(data, 1, len, pipe);
+            pclose(pipe);
+        } else {
+            editorSetStatusMsg("Clipboard error: Failed to run clipboard command.");
+        }
+    } else {
+        editorSetStatusMsg("Clipboard error: Unsupported OS or missing clipboard tool.");
+    }
+}
+
+uint32_t searchFoldCodepoint(uint32_t cp) {
+    // simple one-to-one folding for Latin, Greek and Cyrillic, both cases encode to the same number of bytes
+    if (cp >= 'A' && cp <= 'Z') return cp + ('a' - 'A');
+    if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) return cp + 0x20;
+    if (cp >= 0x100 && cp <= 0x137 && cp != 0x130 && cp != 0x131) return cp | 1;
+    if (cp >= 0x139 && cp <= 0x148 && (cp & 1)) return cp + 1;
+    if (cp >= 0x14A && cp <= 0x177) return cp | 1;
+    if (cp == 0x178) return 0xFF;
+    if (cp >= 0x179 && cp <= 0x17E && (cp & 1)) return cp + 1;
+    if (cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2) return cp + 0x20;
+    if (cp >= 0x400 && cp <= 0x40F) return cp + 0x50;
+    if (cp >= 0x410 && cp <= 0x42F) return cp + 0x20;
+    return cp;
+}
+
+uint32_t searchOtherCase(uint32_t cp) {
+    uint32_t folded = searchFoldCodepoint(cp);
+    if (folded != cp) return folded;
+
+    if (cp >= 'a' && cp <= 'z') return cp - ('a' - 'A');
+    if (cp >= 0xE0 && cp <= 0xFE && cp != 0xF7) return cp - 0x20;
+    if (cp == 0xFF) return 0x178;
+    if (cp >= 0x101 && cp <= 0x137 && cp != 0x131 && (cp & 1)) return cp - 1;
+    if (cp >= 0x13A && cp <= 0x148 && !(cp & 1)) return cp - 1;
+    if (cp >= 0x14B && cp <= 0x177 && (cp & 1)) return cp - 1;
+    if (cp >= 0x17A && cp <= 0x17E && !(cp & 1)) return cp - 1;
+    if (cp >= 0x3B1 && cp <= 0x3C9 && cp != 0x3C2) return cp - 0x20;
+    if (cp >= 0x430 && cp <= 0x44F) return cp - 0x20;
+    if (cp >= 0x450 && cp <= 0x45F) return cp - 0x50;
+    return cp;
+}
+
+bool searchEqualFold(const char *a, const char *b, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // ASCII letters are folded in registers, a block with other differences goes to the scalar loop
+    __m128i below_upper = _mm_set1_epi8('A' - 1);
+    __m128i above_upper = _mm_set1_epi8('Z' + 1);
+    __m128i case_bit = _mm_set1_epi8('a' - 'A');
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i upper_a = _mm_and_si128(_mm_cmpgt_epi8(va, below_upper), _mm_cmplt_epi8(va, above_upper));
+        __m128i upper_b = _mm_and_si128(_mm_cmpgt_epi8(vb, below_upper), _mm_cmplt_epi8(vb, above_upper));
+        __m128i folded_a = _mm_or_si128(va, _mm_and_si128(upper_a, case_bit));
+        __m128i folded_b = _mm_or_si128(vb, _mm_and_si128(upper_b, case_bit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(folded_a, folded_b)) == 0xFFFF) continue;
+        if (_mm_movemask_epi8(_mm_or_si128(va, vb)) == 0) return false;
+        break;
+    }
+#endif
+
+    while (i < n) {
+        unsigned char ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+        if (ca <= UTF8_ASCII_MAX && cb <= UTF8_ASCII_MAX) {
+            if (to_lower(ca) != to_lower(cb)) return false;
+            i++;
+            continue;
+        }
+
+        // the block loop may have stopped inside a character, decode it from its lead byte
+        size_t start = i;
+        while (start > 0 && i - start < 3 && utf8IsCont((unsigned char)a[start])) start--;
+        int window = n - start < 4 ? (int)(n - start) : 4;
+        int len_a, len_b;
+        uint32_t cp_a = utf8Decode(a + start, 0, window, &len_a);
+        uint32_t cp_b = utf8Decode(b + start, 0, window, &len_b);
+        if (len_a == 1 || len_b == 1 || start + len_a <= i) {
+            if (ca != cb) return false;
+            i++;
+            continue;
+        }
+        if (len_a != len_b || searchFoldCodepoint(cp_a) != searchFoldCodepoint(cp_b)) return false;
+        i = start + len_a;
+    }
+    return true;
+}
+
+void searchCompile(SearchPattern *pat, const char *needle, size_t len, bool ignore_case, bool whole_word) {
+    pat->needle = needle;
+    pat->len = len;
+    pat->ignore_case = ignore_case;
+    pat->whole_word = whole_word;
+    for (int c = 0; c < 256; c++)
+        pat->skip[c] = len;
+    for (size_t k = 0; k + 1 < len; k++)
+        pat->skip[(unsigned char)needle[k]] = len - 1 - k;
+    pat->first_alt = len > 0 ? (unsigned char)needle[0] : 0;
+    pat->last_alt = len > 0 ? (unsigned char)needle[len - 1] : 0;
+    if (!ignore_case || len == 0) return;
+
+    // the other case of every character, byte for byte, feeds the skip table and the first/last byte filter
+    char *other = safeMalloc(len);
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = (unsigned char)needle[i];
+        if (c <= UTF8_ASCII_MAX) {
+            other[i] = (char)searchOtherCase(c);
+            i++;
+            continue;
+        }
+
+        int seq_len;
+        uint32_t cp = utf8Decode(needle + i, 0, len - i < 4 ? (int)(len - i) : 4, &seq_len);
+        uint32_t swapped = searchOtherCase(cp);
+        memcpy(other + i, needle + i, seq_len);
+        if (seq_len == 2 && swapped != cp) {
+            other[i] = (char)(UTF8_LEAD2_MARK | (swapped >> UTF8_CONT_SHIFT));
+            other[i + 1] = (char)(UTF8_CONT_MARK | (swapped & UTF8_CONT_PAYLOAD));
+        }
+        i += seq_len;
+    }
+
+    // both cases in one pass, a later position always shifts less
+    for (size_t k = 0; k + 1 < len; k++) {
+        pat->skip[(unsigned char)needle[k]] = len - 1 - k;
+        pat->skip[(unsigned char)other[k]] = len - 1 - k;
+    }
+    pat->first_alt = (unsigned char)other[0];
+    pat->last_alt = (unsigned char)other[len - 1];
+    free(other);
+}
+
+const char *searchBlock(const SearchPattern *pat, const char *hay, size_t hay_len) {
+    size_t m = pat->len;
+    if (m == 0 || hay_len < m) return NULL;
+    if (pat->ignore_case) return searchBlockFold(pat, hay, hay_len);
+    if (m == 1) return memchr(hay, pat->needle[0], hay_len);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    // compare the first and last needle bytes 16 positions at a time
+    __m128i first = _mm_set1_epi8(pat->needle[0]);
+    __m128i last = _mm_set1_epi8(pat->needle[m - 1]);
+    for (; i + m - 1 + 16 <= hay_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat->needle + 1, m - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    unsigned char last_byte = (unsigned char)pat->needle[m - 1];
+    while (i + m <= hay_len) {
+        unsigned char c = (unsigned char)hay[i + m - 1];
+        if (c == last_byte && memcmp(hay + i, pat->needle, m - 1) == 0)
+            return hay + i;
+        i += pat->skip[c];
+    }
+    return NULL;
+}
+
+const char *searchBlockFold(const SearchPattern *pat, const char *hay, size_t hay_len) {
+    size_t m = pat->len;
+    size_t i = 0;
+#ifdef __SSE2__
+    // either case of the first and last needle bytes passes the filter, 16 positions at a time
+    __m128i first = _mm_set1_epi8(pat->needle[0]);
+    __m128i first_alt = _mm_set1_epi8((char)pat->first_alt);
+    __m128i last = _mm_set1_epi8(pat->needle[m - 1]);
+    __m128i last_alt = _mm_set1_epi8((char)pat->last_alt);
+    for (; i + m - 1 + 16 <= hay_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        __m128i hit_first = _mm_or_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(first_alt, block_first));
+        __m128i hit_last = _mm_or_si128(_mm_cmpeq_epi8(last, block_last), _mm_cmpeq_epi8(last_alt, block_last));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(hit_first, hit_last));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (searchEqualFold(hay + i + bit, pat->needle, m))
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    unsigned char last_byte = (unsigned char)pat->needle[m - 1];
+    while (i + m <= hay_len) {
+        unsigned char c = (unsigned char)hay[i + m - 1];
+        if ((c == last_byte || c == pat->last_alt) && searchEqualFold(hay + i, pat->needle, m))
+            return hay + i;
+        i += pat->skip[c];
+    }
+    return NULL;
+}
+
+bool searchIsWholeWord(PieceTable *pt, const char *base, size_t piece_start, size_t piece_end, size_t pos, size_t len) {
+    // the neighbours are read from the piece when they are in it
+    if (pos > 0) {
+        char before = pos - 1 >= piece_start ? base[pos - 1 - piece_start] : ptCharAt(pt, pos - 1);
+        if (isWordChar(before)) return false;
+    }
+    size_t end = pos + len;
+    if (end < pt->logical_size) {
+        char after = end < piece_end ? base[end - piece_start] : ptCharAt(pt, end);
+        if (isWordChar(after)) return false;
+    }
+    return true;
+}
+
+size_t ptSearch(PieceTable *pt, const SearchPattern *pat, size_t from, size_t to, SearchEmitFn emit, void *ctx) {
+    size_t m = pat->len;
+    if (to > pt->logical_size) to = pt->logical_size;
+    if (m == 0 || from >= to || to - from < m) return 0;
+
+    size_t p_idx, p_off;
+    if (!ptFindPiece(pt, from, &p_idx, &p_off)) return 0;
+
+    char *stitch = safeMalloc(2 * m);
+    size_t piece_start = from - p_off;
+    size_t next = from;
+    size_t count = 0;
+    for (; p_idx < pt->num_pieces && piece_start < to; p_idx++) {
+        Piece p = pt->pieces[p_idx];
+        size_t piece_end = piece_start + p.length;
+        size_t limit = piece_end < to ? piece_end : to;
+        const char *base = ((p.source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf) + p.start;
+
+        while (next + m <= limit) {
+            const char *hit = searchBlock(pat, base + (next - piece_start), limit - next);
+            if (!hit) break;
+
+            size_t pos = piece_start + (hit - base);
+            if (pat->whole_word && !searchIsWholeWord(pt, base, piece_start, piece_end, pos, m)) {
+                // a rejected hit does not consume its bytes
+                next = pos + 1;
+                continue;
+            }
+            next = pos + m;
+            count++;
+            if (emit && !emit(pos, ctx)) goto done;
+        }
+
+        // a match starting in the last m - 1 bytes continues into the following pieces
+        if (m > 1 && limit == piece_end && piece_end < to) {
+            size_t s0 = piece_end >= m - 1 ? piece_end - (m - 1) : 0;
+            if (s0 < next) s0 = next;
+            size_t stitch_end = piece_end + (m - 1) < to ? piece_end + (m - 1) : to;
+            while (s0 < piece_end && stitch_end - s0 >= m) {
+                ptReadLogical(pt, s0, stitch_end - s0, stitch);
+                const char *hit = searchBlock(pat, stitch, stitch_end - s0);
+                if (!hit || s0 + (hit - stitch) >= piece_end) break;
+
+                size_t pos = s0 + (hit - stitch);
+                if (pat->whole_word && !searchIsWholeWord(pt, stitch, s0, stitch_end, pos, m)) {
+                    s0 = pos + 1;
+                    continue;
+                }
+                next = pos + m;
+                count++;
+                if (emit && !emit(pos, ctx)) goto done;
+                break;
+            }
+        }
+
+        if (next < piece_end) next = piece_end;
+        piece_start = piece_end;
+    }
+
+done:
+    free(stitch);
+    return count;
+}
+
+bool searchChunkCollect(size_t offset, void *ctx) {
+    SearchChunk *chunk = ctx;
+    if (chunk->count >= chunk->capacity) {
+        chunk->capacity = chunk->capacity == 0 ? BUFFER_SIZE_1024 : chunk->capacity * 2;
+        chunk->hits = safeRealloc(chunk->hits, sizeof(size_t) * chunk->capacity);
+    }
+    chunk->hits[chunk->count++] = offset;
+    return true;
+}
+
+bool searchFirstHit(size_t offset, void *ctx) {
+    *(size_t *)ctx = offset;
+    return false;
+}
+
+void *searchChunkWorker(void *arg) {
+    SearchChunk *chunk = arg;
+    ptSearch(chunk->pt, chunk->pat, chunk->from, chunk->to, searchChunkCollect, chunk);
+    return NULL;
+}
+
+int editorSearchThreads() {
+    const char *env = getenv("CYPHER_SEARCH_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SEARCH_THREADS) threads = MAX_SEARCH_THREADS;
+    return (int)threads;
+}
+
+size_t ptSearchParallel(PieceTable *pt, const SearchPattern *pat, size_t from, size_t to, int threads, SearchEmitFn emit, void *ctx) {
+    size_t m = pat->len;
+    if (to > pt->logical_size) to = pt->logical_size;
+    if (threads <= 1 || from >= to || to - from < SEARCH_PARALLEL_MIN || m == 0)
+        return ptSearch(pt, pat, from, to, emit, ctx);
+
+    // workers only read the table, so the offsets must be current before they start
+    if (pt->offsets_dirty) ptRebuildOffsets(pt);
+
+    // cut at a piece boundary when one is close, split inside long pieces otherwise
+    size_t bounds[MAX_SEARCH_THREADS + 1];
+    size_t span = (to - from) / threads;
+    int num_chunks = 0;
+    bounds[0] = from;
+    for (int i = 1; i < threads; i++) {
+        size_t ideal = from + (size_t)i * span;
+        size_t piece_idx, piece_offset;
+        size_t cut = ideal;
+        if (ptFindPiece(pt, ideal, &piece_idx, &piece_offset)) {
+            size_t to_next = pt->pieces[piece_idx].length - piece_offset;
+            if (piece_offset < span / 4) cut = ideal - piece_offset;
+            else if (to_next < span / 4) cut = ideal + to_next;
+        }
+        if (cut > bounds[num_chunks] && cut < to)
+            bounds[++num_chunks] = cut;
+    }
+    bounds[++num_chunks] = to;
+
+    SearchChunk *chunks = safeMalloc(sizeof(SearchChunk) * num_chunks);
+    pthread_t *workers = safeMalloc(sizeof(pthread_t) * num_chunks);
+    bool *started = safeMalloc(sizeof(bool) * num_chunks);
+    for (int c = 0; c < num_chunks; c++) {
+        // overlap by m - 1 bytes so matches starting before the cut are complete
+        size_t chunk_to = bounds[c + 1] + (m - 1);
+        chunks[c] = (SearchChunk){ pt, pat, bounds[c], chunk_to < to ? chunk_to : to, NULL, 0, 0 };
+        started[c] = c > 0 && pthread_create(&workers[c], NULL, searchChunkWorker, &chunks[c]) == 0;
+    }
+    for (int c = 0; c < num_chunks; c++) {
+        if (!started[c]) searchChunkWorker(&chunks[c]);
+    }
+    for (int c = 1; c < num_chunks; c++) {
+        if (started[c]) pthread_join(workers[c], NULL);
+    }
+
+    size_t count = 0;
+    size_t last_end = from;
+    bool stopped = false;
+    for (int c = 0; c < num_chunks && !stopped; c++) {
+        SearchChunk *chunk = &chunks[c];
+        size_t i = 0;
+
+        // a match running over the cut can shadow the first hits of this chunk, rescan until both chains meet
+        while (i < chunk->count && chunk->hits[i] < last_end) {
+            size_t pos = SIZE_MAX;
+            ptSearch(pt, pat, last_end, chunk->to, searchFirstHit, &pos);
+            if (pos == SIZE_MAX) {
+                i = chunk->count;
+                break;
+            }
+
+            while (i < chunk->count && chunk->hits[i] < pos) i++;
+            if (i < chunk->count && chunk->hits[i] == pos) break;
+
+            count++;
+            last_end = pos + m;
+            if (emit && !emit(pos, ctx)) {
+                stopped = true;
+                break;
+            }
+        }
+
+        for (; i < chunk->count && !stopped; i++) {
+            count++;
+            last_end = chunk->hits[i] + m;
+            if (emit && !emit(chunk->hits[i], ctx)) stopped = true;
+        }
+    }
+
+    for (int c = 0; c < num_chunks; c++)
+        free(chunks[c].hits);
+    free(chunks);
+    free(workers);
+    free(started);
+    return count;
+}
+
+bool editorAppendMatch(size_t offset, void *ctx) {
+    matchStoreAppend(ctx, offset);
+    return true;
+}
+
+bool searchHasBorder(const char *needle, size_t len, bool ignore_case) {
+    for (size_t k = 1; k < len; k++) {
+        if (ignore_case ? searchEqualFold(needle, needle + len - k, k) : memcmp(needle, needle + len - k, k) == 0)
+            return true;
+    }
+    return false;
+}
+
+char *editorBenchLoad(const char *path, size_t *out_len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cypher: cannot open %s\n", path);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (file_size <= 0) {
+        fclose(fp);
+        fprintf(stderr, "cypher: %s is empty\n", path);
+        return NULL;
+    }
+
+    char *content = safeMalloc(file_size + 1);
+    size_t len = fread(content, 1, file_size, fp);
+    fclose(fp);
+    content[len] = '\0';
+    *out_len = len;
+    return content;
+}
+
+int editorBenchSearch(const char *path, const char *query) {
+    size_t len;
+    char *content = editorBenchLoad(path, &len);
+    if (!content) return 1;
+
+    PieceTable pt;
+    ptInit(&pt, content, len);
+
+    // split the original buffer the way edits would, so stitching is exercised
+    for (size_t off = BENCH_PIECE_SPAN; off < len; off += BENCH_PIECE_SPAN) {
+        ptInsert(&pt, off, "x", 1);
+        ptDelete(&pt, off, 1);
+    }
+
+    SearchPattern pat;
+    size_t query_len = strlen(query);
+    searchCompile(&pat, query, query_len, false, false);
+
+    long best_pt = LONG_MAX, best_memmem = LONG_MAX;
+    size_t pt_count = 0, memmem_count = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        long start = currentMicros();
+        pt_count = ptSearch(&pt, &pat, 0, pt.logical_size, NULL, NULL);
+        long elapsed = currentMicros() - start;
+        if (elapsed < best_pt) best_pt = elapsed;
+
+        start = currentMicros();
+        memmem_count = 0;
+        const char *cur = content;
+        const char *end = content + len;
+        const char *hit;
+        while ((hit = memmem(cur, end - cur, query, query_len)) != NULL) {
+            memmem_count++;
+            cur = hit + query_len;
+        }
+        elapsed = currentMicros() - start;
+        if (elapsed < best_memmem) best_memmem = elapsed;
+    }
+
+    char size_str[BUFFER_SIZE_32];
+    humanReadableSize(len, size_str, sizeof(size_str));
+    printf("%s, %zu pieces, query \"%s\" (best of %d runs)\n", size_str, pt.num_pieces, query, BENCH_RUNS);
+    printf("  piece search : %zu matches, %8.3f ms, %6.2f GB/s\n", pt_count, best_pt / 1000.0, len / (best_pt > 0 ? best_pt * 1000.0 : 1.0));
+    printf("  memmem       : %zu matches, %8.3f ms, %6.2f GB/s\n", memmem_count, best_memmem / 1000.0, len / (best_memmem > 0 ? best_memmem * 1000.0 : 1.0));
+    if (pt_count != memmem_count)
+        printf("  MISMATCH: match counts differ\n");
+
+    // case folding happens in the filter and the compare, so it should stay close to the exact search
+    SearchPattern fold_pat;
+    searchCompile(&fold_pat, query, query_len, true, false);
+    long best_fold = LONG_MAX, best_strcasestr = LONG_MAX;
+    size_t fold_count = 0, strcasestr_count = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        long start = currentMicros();
+        fold_count = ptSearch(&pt, &fold_pat, 0, pt.logical_size, NULL, NULL);
+        long elapsed = currentMicros() - start;
+        if (elapsed < best_fold) best_fold = elapsed;
+
+        start = currentMicros();
+        strcasestr_count = 0;
+        const char *cur = content;
+        const char *hit;
+        while ((hit = strcasestr(cur, query)) != NULL) {
+            strcasestr_count++;
+            cur = hit + query_len;
+        }
+        elapsed = currentMicros() - start;
+        if (elapsed < best_strcasestr) best_strcasestr = elapsed;
+    }
+    printf("  ignore case  : %zu matches, %8.3f ms, %6.2f GB/s\n", fold_count, best_fold / 1000.0, len / (best_fold > 0 ? best_fold * 1000.0 : 1.0));
+    printf("  strcasestr   : %zu matches, %8.3f ms, %6.2f GB/s\n", strcasestr_count, best_strcasestr / 1000.0, len / (best_strcasestr > 0 ? best_strcasestr * 1000.0 : 1.0));
+    if (fold_count != strcasestr_count)
+        printf("  MISMATCH: case-insensitive match counts differ\n");
+
+    // scaling curve up to CYPHER_SEARCH_THREADS (or the number of online cores)
+    int max_threads = editorSearchThreads();
+    bool counts_agree = pt_count == memmem_count;
+    long single = best_pt;
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+        long best = LONG_MAX;
+        size_t count = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            long start = currentMicros();
+            count = ptSearchParallel(&pt, &pat, 0, pt.logical_size, threads, NULL, NULL);
+            long elapsed = currentMicros() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        if (threads == 1) single = best;
+        printf("  %2d thread%s   : %zu matches, %8.3f ms, %6.2f GB/s, %5.2fx\n", threads, threads == 1 ? " " : "s", count, best / 1000.0,
+               len / (best > 0 ? best * 1000.0 : 1.0), (double)single / (best > 0 ? best : 1));
+        if (count != memmem_count) counts_agree = false;
+        if (threads == max_threads) break;
+    }
+    if (len < SEARCH_PARALLEL_MIN)
+        printf("  (files under %d MB are always searched on one thread)\n", SEARCH_PARALLEL_MIN / (1024 * 1024));
+
+    ptFree(&pt);
+    return counts_agree ? 0 : 1;
+}
+
+int editorBenchRegex(const char *path, const char *pattern) {
+    Regex re;
+    const char *error;
+    if (!regexCompile(&re, pattern, &error)) {
+        fprintf(stderr, "cypher: bad regex: %s\n", error);
+        return 1;
+    }
+
+    size_t len;
+    char *content = editorBenchLoad(path, &len);
+    if (!content) {
+        regexFree(&re);
+        return 1;
+    }
+
+    // POSIX regexec needs the flat text, so it runs on the loaded copy as the baseline
+    regex_t posix;
+    bool has_posix = regcomp(&posix, pattern, REG_EXTENDED | REG_NEWLINE) == 0;
+    long best_posix = LONG_MAX;
+    size_t posix_count = 0;
+    for (int run = 0; has_posix && run < BENCH_RUNS; run++) {
+        long start = currentMicros();
+        posix_count = 0;
+        char *line = content;
+        regmatch_t m;
+        while (line < content + len) {
+            // one line at a time, regexec would otherwise measure the rest of the file on every call
+            char *line_end = memchr(line, '\n', content + len - line);
+            if (!line_end) line_end = content + len;
+            char saved = *line_end;
+            *line_end = '\0';
+            for (const char *cur = line; cur <= line_end;) {
+                if (regexec(&posix, cur, 1, &m, cur > line ? REG_NOTBOL : 0) != 0) break;
+                if (m.rm_eo == m.rm_so) {
+                    cur += m.rm_so + 1;
+                    continue;
+                }
+                posix_count++;
+                cur += m.rm_eo;
+            }
+            *line_end = saved;
+            line = line_end + 1;
+        }
+        long elapsed = currentMicros() - start;
+        if (elapsed < best_posix) best_posix = elapsed;
+    }
+    if (has_posix) regfree(&posix);
+
+    PieceTable pt;
+    ptInit(&pt, content, len);
+    for (size_t off = BENCH_PIECE_SPAN; off < len; off += BENCH_PIECE_SPAN) {
+        ptInsert(&pt, off, "x", 1);
+        ptDelete(&pt, off, 1);
+    }
+
+    long best = LONG_MAX;
+    size_t count = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        long start = currentMicros();
+        count = regexSearch(&pt, &re, 0, pt.logical_size, NULL, NULL);
+        long elapsed = currentMicros() - start;
+        if (elapsed < best) best = elapsed;
+    }
+
+    char size_str[BUFFER_SIZE_32];
+    humanReadableSize(len, size_str, sizeof(size_str));
+    printf("%s, %zu pieces, regex \"%s\" (best of %d runs)\n", size_str, pt.num_pieces, pattern, BENCH_RUNS);
+    printf("  piece regex  : %zu matches, %8.3f ms, %6.2f MB/s, %d dfa states\n", count, best / 1000.0, len / (best > 0 ? (double)best : 1.0), re.num_states);
+    if (has_posix)
+        printf("  regexec      : %zu matches, %8.3f ms, %6.2f MB/s\n", posix_count, best_posix / 1000.0, len / (best_posix > 0 ? (double)best_posix : 1.0));
+    else
+        printf("  regexec      : pattern not valid POSIX ERE\n");
+
+    ptFree(&pt);
+    regexFree(&re);
+    return 0;
+}
+
+void ptCursorInit(PieceCursor *cur, PieceTable *pt, size_t pos) {
+    cur->pt = pt;
+    if (!ptFindPiece(pt, pos, &cur->piece, &cur->offset)) {
+        cur->piece = pt->num_pieces;
+        cur->offset = 0;
+    }
+}
+
+int ptCursorNext(PieceCursor *cur) {
+    PieceTable *pt = cur->pt;
+    while (cur->piece < pt->num_pieces && cur->offset >= pt->pieces[cur->piece].length) {
+        cur->piece++;
+        cur->offset = 0;
+    }
+    if (cur->piece >= pt->num_pieces) return RX_END;
+
+    Piece *p = &pt->pieces[cur->piece];
+    const char *buf = (p->source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf;
+    return (unsigned char)buf[p->start + cur->offset++];
+}
+
+bool regexIsWord(int c) {
+    return c != RX_END && (is_alnum(c) || c == '_');
+}
+
+void regexSetClass(uint32_t *set, char cls) {
+    uint32_t bits[8] = {0};
+    for (int c = 0; c < 256; c++) {
+        bool in;
+        switch (cls) {
+            case 'd': case 'D': in = c >= '0' && c <= '9'; break;
+            case 'w': case 'W': in = regexIsWord(c); break;
+            default:            in = c == ' ' || (c >= '\t' && c <= '\r'); break;
+        }
+        if (in) bits[c >> 5] |= 1u << (c & 31);
+    }
+
+    bool negate = cls == 'D' || cls == 'W' || cls == 'S';
+    for (int i = 0; i < 8; i++)
+        set[i] |= negate ? ~bits[i] : bits[i];
+}
+
+int regexAddSet(Regex *re, const uint32_t *bits) {
+    if (re->num_sets >= re->sets_cap) {
+        re->sets_cap = re->sets_cap == 0 ? BUFFER_SIZE_32 : re->sets_cap * 2;
+        re->sets = safeRealloc(re->sets, sizeof(uint32_t[8]) * re->sets_cap);
+    }
+    memcpy(re->sets[re->num_sets], bits, sizeof(uint32_t[8]));
+    // matches never cross a line, the newline is not in any set
+    re->sets[re->num_sets]['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return re->num_sets++;
+}
+
+int regexNewNode(RegexParser *ps, RegexNodeType type) {
+    if (ps->num_nodes >= ps->capacity) {
+        ps->capacity = ps->capacity == 0 ? BUFFER_SIZE_32 : ps->capacity * 2;
+        ps->nodes = safeRealloc(ps->nodes, sizeof(RegexNode) * ps->capacity);
+    }
+    RegexNode *node = &ps->nodes[ps->num_nodes];
+    memset(node, 0, sizeof(RegexNode));
+    node->type = type;
+    node->greedy = true;
+    return ps->num_nodes++;
+}
+
+int regexParseEscapedChar(RegexParser *ps) {
+    char e = ps->src[ps->pos];
+    switch (e) {
+        case '\0':
+            ps->error = "trailing backslash";
+            return -1;
+        case 'n':
+            ps->error = "patterns cannot match across lines";
+            return -1;
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default:
+            if (e >= '1' && e <= '9') {
+                ps->error = "backreferences are not supported";
+                return -1;
+            }
+            return (unsigned char)e;
+    }
+}
+
+int regexParseClass(RegexParser *ps) {
+    uint32_t bits[8] = {0};
+    ps->pos++;
+    bool negate = ps->src[ps->pos] == '^';
+    if (negate) ps->pos++;
+
+    bool first = true;
+    while (true) {
+        char c = ps->src[ps->pos];
+        if (c == '\0') {
+            ps->error = "missing ]";
+            return -1;
+        }
+        if (c == ']' && !first) {
+            ps->pos++;
+            break;
+        }
+        first = false;
+
+        int lo;
+        if (c == '\\') {
+            char e = ps->src[ps->pos + 1];
+            if (e == 'd' || e == 'D' || e == 'w' || e == 'W' || e == 's' || e == 'S') {
+                regexSetClass(bits, e);
+                ps->pos += 2;
+                continue;
+            }
+            ps->pos++;
+            if ((lo = regexParseEscapedChar(ps)) < 0) return -1;
+        } else {
+            lo = (unsigned char)c;
+        }
+        ps->pos++;
+
+        int hi = lo;
+        if (ps->src[ps->pos] == '-' && ps->src[ps->pos + 1] != ']' && ps->src[ps->pos + 1] != '\0') {
+            ps->pos++;
+            if (ps->src[ps->pos] == '\\') {
+                ps->pos++;
+                if ((hi = regexParseEscapedChar(ps)) < 0) return -1;
+            } else {
+                hi = (unsigned char)ps->src[ps->pos];
+            }
+            ps->pos++;
+            if (hi < lo) {
+                ps->error = "bad character range";
+                return -1;
+            }
+        }
+        for (int ch = lo; ch <= hi; ch++)
+            bits[ch >> 5] |= 1u << (ch & 31);
+    }
+
+    if (negate) {
+        for (int i = 0; i < 8; i++)
+            bits[i] = ~bits[i];
+    }
+    int node = regexNewNode(ps, RXN_SET);
+    ps->nodes[node].arg = regexAddSet(ps->re, bits);
+    return node;
+}
+
+bool regexParseCount(RegexParser *ps, int *min, int *max) {
+    // {n}, {n,} and {n,m}; anything else leaves the brace as a literal
+    size_t pos = ps->pos + 1;
+    int lo = 0, hi;
+    if (ps->src[pos] < '0' || ps->src[pos] > '9') return false;
+    while (ps->src[pos] >= '0' && ps->src[pos] <= '9' && lo <= RX_MAX_REPEAT)
+        lo = lo * 10 + (ps->src[pos++] - '0');
+
+    if (ps->src[pos] == '}') {
+        hi = lo;
+    } else if (ps->src[pos] == ',') {
+        pos++;
+        if (ps->src[pos] == '}') {
+            hi = -1;
+        } else {
+            if (ps->src[pos] < '0' || ps->src[pos] > '9') return false;
+            hi = 0;
+            while (ps->src[pos] >= '0' && ps->src[pos] <= '9' && hi <= RX_MAX_REPEAT)
+                hi = hi * 10 + (ps->src[pos++] - '0');
+        }
+        if (ps->src[pos] != '}') return false;
+    } else {
+        return false;
+    }
+
+    if (lo > RX_MAX_REPEAT || hi > RX_MAX_REPEAT) ps->error = "repeat count too large";
+    else if (hi != -1 && hi < lo) ps->error = "bad repeat range";
+    ps->pos = pos + 1;
+    *min = lo;
+    *max = hi;
+    return true;
+}
+
+int regexParseAtom(RegexParser *ps) {
+    uint32_t bits[8] = {0};
+    char c = ps->src[ps->pos];
+    int node;
+    switch (c) {
+        case '(': {
+            ps->pos++;
+            int group = -1;
+            if (ps->src[ps->pos] == '?' && ps->src[ps->pos + 1] == ':')
+                ps->pos += 2;
+            else if (ps->re->num_groups < RX_MAX_GROUPS)
+                group = ps->re->num_groups++;
+
+            int inner = regexParseAlt(ps);
+            if (ps->error) return -1;
+            if (ps->src[ps->pos] != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->pos++;
+            node = regexNewNode(ps, RXN_GROUP);
+            ps->nodes[node].left = inner;
+            ps->nodes[node].arg = group;
+            return node;
+        }
+        case '[':
+            return regexParseClass(ps);
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+        case '^':
+        case '$':
+            ps->pos++;
+            if (c == '^') ps->re->bol_asserts = true;
+            node = regexNewNode(ps, RXN_ASSERT);
+            ps->nodes[node].arg = (c == '^') ? RX_BOL : RX_EOL;
+            return node;
+        case '.':
+            ps->pos++;
+            memset(bits, 0xFF, sizeof(bits));
+            break;
+        case '\\': {
+            ps->pos++;
+            char e = ps->src[ps->pos];
+            if (e == 'b' || e == 'B') {
+                ps->pos++;
+                ps->re->word_asserts = true;
+                node = regexNewNode(ps, RXN_ASSERT);
+                ps->nodes[node].arg = (e == 'b') ? RX_WORDB : RX_NWORDB;
+                return node;
+            }
+            if (e == 'd' || e == 'D' || e == 'w' || e == 'W' || e == 's' || e == 'S') {
+                regexSetClass(bits, e);
+            } else {
+                int ch = regexParseEscapedChar(ps);
+                if (ch < 0) return -1;
+                bits[ch >> 5] |= 1u << (ch & 31);
+            }
+            ps->pos++;
+            break;
+        }
+        default:
+            ps->pos++;
+            bits[(unsigned char)c >> 5] |= 1u << ((unsigned char)c & 31);
+            break;
+    }
+
+    node = regexNewNode(ps, RXN_SET);
+    ps->nodes[node].arg = regexAddSet(ps->re, bits);
+    return node;
+}
+
+int regexParseRepeat(RegexParser *ps) {
+    int atom = regexParseAtom(ps);
+    while (!ps->error) {
+        char c = ps->src[ps->pos];
+        int min, max;
+        if (c == '*') {
+            min = 0;
+            max = -1;
+            ps->pos++;
+        } else if (c == '+') {
+            min = 1;
+            max = -1;
+            ps->pos++;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+            ps->pos++;
+        } else if (c != '{' || !regexParseCount(ps, &min, &max)) {
+            break;
+        }
+        if (ps->error) break;
+
+        int node = regexNewNode(ps, RXN_REPEAT);
+        ps->nodes[node].left = atom;
+        ps->nodes[node].min = min;
+        ps->nodes[node].max = max;
+        if (ps->src[ps->pos] == '?') {
+            ps->nodes[node].greedy = false;
+            ps->pos++;
+        }
+        atom = node;
+    }
+    return atom;
+}
+
+int regexParseCat(RegexParser *ps) {
+    int left = regexNewNode(ps, RXN_EMPTY);
+    while (!ps->error) {
+        char c = ps->src[ps->pos];
+        if (c == '\0' || c == '|' || c == ')') break;
+
+        int right = regexParseRepeat(ps);
+        if (ps->error) break;
+        int node = regexNewNode(ps, RXN_CAT);
+        ps->nodes[node].left = left;
+        ps->nodes[node].right = right;
+        left = node;
+    }
+    return left;
+}
+
+int regexParseAlt(RegexParser *ps) {
+    int left = regexParseCat(ps);
+    while (!ps->error && ps->src[ps->pos] == '|') {
+        ps->pos++;
+        int right = regexParseCat(ps);
+        int node = regexNewNode(ps, RXN_ALT);
+        ps->nodes[node].left = left;
+        ps->nodes[node].right = right;
+        left = node;
+    }
+    return left;
+}
+
+int regexEmit(Regex *re, RegexOp op, int x, int y) {
+    if (re->num_insts >= re->insts_cap) {
+        re->insts_cap = re->insts_cap == 0 ? BUFFER_SIZE_128 : re->insts_cap * 2;
+        re->prog = safeRealloc(re->prog, sizeof(RegexInst) * re->insts_cap);
+    }
+    re->prog[re->num_insts] = (RegexInst){ op, x, y };
+    return re->num_insts++;
+}
+
+void regexCompileNode(Regex *re, const RegexNode *nodes, int n) {
+    if (re->num_insts > RX_MAX_INSTS) return;
+
+    const RegexNode *node = &nodes[n];
+    switch (node->type) {
+        case RXN_EMPTY:
+            break;
+        case RXN_SET:
+            regexEmit(re, RX_SET, node->arg, 0);
+            break;
+        case RXN_ASSERT:
+            regexEmit(re, node->arg, 0, 0);
+            break;
+        case RXN_CAT:
+            regexCompileNode(re, nodes, node->left);
+            regexCompileNode(re, nodes, node->right);
+            break;
+        case RXN_GROUP:
+            if (node->arg >= 0) regexEmit(re, RX_SAVE, 2 * node->arg, 0);
+            regexCompileNode(re, nodes, node->left);
+            if (node->arg >= 0) regexEmit(re, RX_SAVE, 2 * node->arg + 1, 0);
+            break;
+        case RXN_ALT: {
+            int split = regexEmit(re, RX_SPLIT, 0, 0);
+            re->prog[split].x = re->num_insts;
+            regexCompileNode(re, nodes, node->left);
+            int jump = regexEmit(re, RX_JMP, 0, 0);
+            re->prog[split].y = re->num_insts;
+            regexCompileNode(re, nodes, node->right);
+            re->prog[jump].x = re->num_insts;
+            break;
+        }
+        case RXN_REPEAT:
+            for (int i = 0; i < node->min; i++)
+                regexCompileNode(re, nodes, node->left);
+
+            if (node->max == -1) {
+                int split = regexEmit(re, RX_SPLIT, 0, 0);
+                int body = re->num_insts;
+                regexCompileNode(re, nodes, node->left);
+                regexEmit(re, RX_JMP, split, 0);
+                int out = re->num_insts;
+                re->prog[split].x = node->greedy ? body : out;
+                re->prog[split].y = node->greedy ? out : body;
+            } else {
+                for (int i = node->min; i < node->max; i++) {
+                    int split = regexEmit(re, RX_SPLIT, 0, 0);
+                    int body = re->num_insts;
+                    regexCompileNode(re, nodes, node->left);
+                    int out = re->num_insts;
+                    re->prog[split].x = node->greedy ? body : out;
+                    re->prog[split].y = node->greedy ? out : body;
+                }
+            }
+            break;
+    }
+}
+
+bool regexCompile(Regex *re, const char *pattern, const char **error) {
+    memset(re, 0, sizeof(Regex));
+    re->num_groups = 1;
+
+    RegexParser ps = { pattern, 0, NULL, 0, 0, re, NULL };
+    int root = regexParseAlt(&ps);
+    if (!ps.error && pattern[ps.pos] != '\0')
+        ps.error = "unmatched )";
+
+    if (!ps.error) {
+        regexEmit(re, RX_SAVE, 0, 0);
+        regexCompileNode(re, ps.nodes, root);
+        regexEmit(re, RX_SAVE, 1, 0);
+        regexEmit(re, RX_MATCH, 0, 0);
+        if (re->num_insts > RX_MAX_INSTS)
+            ps.error = "pattern too large";
+    }
+    free(ps.nodes);
+
+    if (ps.error) {
+        regexFree(re);
+        *error = ps.error;
+        return false;
+    }
+
+    int n = re->num_insts;
+    int slots = 2 * re->num_groups;
+    re->stack = safeMalloc(sizeof(int) * (3 * n + 2));
+    re->list = safeMalloc(sizeof(int) * n);
+    re->step = safeMalloc(sizeof(int) * n);
+    re->marks = safeMalloc(sizeof(unsigned) * n);
+    memset(re->marks, 0, sizeof(unsigned) * n);
+    for (int k = 0; k < 2; k++) {
+        re->threads[k] = safeMalloc(sizeof(int) * n);
+        re->thread_caps[k] = safeMalloc(sizeof(size_t) * n * slots);
+    }
+    re->pool_cap = BUFFER_SIZE_128;
+    re->pool = safeMalloc(sizeof(int) * re->pool_cap);
+    re->table = safeMalloc(sizeof(int) * RX_DFA_TABLE_SIZE);
+    regexDfaFlush(re);
+    *error = NULL;
+    return true;
+}
+
+void regexFree(Regex *re) {
+    free(re->prog);
+    free(re->sets);
+    free(re->states);
+    free(re->trans);
+    free(re->eol_match);
+    free(re->pool);
+    free(re->table);
+    free(re->stack);
+    free(re->list);
+    free(re->step);
+    free(re->marks);
+    for (int k = 0; k < 2; k++) {
+        free(re->threads[k]);
+        free(re->thread_caps[k]);
+    }
+    memset(re, 0, sizeof(Regex));
+}
+
+void regexFoldCase(Regex *re) {
+    // every set that holds a letter also gets its other case, the DFA is built from the sets lazily
+    for (int k = 0; k < re->num_sets; k++) {
+        uint32_t *bits = re->sets[k];
+        for (int c = 'a'; c <= 'z'; c++) {
+            int upper = c - ('a' - 'A');
+            bool has = (bits[c >> 5] & (1u << (c & 31))) || (bits[upper >> 5] & (1u << (upper & 31)));
+            if (!has) continue;
+            bits[c >> 5] |= 1u << (c & 31);
+            bits[upper >> 5] |= 1u << (upper & 31);
+        }
+    }
+}
+
+unsigned regexNextMark(Regex *re) {
+    if (++re->mark_gen == 0) {
+        memset(re->marks, 0, sizeof(unsigned) * re->num_insts);
+        re->mark_gen = 1;
+    }
+    return re->mark_gen;
+}
+
+uint8_t regexFlagsBefore(Regex *re, int prev) {
+    // flags only tell states apart when some assertion reads them
+    uint8_t flags = 0;
+    if (re->bol_asserts && (prev == '\n' || prev == RX_END)) flags |= RX_PREV_NL;
+    if (re->word_asserts && regexIsWord(prev)) flags |= RX_PREV_WORD;
+    return flags;
+}
+
+uint8_t regexFlagsAt(Regex *re, PieceTable *pt, size_t pos) {
+    return regexFlagsBefore(re, pos == 0 ? RX_END : (unsigned char)ptCharAt(pt, pos - 1));
+}
+
+int regexClosure(Regex *re, const int *pcs, int num_pcs, uint8_t flags, int next, int *out, bool *matched) {
+    unsigned mark = regexNextMark(re);
+    bool next_eol = next == '\n' || next == RX_END;
+    bool next_word = regexIsWord(next);
+    int sp = 0;
+    int count = 0;
+    *matched = false;
+
+    // every position may start a match
+    re->stack[sp++] = 0;
+    for (int i = 0; i < num_pcs; i++)
+        re->stack[sp++] = pcs[i];
+
+    while (sp > 0) {
+        int pc = re->stack[--sp];
+        if (re->marks[pc] == mark) continue;
+        re->marks[pc] = mark;
+
+        RegexInst *in = &re->prog[pc];
+        switch (in->op) {
+            case RX_SET:    out[count++] = pc; break;
+            case RX_MATCH:  *matched = true; break;
+            case RX_JMP:    re->stack[sp++] = in->x; break;
+            case RX_SPLIT:  re->stack[sp++] = in->y; re->stack[sp++] = in->x; break;
+            case RX_SAVE:   re->stack[sp++] = pc + 1; break;
+            case RX_BOL:    if (flags & RX_PREV_NL) re->stack[sp++] = pc + 1; break;
+            case RX_EOL:    if (next_eol) re->stack[sp++] = pc + 1; break;
+            case RX_WORDB:  if (((flags & RX_PREV_WORD) != 0) != next_word) re->stack[sp++] = pc + 1; break;
+            case RX_NWORDB: if (((flags & RX_PREV_WORD) != 0) == next_word) re->stack[sp++] = pc + 1; break;
+        }
+    }
+    return count;
+}
+
+int regexCompareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+void regexDfaFlush(Regex *re) {
+    re->num_states = 0;
+    re->pool_len = 0;
+    for (int i = 0; i < 4; i++)
+        re->start_states[i] = -1;
+    re->epoch++;
+    for (int i = 0; i < RX_DFA_TABLE_SIZE; i++)
+        re->table[i] = -1;
+}
+
+int regexDfaState(Regex *re, const int *pcs, int num_pcs, uint8_t flags) {
+    uint32_t hash = (uint32_t)hashBytes(FNV_OFFSET_64, pcs, sizeof(int) * num_pcs) ^ flags;
+    int slot = hash & (RX_DFA_TABLE_SIZE - 1);
+    for (; re->table[slot] != -1; slot = (slot + 1) & (RX_DFA_TABLE_SIZE - 1)) {
+        RegexDfaState *st = &re->states[re->table[slot]];
+        if (st->hash == hash && st->flags == flags && st->num_pcs == num_pcs &&
+            memcmp(re->pool + st->pcs, pcs, sizeof(int) * num_pcs) == 0)
+            return re->table[slot];
+    }
+
+    // too many states, start over rather than grow without bound
+    if (re->num_states >= RX_DFA_MAX_STATES) {
+        regexDfaFlush(re);
+        slot = hash & (RX_DFA_TABLE_SIZE - 1);
+    }
+
+    if (re->num_states >= re->states_cap) {
+        re->states_cap = re->states_cap == 0 ? BUFFER_SIZE_32 : re->states_cap * 2;
+        re->states = safeRealloc(re->states, sizeof(RegexDfaState) * re->states_cap);
+        re->trans = safeRealloc(re->trans, sizeof(int) * 256 * re->states_cap);
+        re->eol_match = safeRealloc(re->eol_match, re->states_cap);
+    }
+    if (re->pool_len + num_pcs > re->pool_cap) {
+        re->pool_cap = (re->pool_len + num_pcs) * 2;
+        re->pool = safeRealloc(re->pool, sizeof(int) * re->pool_cap);
+    }
+
+    int id = re->num_states++;
+    memcpy(re->pool + re->pool_len, pcs, sizeof(int) * num_pcs);
+    re->states[id] = (RegexDfaState){ re->pool_len, num_pcs, flags, hash, -1, {0} };
+    re->pool_len += num_pcs;
+    for (int c = 0; c < 256; c++)
+        re->trans[id * 256 + c] = RX_UNKNOWN;
+    re->eol_match[id] = -1;
+    re->table[slot] = id;
+    return id;
+}
+
+int regexDfaStep(Regex *re, int state, int c) {
+    RegexDfaState *st = &re->states[state];
+    bool matched;
+    int count = regexClosure(re, re->pool + st->pcs, st->num_pcs, st->flags, c, re->list, &matched);
+    if (matched) {
+        re->trans[state * 256 + c] = RX_MATCHED;
+        return RX_MATCHED;
+    }
+
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        const uint32_t *set = re->sets[re->prog[re->list[i]].x];
+        if (set[c >> 5] & (1u << (c & 31)))
+            re->step[next++] = re->list[i] + 1;
+    }
+    qsort(re->step, next, sizeof(int), regexCompareInts);
+
+    unsigned epoch = re->epoch;
+    int target = regexDfaState(re, re->step, next, regexFlagsBefore(re, c));
+    if (re->epoch == epoch)
+        re->trans[state * 256 + c] = re->states[target].accel_len > 0 ? RX_ACCEL_BASE - target : target;
+    return target;
+}
+
+void regexDfaAccel(Regex *re, int state) {
+    // a state that loops on itself for all but a few bytes can skip straight to the next of them
+    uint8_t bytes[RX_MAX_ACCEL];
+    int count = 0;
+    unsigned epoch = re->epoch;
+    re->states[state].accel_len = 0;
+    bytes[count++] = '\n';
+    for (int c = 0; c < 256; c++) {
+        if (c == '\n') continue;
+        int next = re->trans[state * 256 + c];
+        if (next == RX_UNKNOWN) next = regexDfaStep(re, state, c);
+        if (re->epoch != epoch) return;
+        if (next == state) continue;
+        if (count == RX_MAX_ACCEL) return;
+        bytes[count++] = (uint8_t)c;
+    }
+
+    re->states[state].accel_len = count;
+    memcpy(re->states[state].accel, bytes, count);
+    for (int c = 0; c < 256; c++) {
+        if (re->trans[state * 256 + c] == state)
+            re->trans[state * 256 + c] = RX_ACCEL_BASE - state;
+    }
+}
+
+int regexDfaAccelState(Regex *re, int state) {
+    uint8_t flags = re->states[state].flags;
+    unsigned epoch = re->epoch;
+    regexDfaAccel(re, state);
+    if (re->epoch != epoch) {
+        // the cache filled up while probing the bytes, go without the skip
+        state = regexDfaState(re, re->step, 0, flags);
+        re->states[state].accel_len = 0;
+    }
+    return state;
+}
+
+int regexDfaStart(Regex *re, uint8_t flags) {
+    if (re->start_states[flags] < 0) {
+        int state = regexDfaState(re, re->step, 0, flags);
+        if (re->states[state].accel_len < 0) state = regexDfaAccelState(re, state);
+        re->start_states[flags] = state;
+    }
+    return re->start_states[flags];
+}
+
+size_t regexAccelScan(const uint8_t *accel, int count, const unsigned char *hay, size_t len) {
+    if (count == 1) {
+        const unsigned char *hit = memchr(hay, accel[0], len);
+        return hit ? (size_t)(hit - hay) : len;
+    }
+
+    uint8_t last = accel[count - 1];
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i b0 = _mm_set1_epi8((char)accel[0]);
+    __m128i b1 = _mm_set1_epi8((char)accel[1]);
+    __m128i b2 = _mm_set1_epi8((char)last);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, b0), _mm_cmpeq_epi8(block, b1)), _mm_cmpeq_epi8(block, b2));
+        unsigned mask = _mm_movemask_epi8(hits);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (hay[i] == accel[0] || hay[i] == accel[1] || hay[i] == last)
+            return i;
+    }
+    return len;
+}
+
+bool regexDfaEolMatch(Regex *re, int state) {
+    if (re->eol_match[state] < 0) {
+        RegexDfaState *st = &re->states[state];
+        bool matched;
+        regexClosure(re, re->pool + st->pcs, st->num_pcs, st->flags, RX_END, re->list, &matched);
+        re->eol_match[state] = matched;
+    }
+    return re->eol_match[state];
+}
+
+size_t regexDfaFindEnd(Regex *re, PieceTable *pt, size_t pos, size_t limit, size_t *seg_start) {
+    size_t piece_idx, piece_offset;
+    *seg_start = pos;
+    if (!ptFindPiece(pt, pos, &piece_idx, &piece_offset)) return SIZE_MAX;
+
+    int state = regexDfaStart(re, regexFlagsAt(re, pt, pos));
+    size_t piece_start = pos - piece_offset;
+    for (; piece_idx < pt->num_pieces; piece_idx++, piece_offset = 0) {
+        Piece p = pt->pieces[piece_idx];
+        const unsigned char *base = (const unsigned char *)((p.source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf) + p.start;
+        const int *trans = re->trans;
+        size_t i = piece_offset;
+        if (re->states[state].accel_len > 0) {
+            i += regexAccelScan(re->states[state].accel, re->states[state].accel_len, base + i, p.length - i);
+            *seg_start = piece_start + i;
+        }
+
+        for (; i < p.length; i++) {
+            int c = base[i];
+            int next = trans[state * 256 + c];
+            if (next >= 0) {
+                state = next;
+                continue;
+            }
+
+            // newlines always take this path, they end every thread and the scan window
+            size_t at = piece_start + i;
+            if (c == '\n') {
+                if (regexDfaEolMatch(re, state)) return at;
+                if (at + 1 >= limit) return SIZE_MAX;
+                state = regexDfaStart(re, regexFlagsBefore(re, '\n'));
+                *seg_start = at + 1;
+            } else {
+                if (next == RX_UNKNOWN) next = regexDfaStep(re, state, c);
+                else if (next <= RX_ACCEL_BASE) next = RX_ACCEL_BASE - next;
+                if (next == RX_MATCHED) return at;
+                state = next;
+            }
+            // a start state has no threads, no match can begin before the next byte that leaves it
+            if (re->states[state].num_pcs == 0 && re->states[state].accel_len < 0)
+                state = regexDfaAccelState(re, state);
+            trans = re->trans;
+            RegexDfaState *st = &re->states[state];
+            if (st->accel_len > 0) {
+                i += regexAccelScan(st->accel, st->accel_len, base + i + 1, p.length - i - 1);
+                *seg_start = piece_start + i + 1;
+            }
+        }
+        piece_start += p.length;
+    }
+    return regexDfaEolMatch(re, state) ? pt->logical_size : SIZE_MAX;
+}
+
+void regexAddThread(Regex *re, int *list, int *count, size_t *list_caps, int pc, size_t *caps, size_t pos, uint8_t flags, int next) {
+    if (re->marks[pc] == re->mark_gen) return;
+    re->marks[pc] = re->mark_gen;
+
+    RegexInst *in = &re->prog[pc];
+    switch (in->op) {
+        case RX_JMP:
+            regexAddThread(re, list, count, list_caps, in->x, caps, pos, flags, next);
+            return;
+        case RX_SPLIT:
+            regexAddThread(re, list, count, list_caps, in->x, caps, pos, flags, next);
+            regexAddThread(re, list, count, list_caps, in->y, caps, pos, flags, next);
+            return;
+        case RX_SAVE: {
+            size_t saved = caps[in->x];
+            caps[in->x] = pos;
+            regexAddThread(re, list, count, list_caps, pc + 1, caps, pos, flags, next);
+            caps[in->x] = saved;
+            return;
+        }
+        case RX_BOL:
+            if (flags & RX_PREV_NL) regexAddThread(re, list, count, list_caps, pc + 1, caps, pos, flags, next);
+            return;
+        case RX_EOL:
+            if (next == '\n' || next == RX_END) regexAddThread(re, list, count, list_caps, pc + 1, caps, pos, flags, next);
+            return;
+        case RX_WORDB:
+        case RX_NWORDB: {
+            bool boundary = ((flags & RX_PREV_WORD) != 0) != regexIsWord(next);
+            if (boundary == (in->op == RX_WORDB)) regexAddThread(re, list, count, list_caps, pc + 1, caps, pos, flags, next);
+            return;
+        }
+        default: {
+            int slots = 2 * re->num_groups;
+            list[*count] = pc;
+            memcpy(&list_caps[*count * slots], caps, sizeof(size_t) * slots);
+            (*count)++;
+            return;
+        }
+    }
+}
+
+bool regexPike(Regex *re, PieceTable *pt, size_t start, size_t last_start, size_t *caps) {
+    int slots = 2 * re->num_groups;
+    int *clist = re->threads[0], *nlist = re->threads[1];
+    size_t *ccaps = re->thread_caps[0], *ncaps = re->thread_caps[1];
+    int ccount = 0;
+    bool matched = false;
+
+    size_t seed[2 * RX_MAX_GROUPS];
+    PieceCursor cur;
+    ptCursorInit(&cur, pt, start);
+    uint8_t flags = regexFlagsAt(re, pt, start);
+    int c = ptCursorNext(&cur);
+    size_t pos = start;
+    regexNextMark(re);
+
+    while (true) {
+        // threads seeded later have lower priority, so the leftmost start wins
+        if (!matched && pos <= last_start) {
+            for (int i = 0; i < slots; i++) seed[i] = SIZE_MAX;
+            regexAddThread(re, clist, &ccount, ccaps, 0, seed, pos, flags, c);
+        }
+        if (ccount == 0 && (matched || pos >= last_start)) break;
+
+        bool line_end = c == '\n' || c == RX_END;
+        int next = line_end ? RX_END : ptCursorNext(&cur);
+        uint8_t next_flags = regexFlagsBefore(re, c);
+        int ncount = 0;
+        regexNextMark(re);
+        for (int t = 0; t < ccount; t++) {
+            RegexInst *in = &re->prog[clist[t]];
+            if (in->op == RX_MATCH) {
+                memcpy(caps, &ccaps[t * slots], sizeof(size_t) * slots);
+                matched = true;
+                break;
+            }
+            if (!line_end && (re->sets[in->x][c >> 5] & (1u << (c & 31))))
+                regexAddThread(re, nlist, &ncount, ncaps, clist[t] + 1, &ccaps[t * slots], pos + 1, next_flags, next);
+        }
+        if (line_end) break;
+
+        int *tmp_list = clist; clist = nlist; nlist = tmp_list;
+        size_t *tmp_caps = ccaps; ccaps = ncaps; ncaps = tmp_caps;
+        ccount = ncount;
+        flags = next_flags;
+        c = next;
+        pos++;
+    }
+    return matched;
+}
+
+size_t regexSearch(PieceTable *pt, Regex *re, size_t from, size_t limit, SearchEmitFn emit, void *ctx) {
+    if (pt->offsets_dirty) ptRebuildOffsets(pt);
+    if (limit > pt->logical_size) limit = pt->logical_size;
+
+    size_t caps[2 * RX_MAX_GROUPS];
+    size_t count = 0;
+    size_t pos = from;
+    while (pos < limit) {
+        size_t seg_start;
+        size_t end = regexDfaFindEnd(re, pt, pos, limit, &seg_start);
+        if (end == SIZE_MAX) break;
+
+        // the leftmost match starts between the last point the dfa held no threads and the earliest end
+        if (!regexPike(re, pt, seg_start, end, caps)) {
+            pos = end + 1;
+            continue;
+        }
+        if (caps[0] >= limit) break;
+        if (caps[1] == caps[0]) {
+            pos = caps[0] + 1;
+            continue;
+        }
+
+        count++;
+        pos = caps[1];
+        if (emit && !emit(caps[0], ctx)) break;
+    }
+    return count;
+}
+
+char *regexExpand(Regex *re, PieceTable *pt, size_t start, const char *replacement, size_t *out_len) {
+    size_t caps[2 * RX_MAX_GROUPS];
+    if (!regexPike(re, pt, start, start, caps)) {
+        for (int i = 0; i < 2 * RX_MAX_GROUPS; i++) caps[i] = SIZE_MAX;
+        caps[0] = caps[1] = start;
+    }
+
+    size_t capacity = strlen(replacement) + BUFFER_SIZE_PADDING;
+    size_t len = 0;
+    char *out = safeMalloc(capacity);
+    for (const char *r = replacement; *r; r++) {
+        const char *piece = r;
+        size_t piece_len = 1;
+        size_t group_start = 0;
+        bool from_buffer = false;
+        char escaped;
+        if (*r == '\\' && r[1] != '\0') {
+            r++;
+            if (*r >= '0' && *r <= '9') {
+                int group = *r - '0';
+                if (group >= re->num_groups || caps[2 * group] == SIZE_MAX || caps[2 * group + 1] == SIZE_MAX) continue;
+                group_start = caps[2 * group];
+                piece_len = caps[2 * group + 1] - group_start;
+                from_buffer = true;
+            } else {
+                escaped = (*r == 'n') ? '\n' : (*r == 't') ? '\t' : *r;
+                piece = &escaped;
+            }
+        }
+
+        if (len + piece_len + 1 > capacity) {
+            capacity = (len + piece_len + 1) * 2;
+            out = safeRealloc(out, capacity);
+        }
+        if (from_buffer) ptReadLogical(pt, group_start, piece_len, out + len);
+        else memcpy(out + len, piece, piece_len);
+        len += piece_len;
+    }
+    out[len] = '\0';
+    *out_len = len;
+    return out;
+}
+
+void matchStoreClear(MatchStore *ms) {
+    for (int b = 0; b < ms->num_blocks; b++)
+        free(ms->blocks[b].deltas);
+    free(ms->blocks);
+    memset(ms, 0, sizeof(MatchStore));
+}
+
+void matchStoreRenumber(MatchStore *ms, int from_block) {
+    matchStoreSettle(ms, ms->num_blocks - 1);
+    int first = from_block > 0 ? ms->blocks[from_block - 1].first + ms->blocks[from_block - 1].count : 0;
+    for (int b = from_block; b < ms->num_blocks; b++) {
+        ms->blocks[b].first = first;
+        first += ms->blocks[b].count;
+    }
+    ms->total = first;
+}
+
+void matchStoreSettle(MatchStore *ms, int block) {
+    // pays what the blocks up to this one owe, the rest keeps owing
+    while (ms->owed_from <= block) {
+        MatchBlock *blk = &ms->blocks[ms->owed_from++];
+        blk->first_offset += ms->owed_offset;
+        blk->last_offset += ms->owed_offset;
+        blk->first += ms->owed_first;
+    }
+}
+
+void matchStoreDefer(MatchStore *ms, int from_block, long offset_delta, int first_delta) {
+    // every block from from_block on moves, only the blocks between this edit and the last one are touched
+    if (from_block >= ms->num_blocks || (offset_delta == 0 && first_delta == 0)) return;
+    if (from_block >= ms->owed_from) {
+        matchStoreSettle(ms, from_block - 1);
+    } else {
+        for (int b = from_block; b < ms->owed_from; b++) {
+            ms->blocks[b].first_offset += offset_delta;
+            ms->blocks[b].last_offset += offset_delta;
+            ms->blocks[b].first += first_delta;
+        }
+    }
+    ms->owed_offset += offset_delta;
+    ms->owed_first += first_delta;
+}
+
+size_t matchStoreFirstOffset(const MatchStore *ms, int block) {
+    return ms->blocks[block].first_offset + (block >= ms->owed_from ? ms->owed_offset : 0);
+}
+
+size_t matchStoreLastOffset(const MatchStore *ms, int block) {
+    return ms->blocks[block].last_offset + (block >= ms->owed_from ? ms->owed_offset : 0);
+}
+
+int matchStoreFirstIndex(const MatchStore *ms, int block) {
+    return ms->blocks[block].first + (block >= ms->owed_from ? ms->owed_first : 0);
+}
+
+void matchBlockPutByte(MatchBlock *blk, uint8_t byte) {
+    if (blk->bytes >= blk->capacity) {
+        blk->capacity = blk->capacity == 0 ? BUFFER_SIZE_128 : blk->capacity * 2;
+        blk->deltas = safeRealloc(blk->deltas, blk->capacity);
+    }
+    blk->deltas[blk->bytes++] = byte;
+}
+
+void matchBlockPutGap(MatchBlock *blk, size_t gap) {
+    // 7 bits per byte, high bit set on every byte but the last
+    while (gap >= 0x80) {
+        matchBlockPutByte(blk, (uint8_t)(gap | 0x80));
+        gap >>= 7;
+    }
+    matchBlockPutByte(blk, (uint8_t)gap);
+}
+
+size_t matchBlockNextGap(const MatchBlock *blk, int *pos) {
+    size_t gap = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = blk->deltas[(*pos)++];
+        gap |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return gap;
+}
+
+int matchBlockDecode(const MatchBlock *blk, size_t *out) {
+    if (blk->count == 0) return 0;
+    int pos = 0;
+    out[0] = blk->first_offset;
+    for (int i = 1; i < blk->count; i++)
+        out[i] = out[i - 1] + matchBlockNextGap(blk, &pos);
+    return blk->count;
+}
+
+void matchBlockEncode(MatchBlock *blk, const size_t *offsets, int count) {
+    blk->count = count;
+    blk->bytes = 0;
+    if (count == 0) return;
+    blk->first_offset = offsets[0];
+    blk->last_offset = offsets[count - 1];
+    for (int i = 1; i < count; i++)
+        matchBlockPutGap(blk, offsets[i] - offsets[i - 1]);
+}
+
+int matchStoreBlockOf(MatchStore *ms, int idx) {
+    int lo = 0, hi = ms->num_blocks - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (matchStoreFirstIndex(ms, mid) <= idx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+size_t matchStoreGet(MatchStore *ms, int idx) {
+    int b = matchStoreBlockOf(ms, idx);
+    MatchBlock *blk = &ms->blocks[b];
+    int k = idx - matchStoreFirstIndex(ms, b);
+    if (k == blk->count - 1) return matchStoreLastOffset(ms, b);
+
+    size_t offset = matchStoreFirstOffset(ms, b);
+    int pos = 0;
+    for (int i = 0; i < k; i++)
+        offset += matchBlockNextGap(blk, &pos);
+    return offset;
+}
+
+int matchStoreLowerBound(MatchStore *ms, size_t offset) {
+    // first block whose last entry reaches the offset
+    int lo = 0, hi = ms->num_blocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (matchStoreLastOffset(ms, mid) < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == ms->num_blocks) return ms->total;
+
+    MatchBlock *blk = &ms->blocks[lo];
+    size_t cur = matchStoreFirstOffset(ms, lo);
+    int pos = 0;
+    int k = 0;
+    while (cur < offset) {
+        cur += matchBlockNextGap(blk, &pos);
+        k++;
+    }
+    return matchStoreFirstIndex(ms, lo) + k;
+}
+
+MatchBlock *matchStoreNewBlock(MatchStore *ms, int at) {
+    if (ms->num_blocks >= ms->capacity) {
+        ms->capacity = ms->capacity == 0 ? BUFFER_SIZE_32 : ms->capacity * 2;
+        ms->blocks = safeRealloc(ms->blocks, sizeof(MatchBlock) * ms->capacity);
+    }
+    // the new block is filled in with its real offsets, so it has to land in front of the owing ones
+    matchStoreSettle(ms, at - 1);
+    memmove(&ms->blocks[at + 1], &ms->blocks[at], sizeof(MatchBlock) * (ms->num_blocks - at));
+    ms->num_blocks++;
+    ms->owed_from++;
+
+    MatchBlock *blk = &ms->blocks[at];
+    memset(blk, 0, sizeof(MatchBlock));
+    return blk;
+}
+
+void matchStoreAppend(MatchStore *ms, size_t offset) {
+    int b = ms->num_blocks - 1;
+    MatchBlock *blk = b >= 0 ? &ms->blocks[b] : NULL;
+    if (!blk || blk->count >= MATCH_BLOCK_SIZE) {
+        int first = ms->total;
+        blk = matchStoreNewBlock(ms, ms->num_blocks);
+        blk->first = first;
+        blk->first_offset = offset;
+        blk->last_offset = offset;
+    } else {
+        size_t last = matchStoreLastOffset(ms, b);
+        matchBlockPutGap(blk, offset - last);
+        blk->last_offset += offset - last;
+    }
+    blk->count++;
+    ms->total++;
+}
+
+void matchStoreInsert(MatchStore *ms, size_t offset) {
+    if (ms->num_blocks == 0 || offset > matchStoreLastOffset(ms, ms->num_blocks - 1)) {
+        matchStoreAppend(ms, offset);
+        return;
+    }
+
+    // first block whose last entry lies after the offset
+    int lo = 0, hi = ms->num_blocks - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (matchStoreLastOffset(ms, mid) < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    int b = lo;
+
+    size_t offsets[2 * MATCH_BLOCK_SIZE];
+    matchStoreSettle(ms, b);
+    MatchBlock *blk = &ms->blocks[b];
+    int count = matchBlockDecode(blk, offsets);
+    int pos = 0;
+    while (pos < count && offsets[pos] < offset) pos++;
+    memmove(&offsets[pos + 1], &offsets[pos], sizeof(size_t) * (count - pos));
+    offsets[pos] = offset;
+    count++;
+
+    // keep blocks small so re-encoding stays cheap
+    int next = b + 1;
+    if (count >= 2 * MATCH_BLOCK_SIZE) {
+        int half = count / 2;
+        MatchBlock *tail = matchStoreNewBlock(ms, b + 1);
+        blk = &ms->blocks[b];
+        matchBlockEncode(tail, offsets + half, count - half);
+        tail->first = blk->first + half;
+        count = half;
+        next = b + 2;
+    }
+    matchBlockEncode(blk, offsets, count);
+    matchStoreDefer(ms, next, 0, 1);
+    ms->total++;
+}
+
+void matchStoreRemoveRange(MatchStore *ms, size_t lo_offset, size_t hi_offset) {
+    int i = matchStoreLowerBound(ms, lo_offset);
+    int remaining = matchStoreLowerBound(ms, hi_offset) - i;
+    if (remaining <= 0) return;
+
+    size_t offsets[2 * MATCH_BLOCK_SIZE];
+    int b = matchStoreBlockOf(ms, i);
+    int from = i - matchStoreFirstIndex(ms, b);
+    int removed = remaining;
+    while (remaining > 0) {
+        matchStoreSettle(ms, b);
+        MatchBlock *blk = &ms->blocks[b];
+        int n = (blk->count - from < remaining) ? blk->count - from : remaining;
+        remaining -= n;
+
+        if (n == blk->count) {
+            free(blk->deltas);
+            memmove(&ms->blocks[b], &ms->blocks[b + 1], sizeof(MatchBlock) * (ms->num_blocks - b - 1));
+            ms->num_blocks--;
+            ms->owed_from--;
+        } else {
+            int count = matchBlockDecode(blk, offsets);
+            memmove(&offsets[from], &offsets[from + n], sizeof(size_t) * (count - from - n));
+            matchBlockEncode(blk, offsets, count - n);
+            blk->first = i - from;
+            b++;
+        }
+        from = 0;
+    }
+    matchStoreDefer(ms, b, 0, -removed);
+    ms->total -= removed;
+}
+
+void matchStoreShift(MatchStore *ms, size_t from_offset, long delta) {
+    if (delta == 0) return;
+    int i = matchStoreLowerBound(ms, from_offset);
+    if (i >= ms->total) return;
+
+    int b = matchStoreBlockOf(ms, i);
+    matchStoreSettle(ms, b);
+    MatchBlock *blk = &ms->blocks[b];
+    int k = i - blk->first;
+    if (k == 0) {
+        blk->first_offset += delta;
+        blk->last_offset += delta;
+    } else {
+        // only the gap in front of the first shifted entry changes
+        size_t offsets[2 * MATCH_BLOCK_SIZE];
+        int count = matchBlockDecode(blk, offsets);
+        for (int r = k; r < count; r++)
+            offsets[r] += delta;
+        matchBlockEncode(blk, offsets, count);
+    }
+    matchStoreDefer(ms, b + 1, delta, 0);
+}
+
+void matchStorePrepend(MatchStore *ms, MatchStore *head) {
+    if (head->num_blocks == 0) {
+        matchStoreClear(head);
+        return;
+    }
+
+    matchStoreSettle(ms, ms->num_blocks - 1);
+    matchStoreSettle(head, head->num_blocks - 1);
+    int needed = ms->num_blocks + head->num_blocks;
+    if (needed > ms->capacity) {
+        ms->capacity = needed;
+        ms->blocks = safeRealloc(ms->blocks, sizeof(MatchBlock) * ms->capacity);
+    }
+    memmove(&ms->blocks[head->num_blocks], &ms->blocks[0], sizeof(MatchBlock) * ms->num_blocks);
+    memcpy(&ms->blocks[0], head->blocks, sizeof(MatchBlock) * head->num_blocks);
+    ms->num_blocks = needed;
+    ms->owed_from = needed;
+    matchStoreRenumber(ms, 0);
+
+    // the blocks now belong to ms, only the array goes
+    free(head->blocks);
+    memset(head, 0, sizeof(MatchStore));
+}
+
+void matchStoreRefine(MatchStore *dst, MatchStore *src, PieceTable *pt, const char *query, size_t query_len, size_t known_len, bool ignore_case) {
+    if (pt->offsets_dirty) ptRebuildOffsets(pt);
+    matchStoreSettle(src, src->num_blocks - 1);
+
+    char *window = safeMalloc(query_len + 1);
+    size_t offsets[2 * MATCH_BLOCK_SIZE];
+    size_t p_idx = 0;
+    size_t last_end = 0;
+    for (int b = 0; b < src->num_blocks; b++) {
+        int count = matchBlockDecode(&src->blocks[b], offsets);
+        for (int r = 0; r < count; r++) {
+            size_t pos = offsets[r];
+            if (pos < last_end) continue;
+            if (pos + query_len > pt->logical_size) goto done;
+
+            // the first known_len bytes already matched, only the new tail needs checking
+            size_t tail = pos + known_len;
+            while (p_idx + 1 < pt->num_pieces && pt->piece_offsets[p_idx + 1] <= tail) p_idx++;
+            Piece *p = &pt->pieces[p_idx];
+            size_t in_piece = tail - pt->piece_offsets[p_idx];
+            size_t tail_len = query_len - known_len;
+            const char *bytes;
+            if (in_piece + tail_len <= p->length) {
+                bytes = ((p->source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf) + p->start + in_piece;
+            } else {
+                ptReadLogical(pt, tail, tail_len, window);
+                bytes = window;
+            }
+
+            bool equal = ignore_case ? searchEqualFold(bytes, query + known_len, tail_len) : memcmp(bytes, query + known_len, tail_len) == 0;
+            if (equal) {
+                matchStoreAppend(dst, pos);
+                last_end = pos + query_len;
+            }
+        }
+    }
+
+done:
+    free(window);
+}
+
+void editorFindSelectFrom(size_t offset) {
+    int idx = matchStoreLowerBound(&E.find.matches, offset);
+    if (idx >= E.find.matches.total) {
+        // the match after the offset may still be found by the scan
+        if (E.find.scanning) return;
+        idx = E.find.matches.total > 0 ? 0 : -1;
+    }
+    E.find.current_idx = idx;
+    if (idx >= 0) editorCenterViewOnMatch();
+}
+
+void editorFindStartScan(const char *query) {
+    editorFindStopScan();
+    matchStoreClear(&E.find.matches);
+    E.find.current_idx = -1;
+
+    // start at the top of the viewport so the visible matches arrive first
+    size_t cursor_offset = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
+    size_t origin = cursor_offset;
+    if (E.view.row_offset < E.buf.num_lines && E.buf.line_offsets[E.view.row_offset] < origin)
+        origin = E.buf.line_offsets[E.view.row_offset];
+
+    // regex slices are cut at line starts, nothing can match across one
+    if (E.find.use_query) {
+        // an edit dropped the tree, queries need a current one
+        if (!E.ts.tree) editorParseTreeSitter();
+    } else if (E.find.use_regex) {
+        int row = E.cursor.y < E.view.row_offset ? E.cursor.y : E.view.row_offset;
+        origin = row < E.buf.num_lines ? E.buf.line_offsets[row] : 0;
+    } else {
+        searchCompile(&E.find.scan_pattern, query, strlen(query), E.find.ignore_case, E.find.whole_word);
+    }
+    E.find.scan_cursor = cursor_offset;
+    E.find.scan_origin = origin;
+    E.find.scan_pos = origin;
+    E.find.scan_wrapped = false;
+    E.find.scanning = true;
+    editorFindScanStep(SCAN_SLICE_MS);
+}
+
+void editorFindStopScan() {
+    E.find.scanning = false;
+    matchStoreClear(&E.find.scan_head);
+}
+
+void editorFindMergeScan() {
+    MatchStore *tail = &E.find.matches;
+    MatchStore *head = &E.find.scan_head;
+    size_t m = E.find.scan_pattern.len;
+    size_t current = E.find.current_idx >= 0 ? matchStoreGet(tail, E.find.current_idx) : SIZE_MAX;
+
+    if (head->total > 0) {
+        // a match running over the origin can shadow the first matches after it, rescan until both chains meet
+        size_t last_end = matchStoreLastOffset(head, head->num_blocks - 1) + m;
+        int i = 0;
+        while (!E.find.use_regex && !E.find.use_query && i < tail->total && matchStoreGet(tail, i) < last_end) {
+            size_t pos = SIZE_MAX;
+            ptSearch(&E.buf.pt, &E.find.scan_pattern, last_end, E.buf.pt.logical_size, searchFirstHit, &pos);
+            matchStoreRemoveRange(tail, matchStoreGet(tail, i), pos);
+            if (pos == SIZE_MAX || (i < tail->total && matchStoreGet(tail, i) == pos)) break;
+
+            matchStoreInsert(tail, pos);
+            i++;
+            last_end = pos + m;
+        }
+        matchStorePrepend(tail, head);
+    }
+    E.find.scanning = false;
+
+    if (current != SIZE_MAX) {
+        E.find.current_idx = matchStoreLowerBound(tail, current);
+        if (E.find.current_idx >= tail->total) E.find.current_idx = tail->total - 1;
+    }
+}
+
+bool editorFindScanStep(long budget_ms) {
+    if (!E.find.scanning) return false;
+
+    PieceTable *pt = &E.buf.pt;
+    size_t m = E.find.scan_pattern.len;
+    int threads = editorSearchThreads();
+    size_t slice = (size_t)SEARCH_PARALLEL_MIN * threads;
+    int found_before = E.find.matches.total + E.find.scan_head.total;
+    SearchPattern newline_pattern;
+    searchCompile(&newline_pattern, "\n", 1, false, false);
+    long start = currentMillis();
+    do {
+        // first from the origin to the end, then wrap around and scan up to the origin
+        MatchStore *dst = E.find.scan_wrapped ? &E.find.scan_head : &E.find.matches;
+        size_t end = E.find.scan_wrapped ? E.find.scan_origin : pt->logical_size;
+        // an edit may have moved the scan up to the end of its stretch already
+        if (E.find.scan_pos < end) {
+            size_t slice_end = end - E.find.scan_pos > slice ? E.find.scan_pos + slice : end;
+            if (E.find.use_query) {
+                // captures are assigned to the slice holding their start, so each is reported once
+                if (slice_end - E.find.scan_pos > FIND_QUERY_SLICE) slice_end = E.find.scan_pos + FIND_QUERY_SLICE;
+                editorFindQueryRange(E.find.scan_pos, slice_end, dst);
+                E.find.scan_pos = slice_end;
+            } else if (E.find.use_regex) {
+                // end the slice on a line start so no match runs over it, regex slices stay on this thread
+                if (slice_end < end) {
+                    size_t newline = SIZE_MAX;
+                    ptSearch(pt, &newline_pattern, slice_end, end, searchFirstHit, &newline);
+                    slice_end = newline == SIZE_MAX ? end : newline + 1;
+                }
+                regexSearch(pt, &E.find.regex, E.find.scan_pos, slice_end, editorAppendMatch, dst);
+                E.find.scan_pos = slice_end;
+            } else {
+                size_t to = slice_end + (m - 1) < pt->logical_size ? slice_end + (m - 1) : pt->logical_size;
+                ptSearchParallel(pt, &E.find.scan_pattern, E.find.scan_pos, to, threads, editorAppendMatch, dst);
+
+                // the next slice continues the chain after the last match
+                E.find.scan_pos = slice_end;
+                if (dst->total > 0 && matchStoreLastOffset(dst, dst->num_blocks - 1) + m > slice_end)
+                    E.find.scan_pos = matchStoreLastOffset(dst, dst->num_blocks - 1) + m;
+            }
+        }
+
+        if (E.find.scan_pos >= end) {
+            if (!E.find.scan_wrapped && E.find.scan_origin > 0) {
+                E.find.scan_wrapped = true;
+                E.find.scan_pos = 0;
+            } else {
+                editorFindMergeScan();
+            }
+        }
+    } while (E.find.scanning && currentMillis() - start < budget_ms);
+
+    bool selected = false;
+    if (E.find.current_idx < 0) {
+        editorFindSelectFrom(E.find.scan_cursor);
+        selected = E.find.current_idx >= 0;
+    }
+    return selected || !E.find.scanning || E.find.matches.total + E.find.scan_head.total != found_before;
+}
+
+void editorFindFinishScan() {
+    if (E.find.scanning)
+        editorFindScanStep(LONG_MAX);
+}
+
+void editorClearPrefixCache() {
+    for (int i = 0; i < E.find.num_prefixes; i++)
+        matchStoreClear(&E.find.prefixes[i].matches);
+    E.find.num_prefixes = 0;
+    E.find.prefix_entries = 0;
+}
+
+void editorUpdateMatchList(const char *prev, const char *query) {
+    // a list the scan has not finished yet cannot seed a refinement
+    bool complete = !E.find.scanning;
+    editorFindStopScan();
+
+    if (E.find.use_regex || E.find.use_query) {
+        // a regex or a tree query cannot be refined from the list of its prefix, every change rescans
+        editorClearPrefixCache();
+        matchStoreClear(&E.find.matches);
+        E.find.current_idx = -1;
+        if (E.find.use_query ? editorFindCompileQuery(query) : editorFindCompileRegex(query)) editorFindStartScan(query);
+        if (!E.find.scanning)
+            editorFindSelectFrom(editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x));
+        return;
+    }
+
+    size_t len = strlen(query);
+    size_t common = 0;
+    if (prev) {
+        while (prev[common] && prev[common] == query[common])
+            common++;
+    }
+
+    // only lists for prefixes of the new query stay useful
+    while (E.find.num_prefixes > 0 && E.find.prefixes[E.find.num_prefixes - 1].query_len > common) {
+        PrefixMatches *top = &E.find.prefixes[--E.find.num_prefixes];
+        E.find.prefix_entries -= top->matches.total;
+        matchStoreClear(&top->matches);
+    }
+
+    if (complete && prev && prev[common] == '\0' && common < len) {
+        // the query grew, the current list becomes the cached list of its prefix
+        if (E.find.num_prefixes >= E.find.prefix_capacity) {
+            E.find.prefix_capacity = E.find.prefix_capacity == 0 ? BUFFER_SIZE_32 : E.find.prefix_capacity * 2;
+            E.find.prefixes = safeRealloc(E.find.prefixes, sizeof(PrefixMatches) * E.find.prefix_capacity);
+        }
+        PrefixMatches *entry = &E.find.prefixes[E.find.num_prefixes++];
+        entry->query_len = common;
+        entry->matches = E.find.matches;
+        E.find.prefix_entries += entry->matches.total;
+        memset(&E.find.matches, 0, sizeof(MatchStore));
+    } else {
+        matchStoreClear(&E.find.matches);
+    }
+
+    PrefixMatches *top = E.find.num_prefixes > 0 ? &E.find.prefixes[E.find.num_prefixes - 1] : NULL;
+    if (top && top->query_len == len) {
+        // backspace onto a prefix that was already searched
+        E.find.matches = top->matches;
+        E.find.prefix_entries -= top->matches.total;
+        E.find.num_prefixes--;
+    } else if (top && !E.find.whole_word && !searchHasBorder(query, top->query_len, E.find.ignore_case)) {
+        // a prefix without a border never overlaps itself, so its list holds every occurrence
+        matchStoreRefine(&E.find.matches, &top->matches, &E.buf.pt, query, len, top->query_len, E.find.ignore_case);
+    } else {
+        editorFindStartScan(query);
+    }
+
+    // drop the shortest prefixes first, they hold the most matches
+    while (E.find.num_prefixes > 0 && E.find.prefix_entries > FIND_PREFIX_CACHE_LIMIT) {
+        PrefixMatches *bottom = &E.find.prefixes[0];
+        E.find.prefix_entries -= bottom->matches.total;
+        matchStoreClear(&bottom->matches);
+        memmove(&E.find.prefixes[0], &E.find.prefixes[1], sizeof(PrefixMatches) * (E.find.num_prefixes - 1));
+        E.find.num_prefixes--;
+    }
+
+    if (!E.find.scanning)
+        editorFindSelectFrom(editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x));
+}
+
+bool editorFindCompileRegex(const char *query) {
+    if (E.find.regex_ok) regexFree(&E.find.regex);
+    E.find.regex_ok = regexCompile(&E.find.regex, query, &E.find.regex_error);
+    if (E.find.regex_ok && E.find.ignore_case) regexFoldCase(&E.find.regex);
+    return E.find.regex_ok;
+}
+
+bool editorFindCompileQuery(const char *query) {
+    static const char *errors[] = {
+        [TSQueryErrorSyntax] = "syntax error", [TSQueryErrorNodeType] = "unknown node type",
+        [TSQueryErrorField] = "unknown field", [TSQueryErrorCapture] = "unknown capture",
+        [TSQueryErrorStructure] = "impossible pattern", [TSQueryErrorLanguage] = "language mismatch",
+    };
+    editorFindFreeQuery();
+    const TSLanguage *language = E.ts.parser ? ts_parser_language(E.ts.parser) : NULL;
+    if (!language) {
+        snprintf(E.find.query_error, sizeof(E.find.query_error), "no parser for this file");
+        return false;
+    }
+
+    uint32_t error_offset = 0;
+    TSQueryError error = TSQueryErrorNone;
+    E.find.ts_query = ts_query_new(language, query, (uint32_t)strlen(query), &error_offset, &error);
+    if (E.find.ts_query && ts_query_capture_count(E.find.ts_query) == 0) {
+        // a bare pattern matches its outermost node
+        size_t len = strlen(query);
+        char *captured = safeMalloc(len + BUFFER_SIZE_32);
+        snprintf(captured, len + BUFFER_SIZE_32, "%s @match", query);
+        ts_query_delete(E.find.ts_query);
+        E.find.ts_query = ts_query_new(language, captured, (uint32_t)strlen(captured), &error_offset, &error);
+        free(captured);
+    }
+    if (!E.find.ts_query) {
+        const char *name = error > TSQueryErrorNone && error <= TSQueryErrorLanguage ? errors[error] : "error";
+        snprintf(E.find.query_error, sizeof(E.find.query_error), "%s at offset %u", name, error_offset);
+        return false;
+    }
+    E.find.ts_cursor = ts_query_cursor_new();
+    return true;
+}
+
+void editorFindFreeQuery() {
+    if (E.find.ts_cursor) ts_query_cursor_delete(E.find.ts_cursor);
+    if (E.find.ts_query) ts_query_delete(E.find.ts_query);
+    E.find.ts_cursor = NULL;
+    E.find.ts_query = NULL;
+    E.find.query_error[0] = '\0';
+}
+
+int compareOffsets(const void *a, const void *b) {
+    size_t oa = *(const size_t *)a, ob = *(const size_t *)b;
+    return (oa > ob) - (oa < ob);
+}
+
+bool editorFindQueryRange(size_t from, size_t to, MatchStore *dst) {
+    if (!E.find.ts_query || !E.ts.tree) return false;
+
+    ts_query_cursor_set_byte_range(E.find.ts_cursor, (uint32_t)from, (uint32_t)to);
+    ts_query_cursor_exec(E.find.ts_cursor, E.find.ts_query, ts_tree_root_node(E.ts.tree));
+
+    // matches come in pattern order, their capture starts are sorted before they are appended
+    size_t *starts = NULL;
+    size_t count = 0, capacity = 0;
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(E.find.ts_cursor, &match)) {
+        if (!editorEvaluateMatchPredicates(E.find.ts_query, &match)) continue;
+        for (uint16_t c = 0; c < match.capture_count; c++) {
+            // captures named with a leading underscore only constrain the pattern
+            uint32_t name_len;
+            const char *name = ts_query_capture_name_for_id(E.find.ts_query, match.captures[c].index, &name_len);
+            if (name_len > 0 && name[0] == '_') continue;
+
+            size_t start = ts_node_start_byte(match.captures[c].node);
+            if (start < from || start >= to || ts_node_end_byte(match.captures[c].node) == start) continue;
+            if (count >= capacity) {
+                capacity = capacity == 0 ? BUFFER_SIZE_128 : capacity * 2;
+                starts = safeRealloc(starts, sizeof(size_t) * capacity);
+            }
+            starts[count++] = start;
+        }
+    }
+    if (count > 1) qsort(starts, count, sizeof(size_t), compareOffsets);
+
+    for (size_t i = 0; i < count; i++)
+        if (i == 0 || starts[i] != starts[i - 1])
+            editorAppendMatch(starts[i], dst);
+    free(starts);
+    return count > 0;
+}
+
+size_t editorFindQueryMatchLength(size_t offset) {
+    if (!E.find.ts_query || !E.ts.tree) return 0;
+
+    // only offsets are stored, the query is re-run on that byte and the widest capture starting there wins
+    ts_query_cursor_set_byte_range(E.find.ts_cursor, (uint32_t)offset, (uint32_t)offset + 1);
+    ts_query_cursor_exec(E.find.ts_cursor, E.find.ts_query, ts_tree_root_node(E.ts.tree));
+
+    size_t len = 0;
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(E.find.ts_cursor, &match)) {
+        if (!editorEvaluateMatchPredicates(E.find.ts_query, &match)) continue;
+        for (uint16_t c = 0; c < match.capture_count; c++) {
+            uint32_t name_len;
+            const char *name = ts_query_capture_name_for_id(E.find.ts_query, match.captures[c].index, &name_len);
+            if ((name_len > 0 && name[0] == '_') || ts_node_start_byte(match.captures[c].node) != offset) continue;
+
+            size_t end = ts_node_end_byte(match.captures[c].node);
+            if (end - offset > len) len = end - offset;
+        }
+    }
+    return len;
+}
+
+size_t editorFindMatchLength(size_t offset) {
+    if (E.find.use_query) return editorFindQueryMatchLength(offset);
+    if (!E.find.use_regex) return strlen(E.find.query);
+
+    // only offsets are stored, a regex match is re-run from its start to get its length
+    size_t caps[2 * RX_MAX_GROUPS];
+    return regexPike(&E.find.regex, &E.buf.pt, offset, offset, caps) ? caps[1] - caps[0] : 0;
+}
+
+void editorFindToggleRegex(const char *query) {
+    E.find.regex_error = NULL;
+    if (E.find.regex_ok) regexFree(&E.find.regex);
+    E.find.regex_ok = false;
+    // regex and tree query modes exclude each other
+    editorFindFreeQuery();
+    E.find.use_query = false;
+    editorFindToggleOption(query, &E.find.use_regex, "Regex search");
+}
+
+void editorFindToggleQuery(const char *query) {
+    E.find.regex_error = NULL;
+    if (E.find.regex_ok) regexFree(&E.find.regex);
+    E.find.regex_ok = false;
+    E.find.use_regex = false;
+    editorFindFreeQuery();
+    editorFindToggleOption(query, &E.find.use_query, "Tree query search");
+}
+
+void editorFindToggleOption(const char *query, bool *option, const char *name) {
+    *option = !*option;
+    // cached prefix lists were found with the other setting
+    editorClearPrefixCache();
+
+    if (query && query[0] != '\0') {
+        char *prev = E.find.query;
+        E.find.query = safeStrdup(query);
+        E.find.active = true;
+        editorUpdateMatchList(NULL, E.find.query);
+        free(prev);
+    } else {
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "%s %s", name, *option ? "on" : "off");
+        editorSetStatusMsg(msg);
+    }
+}
+
+bool editorFindModeKey(const char *query, int key) {
+    if (key == CTRL_KEY('t'))
+        editorFindToggleRegex(query);
+    else if (key == CTRL_KEY('n'))
+        editorFindToggleQuery(query);
+    else if (key == CTRL_KEY('k'))
+        editorFindToggleOption(query, &E.find.ignore_case, "Ignore case");
+    else if (key == CTRL_KEY('w'))
+        editorFindToggleOption(query, &E.find.whole_word, "Whole word");
+    else
+        return false;
+    return true;
+}
+
+bool editorInsertMatch(size_t offset, void *ctx) {
+    matchStoreInsert(ctx, offset);
+    return true;
+}
+
+void editorFindTrackEdit(size_t offset, size_t removed, size_t inserted) {
+    editorFindDropEdit(offset, removed, inserted);
+    editorFindRescanEdit(offset, inserted);
+}
+
+void editorFindDropRegion(MatchStore *ms, size_t *start, size_t *end, size_t lo, size_t offset, size_t removed, size_t inserted) {
+    // [start, end) is the stretch the store covers, a NULL bound reaches the edge of the text
+    size_t hi = offset + removed;
+    long delta = (long)inserted - (long)removed;
+    size_t margin = (E.find.whole_word || E.find.use_regex) ? 1 : 0;
+    if (end && lo >= *end) return;
+
+    matchStoreRemoveRange(ms, lo, hi);
+    matchStoreShift(ms, hi, delta);
+    if (start && hi + margin <= *start) {
+        // the edit is in front of the stretch, which just moves
+        *start += delta;
+        if (end) *end += delta;
+    } else if (start && lo < *start) {
+        // the edit eats into the start of the stretch, it now begins after the edit
+        size_t new_start = offset + inserted + margin;
+        if (E.find.use_regex) {
+            // a regex stretch starts on a line the edit left alone
+            int row, col;
+            editorOffsetToRowCol(&E.buf, offset + inserted, &row, &col);
+            new_start = row + 1 < E.buf.num_lines ? E.buf.line_offsets[row + 1] : E.buf.pt.logical_size;
+        }
+        if (new_start > E.buf.pt.logical_size) new_start = E.buf.pt.logical_size;
+        matchStoreRemoveRange(ms, 0, new_start);
+        if (!E.find.use_regex && !E.find.use_query) {
+            // the kept matches were chained from the old start, a dropped one may have shadowed
+            // a match right after the edit, so the stretch starts where that can no longer happen
+            size_t chained = new_start + strlen(E.find.query) - 1;
+            if (ms->total > 0 && matchStoreGet(ms, 0) < chained) chained = matchStoreGet(ms, 0);
+            new_start = chained < E.buf.pt.logical_size ? chained : E.buf.pt.logical_size;
+        }
+        if (end) *end = *end >= hi + margin ? *end + delta : new_start;
+        if (end && *end < new_start) *end = new_start;
+        *start = new_start;
+    } else if (end && hi + margin > *end) {
+        // the edit runs over the end of the stretch, the scan goes back to where it starts
+        matchStoreRemoveRange(ms, lo, SIZE_MAX);
+        *end = lo;
+        if (!E.find.use_regex && !E.find.use_query && ms->total > 0) {
+            size_t last_end = matchStoreLastOffset(ms, ms->num_blocks - 1) + strlen(E.find.query);
+            if (last_end > *end) *end = last_end;
+        }
+    } else if (end) {
+        *end += delta;
+    }
+}
+
+void editorFindDropEdit(size_t offset, size_t removed, size_t inserted) {
+    editorClearPrefixCache();
+    if (!E.find.active || !E.find.query || E.find.query[0] == '\0') return;
+
+    // matches overlapping the edited span are gone, the ones after it move
+    // whole words also depend on the byte on either side, so they reach one byte further
+    // regex matches never leave their line, so the whole line in front of the edit goes
+    size_t m = strlen(E.find.query);
+    size_t lo = offset;
+    if (E.find.use_regex) {
+        int row, col;
+        editorOffsetToRowCol(&E.buf, offset, &row, &col);
+        lo = E.buf.line_offsets[row];
+    } else if (!E.find.use_query) {
+        size_t reach = E.find.whole_word ? m : m - 1;
+        lo = offset >= reach ? offset - reach : 0;
+    }
+
+    if (!E.find.scanning) {
+        editorFindDropRegion(&E.find.matches, NULL, NULL, lo, offset, removed, inserted);
+    } else {
+        // a running scan keeps going: the stretches it covered follow the edit and lose what the edit touched
+        size_t hi = offset + removed;
+        long delta = (long)inserted - (long)removed;
+        if (E.find.scan_cursor >= hi) E.find.scan_cursor += delta;
+        else if (E.find.scan_cursor > offset) E.find.scan_cursor = offset;
+
+        if (E.find.scan_wrapped) {
+            size_t head_start = 0;
+            editorFindDropRegion(&E.find.scan_head, &head_start, &E.find.scan_pos, lo, offset, removed, inserted);
+            editorFindDropRegion(&E.find.matches, &E.find.scan_origin, NULL, lo, offset, removed, inserted);
+        } else {
+            editorFindDropRegion(&E.find.matches, &E.find.scan_origin, &E.find.scan_pos, lo, offset, removed, inserted);
+        }
+    }
+    if (E.find.current_idx >= E.find.matches.total) E.find.current_idx = E.find.matches.total - 1;
+}
+
+void editorFindRescanEdit(size_t offset, size_t inserted) {
+    if (!E.find.active || !E.find.query || E.find.query[0] == '\0' || E.find.use_query) return;
+    if (E.find.use_regex && !E.find.regex_ok) return;
+
+    // only a stretch the scan already covered is searched again, the scan gets to the rest
+    size_t size = E.buf.pt.logical_size;
+    MatchStore *open = NULL;
+    size_t floor = 0;
+    if (!E.find.scanning) {
+        editorFindRescanRegion(&E.find.matches, offset, inserted, 0, size);
+    } else if (offset >= E.find.scan_origin && E.find.scan_wrapped) {
+        editorFindRescanRegion(&E.find.matches, offset, inserted, E.find.scan_origin, size);
+    } else if (offset >= E.find.scan_origin) {
+        open = &E.find.matches;
+        floor = E.find.scan_origin;
+    } else if (E.find.scan_wrapped) {
+        open = &E.find.scan_head;
+    }
+
+    if (open) {
+        // the scan picks up after the last match, which may now run past where it stopped
+        editorFindRescanRegion(open, offset, inserted, floor, E.find.scan_pos);
+        if (!E.find.use_regex && open->total > 0) {
+            size_t last_end = matchStoreLastOffset(open, open->num_blocks - 1) + strlen(E.find.query);
+            if (last_end > E.find.scan_pos) E.find.scan_pos = last_end;
+        }
+    }
+    if (E.find.current_idx >= E.find.matches.total) E.find.current_idx = E.find.matches.total - 1;
+}
+
+void editorFindRescanRegion(MatchStore *ms, size_t offset, size_t inserted, size_t floor, size_t limit) {
+    // the store only holds matches starting in [floor, limit), the scan finds the others
+    size_t m = strlen(E.find.query);
+    size_t size = E.buf.pt.logical_size;
+
+    if (E.find.use_regex) {
+        // only the lines around the edit are rescanned
+        int row, col;
+        editorOffsetToRowCol(&E.buf, offset, &row, &col);
+        size_t line_start = E.buf.line_offsets[row];
+        editorOffsetToRowCol(&E.buf, offset + inserted, &row, &col);
+        size_t line_end = row + 1 < E.buf.num_lines ? E.buf.line_offsets[row + 1] : size;
+        if (line_start < floor) line_start = floor;
+        if (line_end > limit) line_end = limit;
+        if (line_start >= line_end) return;
+
+        matchStoreRemoveRange(ms, line_start, line_end);
+        regexSearch(&E.buf.pt, &E.find.regex, line_start, line_end, editorInsertMatch, ms);
+        return;
+    }
+
+    size_t reach = E.find.whole_word ? m : m - 1;
+    size_t lo = offset >= reach ? offset - reach : 0;
+    if (lo < floor) lo = floor;
+    SearchPattern pat;
+    searchCompile(&pat, E.find.query, m, E.find.ignore_case, E.find.whole_word);
+
+    // matches never overlap, so rescanning starts after the last one kept before the edit
+    size_t a = lo;
+    int prev = matchStoreLowerBound(ms, lo) - 1;
+    if (prev >= 0 && matchStoreGet(ms, prev) + m > a)
+        a = matchStoreGet(ms, prev) + m;
+    size_t b = offset + inserted + reach;
+
+    // rescan [a, b) until the new chain of matches lines up with the old one again
+    while (a < limit) {
+        if (b > limit) b = limit;
+        int spanning = matchStoreLowerBound(ms, b >= m - 1 ? b - (m - 1) : 0);
+        if (spanning < ms->total && matchStoreGet(ms, spanning) < b)
+            b = matchStoreGet(ms, spanning) + m;
+
+        matchStoreRemoveRange(ms, a, b);
+        int before = matchStoreLowerBound(ms, a);
+        size_t found = ptSearch(&E.buf.pt, &pat, a, b, editorInsertMatch, ms);
+        size_t last_end = found > 0 ? matchStoreGet(ms, before + (int)found - 1) + m : a;
+
+        // a new match may still start before b and run past it
+        size_t s0 = b >= m - 1 ? b - (m - 1) : 0;
+        if (s0 < last_end) s0 = last_end;
+        if (m == 1 || s0 >= b || b >= size) break;
+
+        size_t s1 = b + (m - 1) < size ? b + (m - 1) : size;
+        size_t hit = SIZE_MAX;
+        ptSearch(&E.buf.pt, &pat, s0, s1, searchFirstHit, &hit);
+        if (hit == SIZE_MAX || hit >= b || hit >= limit) break;
+
+        size_t hit_end = hit + m;
+        int tail = matchStoreLowerBound(ms, hit_end >= m - 1 ? hit_end - (m - 1) : 0);
+        size_t tail_end = (tail < ms->total && matchStoreGet(ms, tail) < hit_end) ? matchStoreGet(ms, tail) + m : 0;
+        matchStoreRemoveRange(ms, b, hit_end);
+        matchStoreInsert(ms, hit);
+        if (tail_end == 0) break;
+
+        a = hit_end;
+        b = tail_end;
+    }
+}
+
+void editorFindRestartScan() {
+    if (E.find.active && E.find.query && E.find.query[0] != '\0' && (E.find.use_query ? E.find.ts_query != NULL : !E.find.use_regex || E.find.regex_ok))
+        editorFindStartScan(E.find.query);
+}
+
+void editorFindTrackSpans(const ReplaceSpan *spans, size_t num_spans) {
+    // patching a span re-encodes a few match blocks, once that outweighs a pass over the text the scan starts over
+    if (num_spans * FIND_SPAN_COST > E.buf.pt.logical_size) {
+        editorClearPrefixCache();
+        editorFindRestartScan();
+        return;
+    }
+
+    // the matches are moved past every span first, so each rescan runs on offsets of the new text
+    long delta = 0;
+    for (size_t i = 0; i < num_spans; i++) {
+        editorFindDropEdit((size_t)((long)spans[i].offset + delta), spans[i].old_len, spans[i].new_len);
+        delta += (long)spans[i].new_len - (long)spans[i].old_len;
+    }
+
+    delta = 0;
+    for (size_t i = 0; i < num_spans; i++) {
+        editorFindRescanEdit((size_t)((long)spans[i].offset + delta), spans[i].new_len);
+        delta += (long)spans[i].new_len - (long)spans[i].old_len;
+    }
+}
+
+void editorFind() {
+    E.sys.has_bracket = false;
+    int saved_cursor_x = E.cursor.x;
+    int saved_cursor_y = E.cursor.y;
+    int saved_col_offset = E.view.col_offset;
+    int saved_row_offset = E.view.row_offset;
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-T: regex, Ctrl-N: query, Ctrl-K: case, Ctrl-W: word, Ctrl-O: cursors)", editorFindCallback, editorGetSelectedText(NULL));
+    if (query) free(query);
+    else {
+        editorClearCarets();
+        E.cursor.x = saved_cursor_x;
+        E.cursor.preferred_x = E.cursor.x;
+        E.cursor.y = saved_cursor_y;
+        E.view.col_offset = saved_col_offset;
+        E.view.row_offset = saved_row_offset;
+        E.find.active = false;
+    }
+}
+
+void editorFindCallback(const char *query, int key) {
+    int direction = 1;
+
+    if (editorFindModeKey(query, key)) return;
+
+    if (key == CTRL_KEY('o')) {
+        editorAddCursorsAtMatches();
+        return;
+    }
+
+    if (key == '\r' && E.find.active && E.find.scanning) {
+        editorSetStatusMsg("Scanning the rest of the file, highlights follow edits (ESC to clear)");
+        return;
+    }
+
+    if (key == '\r' && E.find.active && E.find.matches.total > 0) {
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "%d match%s, highlights follow edits (ESC to clear)", E.find.matches.total, E.find.matches.total == 1 ? "" : "es");
+        editorSetStatusMsg(msg);
+        return;
+    }
+
+    if (key == '\r' || key == ESCAPE_CHAR || query[0] == '\0') {
+        if (key == ESCAPE_CHAR)
+            editorSetStatusMsg("Find cancelled");
+        editorResetFind();
+        return;
+    }
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) direction = 1;
+    else if (key == ARROW_LEFT || key == ARROW_UP) direction = -1;
+    else if (key == BACKSPACE) direction = 1;
+    else if (is_cntrl(key)) return;
+    else direction = 1;
+
+    if (E.find.query == NULL || strcmp(E.find.query, query) != 0) {
+        // the scan keeps pointing at the query, so it has to live in the finder first
+        char *prev = E.find.query;
+        E.find.query = safeStrdup(query);
+        E.find.active = true;
+        editorUpdateMatchList(prev, E.find.query);
+        free(prev);
+    } else {
+        if (E.find.matches.total > 0) {
+            E.find.current_idx += direction;
+            if (E.find.current_idx < 0) E.find.current_idx = E.find.matches.total - 1;
+            else if (E.find.current_idx >= E.find.matches.total) E.find.current_idx = 0;
+            editorCenterViewOnMatch();
+        }
+    }
+}
+
+void editorReplace() {
+    int saved_cursor_x = E.cursor.x;
+    int saved_cursor_y = E.cursor.y;
+    int saved_col_offset = E.view.col_offset;
+    int saved_row_offset = E.view.row_offset;
+
+    char *find_query = editorPrompt("Replace - Find: %s (ESC to cancel, Ctrl-T: regex, Ctrl-N: query, Ctrl-K: case, Ctrl-W: word)", editorReplaceCallback, editorGetSelectedText(NULL));
+    bool cancelled = find_query && find_query[0] && editorReplaceFinishScan();
+    if (cancelled || !find_query || strlen(find_query) == 0 || E.find.matches.total == 0) {
+        editorSetStatusMsg("Replace cancelled");
+        E.cursor.x = saved_cursor_x;
+        E.cursor.y = saved_cursor_y;
+        E.view.col_offset = saved_col_offset;
+        E.view.row_offset = saved_row_offset;
+        E.find.active = false;
+        // a scan stopped halfway leaves a partial match list behind
+        if (cancelled) editorResetFind();
+        free(find_query);
+        return;
+    }
+
+    char *replace_query = editorPrompt(E.find.use_regex ? "Replace - With: %s (\\1-\\9 for groups, ESC to cancel)" : "Replace - With: %s (ESC to cancel)", NULL, NULL);
+    if (!replace_query) {
+        editorSetStatusMsg("Replace cancelled");
+        free(find_query);
+        free(replace_query);
+        editorResetFind();
+        return;
+    }
+
+    int replaced = 0;
+    bool done = false;
+    int idx = E.find.current_idx < 0 ? 0 : E.find.current_idx;
+    bool needs_refresh = true;
+    while (!done && E.find.matches.total > 0) {
+        if (E.view.resized) {
+            E.view.resized = 0;
+            if (getWindowSize(&E.view.screen_rows, &E.view.screen_cols) == -1) die("getWindowSize");
+            E.view.screen_rows -= UI_RESERVED_ROWS;
+            needs_refresh = true;
+        }
+
+        if (needs_refresh) {
+            editorCenterViewOnMatch();
+            editorSetStatusMsg("Arrows: navigate, Enter: replace, A: all, ESC: cancel");
+            editorRefreshScreen();
+            needs_refresh = false;
+        }
+
+        int key = editorReadKey();
+        if (key == 0) continue;
+        needs_refresh = true;
+        switch (key) {
+            case ESCAPE_CHAR:
+                done = true;
+                E.sel.active = false;
+                break;
+            case ARROW_DOWN:
+            case ARROW_RIGHT:
+                idx = (idx + 1) % E.find.matches.total;
+                E.find.current_idx = idx;
+                editorCenterViewOnMatch();
+                break;
+            case ARROW_UP:
+            case ARROW_LEFT:
+                idx = (idx + E.find.matches.total - 1) % E.find.matches.total;
+                E.find.current_idx = idx;
+                editorCenterViewOnMatch();
+                break;
+            case 'a':
+            case 'A': {
+                int count = editorReplaceAll(replace_query);
+                done = true;
+                if (count < 0) {
+                    // cancelled before anything was edited
+                    editorSetStatusMsg("Replace all cancelled");
+                    continue;
+                }
+                replaced += count;
+                break;
+            }
+            case '\r':
+            case '\n':
+                if (editorReplaceCurrent(find_query, replace_query)) {
+                    replaced++;
+                    if (E.find.matches.total == 0) {
+                        done = true;
+                    } else {
+                        // matches follow the edit, continue with the first one after the cursor
+                        size_t cursor_offset = editorGetLogicalOffset(&E.buf, E.cursor.y, E.cursor.x);
+                        int next_idx = matchStoreLowerBound(&E.find.matches, cursor_offset);
+                        if (next_idx >= E.find.matches.total)
+                            next_idx = 0;
+                        idx = next_idx;
+                        E.find.current_idx = next_idx;
+                        editorCenterViewOnMatch();
+                    }
+                }
+                editorReplaceCallback(find_query, 0);
+                break;
+            default:
+                break;
+        }
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+        editorSetStatusMsg(msg);
+    }
+    editorResetFind();
+}
+
+void editorReplaceCallback(const char *query, int key) {
+    if (editorFindModeKey(query, key)) return;
+
+    if (query == NULL || !query[0]) {
+        editorResetFind();
+        return;
+    }
+
+    if (E.find.query == NULL || strcmp(E.find.query, query) != 0) {
+        // the scan keeps pointing at the query, so it has to live in the finder first
+        char *prev = E.find.query;
+        E.find.query = safeStrdup(query);
+        E.find.active = true;
+        editorUpdateMatchList(prev, E.find.query);
+        free(prev);
+    }
+}
+
+bool editorReplaceCurrent(const char *find_str, const char *replace_str) {
+    if (!find_str || !replace_str || E.find.matches.total == 0 || E.find.current_idx < 0) return false;
+
+    size_t offset = matchStoreGet(&E.find.matches, E.find.current_idx);
+
+    size_t find_len = editorFindMatchLength(offset);
+    size_t replace_len = strlen(replace_str);
+    char *expanded = NULL;
+    if (E.find.use_regex) {
+        expanded = regexExpand(&E.find.regex, &E.buf.pt, offset, replace_str, &replace_len);
+        replace_str = expanded;
+    }
+
+    editorBeginMacro();
+    executeDelete(offset, find_len);
+    executeInsert(offset, replace_str, replace_len);
+    editorEndMacro();
+    free(expanded);
+
+    E.buf.dirty = true;
+    editorOffsetToRowCol(&E.buf, offset + replace_len, &E.cursor.y, &E.cursor.x);
+    E.cursor.preferred_x = E.cursor.x;
+    return true;
+}
+
+bool editorReplaceProgress(const char *label, size_t done, size_t total, long *last_shown) {
+    long now = currentMillis();
+    if (now - *last_shown < REPLACE_PROGRESS_MS) return false;
+    *last_shown = now;
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "%s... %d%% (ESC to cancel)", label, total > 0 ? (int)(done * 100 / total) : 100);
+    editorSetStatusMsg(msg);
+    editorRefreshScreen();
+
+    // keys typed meanwhile are dropped, only ESC matters here
+    while (editorInputPending())
+        if (editorReadKey() == ESCAPE_CHAR) return true;
+    return false;
+}
+
+bool editorReplaceFinishScan() {
+    // the rest of the scan runs in slices, ESC between them stops it before anything is edited
+    long last_shown = currentMillis();
+    while (E.find.scanning) {
+        editorFindScanStep(SCAN_SLICE_MS);
+        size_t size = E.buf.pt.logical_size;
+        size_t done = E.find.scan_wrapped ? size - E.find.scan_origin + E.find.scan_pos : E.find.scan_pos - E.find.scan_origin;
+        if (E.find.scanning && editorReplaceProgress("Searching", done, size, &last_shown)) return true;
+    }
+    return false;
+}
+
+int editorReplaceAll(const char *replace_str) {
+    if (!E.find.query || !replace_str) return 0;
+    int total = E.find.matches.total;
+    if (total == 0) return 0;
+
+    int count = 0;
+    size_t *offsets = safeMalloc(sizeof(size_t) * total);
+    matchStoreSettle(&E.find.matches, E.find.matches.num_blocks - 1);
+    for (int b = 0; b < E.find.matches.num_blocks; b++)
+        matchBlockDecode(&E.find.matches.blocks[b], offsets + E.find.matches.blocks[b].first);
+
+    // the replacement is described as spans over the current text, nothing is edited before the last one is known
+    ReplaceSpan *spans = safeMalloc(sizeof(ReplaceSpan) * total);
+    char *old_text, *new_text;
+    size_t old_len = 0, new_len = 0;
+    bool shared = !E.find.use_regex && !E.find.use_query && !E.find.ignore_case;
+    long last_shown = currentMillis();
+    if (shared) {
+        size_t find_len = strlen(E.find.query);
+        size_t replace_len = strlen(replace_str);
+        old_text = safeStrdup(E.find.query);
+        new_text = safeStrdup(replace_str);
+        old_len = find_len;
+        new_len = replace_len;
+        for (int i = 0; i < total; i++) {
+            if (i % REPLACE_PROGRESS_STEP == 0 && editorReplaceProgress("Replacing", i, total, &last_shown)) {
+                free(offsets);
+                free(spans);
+                free(old_text);
+                free(new_text);
+                return -1;
+            }
+            spans[count++] = (ReplaceSpan){offsets[i], find_len, replace_len};
+        }
+    } else {
+        // the matched text differs from match to match, both sides are kept in pools for undo
+        size_t old_cap = BUFFER_SIZE_1024, new_cap = BUFFER_SIZE_1024;
+        old_text = safeMalloc(old_cap);
+        new_text = safeMalloc(new_cap);
+        size_t prev_end = 0;
+        for (int i = 0; i < total; i++) {
+            if (i % REPLACE_PROGRESS_STEP == 0 && editorReplaceProgress("Replacing", i, total, &last_shown)) {
+                free(offsets);
+                free(spans);
+                free(old_text);
+                free(new_text);
+                return -1;
+            }
+
+            size_t find_len = editorFindMatchLength(offsets[i]);
+            if (offsets[i] < prev_end || find_len == 0) continue;
+            size_t expanded_len = strlen(replace_str);
+            char *expanded = NULL;
+            if (E.find.use_regex)
+                expanded = regexExpand(&E.find.regex, &E.buf.pt, offsets[i], replace_str, &expanded_len);
+
+            if (old_len + find_len > old_cap) {
+                while (old_len + find_len > old_cap) old_cap *= 2;
+                old_text = safeRealloc(old_text, old_cap);
+            }
+            if (new_len + expanded_len > new_cap) {
+                while (new_len + expanded_len > new_cap) new_cap *= 2;
+                new_text = safeRealloc(new_text, new_cap);
+            }
+            ptReadLogical(&E.buf.pt, offsets[i], find_len, old_text + old_len);
+            memcpy(new_text + new_len, expanded ? expanded : replace_str, expanded_len);
+            old_len += find_len;
+            new_len += expanded_len;
+            free(expanded);
+
+            spans[count++] = (ReplaceSpan){offsets[i], find_len, expanded_len};
+            prev_end = offsets[i] + find_len;
+        }
+    }
+    free(offsets);
+
+    if (count == 0) {
+        free(spans);
+        free(old_text);
+        free(new_text);
+        return 0;
+    }
+
+    // the matches are about to be replaced, nothing is left to track
+    editorResetFind();
+    if (currentMillis() - last_shown >= REPLACE_PROGRESS_MS || count >= REPLACE_PROGRESS_STEP) {
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "Replacing %d occurrence%s...", count, count == 1 ? "" : "s");
+        editorSetStatusMsg(msg);
+        editorRefreshScreen();
+    }
+
+    // one new piece list, one line index rebuild, one reparse and one undo entry
+    recordBulkCommand(spans, count, old_text, old_len, new_text, new_len, shared, E.cursor);
+    editorDocumentReplaceSpans(spans, count, new_text, new_len, shared, NULL, NULL);
+    editorParseTreeSitter();
+    E.buf.dirty = true;
+    return count;
+}
+
+void editorCenterViewOnMatch() {
+    if (E.find.matches.total > 0 && E.find.current_idx >= 0 && E.find.current_idx < E.find.matches.total) {
+        int row, col;
+        editorOffsetToRowCol(&E.buf, matchStoreGet(&E.find.matches, E.find.current_idx), &row, &col);
+        E.cursor.x = col;
+        E.cursor.y = row;
+        E.cursor.preferred_x = E.cursor.x;
+        if (row < E.view.row_offset || row >= E.view.row_offset + E.view.screen_rows) {
+            E.view.row_offset = row - (E.view.screen_rows / 2);
+            if (E.view.row_offset < 0)
+                E.view.row_offset = 0;
+        }
+
+        size_t render_line_len;
+        char *render_line_text = editorGetLine(&E.buf, row, &render_line_len);
+        int render_pos = editorLineCxToRx(render_line_text, render_line_len, E.cursor.x);
+        free(render_line_text);
+
+        if (render_pos < E.view.col_offset || render_pos >= E.view.col_offset + E.view.screen_cols) {
+            E.view.col_offset = render_pos - (E.view.screen_cols / 2);
+            if (E.view.col_offset < 0)
+                E.view.col_offset = 0;
+        }
+    }
+}
+
+void editorResetFind() {
+    free(E.find.query);
+    E.find.query = NULL;
+    editorFindStopScan();
+    matchStoreClear(&E.find.matches);
+    editorClearPrefixCache();
+    if (E.find.regex_ok) regexFree(&E.find.regex);
+    E.find.regex_ok = false;
+    E.find.regex_error = NULL;
+    editorFindFreeQuery();
+    E.find.current_idx = -1;
+    E.find.active = false;
+}
+
+IgnoreList *projectLoadIgnore(ProjectSearch *ps, const char *dir, size_t base_len, IgnoreList *parent) {
+    char path[PATH_MAX + BUFFER_SIZE_PADDING];
+    snprintf(path, sizeof(path), "%s/.gitignore", dir);
+    char *content = editorReadFileIntoString(path);
+    if (!content) return parent;
+
+    IgnoreList *list = safeCalloc(1, sizeof(IgnoreList));
+    list->parent = parent;
+    list->base_len = base_len;
+    int capacity = 0;
+    char *next;
+    for (char *line = content; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        // trailing spaces are dropped unless escaped
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\r' || (line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\'))))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        IgnoreRule rule = {0};
+        if (line[0] == '!') {
+            rule.negate = true;
+            line++;
+        } else if (line[0] == '\\') {
+            line++;     // \# and \! start a literal pattern
+        }
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '/') {
+            rule.dir_only = true;
+            line[--len] = '\0';
+        }
+        if (strncmp(line, "**/", 3) == 0) {
+            rule.any_depth = true;
+            line += 3;
+        }
+        if (line[0] == '/') {
+            rule.anchored = true;
+            line++;
+        }
+        if (line[0] == '\0') continue;
+        if (strchr(line, '/')) rule.anchored = true;
+
+        // a pattern holding ** lets * cross directories, close enough to git for a/**/b and a/**
+        rule.flags = strstr(line, "**") ? 0 : FNM_PATHNAME;
+        if (list->num_rules >= capacity) {
+            capacity = capacity == 0 ? BUFFER_SIZE_32 : capacity * 2;
+            list->rules = safeRealloc(list->rules, sizeof(IgnoreRule) * capacity);
+        }
+        rule.pattern = safeStrdup(line);
+        list->rules[list->num_rules++] = rule;
+    }
+    free(content);
+
+    if (list->num_rules == 0) {
+        free(list->rules);
+        free(list);
+        return parent;
+    }
+
+    // lists are shared by every job below their directory, so they live until the search is freed
+    pthread_mutex_lock(&ps->lock);
+    ps->ignores = safeRealloc(ps->ignores, sizeof(IgnoreList *) * (ps->num_ignores + 1));
+    ps->ignores[ps->num_ignores++] = list;
+    pthread_mutex_unlock(&ps->lock);
+    return list;
+}
+
+bool projectIgnoreRuleMatch(const IgnoreRule *rule, const char *rel, bool is_dir) {
+    if (rule->dir_only && !is_dir) return false;
+    if (!rule->anchored) {
+        const char *name = strrchr(rel, '/');
+        return fnmatch(rule->pattern, name ? name + 1 : rel, 0) == 0;
+    }
+
+    if (fnmatch(rule->pattern, rel, rule->flags) == 0) return true;
+    // a leading **/ lets the pattern start below any directory
+    for (const char *p = rule->any_depth ? strchr(rel, '/') : NULL; p; p = strchr(p + 1, '/')) {
+        if (fnmatch(rule->pattern, p + 1, rule->flags) == 0) return true;
+    }
+    return false;
+}
+
+bool projectIsIgnored(const IgnoreList *list, const char *rel, bool is_dir) {
+    // the innermost .gitignore decides first, and inside one file the last matching rule wins
+    for (; list; list = list->parent) {
+        for (int i = list->num_rules - 1; i >= 0; i--) {
+            if (projectIgnoreRuleMatch(&list->rules[i], rel + list->base_len, is_dir))
+                return !list->rules[i].negate;
+        }
+    }
+    return false;
+}
+
+void projectPushJobs(ProjectSearch *ps, ProjectJob *jobs, int count) {
+    if (count == 0) return;
+
+    pthread_mutex_lock(&ps->lock);
+    if (ps->num_jobs + count > ps->jobs_capacity) {
+        ps->jobs_capacity = (ps->num_jobs + count) * 2;
+        ps->jobs = safeRealloc(ps->jobs, sizeof(ProjectJob) * ps->jobs_capacity);
+    }
+    memcpy(ps->jobs + ps->num_jobs, jobs, sizeof(ProjectJob) * count);
+    ps->num_jobs += count;
+    ps->pending += count;
+    pthread_cond_broadcast(&ps->wake);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+bool projectNextJob(ProjectSearch *ps, ProjectJob *job) {
+    pthread_mutex_lock(&ps->lock);
+    // an empty queue is only the end of the walk once no running job can push more
+    while (ps->num_jobs == 0 && ps->pending > 0 && !ps->stop)
+        pthread_cond_wait(&ps->wake, &ps->lock);
+    bool has_job = ps->num_jobs > 0 && !ps->stop;
+    if (has_job) *job = ps->jobs[--ps->num_jobs];
+    pthread_mutex_unlock(&ps->lock);
+    return has_job;
+}
+
+void projectFinishJob(ProjectSearch *ps) {
+    pthread_mutex_lock(&ps->lock);
+    if (--ps->pending == 0) {
+        ps->elapsed_us = currentMicros() - ps->start_us;
+        pthread_cond_broadcast(&ps->wake);
+    }
+    pthread_mutex_unlock(&ps->lock);
+}
+
+void projectScanDir(ProjectSearch *ps, ProjectJob *job) {
+    DIR *dir = opendir(job->path);
+    if (!dir) return;
+
+    bool is_root = strcmp(job->path, ps->root) == 0;
+    size_t base_len = is_root ? 0 : strlen(job->path + ps->root_len) + 1;
+    IgnoreList *ignore = projectLoadIgnore(ps, job->path, base_len, job->ignore);
+
+    // entries are queued in one batch so the lock is taken once per directory
+    ProjectJob *batch = NULL;
+    int count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // hidden entries, .git included, are skipped like other project search tools do
+        if (entry->d_name[0] == '.') continue;
+
+        char path[PATH_MAX];
+        int len = (is_root && ps->root_len == 0) ? snprintf(path, sizeof(path), "%s", entry->d_name)
+                                                 : snprintf(path, sizeof(path), "%s/%s", job->path, entry->d_name);
+        if (len < 0 || len >= (int)sizeof(path)) continue;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) != 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        }
+        // symlinks are not followed, so a link cycle cannot trap the walk
+        if (!is_dir && !is_file) continue;
+        if (projectIsIgnored(ignore, path + ps->root_len, is_dir)) continue;
+
+        if (count >= capacity) {
+            capacity = capacity == 0 ? BUFFER_SIZE_32 : capacity * 2;
+            batch = safeRealloc(batch, sizeof(ProjectJob) * capacity);
+        }
+        batch[count++] = (ProjectJob){ safeStrdup(path), ignore, is_dir };
+    }
+    closedir(dir);
+
+    projectPushJobs(ps, batch, count);
+    free(batch);
+}
+
+bool projectCollectHit(size_t offset, void *ctx) {
+    ProjectWorker *w = ctx;
+
+    // hits arrive in order, so lines are counted forward from the previous hit
+    size_t line_start = w->line_start;
+    const char *nl;
+    while ((nl = memchr(w->data + line_start, '\n', offset - line_start)) != NULL) {
+        w->line++;
+        line_start = nl - w->data + 1;
+    }
+    w->line_start = line_start;
+
+    const char *eol = memchr(w->data + offset, '\n', w->size - offset);
+    size_t line_end = eol ? (size_t)(eol - w->data) : w->size;
+
+    // the preview drops the indentation and keeps the hit in view on long lines
+    size_t start = line_start;
+    while (start < offset && (w->data[start] == ' ' || w->data[start] == '\t'))
+        start++;
+    if (offset - start > PROJECT_PREVIEW_LEN / 2) {
+        start = offset - PROJECT_PREVIEW_LEN / 4;
+        while (start < offset && utf8IsCont(w->data[start]))
+            start++;
+    }
+    size_t end = line_end - start > PROJECT_PREVIEW_LEN ? start + PROJECT_PREVIEW_LEN : line_end;
+    while (end > start && end < line_end && utf8IsCont(w->data[end]))
+        end--;
+
+    char *preview = safeMalloc(end - start + 1);
+    for (size_t i = start; i < end; i++)
+        preview[i - start] = is_cntrl(w->data[i]) ? ' ' : w->data[i];
+    preview[end - start] = '\0';
+
+    if (w->num_hits >= w->hits_capacity) {
+        w->hits_capacity = w->hits_capacity == 0 ? BUFFER_SIZE_32 : w->hits_capacity * 2;
+        w->hits = safeRealloc(w->hits, sizeof(ProjectHit) * w->hits_capacity);
+    }
+    w->hits[w->num_hits++] = (ProjectHit){ NULL, w->line, (int)(offset - line_start), preview };
+    return w->num_hits < PROJECT_MAX_HITS;
+}
+
+void projectSearchFile(ProjectWorker *w, const char *path) {
+    ProjectSearch *ps = w->ps;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    // mapping costs more than a read for the typical small source file, so only large files are mapped
+    size_t size = st.st_size;
+    char *data = NULL;
+    bool mapped = false;
+    if (size >= PROJECT_MMAP_MIN) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapped = data != MAP_FAILED;
+    }
+    if (!mapped) {
+        if (size + 1 > w->buf_capacity) {
+            w->buf_capacity = size + 1;
+            w->buf = safeRealloc(w->buf, w->buf_capacity);
+        }
+        size_t got = 0;
+        ssize_t nread;
+        while (got < size && (nread = read(fd, w->buf + got, size - got)) > 0)
+            got += nread;
+        size = got;
+        data = w->buf;
+    }
+    close(fd);
+
+    // a NUL near the start marks a binary file
+    if (size == 0 || memchr(data, '\0', size < PROJECT_BINARY_PROBE ? size : PROJECT_BINARY_PROBE)) {
+        if (mapped) munmap(data, size);
+        return;
+    }
+
+    // the whole file is one original piece, so the buffer searches run on it unchanged
+    Piece piece = { BUFFER_ORIGINAL, 0, size };
+    size_t piece_offsets[2] = { 0, size };
+    PieceTable pt = { data, NULL, 0, 0, 0, &piece, 1, 1, size, piece_offsets, 2, false };
+
+    w->data = data;
+    w->size = size;
+    w->line_start = 0;
+    w->line = 0;
+    w->num_hits = 0;
+    SearchEmitFn emit = ps->count_only ? NULL : projectCollectHit;
+    size_t count;
+    if (ps->use_regex)
+        count = w->regex_ok ? regexSearch(&pt, &w->regex, 0, size, emit, w) : 0;
+    else
+        count = ptSearch(&pt, &ps->pattern, 0, size, emit, w);
+
+    pthread_mutex_lock(&ps->lock);
+    ps->files_searched++;
+    ps->bytes_searched += size;
+    ps->total_matches += count;
+    if (w->num_hits > 0) {
+        if (ps->num_files >= ps->files_capacity) {
+            ps->files_capacity = ps->files_capacity == 0 ? BUFFER_SIZE_128 : ps->files_capacity * 2;
+            ps->files = safeRealloc(ps->files, sizeof(char *) * ps->files_capacity);
+        }
+        char *owned = safeStrdup(path);
+        ps->files[ps->num_files++] = owned;
+
+        int take = PROJECT_MAX_HITS - ps->num_hits;
+        if (take > w->num_hits) take = w->num_hits;
+        if (ps->num_hits + take > ps->hits_capacity) {
+            ps->hits_capacity = (ps->num_hits + take) * 2;
+            ps->hits = safeRealloc(ps->hits, sizeof(ProjectHit) * ps->hits_capacity);
+        }
+        for (int i = 0; i < take; i++) {
+            w->hits[i].path = owned;
+            ps->hits[ps->num_hits++] = w->hits[i];
+        }
+        for (int i = take; i < w->num_hits; i++)
+            free(w->hits[i].preview);
+
+        if (ps->num_hits >= PROJECT_MAX_HITS) {
+            ps->truncated = true;
+            ps->stop = true;
+            pthread_cond_broadcast(&ps->wake);
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+
+    if (mapped) munmap(data, size);
+}
+
+void *projectSearchWorker(void *arg) {
+    ProjectSearch *ps = arg;
+    ProjectWorker w;
+    memset(&w, 0, sizeof(w));
+    w.ps = ps;
+
+    // the dfa is built lazily while searching, so every worker compiles its own copy
+    if (ps->use_regex) {
+        const char *error;
+        w.regex_ok = regexCompile(&w.regex, ps->query, &error);
+        if (w.regex_ok && ps->ignore_case) regexFoldCase(&w.regex);
+    }
+
+    ProjectJob job;
+    while (projectNextJob(ps, &job)) {
+        if (job.is_dir) projectScanDir(ps, &job);
+        else projectSearchFile(&w, job.path);
+        free(job.path);
+        projectFinishJob(ps);
+    }
+
+    if (w.regex_ok) regexFree(&w.regex);
+    free(w.buf);
+    free(w.hits);
+    return NULL;
+}
+
+void projectSearchStart(ProjectSearch *ps, const char *root, const char *query, int threads, bool count_only) {
+    memset(ps, 0, sizeof(ProjectSearch));
+    ps->root = safeStrdup(root);
+    size_t len = strlen(ps->root);
+    while (len > 1 && ps->root[len - 1] == '/')
+        ps->root[--len] = '\0';
+    // paths under "." are kept relative, everything else is prefixed with the root
+    ps->root_len = strcmp(ps->root, ".") == 0 ? 0 : len + 1;
+
+    ps->query = query;
+    ps->use_regex = E.find.use_regex;
+    ps->ignore_case = E.find.ignore_case;
+    ps->whole_word = E.find.whole_word && !E.find.use_regex;
+    ps->count_only = count_only;
+    if (!ps->use_regex)
+        searchCompile(&ps->pattern, query, strlen(query), ps->ignore_case, ps->whole_word);
+
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->wake, NULL);
+    ps->start_us = currentMicros();
+
+    ProjectJob root_job = { safeStrdup(ps->root), NULL, true };
+    projectPushJobs(ps, &root_job, 1);
+    if (threads > MAX_SEARCH_THREADS) threads = MAX_SEARCH_THREADS;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&ps->workers[ps->num_workers], NULL, projectSearchWorker, ps) == 0)
+            ps->num_workers++;
+    }
+    if (ps->num_workers == 0) projectSearchWorker(ps);
+}
+
+bool projectSearchRunning(ProjectSearch *ps) {
+    pthread_mutex_lock(&ps->lock);
+    bool running = ps->pending > 0 && !ps->stop;
+    pthread_mutex_unlock(&ps->lock);
+    return running;
+}
+
+int compareProjectHits(const void *a, const void *b) {
+    const ProjectHit *ha = a, *hb = b;
+    if (ha->path != hb->path) return strcmp(ha->path, hb->path);
+    if (ha->line != hb->line) return ha->line < hb->line ? -1 : 1;
+    return (ha->col > hb->col) - (ha->col < hb->col);
+}
+
+void projectSearchFinish(ProjectSearch *ps, bool cancel) {
+    if (cancel) {
+        pthread_mutex_lock(&ps->lock);
+        ps->stop = true;
+        pthread_cond_broadcast(&ps->wake);
+        pthread_mutex_unlock(&ps->lock);
+    }
+    for (int i = 0; i < ps->num_workers; i++)
+        pthread_join(ps->workers[i], NULL);
+    ps->num_workers = 0;
+
+    for (int i = 0; i < ps->num_jobs; i++)
+        free(ps->jobs[i].path);
+    ps->num_jobs = 0;
+    if (ps->elapsed_us == 0) ps->elapsed_us = currentMicros() - ps->start_us;
+}
+
+void projectSearchFree(ProjectSearch *ps) {
+    for (int i = 0; i < ps->num_ignores; i++) {
+        for (int r = 0; r < ps->ignores[i]->num_rules; r++)
+            free(ps->ignores[i]->rules[r].pattern);
+        free(ps->ignores[i]->rules);
+        free(ps->ignores[i]);
+    }
+    for (int i = 0; i < ps->num_files; i++)
+        free(ps->files[i]);
+    for (int i = 0; i < ps->num_hits; i++)
+        free(ps->hits[i].preview);
+    free(ps->ignores);
+    free(ps->files);
+    free(ps->hits);
+    free(ps->jobs);
+    free(ps->root);
+    pthread_mutex_destroy(&ps->lock);
+    pthread_cond_destroy(&ps->wake);
+}
+
+void editorProjectPromptText() {
+    char mode[BUFFER_SIZE_32];
+    int len = snprintf(mode, sizeof(mode), "%s%s%s", E.find.use_regex ? "regex " : "", E.find.ignore_case ? "icase " : "",
+                       E.find.whole_word && !E.find.use_regex ? "word " : "");
+    if (len > 0) mode[len - 1] = '\0';
+    // the prompt is a format string, rebuilt here so toggles show up while typing
+    snprintf(g_project_prompt, sizeof(g_project_prompt), "Search project%s%s%s: %%s (ESC/Enter, Ctrl-T: regex, Ctrl-K: case, Ctrl-W: word)",
+             len > 0 ? " [" : "", mode, len > 0 ? "]" : "");
+}
+
+void editorProjectSearchCallback(const char *query, int key) {
+    (void)query;
+    bool *option = NULL;
+    if (key == CTRL_KEY('t')) option = &E.find.use_regex;
+    else if (key == CTRL_KEY('k')) option = &E.find.ignore_case;
+    else if (key == CTRL_KEY('w')) option = &E.find.whole_word;
+    if (!option) return;
+
+    // the modes are shared with find, whose highlights were made with the old setting
+    editorResetFind();
+    *option = !*option;
+    if (option == &E.find.use_regex) E.find.use_query = false;
+    editorProjectPromptText();
+}
+
+int editorAppendClipped(AppendBuffer *ab, const char *str, int len, int cols) {
+    int i = 0, used = 0;
+    while (i < len) {
+        int seq_len;
+        int width = utf8CharWidth(str, i, len, &seq_len);
+        if (used + width > cols) break;
+        used += width;
+        i += seq_len;
+    }
+    abAppend(ab, str, i);
+    return used;
+}
+
+void editorDrawProjectResults(ProjectSearch *ps, int selected, int top) {
+    AppendBuffer ab = {NULL, 0, 0};
+    abAppend(&ab, HIDE_CURSOR CURSOR_RESET, sizeof(HIDE_CURSOR CURSOR_RESET) - 1);
+
+    pthread_mutex_lock(&ps->lock);
+    char state[BUFFER_SIZE_128];
+    if (ps->pending > 0 && !ps->stop)
+        snprintf(state, sizeof(state), "searching...");
+    else if (ps->truncated)
+        snprintf(state, sizeof(state), "stopped at %d matches", PROJECT_MAX_HITS);
+    else
+        snprintf(state, sizeof(state), "%.1f ms", ps->elapsed_us / 1000.0);
+
+    char header[BUFFER_SIZE_1024];
+    int len = snprintf(header, sizeof(header), " \"%s\" - %d match%s in %d file%s, %zu files searched (%s)", ps->query, ps->num_hits,
+                       ps->num_hits == 1 ? "" : "es", ps->num_files, ps->num_files == 1 ? "" : "s", ps->files_searched, state);
+    if (len >= (int)sizeof(header)) len = sizeof(header) - 1;
+    abAppend(&ab, INVERTED_COLORS, sizeof(INVERTED_COLORS) - 1);
+    int used = editorAppendClipped(&ab, header, len, E.view.screen_cols);
+    for (; used < E.view.screen_cols; used++)
+        abAppend(&ab, " ", 1);
+    abAppend(&ab, REMOVE_GRAPHICS NEW_LINE, sizeof(REMOVE_GRAPHICS NEW_LINE) - 1);
+
+    for (int row = 0; row < E.view.screen_rows; row++) {
+        int idx = top + row;
+        if (idx < ps->num_hits) {
+            ProjectHit *hit = &ps->hits[idx];
+            if (idx == selected) abAppend(&ab, LIGHT_GRAY_BG_COLOR, sizeof(LIGHT_GRAY_BG_COLOR) - 1);
+
+            char location[PATH_MAX + BUFFER_SIZE_PADDING];
+            int loc_len = snprintf(location, sizeof(location), "%s:%d:%d: ", hit->path, hit->line + 1, hit->col + 1);
+            if (loc_len >= (int)sizeof(location)) loc_len = sizeof(location) - 1;
+            abAppend(&ab, FG_DARK_GRAY, sizeof(FG_DARK_GRAY) - 1);
+            used = editorAppendClipped(&ab, location, loc_len, E.view.screen_cols);
+            abAppend(&ab, FG_DEFAULT, sizeof(FG_DEFAULT) - 1);
+            used += editorAppendClipped(&ab, hit->preview, strlen(hit->preview), E.view.screen_cols - used);
+
+            if (idx == selected) {
+                for (; used < E.view.screen_cols; used++)
+                    abAppend(&ab, " ", 1);
+                abAppend(&ab, RESET_BG_COLOR, sizeof(RESET_BG_COLOR) - 1);
+            }
+        }
+        abAppend(&ab, CLEAR_LINE NEW_LINE, sizeof(CLEAR_LINE NEW_LINE) - 1);
+    }
+    pthread_mutex_unlock(&ps->lock);
+
+    const char *help = "Enter: open  Arrows/PgUp/PgDn/Home/End: move  ESC: close";
+    editorAppendClipped(&ab, help, strlen(help), E.view.screen_cols);
+    abAppend(&ab, CLEAR_LINE, sizeof(CLEAR_LINE) - 1);
+
+    write(STDOUT_FILENO, ab.b, ab.len);
+    abFree(&ab);
+}
+
+int editorProjectResults(ProjectSearch *ps) {
+    int selected = 0;
+    int top = 0;
+    bool running = true;
+    bool needs_redraw = true;
+    while (true) {
+        if (E.view.resized) {
+            E.view.resized = 0;
+            if (getWindowSize(&E.view.screen_rows, &E.view.screen_cols) == -1) die("getWindowSize");
+            E.view.screen_rows -= UI_RESERVED_ROWS;
+            needs_redraw = true;
+        }
+
+        if (running && !projectSearchRunning(ps)) {
+            projectSearchFinish(ps, false);
+            running = false;
+            needs_redraw = true;
+
+            // hits streamed in as files finished, the final list is sorted with the selection kept
+            ProjectHit keep = selected < ps->num_hits ? ps->hits[selected] : (ProjectHit){ NULL, 0, 0, NULL };
+            if (ps->num_hits > 1) qsort(ps->hits, ps->num_hits, sizeof(ProjectHit), compareProjectHits);
+            for (int i = 0; keep.preview && i < ps->num_hits; i++) {
+                if (ps->hits[i].preview == keep.preview) {
+                    selected = i;
+                    break;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&ps->lock);
+        int total = ps->num_hits;
+        pthread_mutex_unlock(&ps->lock);
+
+        if (selected >= total) selected = total - 1;
+        if (selected < 0) selected = 0;
+        if (selected < top) top = selected;
+        if (selected >= top + E.view.screen_rows) top = selected - E.view.screen_rows + 1;
+
+        // while the walk runs, the list is redrawn on every read timeout to stream new hits
+        if (needs_redraw || running) {
+            editorDrawProjectResults(ps, selected, top);
+            needs_redraw = false;
+        }
+
+        int ch = editorReadKey();
+        if (ch == 0) continue;
+        needs_redraw = true;
+        switch (ch) {
+            case ARROW_UP:
+                selected--;
+                break;
+            case ARROW_DOWN:
+                selected++;
+                break;
+            case PAGE_UP:
+                selected -= E.view.screen_rows;
+                break;
+            case PAGE_DOWN:
+                selected += E.view.screen_rows;
+                break;
+            case HOME_KEY:
+                selected = 0;
+                break;
+            case END_KEY:
+                selected = total - 1;
+                break;
+            case '\r':
+                if (total > 0) return selected;
+                break;
+            case ESCAPE_CHAR:
+            case CTRL_KEY('q'):
+                return -1;
+        }
+    }
+}
+
+void editorOpenProjectHit(const ProjectHit *hit, const char *query) {
+    // a hit in the open file only moves the cursor
+    char *open_path = E.buf.filename ? realpath(E.buf.filename, NULL) : NULL;
+    char *hit_path = realpath(hit->path, NULL);
+    bool same_file = open_path && hit_path && strcmp(open_path, hit_path) == 0;
+    free(open_path);
+    free(hit_path);
+    if (!same_file && !editorSwitchFile(hit->path)) return;
+
+    editorResetFind();
+    E.sel.active = false;
+    E.cursor.y = hit->line;
+    E.cursor.x = hit->col;
+    clampCursorPosition();
+    E.cursor.preferred_x = E.cursor.x;
+    E.view.row_offset = E.cursor.y - E.view.screen_rows / 2;
+    if (E.view.row_offset < 0) E.view.row_offset = 0;
+    E.view.col_offset = 0;
+
+    // the query stays highlighted in the opened file, starting from the hit
+    E.find.query = safeStrdup(query);
+    E.find.active = true;
+    editorUpdateMatchList(NULL, E.find.query);
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "%s:%d (ESC to clear highlights)", hit->path, hit->line + 1);
+    editorSetStatusMsg(msg);
+}
+
+void editorProjectSearch() {
+    E.sys.has_bracket = false;
+    char *initial = editorGetSelectedText(NULL);
+    if (!initial && g_project_query) initial = safeStrdup(g_project_query);
+
+    editorProjectPromptText();
+    char *query = editorPrompt(g_project_prompt, editorProjectSearchCallback, initial);
+    if (!query) {
+        editorSetStatusMsg("Project search cancelled");
+        return;
+    }
+    free(g_project_query);
+    g_project_query = query;
+
+    if (E.find.use_regex) {
+        Regex re;
+        const char *error;
+        if (!regexCompile(&re, query, &error)) {
+            char msg[STATUS_LENGTH];
+            snprintf(msg, sizeof(msg), "Bad regex: %s", error);
+            editorSetStatusMsg(msg);
+            return;
+        }
+        regexFree(&re);
+    }
+
+    ProjectSearch ps;
+    projectSearchStart(&ps, ".", query, editorSearchThreads(), false);
+    int idx = editorProjectResults(&ps);
+    projectSearchFinish(&ps, true);
+
+    write(STDOUT_FILENO, CLEAR_SCREEN CURSOR_RESET SHOW_CURSOR, sizeof(CLEAR_SCREEN CURSOR_RESET SHOW_CURSOR) - 1);
+    editorInvalidateFrameCache();
+    if (idx >= 0) {
+        editorOpenProjectHit(&ps.hits[idx], query);
+    } else {
+        char msg[STATUS_LENGTH];
+        snprintf(msg, sizeof(msg), "%d match%s in %d file%s", ps.num_hits, ps.num_hits == 1 ? "" : "es", ps.num_files, ps.num_files == 1 ? "" : "s");
+        editorSetStatusMsg(msg);
+    }
+    projectSearchFree(&ps);
+}
+
+bool benchRunRipgrep(const char *dir, const char *query, size_t *count, long *elapsed_us) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    long start = currentMicros();
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) dup2(null_fd, STDERR_FILENO);
+        execlp("rg", "rg", "--count-matches", "--no-messages", "--no-require-git", "--fixed-strings", "--", query, dir, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    // every output line is path:count
+    *count = 0;
+    FILE *fp = fdopen(fds[0], "r");
+    char line[PATH_MAX + BUFFER_SIZE_PADDING];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char *colon = strrchr(line, ':');
+        if (colon) *count += strtoull(colon + 1, NULL, 10);
+    }
+    if (fp) fclose(fp);
+    else close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    *elapsed_us = currentMicros() - start;
+    // rg exits with 1 when nothing matched and 127 comes from the failed exec above
+    return WIFEXITED(status) && (WEXITSTATUS(status) == 0 || WEXITSTATUS(status) == 1);
+}
+
+int editorBenchProject(const char *dir, const char *query) {
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "cypher: %s is not a directory\n", dir);
+        return 1;
+    }
+
+    // the warm up walk fills the page cache, so every timed run reads from memory like rg's would
+    ProjectSearch ps;
+    projectSearchStart(&ps, dir, query, editorSearchThreads(), true);
+    projectSearchFinish(&ps, false);
+    size_t files = ps.files_searched, bytes = ps.bytes_searched;
+    projectSearchFree(&ps);
+
+    char size_str[BUFFER_SIZE_32];
+    humanReadableSize(bytes, size_str, sizeof(size_str));
+    printf("%s: %zu files, %s, query \"%s\" (best of %d runs)\n", dir, files, size_str, query, BENCH_RUNS);
+
+    int max_threads = editorSearchThreads();
+    bool counts_agree = true;
+    size_t first_count = 0;
+    long single = 0;
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+        long best = LONG_MAX;
+        size_t count = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            projectSearchStart(&ps, dir, query, threads, true);
+            projectSearchFinish(&ps, false);
+            if (ps.elapsed_us < best) best = ps.elapsed_us;
+            count = ps.total_matches;
+            projectSearchFree(&ps);
+        }
+        if (threads == 1) {
+            single = best;
+            first_count = count;
+        }
+        if (count != first_count) counts_agree = false;
+        printf("  %2d thread%s   : %zu matches, %8.3f ms, %6.2f GB/s, %5.2fx\n", threads, threads == 1 ? " " : "s", count, best / 1000.0,
+               bytes / (best > 0 ? best * 1000.0 : 1.0), (double)single / (best > 0 ? best : 1));
+        if (threads == max_threads) break;
+    }
+
+    // rg is timed as a whole process, its startup is part of what a user waits for too
+    long best_rg = LONG_MAX;
+    size_t rg_count = 0;
+    bool has_rg = true;
+    for (int run = 0; run < BENCH_RUNS && has_rg; run++) {
+        long elapsed;
+        has_rg = benchRunRipgrep(dir, query, &rg_count, &elapsed);
+        if (elapsed < best_rg) best_rg = elapsed;
+    }
+    if (has_rg) {
+        printf("  ripgrep      : %zu matches, %8.3f ms, %6.2f GB/s\n", rg_count, best_rg / 1000.0, bytes / (best_rg > 0 ? best_rg * 1000.0 : 1.0));
+        if (rg_count != first_count)
+            printf("  note: ripgrep counts differ (its binary file and ignore rules are not identical)\n");
+    } else {
+        printf("  (rg not found on PATH, comparison skipped)\n");
+    }
+
+    if (!counts_agree)
+        printf("  MISMATCH: match counts differ between thread counts\n");
+    return counts_agree ? 0 : 1;
+}
+
+void freeEditCommand(EditCommand *cmd) {
+    editCommandAccount(cmd, false);
+    free(cmd->packed);
+    cmd->packed = NULL;
+    free(cmd->text);
+    cmd->text = NULL;
+    free(cmd->pieces);
+    cmd->pieces = NULL;
+    free(cmd->spans);
+    cmd->spans = NULL;
+    free(cmd->new_text);
+    cmd->new_text = NULL;
+}
+
+void editCommandAddPieces(EditCommand *cmd, const Piece *pieces, size_t num_pieces, bool prepend) {
+    if (num_pieces == 0) return;
+
+    // typing and backspacing walk along one buffer, so a burst usually just grows the piece at its edge
+    if (cmd->num_pieces > 0) {
+        Piece *edge = prepend ? &cmd->pieces[0] : &cmd->pieces[cmd->num_pieces - 1];
+        const Piece *next = prepend ? &pieces[num_pieces - 1] : &pieces[0];
+        if (edge->source == next->source && prepend && next->start + next->length == edge->start) {
+            edge->start = next->start;
+            edge->length += next->length;
+            num_pieces--;
+        } else if (edge->source == next->source && !prepend && edge->start + edge->length == next->start) {
+            edge->length += next->length;
+            pieces++;
+            num_pieces--;
+        }
+        if (num_pieces == 0) return;
+    }
+
+    if (cmd->num_pieces + num_pieces > cmd->piece_capacity) {
+        cmd->piece_capacity = cmd->piece_capacity == 0 ? num_pieces : cmd->piece_capacity * 2;
+        while (cmd->piece_capacity < cmd->num_pieces + num_pieces) cmd->piece_capacity *= 2;
+        cmd->pieces = safeRealloc(cmd->pieces, sizeof(Piece) * cmd->piece_capacity);
+    }
+    if (prepend) {
+        memmove(cmd->pieces + num_pieces, cmd->pieces, sizeof(Piece) * cmd->num_pieces);
+        memcpy(cmd->pieces, pieces, sizeof(Piece) * num_pieces);
+    } else {
+        memcpy(cmd->pieces + cmd->num_pieces, pieces, sizeof(Piece) * num_pieces);
+    }
+    cmd->num_pieces += num_pieces;
+}
+
+char *editCommandText(EditCommand *cmd) {
+    char *text = safeMalloc(cmd->len + 1);
+    ptReadPieces(&E.buf.pt, cmd->pieces, cmd->num_pieces, text);
+    return text;
+}
+
+void editorBeginMacro() {
+    history.in_transaction = true;
+    history.current_transaction_id++;
+}
+
+void editorEndMacro() {
+    history.in_transaction = false;
+}
+
+void editorBeginBatch() {
+    history.batch.active = true;
+    history.batch.num_edits = 0;
+    history.batch.text_len = 0;
+    history.batch.cursor = E.cursor;
+    history.batch.join = false;
+}
+
+void editorBatchReplace(size_t offset, size_t old_len, const char *text, size_t new_len) {
+    if (old_len == 0 && new_len == 0) return;
+    EditBatch *batch = &history.batch;
+    if (!batch->active) {
+        executeDelete(offset, old_len);
+        executeInsert(offset, text, new_len);
+        return;
+    }
+
+    // offsets stay in the coordinates of the text at editorBeginBatch, nothing is applied until the commit
+    if (batch->num_edits >= batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? INIT_EDIT_BATCH_CAP : batch->capacity * 2;
+        batch->edits = safeRealloc(batch->edits, sizeof(BatchEdit) * batch->capacity);
+    }
+    if (batch->text_len + new_len > batch->text_capacity) {
+        if (batch->text_capacity == 0) batch->text_capacity = BUFFER_SIZE_1024;
+        while (batch->text_len + new_len > batch->text_capacity) batch->text_capacity *= 2;
+        batch->text = safeRealloc(batch->text, batch->text_capacity);
+    }
+    if (new_len > 0) memcpy(batch->text + batch->text_len, text, new_len);
+    batch->edits[batch->num_edits++] = (BatchEdit){offset, old_len, new_len, batch->text_len};
+    batch->text_len += new_len;
+}
+
+int compareBatchEdits(const void *a, const void *b) {
+    const BatchEdit *ea = a;
+    const BatchEdit *eb = b;
+    if (ea->offset != eb->offset) return ea->offset < eb->offset ? -1 : 1;
+    // edits at the same offset keep the order they were queued in
+    if (ea->text_start != eb->text_start) return ea->text_start < eb->text_start ? -1 : 1;
+    return 0;
+}
+
+void editorCommitBatch() {
+    EditBatch *batch = &history.batch;
+    batch->active = false;
+    if (batch->num_edits == 0) return;
+
+    qsort(batch->edits, batch->num_edits, sizeof(BatchEdit), compareBatchEdits);
+
+    // touching or overlapping edits are merged so the spans handed to the piece table are disjoint
+    ReplaceSpan *spans = safeMalloc(sizeof(ReplaceSpan) * batch->num_edits);
+    char *new_text = safeMalloc(batch->text_len + 1);
+    size_t count = 0, new_len = 0, old_len = 0;
+    for (size_t i = 0; i < batch->num_edits; i++) {
+        BatchEdit *edit = &batch->edits[i];
+        size_t end = edit->offset + edit->old_len;
+        if (end > E.buf.pt.logical_size) end = E.buf.pt.logical_size;
+        if (edit->offset > end) continue;
+        if (count > 0 && edit->offset <= spans[count - 1].offset + spans[count - 1].old_len) {
+            ReplaceSpan *prev = &spans[count - 1];
+            size_t prev_end = prev->offset + prev->old_len;
+            if (end > prev_end) {
+                old_len += end - prev_end;
+                prev->old_len = end - prev->offset;
+            }
+            prev->new_len += edit->new_len;
+        } else {
+            spans[count++] = (ReplaceSpan){edit->offset, end - edit->offset, edit->new_len};
+            old_len += end - edit->offset;
+        }
+        if (edit->new_len > 0) memcpy(new_text + new_len, batch->text + edit->text_start, edit->new_len);
+        new_len += edit->new_len;
+    }
+    if (count == 0) {
+        free(spans);
+        free(new_text);
+        return;
+    }
+
+    if (count == 1 && !batch->join && (spans[0].old_len == 0 || spans[0].new_len == 0)) {
+        // a lone insert or delete patches the line index in place instead of rebuilding it over the whole text
+        EditorCursor cursor = E.cursor;
+        E.cursor = batch->cursor;
+        history.last_edit_time = 0;
+        if (spans[0].old_len > 0)
+            executeDelete(spans[0].offset, spans[0].old_len);
+        else
+            executeInsert(spans[0].offset, new_text, new_len);
+        history.last_edit_time = 0;
+        E.cursor = cursor;
+        clampCursorPosition();
+        free(spans);
+        free(new_text);
+        return;
+    }
+
+    char *old_text = safeMalloc(old_len + 1);
+    size_t old_pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        ptReadLogical(&E.buf.pt, spans[i].offset, spans[i].old_len, old_text + old_pos);
+        old_pos += spans[i].old_len;
+    }
+
+    // the whole batch is one undo entry, one piece list splice, one line index rebuild and one tree edit
+    EditorCursor cursor = E.cursor;
+    bool merged = batch->join && editorMergeBulkCommand(spans, count, old_text, new_text);
+    batch->join = merged;
+    if (!merged)
+        recordBulkCommand(spans, count, old_text, old_len, new_text, new_len, false, batch->cursor);
+    editorDocumentReplaceSpans(spans, count, new_text, new_len, false, NULL, NULL);
+    if (merged) {
+        free(spans);
+        free(old_text);
+        free(new_text);
+    }
+    E.cursor = cursor;
+    clampCursorPosition();
+    if (!E.sel.is_pasting) E.ts.needs_reparse = true;
+    E.buf.dirty = true;
+}
+
+void recordCommand(CommandType type, size_t offset, const Piece *pieces, size_t num_pieces, size_t len, EditorCursor cursor) {
+    long now = currentMillis();
+    editorParkRedo();
+
+    if (history.save_point > history.undo_top)
+        history.save_point = -2;
+
+    bool merged = false;
+    if (history.undo_top >= 0) {
+        EditCommand *last_cmd = &history.undo_stack[history.undo_top];
+        long time_elapsed = now - history.last_edit_time;
+
+        int current_txn = history.in_transaction ? history.current_transaction_id : 0;
+        if (time_elapsed < UNDO_TIMEOUT_MS && last_cmd->type == type && last_cmd->transaction_id == current_txn && last_cmd->storage == UNDO_RAW) {
+            editCommandAccount(last_cmd, false);
+            if (type == CMD_INSERT && offset == last_cmd->offset + last_cmd->len) {
+                editCommandAddPieces(last_cmd, pieces, num_pieces, false);
+                last_cmd->len += len;
+                merged = true;
+            } else if (type == CMD_DELETE) {
+                if (offset + len == last_cmd->offset) {
+                    editCommandAddPieces(last_cmd, pieces, num_pieces, true);
+                    last_cmd->offset = offset;
+                    last_cmd->len += len;
+                    merged = true;
+                } else if (offset == last_cmd->offset) {
+                    editCommandAddPieces(last_cmd, pieces, num_pieces, false);
+                    last_cmd->len += len;
+                    merged = true;
+                }
+            }
+            editCommandAccount(last_cmd, true);
+            if (merged) editorHistoryChangedFrom(history.undo_top);
+        }
+    }
+
+    if (!merged) {
+        if (history.undo_top >= history.undo_capacity - 1) {
+            history.undo_capacity *= 2;
+            history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+        }
+
+        // the entry only refers to the text, which stays in the piece table buffers
+        history.undo_top++;
+        EditCommand *cmd = &history.undo_stack[history.undo_top];
+        cmd->type = type;
+        cmd->offset = offset;
+        cmd->text = NULL;
+        cmd->len = len;
+        cmd->capacity = 0;
+        cmd->pieces = NULL;
+        cmd->num_pieces = 0;
+        cmd->piece_capacity = 0;
+        editCommandAddPieces(cmd, pieces, num_pieces, false);
+        cmd->cursor = cursor;
+        cmd->transaction_id = history.in_transaction ? history.current_transaction_id : 0;
+        cmd->spans = NULL;
+        cmd->num_spans = 0;
+        cmd->new_text = NULL;
+        cmd->new_len = 0;
+        cmd->shared_text = false;
+        cmd->storage = UNDO_RAW;
+        cmd->packed = NULL;
+        cmd->packed_len = 0;
+        cmd->flip_on_load = false;
+        editCommandAccount(cmd, true);
+    }
+    history.last_edit_time = now;
+    editorTrimUndoMemory();
+}
+
+void recordBulkCommand(ReplaceSpan *spans, size_t num_spans, char *old_text, size_t old_len, char *new_text, size_t new_len, bool shared, EditorCursor cursor) {
+    editorParkRedo();
+
+    if (history.save_point > history.undo_top)
+        history.save_point = -2;
+
+    if (history.undo_top >= history.undo_capacity - 1) {
+        history.undo_capacity *= 2;
+        history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+    }
+
+    // the entry owns the spans and both text pools
+    history.undo_top++;
+    EditCommand *cmd = &history.undo_stack[history.undo_top];
+    cmd->type = CMD_BULK;
+    cmd->offset = spans[0].offset;
+    cmd->text = old_text;
+    cmd->len = old_len;
+    cmd->capacity = old_len + 1;
+    cmd->pieces = NULL;
+    cmd->num_pieces = 0;
+    cmd->piece_capacity = 0;
+    cmd->cursor = cursor;
+    cmd->transaction_id = 0;
+    cmd->spans = spans;
+    cmd->num_spans = num_spans;
+    cmd->new_text = new_text;
+    cmd->new_len = new_len;
+    cmd->shared_text = shared;
+    cmd->storage = UNDO_RAW;
+    cmd->packed = NULL;
+    cmd->packed_len = 0;
+    cmd->flip_on_load = false;
+    editCommandAccount(cmd, true);
+    history.last_edit_time = currentMillis();
+    editorTrimUndoMemory();
+}
+
+size_t composeSpanText(const ComposeSpan *x, size_t nx, const ComposeSpan *y, size_t ny, size_t start, size_t end, bool use_new, char *out) {
+    // x replaces its stretch, the rest of [start, end) is covered by y and copied out of it
+    size_t out_len = 0, xi = 0, yi = 0, pos = start;
+    while (true) {
+        if (xi < nx && x[xi].start == pos) {
+            const char *text = use_new ? x[xi].new_text : x[xi].old_text;
+            size_t len = use_new ? x[xi].new_len : x[xi].old_len;
+            memcpy(out + out_len, text, len);
+            out_len += len;
+            pos = x[xi++].end;
+            continue;
+        }
+        if (pos >= end) break;
+
+        while (yi < ny && y[yi].end <= pos) yi++;
+        if (yi >= ny) break;
+        size_t stop = y[yi].end;
+        if (xi < nx && x[xi].start < stop) stop = x[xi].start;
+        memcpy(out + out_len, (use_new ? y[yi].new_text : y[yi].old_text) + (pos - y[yi].start), stop - pos);
+        out_len += stop - pos;
+        pos = stop;
+    }
+    return out_len;
+}
+
+bool editorMergeBulkCommand(const ReplaceSpan *spans, size_t num_spans, const char *old_text, const char *new_text) {
+    if (history.undo_top < 0 || history.redo_top >= 0 || history.save_point == history.undo_top) return false;
+    EditCommand *cmd = &history.undo_stack[history.undo_top];
+    if (cmd->type != CMD_BULK || cmd->storage != UNDO_RAW || cmd->shared_text) return false;
+
+    // both batches as stretches of the text between them: what the first one wrote and what the second one replaced
+    size_t na = cmd->num_spans, nb = num_spans;
+    ComposeSpan *a = safeMalloc(sizeof(ComposeSpan) * (na + 1));
+    ComposeSpan *b = safeMalloc(sizeof(ComposeSpan) * (nb + 1));
+    long delta = 0;
+    size_t old_pos = 0, new_pos = 0;
+    for (size_t i = 0; i < na; i++) {
+        ReplaceSpan *span = &cmd->spans[i];
+        size_t start = (size_t)((long)span->offset + delta);
+        a[i] = (ComposeSpan){ start, start + span->new_len, cmd->text + old_pos, span->old_len, cmd->new_text + new_pos, span->new_len };
+        old_pos += span->old_len;
+        new_pos += span->new_len;
+        delta += (long)span->new_len - (long)span->old_len;
+    }
+    old_pos = new_pos = 0;
+    for (size_t i = 0; i < nb; i++) {
+        b[i] = (ComposeSpan){ spans[i].offset, spans[i].offset + spans[i].old_len, old_text + old_pos, spans[i].old_len, new_text + new_pos, spans[i].new_len };
+        old_pos += spans[i].old_len;
+        new_pos += spans[i].new_len;
+    }
+
+    // stretches that overlap or touch become one span, its old text comes from before the first batch
+    // and its new text from after the second
+    ReplaceSpan *merged = safeMalloc(sizeof(ReplaceSpan) * (na + nb));
+    char *merged_old = safeMalloc(cmd->len + old_pos + 1);
+    char *merged_new = safeMalloc(cmd->new_len + new_pos + 1);
+    size_t count = 0, merged_old_len = 0, merged_new_len = 0, ai = 0, bi = 0;
+    long delta_a = 0;
+    while (ai < na || bi < nb) {
+        size_t a0 = ai, b0 = bi;
+        size_t start = (bi >= nb || (ai < na && a[ai].start <= b[bi].start)) ? a[ai].start : b[bi].start;
+        size_t end = start;
+        while (true) {
+            if (ai < na && a[ai].start <= end) {
+                if (a[ai].end > end) end = a[ai].end;
+                delta_a += (long)a[ai].new_len - (long)a[ai].old_len;
+                ai++;
+            } else if (bi < nb && b[bi].start <= end) {
+                if (b[bi].end > end) end = b[bi].end;
+                bi++;
+            } else {
+                break;
+            }
+        }
+
+        long delta_before = delta_a;
+        for (size_t i = a0; i < ai; i++) delta_before -= (long)a[i].new_len - (long)a[i].old_len;
+        size_t cluster_old = composeSpanText(a + a0, ai - a0, b + b0, bi - b0, start, end, false, merged_old + merged_old_len);
+        size_t cluster_new = composeSpanText(b + b0, bi - b0, a + a0, ai - a0, start, end, true, merged_new + merged_new_len);
+        merged[count++] = (ReplaceSpan){ (size_t)((long)start - delta_before), cluster_old, cluster_new };
+        merged_old_len += cluster_old;
+        merged_new_len += cluster_new;
+    }
+    free(a);
+    free(b);
+
+    editCommandAccount(cmd, false);
+    free(cmd->spans);
+    free(cmd->text);
+    free(cmd->new_text);
+    cmd->spans = merged;
+    cmd->num_spans = count;
+    cmd->offset = merged[0].offset;
+    cmd->text = merged_old;
+    cmd->len = merged_old_len;
+    cmd->capacity = merged_old_len + 1;
+    cmd->new_text = merged_new;
+    cmd->new_len = merged_new_len;
+    editCommandAccount(cmd, true);
+    editorHistoryChangedFrom(history.undo_top);
+    history.last_edit_time = currentMillis();
+    editorTrimUndoMemory();
+    return true;
+}
+
+void editorInvertBulkCommand(EditCommand *cmd) {
+    // spans move to the offsets of the replaced text and swap their lengths
+    long delta = 0;
+    for (size_t i = 0; i < cmd->num_spans; i++) {
+        ReplaceSpan *span = &cmd->spans[i];
+        size_t old_len = span->old_len;
+        span->offset = (size_t)((long)span->offset + delta);
+        delta += (long)span->new_len - (long)old_len;
+        span->old_len = span->new_len;
+        span->new_len = old_len;
+    }
+
+    char *text = cmd->text;
+    size_t len = cmd->len;
+    cmd->text = cmd->new_text;
+    cmd->len = cmd->new_len;
+    cmd->capacity = cmd->len + 1;
+    cmd->new_text = text;
+    cmd->new_len = len;
+    cmd->offset = cmd->num_spans > 0 ? cmd->spans[0].offset : 0;
+}
+
+void editorDocumentInsert(size_t offset, const char *text, size_t len, const Piece *pieces, size_t num_pieces) {
+    editorEditTreeSitter(offset, 0, len, text);
+    // text coming back from the history is spliced in from where it already is
+    if (pieces)
+        ptInsertPieces(&E.buf.pt, offset, pieces, num_pieces, len);
+    else
+        ptInsert(&E.buf.pt, offset, text, len);
+    editorInsertLineOffsets(&E.buf, offset, text, len);
+    bracketIndexInsert(&E.buf.brackets, offset, text, len);
+    editorFindTrackEdit(offset, 0, len);
+    dirtyRangesTrackEdit(&E.buf.edited, offset, 0, len);
+    E.buf.generation++;
+}
+
+void editorDocumentDelete(size_t offset, const char *deleted_text, size_t len) {
+    editorEditTreeSitter(offset, len, 0, NULL);
+    ptDelete(&E.buf.pt, offset, len);
+    editorDeleteLineOffsets(&E.buf, offset, deleted_text, len);
+    bracketIndexDelete(&E.buf.brackets, offset, len);
+    editorFindTrackEdit(offset, len, 0);
+    dirtyRangesTrackEdit(&E.buf.edited, offset, len, 0);
+    E.buf.generation++;
+}
+
+void editorDocumentReplaceSpans(const ReplaceSpan *spans, size_t num_spans, const char *text, size_t text_len, bool shared, const Piece *pieces, const size_t *piece_counts) {
+    // the syntax tree gets one edit covering every span so the next parse stays incremental
+    size_t start = spans[0].offset;
+    size_t old_end = spans[num_spans - 1].offset + spans[num_spans - 1].old_len;
+    size_t new_end = old_end;
+    for (size_t i = 0; i < num_spans; i++)
+        new_end = new_end + spans[i].new_len - spans[i].old_len;
+    int start_row = 0, start_col = 0, old_end_row = 0, old_end_col = 0, new_end_row, new_end_col;
+    if (E.ts.tree) {
+        editorOffsetToRowCol(&E.buf, start, &start_row, &start_col);
+        editorOffsetToRowCol(&E.buf, old_end, &old_end_row, &old_end_col);
+    }
+
+    // text coming back from the history is spliced in from where it already is
+    if (pieces)
+        ptSpliceSpans(&E.buf.pt, spans, num_spans, pieces, piece_counts);
+    else
+        ptReplaceSpans(&E.buf.pt, spans, num_spans, text, text_len, shared);
+    dirtyRangesApply(&E.buf.edited, spans, num_spans);
+    E.buf.generation++;
+    // the line starts, matches and brackets are patched span by span, nothing rescans the whole text
+    editorReplaceLineOffsets(&E.buf, spans, num_spans, text, shared);
+    editorFindTrackSpans(spans, num_spans);
+    clampCursorPosition();
+    E.cursor.preferred_x = E.cursor.x;
+
+    if (E.ts.tree) {
+        editorOffsetToRowCol(&E.buf, new_end, &new_end_row, &new_end_col);
+        TSInputEdit edit = {
+            .start_byte = start,
+            .old_end_byte = old_end,
+            .new_end_byte = new_end,
+            .start_point = { (uint32_t)start_row, (uint32_t)start_col },
+            .old_end_point = { (uint32_t)old_end_row, (uint32_t)old_end_col },
+            .new_end_point = { (uint32_t)new_end_row, (uint32_t)new_end_col },
+        };
+        ts_tree_edit(E.ts.tree, &edit);
+    }
+
+    // brackets come last so the new ones are classified against the edited tree
+    long delta = 0;
+    size_t text_pos = 0;
+    for (size_t i = 0; i < num_spans; i++) {
+        size_t offset = (size_t)((long)spans[i].offset + delta);
+        bracketIndexDelete(&E.buf.brackets, offset, spans[i].old_len);
+        bracketIndexInsert(&E.buf.brackets, offset, text + text_pos, spans[i].new_len);
+        if (!shared) text_pos += spans[i].new_len;
+        delta += (long)spans[i].new_len - (long)spans[i].old_len;
+    }
+}
+
+void editorDocumentRestore(const PieceSnapshot *snap) {
+    ptRestore(&E.buf.pt, snap);
+    E.buf.edited.all = true;
+    if (E.ts.tree) {
+        ts_tree_delete(E.ts.tree);
+        E.ts.tree = NULL;
+    }
+    editorDocumentRebuild();
+}
+
+void editorDocumentRebuild() {
+    // everything derived from the text is rebuilt once instead of being patched per edit
+    editorUpdateLineOffsets(&E.buf);
+    E.buf.brackets.valid = false;
+    editorClearPrefixCache();
+    editorFindRestartScan();
+
+    clampCursorPosition();
+    E.cursor.preferred_x = E.cursor.x;
+}
+
+bool editorApplyGroup(EditCommand *cmds, int count, bool undo, bool *damaged) {
+    for (int i = 0; i < count; i++) {
+        if (!editCommandLoad(&cmds[i])) {
+            *damaged = true;
+            return false;
+        }
+        if (cmds[i].type == CMD_BULK) return false;
+    }
+
+    // the entries are replayed from the top of the stack down, undo applies the inverse of each
+    ReplaceSpan *spans = safeMalloc(sizeof(ReplaceSpan) * count);
+    bool descending = true, ascending = true;
+    for (int i = count - 1, n = 0; i >= 0; i--, n++) {
+        bool inserts = (cmds[i].type == CMD_INSERT) != undo;
+        spans[n] = (ReplaceSpan){ cmds[i].offset, inserts ? 0 : cmds[i].len, inserts ? cmds[i].len : 0 };
+        if (n == 0) continue;
+        ReplaceSpan *prev = &spans[n - 1];
+        if (spans[n].offset + spans[n].old_len > prev->offset) descending = false;
+        if (spans[n].offset < prev->offset + prev->new_len) ascending = false;
+    }
+    if (!descending && !ascending) {
+        // edits that land on each other's text are left to the one by one replay
+        free(spans);
+        return false;
+    }
+
+    // both layouts become ascending spans over the text as it is now, which is one pass over the piece list
+    if (descending) {
+        for (int i = 0, j = count - 1; i < j; i++, j--) {
+            ReplaceSpan tmp = spans[i];
+            spans[i] = spans[j];
+            spans[j] = tmp;
+        }
+    } else {
+        long delta = 0;
+        for (int n = 0; n < count; n++) {
+            spans[n].offset = (size_t)((long)spans[n].offset - delta);
+            delta += (long)spans[n].new_len - (long)spans[n].old_len;
+        }
+    }
+
+    // the recorded pieces go back into the list as they are, the text is only read for the line starts
+    size_t text_len = 0, num_pieces = 0;
+    for (int n = 0; n < count; n++) {
+        text_len += spans[n].new_len;
+        if (spans[n].new_len > 0) num_pieces += cmds[descending ? n : count - 1 - n].num_pieces;
+    }
+    char *text = safeMalloc(text_len + 1);
+    Piece *pieces = safeMalloc(sizeof(Piece) * (num_pieces + 1));
+    size_t *piece_counts = safeMalloc(sizeof(size_t) * count);
+    size_t text_pos = 0, piece_pos = 0;
+    for (int n = 0; n < count; n++) {
+        piece_counts[n] = 0;
+        if (spans[n].new_len == 0) continue;
+        EditCommand *cmd = &cmds[descending ? n : count - 1 - n];
+        ptReadPieces(&E.buf.pt, cmd->pieces, cmd->num_pieces, text + text_pos);
+        memcpy(&pieces[piece_pos], cmd->pieces, sizeof(Piece) * cmd->num_pieces);
+        piece_counts[n] = cmd->num_pieces;
+        text_pos += spans[n].new_len;
+        piece_pos += cmd->num_pieces;
+    }
+
+    editorDocumentReplaceSpans(spans, count, text, text_len, false, pieces, piece_counts);
+    free(spans);
+    free(text);
+    free(pieces);
+    free(piece_counts);
+    return true;
+}
+
+void executeInsert(size_t offset, const char *text, size_t len) {
+    if (len == 0) return;
+
+    // ptInsert appends the text at the end of the add buffer, the history points there
+    Piece piece = {BUFFER_ADD, E.buf.pt.add_len, len};
+    recordCommand(CMD_INSERT, offset, &piece, 1, len, E.cursor);
+    editorDocumentInsert(offset, text, len, NULL, 0);
+    if (!E.sel.is_pasting) E.ts.needs_reparse = true;
+    E.buf.dirty = true;
+}
+
+void executeDelete(size_t offset, size_t len) {
+    if (len == 0) return;
+
+    char *deleted_text = safeMalloc(len + 1);
+    ptReadLogical(&E.buf.pt, offset, len, deleted_text);
+
+    size_t num_pieces;
+    Piece *pieces = ptCopyPieces(&E.buf.pt, offset, len, &num_pieces);
+    recordCommand(CMD_DELETE, offset, pieces, num_pieces, len, E.cursor);
+    free(pieces);
+    editorDocumentDelete(offset, deleted_text, len);
+    if (!E.sel.is_pasting) E.ts.needs_reparse = true;
+    E.buf.dirty = true;
+    free(deleted_text);
+}
+
+void editorUndo() {
+    if (history.undo_top < 0) {
+        editorSetStatusMsg("Nothing to undo");
+        return;
+    }
+
+    // the state before the first undo is kept, a new edit from here turns it into a branch tip
+    if (history.redo_top < 0 && !history.tip) {
+        history.tip = ptSnapshot(&E.buf.pt);
+        history.tip_cursor = E.cursor;
+    }
+
+    int target_transaction = history.undo_stack[history.undo_top].transaction_id;
+    bool is_macro = (target_transaction != 0);
+    bool damaged = false;
+    int group = 1;
+    while (is_macro && group <= history.undo_top && history.undo_stack[history.undo_top - group].transaction_id == target_transaction)
+        group++;
+    // a long transaction is applied as one net edit when its entries don't overlap
+    bool batched = group >= UNDO_BATCH_MIN && editorApplyGroup(&history.undo_stack[history.undo_top - group + 1], group, true, &damaged);
+    do {
+        if (damaged || history.undo_top < 0) break;
+        EditCommand *cmd = &history.undo_stack[history.undo_top];
+        if (is_macro && cmd->transaction_id != target_transaction) break;
+
+        if (history.redo_top >= history.redo_capacity - 1) {
+            history.redo_capacity *= 2;
+            history.redo_stack = safeRealloc(history.redo_stack, sizeof(EditCommand) * history.redo_capacity);
+        }
+
+        // the entry moves over with its buffers, nothing is copied
+        history.redo_top++;
+        history.redo_stack[history.redo_top] = *cmd;
+        cmd = &history.redo_stack[history.redo_top];
+        history.undo_top--;
+        if (history.pack_floor > history.undo_top + 1) history.pack_floor = history.undo_top + 1;
+        if (history.spill_floor > history.undo_top + 1) history.spill_floor = history.undo_top + 1;
+        E.cursor = cmd->cursor;
+        if (batched) continue;
+        if (!editCommandLoad(cmd)) {
+            damaged = true;
+            break;
+        }
+
+        if (cmd->type == CMD_INSERT) {
+            char *text = editCommandText(cmd);
+            editorDocumentDelete(cmd->offset, text, cmd->len);
+            free(text);
+        } else if (cmd->type == CMD_DELETE) {
+            char *text = editCommandText(cmd);
+            editorDocumentInsert(cmd->offset, text, cmd->len, cmd->pieces, cmd->num_pieces);
+            free(text);
+        } else if (cmd->type == CMD_BULK) {
+            editorInvertBulkCommand(cmd);
+            editorDocumentReplaceSpans(cmd->spans, cmd->num_spans, cmd->new_text, cmd->new_len, cmd->shared_text, NULL, NULL);
+        }
+    } while (is_macro);
+
+    editorParseTreeSitter();
+    if (damaged) {
+        // an entry that can't be read leaves every older one without a base
+        editorClearHistory();
+        E.buf.dirty = true;
+        editorSetStatusMsg("Undo history is damaged and was dropped");
+        return;
+    }
+    editorTrimUndoMemory();
+    E.buf.dirty = (history.undo_top != history.save_point);
+    editorSetStatusMsg("Undid");
+}
+
+void editorRedo() {
+    if (history.redo_top < 0) {
+        editorSetStatusMsg("Nothing to redo");
+        return;
+    }
+
+    int target_transaction = history.redo_stack[history.redo_top].transaction_id;
+    bool is_macro = (target_transaction != 0);
+    bool damaged = false;
+    int group = 1;
+    while (is_macro && group <= history.redo_top && history.redo_stack[history.redo_top - group].transaction_id == target_transaction)
+        group++;
+    bool batched = group >= UNDO_BATCH_MIN && editorApplyGroup(&history.redo_stack[history.redo_top - group + 1], group, false, &damaged);
+    do {
+        if (damaged || history.redo_top < 0) break;
+        EditCommand *cmd = &history.redo_stack[history.redo_top];
+        if (is_macro && cmd->transaction_id != target_transaction) break;
+
+        if (history.undo_top >= history.undo_capacity - 1) {
+            history.undo_capacity *= 2;
+            history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+        }
+
+        history.undo_top++;
+        history.undo_stack[history.undo_top] = *cmd;
+        cmd = &history.undo_stack[history.undo_top];
+        history.redo_top--;
+        if (history.redo_pack_floor > history.redo_top + 1) history.redo_pack_floor = history.redo_top + 1;
+        if (history.redo_spill_floor > history.redo_top + 1) history.redo_spill_floor = history.redo_top + 1;
+        if (batched) continue;
+        if (!editCommandLoad(cmd)) {
+            damaged = true;
+            break;
+        }
+
+        if (cmd->type == CMD_INSERT) {
+            char *text = editCommandText(cmd);
+            editorDocumentInsert(cmd->offset, text, cmd->len, cmd->pieces, cmd->num_pieces);
+            free(text);
+        } else if (cmd->type == CMD_DELETE) {
+            char *text = editCommandText(cmd);
+            editorDocumentDelete(cmd->offset, text, cmd->len);
+            free(text);
+        } else if (cmd->type == CMD_BULK) {
+            editorInvertBulkCommand(cmd);
+            editorDocumentReplaceSpans(cmd->spans, cmd->num_spans, cmd->new_text, cmd->new_len, cmd->shared_text, NULL, NULL);
+        }
+    } while (is_macro);
+
+    editorParseTreeSitter();
+    if (damaged) {
+        // an entry that can't be read leaves every older one without a base
+        editorClearHistory();
+        E.buf.dirty = true;
+        editorSetStatusMsg("Undo history is damaged and was dropped");
         return;
     }
+    editorTrimUndoMemory();
+    E.buf.dirty = (history.undo_top != history.save_point);
+    editorSetStatusMsg("Redid");
+}
 
-    free(E.sel.clipboard);
-    int len;
-    E.sel.clipboard = editorGetSelectedText(&len);
-
-    if (E.sel.clipboard) {
-        char sizebuf[BUFFER_SIZE_32];
-        humanReadableSize(len, sizebuf, sizeof(sizebuf));
+size_t lzCompressBound(size_t len) {
+    return len + len / 255 + BUFFER_SIZE_32;
+}
 
-        char msg[STATUS_LENGTH];
-        snprintf(msg, sizeof(msg), "Copied %s", sizebuf);
-        editorSetStatusMsg(msg);
-        clipboardCopyToSystem(E.sel.clipboard, len);
+size_t lzPutLength(unsigned char *dst, size_t out, size_t value) {
+    while (value >= 255) {
+        dst[out++] = 255;
+        value -= 255;
     }
+    dst[out++] = (unsigned char)value;
+    return out;
 }
 
-void editorCutSelection() {
-    if (!E.sel.active) {
-        editorSetStatusMsg("No selection to cut");
-        return;
+bool lzGetLength(const unsigned char *src, size_t src_len, size_t *in, size_t *value) {
+    unsigned char byte;
+    do {
+        if (*in >= src_len) return false;
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t lzEmitSequence(unsigned char *dst, size_t out, const unsigned char *literals, size_t num_literals, size_t offset, size_t match_len) {
+    // token: literal count in the high nibble, match length past the minimum in the low one, 15 means more bytes follow
+    size_t literal_code = num_literals < 15 ? num_literals : 15;
+    size_t match_code = 0;
+    if (match_len > 0)
+        match_code = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+    dst[out++] = (unsigned char)(literal_code << 4 | match_code);
+    if (literal_code == 15) out = lzPutLength(dst, out, num_literals - 15);
+    memcpy(dst + out, literals, num_literals);
+    out += num_literals;
+
+    // only the last sequence has no match, the decoder knows it by running out of input
+    if (match_len > 0) {
+        dst[out++] = (unsigned char)(offset & 0xFF);
+        dst[out++] = (unsigned char)(offset >> 8);
+        if (match_code == 15) out = lzPutLength(dst, out, match_len - LZ_MIN_MATCH - 15);
+    }
+    return out;
+}
+
+size_t lzCompress(const unsigned char *src, size_t len, unsigned char *dst) {
+    // positions are kept off by one so a zeroed slot means empty
+    size_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0, pos = 0, out = 0;
+    size_t limit = len >= LZ_MIN_MATCH ? len - LZ_MIN_MATCH + 1 : 0;
+    while (pos < limit) {
+        uint32_t seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || memcmp(src + candidate - 1, src + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+
+        candidate--;
+        size_t match_len = LZ_MIN_MATCH;
+        while (pos + match_len < len && src[candidate + match_len] == src[pos + match_len])
+            match_len++;
+        out = lzEmitSequence(dst, out, src + anchor, pos - anchor, pos - candidate, match_len);
+        pos += match_len;
+        anchor = pos;
+    }
+    return lzEmitSequence(dst, out, src + anchor, len - anchor, 0, 0);
+}
+
+bool lzDecompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_len) {
+    size_t in = 0, out = 0;
+    while (in < src_len) {
+        unsigned char token = src[in++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !lzGetLength(src, src_len, &in, &literals)) return false;
+        if (literals > src_len - in || literals > dst_len - out) return false;
+        memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if (in == src_len) break;
+
+        if (src_len - in < 2) return false;
+        size_t offset = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lzGetLength(src, src_len, &in, &match_len)) return false;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_len > dst_len - out) return false;
+
+        // a match may overlap the bytes it produces, so it is copied forward one byte at a time
+        for (size_t i = 0; i < match_len; i++)
+            dst[out + i] = dst[out - offset + i];
+        out += match_len;
+    }
+    return out == dst_len;
+}
+
+size_t editorUndoBudget() {
+    const char *env = getenv("CYPHER_UNDO_MEMORY");
+    long mb = env ? atol(env) : 0;
+    return mb > 0 ? (size_t)mb * 1024 * 1024 : UNDO_MEMORY_DEFAULT;
+}
+
+size_t editCommandBytes(EditCommand *cmd) {
+    if (cmd->storage != UNDO_RAW) return cmd->packed_len;
+
+    size_t bytes = cmd->piece_capacity * sizeof(Piece) + cmd->num_spans * sizeof(ReplaceSpan);
+    if (cmd->type == CMD_BULK) bytes += cmd->len + cmd->new_len;
+    return bytes;
+}
+
+void editCommandAccount(EditCommand *cmd, bool add) {
+    size_t *counter = &history.raw_bytes;
+    if (cmd->storage == UNDO_PACKED) counter = &history.packed_bytes;
+    else if (cmd->storage == UNDO_SPILLED) counter = &history.spilled_bytes;
+    else if (cmd->storage == UNDO_MAPPED) counter = &history.mapped_bytes;
+    size_t bytes = editCommandBytes(cmd);
+    *counter = add ? *counter + bytes : *counter - bytes;
+}
+
+bool editCommandPack(EditCommand *cmd) {
+    if (cmd->storage != UNDO_RAW || editCommandBytes(cmd) < UNDO_PACK_MIN) return false;
+
+    // spans and both texts go into one blob, compressed when that makes it smaller
+    // an insert or delete keeps its text instead of its pieces, a packed entry no longer pins the add buffer
+    size_t spans_len = cmd->num_spans * sizeof(ReplaceSpan);
+    size_t text_len = cmd->len;
+    size_t new_len = cmd->type == CMD_BULK ? cmd->new_len : 0;
+    size_t raw_len = spans_len + text_len + new_len;
+
+    unsigned char *raw = safeMalloc(raw_len + 1);
+    if (spans_len > 0) memcpy(raw, cmd->spans, spans_len);
+    if (cmd->type == CMD_BULK) {
+        if (text_len > 0) memcpy(raw + spans_len, cmd->text, text_len);
+        if (new_len > 0) memcpy(raw + spans_len + text_len, cmd->new_text, new_len);
+    } else {
+        ptReadPieces(&E.buf.pt, cmd->pieces, cmd->num_pieces, (char *)raw + spans_len);
     }
 
-    free(E.sel.clipboard);
-    int len;
-    E.sel.clipboard = editorGetSelectedText(&len);
-    if (!E.sel.clipboard) return;
+    unsigned char *packed = safeMalloc(lzCompressBound(raw_len));
+    size_t packed_len = lzCompress(raw, raw_len, packed);
 
-    clipboardCopyToSystem(E.sel.clipboard, len);
-    editorDeleteSelectedText();
+    editCommandAccount(cmd, false);
+    free(cmd->spans);
+    free(cmd->pieces);
+    free(cmd->text);
+    free(cmd->new_text);
+    cmd->spans = NULL;
+    cmd->pieces = NULL;
+    cmd->text = NULL;
+    cmd->new_text = NULL;
+    cmd->num_pieces = 0;
+    cmd->piece_capacity = 0;
+    cmd->unpacked_len = raw_len;
+    cmd->compressed = packed_len < raw_len;
+    if (cmd->compressed) {
+        free(raw);
+        cmd->packed = safeRealloc(packed, packed_len);
+        cmd->packed_len = packed_len;
+    } else {
+        free(packed);
+        cmd->packed = (char *)raw;
+        cmd->packed_len = raw_len;
+    }
+    cmd->storage = UNDO_PACKED;
+    editCommandAccount(cmd, true);
+    return true;
+}
 
-    char sizebuf[BUFFER_SIZE_32];
-    humanReadableSize(strlen(E.sel.clipboard), sizebuf, sizeof(sizebuf));
+bool editCommandSpill(EditCommand *cmd) {
+    if (cmd->storage != UNDO_PACKED) return false;
 
-    char msg[STATUS_LENGTH];
-    snprintf(msg, sizeof(msg), "Cut %s", sizebuf);
-    editorSetStatusMsg(msg);
+    if (history.spill_fd == -1) {
+        // the file is unlinked right away, it goes away with the process
+        const char *dir = getenv("TMPDIR");
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/cypher-undo-XXXXXX", dir && dir[0] ? dir : "/tmp");
+        history.spill_fd = mkstemp(path);
+        if (history.spill_fd == -1) return false;
+        unlink(path);
+        history.spill_size = 0;
+    }
+
+    if (!editorWriteAt(history.spill_fd, (const unsigned char *)cmd->packed, cmd->packed_len, history.spill_size)) return false;
+
+    editCommandAccount(cmd, false);
+    free(cmd->packed);
+    cmd->packed = NULL;
+    cmd->spill_offset = history.spill_size;
+    history.spill_size += (off_t)cmd->packed_len;
+    cmd->storage = UNDO_SPILLED;
+    editCommandAccount(cmd, true);
+    return true;
 }
 
-void editorCutLine() {
-    if (E.cursor.y >= E.buf.num_lines) return;
+unsigned char *editCommandUnpack(EditCommand *cmd) {
+    // the packed bytes live in memory, in the spill file or in a mapped history file
+    const unsigned char *packed = (const unsigned char *)cmd->packed;
+    unsigned char *read_buf = NULL;
+    if (cmd->storage == UNDO_SPILLED) {
+        read_buf = safeMalloc(cmd->packed_len);
+        size_t done = 0;
+        while (done < cmd->packed_len) {
+            ssize_t n = pread(history.spill_fd, read_buf + done, cmd->packed_len - done, cmd->spill_offset + (off_t)done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                free(read_buf);
+                return NULL;
+            }
+            done += (size_t)n;
+        }
+        packed = read_buf;
+    } else if (cmd->storage == UNDO_MAPPED) {
+        if (!editorCheckUndoBase()) return NULL;
+        packed = history.map + cmd->spill_offset;
+    }
 
-    size_t start_offset = editorGetLogicalOffset(&E.buf, E.cursor.y, 0);
-    size_t line_len = editorGetLineLength(&E.buf, E.cursor.y);
+    unsigned char *raw = safeMalloc(cmd->unpacked_len + 1);
+    bool ok = true;
+    if (cmd->compressed)
+        ok = lzDecompress(packed, cmd->packed_len, raw, cmd->unpacked_len);
+    else
+        memcpy(raw, packed, cmd->unpacked_len);
+    free(read_buf);
+    if (!ok) {
+        free(raw);
+        return NULL;
+    }
+    return raw;
+}
 
-    size_t delete_len = line_len;
-    if (E.cursor.y < E.buf.num_lines - 1) delete_len += 1;
+bool editCommandLoad(EditCommand *cmd) {
+    if (cmd->storage == UNDO_RAW) return true;
 
-    char *line_content = safeMalloc(delete_len + 1);
-    ptReadLogical(&E.buf.pt, start_offset, delete_len, line_content);
+    unsigned char *raw = editCommandUnpack(cmd);
+    if (!raw) return false;
 
-    free(E.sel.clipboard);
-    E.sel.clipboard = line_content;
-    clipboardCopyToSystem(E.sel.clipboard, delete_len);
+    editCommandAccount(cmd, false);
+    size_t spans_len = cmd->num_spans * sizeof(ReplaceSpan);
+    size_t text_len = cmd->len;
+    size_t new_len = cmd->type == CMD_BULK ? cmd->new_len : 0;
+    if (spans_len > 0) {
+        cmd->spans = safeMalloc(spans_len);
+        memcpy(cmd->spans, raw, spans_len);
+    }
+    if (cmd->type == CMD_BULK) {
+        cmd->text = safeMalloc(text_len + 1);
+        memcpy(cmd->text, raw + spans_len, text_len);
+        cmd->text[text_len] = '\0';
+        cmd->new_text = safeMalloc(new_len + 1);
+        memcpy(cmd->new_text, raw + spans_len + text_len, new_len);
+        cmd->new_text[new_len] = '\0';
+    } else {
+        // the text joins the add buffer again, then the entry points there like any other
+        Piece piece = {BUFFER_ADD, ptAppendAdd(&E.buf.pt, (const char *)raw + spans_len, text_len), text_len};
+        cmd->num_pieces = 0;
+        cmd->piece_capacity = 0;
+        editCommandAddPieces(cmd, &piece, 1, false);
+    }
+    if (cmd->storage == UNDO_MAPPED && cmd->flip_on_load) editorInvertBulkCommand(cmd);
+    cmd->flip_on_load = false;
+
+    free(raw);
+    free(cmd->packed);
+    cmd->packed = NULL;
+    cmd->packed_len = 0;
+    cmd->storage = UNDO_RAW;
+    editCommandAccount(cmd, true);
+    return true;
+}
 
-    executeDelete(start_offset, delete_len);
-    if (E.cursor.y >= E.buf.num_lines && E.buf.num_lines > 0)
-        E.cursor.y = E.buf.num_lines - 1;
+bool editorWriteAt(int fd, const unsigned char *buf, size_t len, off_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd, buf + written, len - written, offset + (off_t)written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += (size_t)n;
+    }
+    return true;
+}
 
-    int current_len = editorGetLineLength(&E.buf, E.cursor.y);
-    E.cursor.x = E.cursor.x > current_len ? current_len : E.cursor.x;
-    E.cursor.preferred_x = E.cursor.x;
+void editorTrimUndoMemory() {
+    size_t budget = history.memory_budget;
+    if (history.raw_bytes + history.packed_bytes <= budget / 2) return;
+
+    // past half the budget the oldest entries are compressed, the top one may still grow by merging
+    int i = history.pack_floor;
+    for (; i < history.undo_top && history.raw_bytes + history.packed_bytes > budget / 2; i++)
+        editCommandPack(&history.undo_stack[i]);
+    history.pack_floor = i;
+    int r = history.redo_pack_floor;
+    for (; r <= history.redo_top && history.raw_bytes + history.packed_bytes > budget / 2; r++)
+        editCommandPack(&history.redo_stack[r]);
+    history.redo_pack_floor = r;
+
+    // past the whole budget they move to the spill file, oldest first, until half of it is free again
+    if (history.raw_bytes + history.packed_bytes <= budget) return;
+    i = history.spill_floor;
+    for (; i < history.pack_floor && history.raw_bytes + history.packed_bytes > budget / 2; i++)
+        if (history.undo_stack[i].storage == UNDO_PACKED && !editCommandSpill(&history.undo_stack[i]))
+            break;
+    history.spill_floor = i;
+    r = history.redo_spill_floor;
+    for (; r < history.redo_pack_floor && history.raw_bytes + history.packed_bytes > budget / 2; r++)
+        if (history.redo_stack[r].storage == UNDO_PACKED && !editCommandSpill(&history.redo_stack[r]))
+            break;
+    history.redo_spill_floor = r;
+}
 
-    E.buf.dirty = true;
-    char sizebuf[BUFFER_SIZE_32];
-    humanReadableSize(delete_len, sizebuf, sizeof(sizebuf));
-    char msg[STATUS_LENGTH];
-    snprintf(msg, sizeof(msg), "Cut %s", sizebuf);
-    editorSetStatusMsg(msg);
+void pieceRefsAdd(PieceRefs *refs, Piece *pieces, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (pieces[i].source != BUFFER_ADD) continue;
+        if (refs->count >= refs->capacity) {
+            refs->capacity = refs->capacity == 0 ? BUFFER_SIZE_1024 : refs->capacity * 2;
+            refs->refs = safeRealloc(refs->refs, sizeof(Piece *) * refs->capacity);
+        }
+        refs->refs[refs->count++] = &pieces[i];
+    }
 }
 
-void clipboardCopyToSystem(const char *data, int len) {
-    if (!data || len <= 0) return;
+int comparePieceRefs(const void *a, const void *b) {
+    const Piece *pa = *(Piece *const *)a;
+    const Piece *pb = *(Piece *const *)b;
+    if (pa->start != pb->start) return pa->start < pb->start ? -1 : 1;
+    return 0;
+}
 
-    if (E.sys.use_osc52) {
-        size_t output_len = 4 * ((len + 2) / 3);
-        char *b64_data = safeMalloc(output_len + 1);
-        base64Encode(data, len, b64_data);
-        if (write(STDOUT_FILENO, OSC52_HEADER, sizeof(OSC52_HEADER) - 1) != -1 &&
-            write(STDOUT_FILENO, b64_data, output_len) != -1 &&
-            write(STDOUT_FILENO, OSC_FOOTER, sizeof(OSC_FOOTER) - 1) != -1) {
-            free(b64_data);
-            return;
+void editorCompactAddBuffer() {
+    PieceTable *pt = &E.buf.pt;
+
+    // every piece into the add buffer: the document, the entries still holding pieces and the branch snapshots
+    PieceRefs refs = {0};
+    pieceRefsAdd(&refs, pt->pieces, pt->num_pieces);
+    for (int i = 0; i <= history.undo_top; i++)
+        if (history.undo_stack[i].storage == UNDO_RAW)
+            pieceRefsAdd(&refs, history.undo_stack[i].pieces, history.undo_stack[i].num_pieces);
+    for (int i = 0; i <= history.redo_top; i++)
+        if (history.redo_stack[i].storage == UNDO_RAW)
+            pieceRefsAdd(&refs, history.redo_stack[i].pieces, history.redo_stack[i].num_pieces);
+    if (history.tip) pieceRefsAdd(&refs, history.tip->pieces, history.tip->num_pieces);
+    for (int b = 0; b < history.num_branches; b++) {
+        UndoBranch *branch = &history.branches[b];
+        for (int i = 0; i < branch->num_cmds; i++)
+            if (branch->cmds[i].storage == UNDO_RAW)
+                pieceRefsAdd(&refs, branch->cmds[i].pieces, branch->cmds[i].num_pieces);
+        // branches can share a snapshot, it is rebased once
+        bool seen = branch->snap == history.tip;
+        for (int k = 0; k < b && !seen; k++)
+            if (history.branches[k].snap == branch->snap) seen = true;
+        if (branch->snap && !seen) pieceRefsAdd(&refs, branch->snap->pieces, branch->snap->num_pieces);
+    }
+    if (refs.count > 1) qsort(refs.refs, refs.count, sizeof(Piece *), comparePieceRefs);
+
+    // overlapping and touching references share one stretch of the new buffer
+    size_t kept = 0, end = 0;
+    for (size_t i = 0; i < refs.count; i++) {
+        size_t start = refs.refs[i]->start, stop = start + refs.refs[i]->length;
+        if (i == 0 || start > end) {
+            kept += stop - start;
+            end = stop;
+        } else if (stop > end) {
+            kept += stop - end;
+            end = stop;
         }
-        free(b64_data);
+    }
+    if (kept > pt->add_len / 2) {
+        // not worth copying, try again once the buffer has doubled
+        pt->add_kept = pt->add_len;
+        free(refs.refs);
+        return;
     }
 
-    if (E.sys.clipboard_cmd != NULL) {
-        FILE *pipe = popen(E.sys.clipboard_cmd, "w");
-        if (pipe != NULL) {
-            fwrite(data, 1, len, pipe);
-            pclose(pipe);
-        } else {
-            editorSetStatusMsg("Clipboard error: Failed to run clipboard command.");
+    size_t capacity = BUFFER_SIZE_1024;
+    while (capacity <= kept) capacity *= 2;
+    char *add_buf = safeMalloc(capacity);
+    size_t written = 0, base = 0, from = 0;
+    end = 0;
+    for (size_t i = 0; i < refs.count; i++) {
+        Piece *piece = refs.refs[i];
+        size_t start = piece->start, stop = start + piece->length;
+        if (i == 0 || start > end) {
+            base = written;
+            from = start;
+            end = start;
         }
-    } else {
-        editorSetStatusMsg("Clipboard error: Unsupported OS or missing clipboard tool.");
+        if (stop > end) {
+            memcpy(add_buf + written, pt->add_buf + end, stop - end);
+            written += stop - end;
+            end = stop;
+        }
+        piece->start = base + (start - from);
     }
-}
+    free(refs.refs);
 
-void editorBuildMatchList(const char *query) {
-    free(E.find.match_lines);
-    free(E.find.match_cols);
-    E.find.match_lines = NULL;
-    E.find.match_cols = NULL;
-    E.find.num_matches = 0;
+    free(pt->add_buf);
+    pt->add_buf = add_buf;
+    pt->add_len = kept;
+    pt->add_capacity = capacity;
+    pt->add_kept = kept;
+    ptCoalesce(pt);
+}
+
+void editorCloseUndoFiles() {
+    if (history.spill_fd != -1) close(history.spill_fd);
+    if (history.map) munmap((void *)history.map, history.map_len);
+    history.map = NULL;
+    history.map_len = 0;
+    history.spill_fd = -1;
+    history.spill_size = 0;
+    history.pack_floor = 0;
+    history.spill_floor = 0;
+    history.redo_pack_floor = 0;
+    history.redo_spill_floor = 0;
+}
+
+void editorUndoMemoryText(char *buf, size_t bufsize) {
+    char raw[BUFFER_SIZE_32], packed[BUFFER_SIZE_32], spilled[BUFFER_SIZE_32], mapped[BUFFER_SIZE_32], headers[BUFFER_SIZE_32], added[BUFFER_SIZE_32];
+    humanReadableSize(history.raw_bytes, raw, sizeof(raw));
+    humanReadableSize(history.packed_bytes, packed, sizeof(packed));
+    humanReadableSize(history.spilled_bytes, spilled, sizeof(spilled));
+    humanReadableSize(history.mapped_bytes, mapped, sizeof(mapped));
+    humanReadableSize(sizeof(EditCommand) * (size_t)(history.undo_capacity + history.redo_capacity), headers, sizeof(headers));
+    // the add buffer is outside the budget, entries only point into it
+    humanReadableSize(E.buf.pt.add_len, added, sizeof(added));
+    snprintf(buf, bufsize, "Undo: %d entries, %s raw, %s packed, %s on disk, %s saved, %s headers, %s add buffer",
+             history.undo_top + history.redo_top + 2, raw, packed, spilled, mapped, headers, added);
+}
+
+char *editorUndoFilePath(const char *filename, char *path, size_t size, bool create) {
+    char dir[PATH_MAX];
+    const char *env = getenv("CYPHER_UNDO_DIR");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (env && env[0])
+        snprintf(dir, sizeof(dir), "%s", env);
+    else if (cache && cache[0])
+        snprintf(dir, sizeof(dir), "%s/cypher/undo", cache);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.cache/cypher/undo", home);
+    else
+        return NULL;
 
-    if (!query || query[0] == '\0') return;
+    if (create) {
+        for (char *p = dir + 1; ; p++) {
+            if (*p != '/' && *p != '\0') continue;
+            char ch = *p;
+            *p = '\0';
+            if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+            *p = ch;
+            if (ch == '\0') break;
+        }
+    }
 
-    int query_len = strlen(query);
-    size_t total_size = E.buf.pt.logical_size;
-    if (total_size < (size_t)query_len) return;
+    // one file per document, named after a hash of its resolved path
+    char *real_path = realpath(filename, NULL);
+    if (!real_path) return NULL;
+    uint64_t key = hashBytes(FNV_OFFSET_64, real_path, strlen(real_path));
+    snprintf(path, size, "%s/%016llx.undo", dir, (unsigned long long)key);
+    return real_path;
+}
 
-    int match_capacity = 0;
-    size_t logical_pos = 0;
-    for (size_t p_idx = 0; p_idx < E.buf.pt.num_pieces; p_idx++) {
-        Piece p = E.buf.pt.pieces[p_idx];
-        if (p.length == 0) continue;
+unsigned char *editCommandPayload(EditCommand *cmd, size_t *payload_len) {
+    // on disk an entry keeps its spans and plain text, pieces only make sense for the buffers of this session
+    size_t spans_len = cmd->num_spans * sizeof(ReplaceSpan);
+    *payload_len = spans_len + cmd->len + (cmd->type == CMD_BULK ? cmd->new_len : 0);
+    // a packed entry is laid out the same way already
+    if (cmd->storage != UNDO_RAW) return editCommandUnpack(cmd);
 
-        char *buf = (p.source == BUFFER_ORIGINAL) ? E.buf.pt.orig_buf : E.buf.pt.add_buf;
-        size_t p_off = 0;
-        while (p_off < p.length) {
-            if (total_size - logical_pos < (size_t)query_len) return;
+    unsigned char *payload = safeMalloc(*payload_len + 1);
+    if (spans_len > 0) memcpy(payload, cmd->spans, spans_len);
+    if (cmd->type == CMD_BULK) {
+        if (cmd->len > 0) memcpy(payload + spans_len, cmd->text, cmd->len);
+        if (cmd->new_len > 0) memcpy(payload + spans_len + cmd->len, cmd->new_text, cmd->new_len);
+    } else {
+        ptReadPieces(&E.buf.pt, cmd->pieces, cmd->num_pieces, (char *)payload);
+    }
+    return payload;
+}
 
-            char *match_ptr = memchr(buf + p.start + p_off, query[0], p.length - p_off);
-            if (!match_ptr) {
-                logical_pos += (p.length - p_off);
-                break;
-            }
+EditCommand *editorLineEntry(int i) {
+    // the line reads as the undo stack bottom up followed by the redo stack top down
+    if (i <= history.undo_top) return &history.undo_stack[i];
+    return &history.redo_stack[history.undo_top + history.redo_top + 1 - i];
+}
 
-            size_t match_off = match_ptr - (buf + p.start);
-            logical_pos += (match_off - p_off);
-            p_off = match_off;
-
-            bool match = true;
-            size_t check_p_idx = p_idx;
-            size_t check_p_off = p_off;
-            for (int j = 1; j < query_len; j++) {
-                check_p_off++;
-                while (check_p_idx < E.buf.pt.num_pieces && check_p_off >= E.buf.pt.pieces[check_p_idx].length) {
-                    check_p_idx++;
-                    check_p_off = 0;
-                }
+void editorHistoryChangedFrom(int pos) {
+    // entries from here on no longer match the undo file, the next save writes it again
+    if (history.saved_entries > pos) history.saved_entries = pos;
+}
 
-                if (check_p_idx >= E.buf.pt.num_pieces) {
-                    match = false;
-                    break;
-                }
+bool editorCheckUndoBase() {
+    // a history taken on the file's stamp is hashed against the text it was saved with once, before anything reads it
+    if (history.base_pending) {
+        history.base_pending = false;
+        history.base_mismatch = hashBytes(FNV_OFFSET_64, E.buf.pt.orig_buf, history.base_len) != history.base_hash;
+    }
+    return !history.base_mismatch;
+}
 
-                Piece cp = E.buf.pt.pieces[check_p_idx];
-                char *cbuf = (cp.source == BUFFER_ORIGINAL) ? E.buf.pt.orig_buf : E.buf.pt.add_buf;
-                if (cbuf[cp.start + check_p_off] != query[j]) {
-                    match = false;
-                    break;
-                }
-            }
+void editorClearHistory() {
+    for (int i = 0; i <= history.undo_top; i++)
+        freeEditCommand(&history.undo_stack[i]);
+    for (int i = 0; i <= history.redo_top; i++)
+        freeEditCommand(&history.redo_stack[i]);
+    history.undo_top = -1;
+    history.redo_top = -1;
+    history.redo_pack_floor = 0;
+    history.redo_spill_floor = 0;
+    history.last_edit_time = 0;
+    history.in_transaction = false;
+    history.typing_time = 0;
+    history.save_point = -2;
+    history.saved_entries = 0;
+    history.base_pending = false;
+    history.base_mismatch = false;
+    editorFreeBranches();
+    editorCloseUndoFiles();
+}
+
+bool editorPackUndoRecord(EditCommand *cmd, bool undone, unsigned char **buf, size_t *capacity, size_t *len, off_t base) {
+    size_t raw_len = 0;
+    unsigned char *raw = NULL;
+    const unsigned char *data;
+    size_t data_len;
+    bool compressed;
+    if (cmd->storage == UNDO_MAPPED) {
+        // entries nobody touched since they were loaded are copied over as they are, facing the way they were saved
+        data = history.map + cmd->spill_offset;
+        data_len = cmd->packed_len;
+        raw_len = cmd->unpacked_len;
+        compressed = cmd->compressed;
+        undone = undone != cmd->flip_on_load;
+    } else {
+        raw = editCommandPayload(cmd, &raw_len);
+        if (!raw) return false;
+        data = raw;
+        data_len = raw_len;
+        compressed = false;
+    }
+
+    size_t need = sizeof(UndoFileEntry) + lzCompressBound(data_len) + 8;
+    if (*len + need > *capacity) {
+        while (*len + need > *capacity) *capacity *= 2;
+        *buf = safeRealloc(*buf, *capacity);
+    }
+    unsigned char *out = *buf + *len + sizeof(UndoFileEntry);
+    if (raw && raw_len >= UNDO_PACK_MIN) {
+        size_t packed_len = lzCompress(raw, raw_len, out);
+        if (packed_len < raw_len) {
+            data_len = packed_len;
+            compressed = true;
+        }
+    }
+    if (!compressed || !raw) memcpy(out, data, data_len);
+    size_t padded = (data_len + 7) & ~(size_t)7;
+    memset(out + data_len, 0, padded - data_len);
+
+    UndoFileEntry *entry = (UndoFileEntry *)(*buf + *len);
+    memset(entry, 0, sizeof(UndoFileEntry));
+    entry->type = (uint8_t)cmd->type;
+    entry->compressed = compressed;
+    entry->shared_text = cmd->shared_text;
+    entry->undone = undone;
+    entry->transaction_id = cmd->transaction_id;
+    entry->offset = cmd->offset;
+    entry->len = cmd->len;
+    entry->new_len = cmd->type == CMD_BULK ? cmd->new_len : 0;
+    entry->num_spans = cmd->num_spans;
+    entry->data_offset = (uint64_t)base + *len + sizeof(UndoFileEntry);
+    entry->data_len = data_len;
+    entry->unpacked_len = raw_len;
+    entry->cursor[0] = cmd->cursor.x;
+    entry->cursor[1] = cmd->cursor.y;
+    entry->cursor[2] = cmd->cursor.render_x;
+    entry->cursor[3] = cmd->cursor.preferred_x;
+    *len += sizeof(UndoFileEntry) + padded;
+    free(raw);
+    return true;
+}
 
-            if (match) {
-                if (E.find.num_matches >= match_capacity) {
-                    match_capacity = match_capacity == 0 ? BUFFER_SIZE_128 : match_capacity * 2;
-                    E.find.match_lines = safeRealloc(E.find.match_lines, sizeof(int) * match_capacity);
-                    E.find.match_cols = safeRealloc(E.find.match_cols, sizeof(int) * match_capacity);
-                }
+bool editorUndoFileMatches(int fd, const char *real_path) {
+    // appending is only safe while the file still ends where this session left it, another instance may have replaced it
+    UndoFileHeader old;
+    char old_path[PATH_MAX];
+    size_t path_len = strlen(real_path);
+    if (pread(fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old)) return false;
+    if (memcmp(old.magic, UNDO_FILE_MAGIC, sizeof(old.magic)) != 0 || old.version != UNDO_FILE_VERSION || old.path_len != path_len) return false;
+    if (old.num_undo + old.num_redo != history.file_entries || old.data_end != (uint64_t)history.file_end) return false;
+    return pread(fd, old_path, path_len, sizeof(old)) == (ssize_t)path_len && memcmp(old_path, real_path, path_len) == 0;
+}
 
-                int match_row, match_col;
-                editorOffsetToRowCol(&E.buf, logical_pos, &match_row, &match_col);
+void editorSaveUndoHistory(const char *filename, uint64_t content_hash, size_t content_len, const struct stat *st) {
+    char path[PATH_MAX];
+    char *real_path = editorUndoFilePath(filename, path, sizeof(path), true);
+    if (!real_path) return;
+
+    int num_entries = history.undo_top + history.redo_top + 2;
+    if (num_entries == 0) {
+        unlink(path);
+        free(real_path);
+        history.saved_entries = 0;
+        history.file_entries = 0;
+        return;
+    }
 
-                E.find.match_lines[E.find.num_matches] = match_row;
-                E.find.match_cols[E.find.num_matches] = match_col;
-                E.find.num_matches++;
-                if (p_off + query_len <= p.length) {
-                    logical_pos += (query_len - 1);
-                    p_off += (query_len - 1);
-                }
-            }
-            logical_pos++;
-            p_off++;
+    // header, padded path, then one record per entry of the line: its table entry followed by its payload
+    size_t path_len = strlen(real_path);
+    size_t table_offset = sizeof(UndoFileHeader) + ((path_len + 7) & ~(size_t)7);
+    UndoFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UNDO_FILE_MAGIC, sizeof(header.magic));
+    header.version = UNDO_FILE_VERSION;
+    header.path_len = (uint32_t)path_len;
+    header.content_hash = content_hash;
+    header.content_len = content_len;
+    if (st) {
+        header.file_dev = (uint64_t)st->st_dev;
+        header.file_ino = (uint64_t)st->st_ino;
+        header.file_mtime = (int64_t)st->st_mtime;
+        header.file_mtime_nsec = (int64_t)STAT_MTIME_NSEC(st);
+    }
+    header.num_undo = history.undo_top + 1;
+    header.num_redo = history.redo_top + 1;
+    header.save_point = history.save_point;
+    header.transaction_id = history.current_transaction_id;
+
+    // while the file holds the start of the line unchanged only the entries past it are written
+    int fd = -1;
+    if (history.file_entries > 0 && history.saved_entries == history.file_entries && history.file_entries <= num_entries) {
+        fd = open(path, O_RDWR);
+        if (fd != -1 && !editorUndoFileMatches(fd, real_path)) {
+            close(fd);
+            fd = -1;
         }
     }
-}
+    int first = fd != -1 ? history.file_entries : 0;
+    off_t base = fd != -1 ? history.file_end : 0;
+    size_t len = fd != -1 ? 0 : table_offset;
+    size_t capacity = BUFFER_SIZE_1024;
+    while (capacity < len + BUFFER_SIZE_1024) capacity *= 2;
+    unsigned char *file = safeCalloc(1, capacity);
 
-void editorFind() {
-    E.sys.has_bracket = false;
-    int saved_cursor_x = E.cursor.x;
-    int saved_cursor_y = E.cursor.y;
-    int saved_col_offset = E.view.col_offset;
-    int saved_row_offset = E.view.row_offset;
+    bool ok = true;
+    for (int i = first; i < num_entries && ok; i++)
+        ok = editorPackUndoRecord(editorLineEntry(i), i > history.undo_top, &file, &capacity, &len, base);
+    header.data_end = (uint64_t)base + len;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback, editorGetSelectedText(NULL));
-    if (query) free(query);
-    else {
-        E.cursor.x = saved_cursor_x;
-        E.cursor.preferred_x = E.cursor.x;
-        E.cursor.y = saved_cursor_y;
-        E.view.col_offset = saved_col_offset;
-        E.view.row_offset = saved_row_offset;
-        E.find.active = false;
+    if (fd != -1) {
+        // the records go first, so a header that never made it to disk still describes a whole file
+        ok = ok && editorWriteAt(fd, file, len, base) && editorWriteAt(fd, (const unsigned char *)&header, sizeof(header), 0);
+        close(fd);
+    } else if (ok) {
+        memcpy(file, &header, sizeof(header));
+        memcpy(file + sizeof(header), real_path, path_len);
+
+        // written next to the old file and renamed over it, a mapped copy stays readable until it is closed
+        char tmp_path[PATH_MAX + BUFFER_SIZE_32];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp-%d", path, (int)getpid());
+        int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        ok = tmp_fd != -1 && editorWriteAt(tmp_fd, file, len, 0);
+        if (tmp_fd != -1) close(tmp_fd);
+        if (ok && rename(tmp_path, path) == -1) ok = false;
+        if (!ok && tmp_fd != -1) unlink(tmp_path);
     }
+    free(file);
+    free(real_path);
+
+    // after a failed write nothing is known about the file, the next save writes it whole
+    history.saved_entries = ok ? num_entries : 0;
+    history.file_entries = ok ? num_entries : 0;
+    history.file_end = ok ? (off_t)header.data_end : 0;
 }
 
-void editorFindCallback(const char *query, int key) {
-    int direction = 1;
+void editorLoadUndoHistory(const char *filename, const struct stat *file_st) {
+    char path[PATH_MAX];
+    char *real_path = editorUndoFilePath(filename, path, sizeof(path), false);
+    if (!real_path) return;
 
-    if (key == '\r' || key == ESCAPE_CHAR || query[0] == '\0') {
-        if (key == ESCAPE_CHAR)
-            editorSetStatusMsg("Find cancelled");
-        editorResetFind();
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(UndoFileHeader)) {
+        if (fd != -1) close(fd);
+        free(real_path);
+        return;
+    }
+    size_t map_len = (size_t)st.st_size;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(real_path);
         return;
     }
 
-    if (key == ARROW_RIGHT || key == ARROW_DOWN) direction = 1;
-    else if (key == ARROW_LEFT || key == ARROW_UP) direction = -1;
-    else if (key == BACKSPACE) direction = 1;
-    else if (is_cntrl(key)) return;
-    else direction = 1;
+    // the history only applies to the exact text it was saved with
+    const unsigned char *bytes = map;
+    const UndoFileHeader *header = map;
+    size_t path_len = strlen(real_path);
+    size_t table_offset = sizeof(UndoFileHeader) + ((path_len + 7) & ~(size_t)7);
+    size_t num_entries = (size_t)header->num_undo + (size_t)header->num_redo;
+    bool ok = memcmp(header->magic, UNDO_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == UNDO_FILE_VERSION &&
+              header->path_len == path_len &&
+              header->num_undo >= 0 && header->num_redo >= 0 &&
+              header->save_point >= -1 && header->save_point < header->num_undo &&
+              table_offset <= header->data_end && header->data_end <= map_len &&
+              num_entries <= (header->data_end - table_offset) / sizeof(UndoFileEntry) &&
+              memcmp(bytes + sizeof(UndoFileHeader), real_path, path_len) == 0 &&
+              header->content_len == E.buf.pt.logical_size;
+    free(real_path);
+
+    // a file that still has the stamp it was saved with is taken as is, its hash is only checked when undo first
+    // reads the history, anything else is hashed now
+    bool stamped = ok && file_st &&
+                   header->file_dev == (uint64_t)file_st->st_dev && header->file_ino == (uint64_t)file_st->st_ino &&
+                   header->file_mtime == (int64_t)file_st->st_mtime && header->file_mtime_nsec == (int64_t)STAT_MTIME_NSEC(file_st);
+    ok = ok && (stamped || header->content_hash == hashBytes(FNV_OFFSET_64, E.buf.pt.orig_buf, E.buf.pt.logical_size));
+
+    size_t pos = table_offset;
+    for (size_t i = 0; ok && i < num_entries; i++) {
+        ok = sizeof(UndoFileEntry) <= header->data_end - pos;
+        if (!ok) break;
+        const UndoFileEntry *entry = (const UndoFileEntry *)(bytes + pos);
+        size_t text_len = entry->len + entry->new_len;
+        ok = entry->type <= CMD_BULK &&
+             (entry->type == CMD_BULK ? entry->num_spans > 0 : entry->num_spans == 0 && entry->new_len == 0) &&
+             entry->data_offset == pos + sizeof(UndoFileEntry) && entry->data_len <= header->data_end - entry->data_offset &&
+             entry->num_spans <= entry->unpacked_len / sizeof(ReplaceSpan) &&
+             text_len >= entry->len &&
+             entry->unpacked_len == entry->num_spans * sizeof(ReplaceSpan) + text_len &&
+             (entry->compressed || entry->data_len == entry->unpacked_len);
+        pos = entry->data_offset + ((entry->data_len + 7) & ~(size_t)7);
+        ok = ok && pos <= header->data_end;
+    }
+    if (!ok) {
+        munmap(map, map_len);
+        return;
+    }
 
-    if (E.find.query == NULL || strcmp(E.find.query, query) != 0) {
-        free(E.find.query);
-        E.find.query = safeStrdup(query);
+    // only the headers are built here, payloads are decoded from the mapping when an entry is undone
+    while (history.undo_capacity <= header->num_undo) history.undo_capacity *= 2;
+    while (history.redo_capacity <= header->num_redo) history.redo_capacity *= 2;
+    history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+    history.redo_stack = safeRealloc(history.redo_stack, sizeof(EditCommand) * history.redo_capacity);
+    pos = table_offset;
+    for (size_t i = 0; i < num_entries; i++) {
+        const UndoFileEntry *entry = (const UndoFileEntry *)(bytes + pos);
+        pos = entry->data_offset + ((entry->data_len + 7) & ~(size_t)7);
+        bool undone = i >= (size_t)header->num_undo;
+        EditCommand *cmd = undone ? &history.redo_stack[num_entries - 1 - i] : &history.undo_stack[i];
+        memset(cmd, 0, sizeof(EditCommand));
+        cmd->type = (CommandType)entry->type;
+        cmd->offset = entry->offset;
+        cmd->len = entry->len;
+        cmd->cursor = (EditorCursor){ entry->cursor[0], entry->cursor[1], entry->cursor[2], entry->cursor[3] };
+        cmd->transaction_id = entry->transaction_id;
+        cmd->num_spans = entry->num_spans;
+        cmd->new_len = entry->new_len;
+        cmd->shared_text = entry->shared_text;
+        cmd->storage = UNDO_MAPPED;
+        cmd->packed_len = entry->data_len;
+        cmd->unpacked_len = entry->unpacked_len;
+        cmd->compressed = entry->compressed;
+        cmd->flip_on_load = cmd->type == CMD_BULK && (entry->undone != 0) != undone;
+        cmd->spill_offset = (off_t)entry->data_offset;
+        editCommandAccount(cmd, true);
+    }
+
+    history.map = bytes;
+    history.map_len = map_len;
+    history.undo_top = header->num_undo - 1;
+    history.redo_top = header->num_redo - 1;
+    history.save_point = header->save_point;
+    if (history.current_transaction_id < header->transaction_id)
+        history.current_transaction_id = header->transaction_id;
+    history.base_pending = stamped;
+    history.base_mismatch = false;
+    history.base_hash = header->content_hash;
+    history.base_len = header->content_len;
+    history.saved_entries = (int)num_entries;
+    history.file_entries = (int)num_entries;
+    history.file_end = (off_t)header->data_end;
+}
+
+UndoBranch *editorAddBranch() {
+    if (history.num_branches >= history.branch_capacity) {
+        history.branch_capacity = history.branch_capacity == 0 ? INIT_UNDO_BRANCH_CAP : history.branch_capacity * 2;
+        history.branches = safeRealloc(history.branches, sizeof(UndoBranch) * history.branch_capacity);
+    }
+    return &history.branches[history.num_branches++];
+}
+
+int editorFindBranch(int id) {
+    for (int i = 0; i < history.num_branches; i++)
+        if (history.branches[i].id == id) return i;
+    return -1;
+}
+
+void editCommandFlip(EditCommand *cmd) {
+    // bulk entries are kept in the direction they apply next, so moving one between applied and undone turns it around
+    if (cmd->type == CMD_BULK && editCommandLoad(cmd))
+        editorInvertBulkCommand(cmd);
+}
+
+void editorParkRedo() {
+    if (history.redo_top < 0) {
+        // editing at the tip makes the saved tip state stale
+        ptReleaseSnapshot(history.tip);
+        history.tip = NULL;
+        return;
+    }
 
-        editorBuildMatchList(E.find.query);
-        if (E.find.num_matches > 0) {
-            E.find.current_idx = 0;
-            editorCenterViewOnMatch();
-        }
-        E.find.active = true;
+    // the undone entries become a branch off the current state instead of being thrown away
+    UndoBranch *branch = editorAddBranch();
+    branch->id = history.next_branch_id++;
+    branch->parent = history.line_id;
+    branch->base = history.undo_top + 1;
+    branch->num_cmds = history.redo_top + 1;
+    branch->cmds = safeMalloc(sizeof(EditCommand) * branch->num_cmds);
+    branch->save_point = history.save_point > history.undo_top ? history.save_point : -2;
+    branch->parked = time(NULL);
+    if (history.tip) {
+        // the state before the undos is known, so the branch is entered at its tip with every entry applied
+        branch->snap = history.tip;
+        branch->position = branch->num_cmds;
+        branch->cursor = history.tip_cursor;
+        history.tip = NULL;
     } else {
-        if (E.find.num_matches > 0) {
-            E.find.current_idx += direction;
-            if (E.find.current_idx < 0) E.find.current_idx = E.find.num_matches - 1;
-            else if (E.find.current_idx >= E.find.num_matches) E.find.current_idx = 0;
-            editorCenterViewOnMatch();
-        }
+        branch->snap = ptSnapshot(&E.buf.pt);
+        branch->position = 0;
+        branch->cursor = E.cursor;
     }
+    for (int i = 0; i < branch->num_cmds; i++) {
+        branch->cmds[i] = history.redo_stack[history.redo_top - i];
+        if (branch->position > 0) editCommandFlip(&branch->cmds[i]);
+        editCommandPack(&branch->cmds[i]);
+    }
+
+    // branches forking further up the undone entries now hang off the new one
+    for (int i = 0; i < history.num_branches - 1; i++)
+        if (history.branches[i].parent == history.line_id && history.branches[i].base > branch->base)
+            history.branches[i].parent = branch->id;
+    history.redo_top = -1;
+    editorHistoryChangedFrom(history.undo_top + 1);
+    history.redo_pack_floor = 0;
+    history.redo_spill_floor = 0;
+    // the entry below the fork is shared with the branch now, so the next edit must not merge into it
+    history.last_edit_time = 0;
 }
 
-void editorReplace() {
-    int saved_cursor_x = E.cursor.x;
-    int saved_cursor_y = E.cursor.y;
-    int saved_col_offset = E.view.col_offset;
-    int saved_row_offset = E.view.row_offset;
+void editorFreeBranches() {
+    for (int i = 0; i < history.num_branches; i++) {
+        UndoBranch *branch = &history.branches[i];
+        for (int j = 0; j < branch->num_cmds; j++)
+            freeEditCommand(&branch->cmds[j]);
+        free(branch->cmds);
+        ptReleaseSnapshot(branch->snap);
+    }
+    free(history.branches);
+    history.branches = NULL;
+    history.num_branches = 0;
+    history.branch_capacity = 0;
+    ptReleaseSnapshot(history.tip);
+    history.tip = NULL;
+}
+
+PieceSnapshot *editorSwitchBranch(int id, PieceSnapshot *state, EditorCursor *cursor) {
+    int idx = editorFindBranch(id);
+    UndoBranch branch = history.branches[idx];
+    history.branches[idx] = history.branches[--history.num_branches];
+
+    // the line reads as the undo stack bottom up followed by the redo stack top down
+    int base = branch.base;
+    int pos = history.undo_top + 1;
+    int line_len = pos + history.redo_top + 1;
+    int new_pos = base + branch.position;
+    int new_len = base + branch.num_cmds;
+    int keep = pos < base ? pos : base;
+    if (new_pos < keep) keep = new_pos;
+
+    // entries below keep stay where they are, the rest of the shared part is laid out again around the new position
+    int old_len = line_len - base;
+    EditCommand *old_cmds = old_len > 0 ? safeMalloc(sizeof(EditCommand) * old_len) : NULL;
+    EditCommand *tail = safeMalloc(sizeof(EditCommand) * (new_len - keep + 1));
+    for (int k = keep; k < line_len; k++) {
+        EditCommand cmd = k < pos ? history.undo_stack[k] : history.redo_stack[line_len - 1 - k];
+        if (k < base)
+            tail[k - keep] = cmd;
+        else
+            old_cmds[k - base] = cmd;
+    }
+    if (branch.num_cmds > 0) memcpy(tail + base - keep, branch.cmds, sizeof(EditCommand) * branch.num_cmds);
+    free(branch.cmds);
+
+    while (history.undo_capacity <= new_pos) history.undo_capacity *= 2;
+    while (history.redo_capacity <= new_len - new_pos) history.redo_capacity *= 2;
+    history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+    history.redo_stack = safeRealloc(history.redo_stack, sizeof(EditCommand) * history.redo_capacity);
+    for (int k = keep; k < base; k++)
+        if ((k < pos) != (k < new_pos)) editCommandFlip(&tail[k - keep]);
+    for (int k = keep; k < new_pos; k++)
+        history.undo_stack[k] = tail[k - keep];
+    for (int k = new_pos; k < new_len; k++)
+        history.redo_stack[new_len - 1 - k] = tail[k - keep];
+    free(tail);
+    history.undo_top = new_pos - 1;
+    history.redo_top = new_len - new_pos - 1;
+    if (history.pack_floor > keep) history.pack_floor = keep;
+    if (history.spill_floor > keep) history.spill_floor = keep;
+    history.redo_pack_floor = 0;
+    history.redo_spill_floor = 0;
+    editorHistoryChangedFrom(keep);
+
+    // the old line keeps its id and becomes a branch of the new one, the saved state goes with whichever holds it
+    int old_id = history.line_id;
+    int old_save = history.save_point;
+    history.line_id = branch.id;
+    history.save_point = old_save != -2 && old_save < base ? old_save : branch.save_point;
+    for (int i = 0; i < history.num_branches; i++)
+        if (history.branches[i].parent == old_id && history.branches[i].base <= base)
+            history.branches[i].parent = branch.id;
+
+    if (old_len > 0) {
+        UndoBranch *parked = editorAddBranch();
+        parked->id = old_id;
+        parked->parent = branch.id;
+        parked->base = base;
+        parked->cmds = old_cmds;
+        parked->num_cmds = old_len;
+        parked->position = pos - base;
+        parked->save_point = old_save != -2 && old_save >= base ? old_save : -2;
+        parked->snap = state;
+        parked->cursor = *cursor;
+        parked->parked = time(NULL);
+        for (int i = 0; i < old_len; i++)
+            editCommandPack(&old_cmds[i]);
+    } else {
+        ptReleaseSnapshot(state);
+    }
 
-    char *find_query = editorPrompt("Replace - Find: %s (ESC to cancel)", editorReplaceCallback, editorGetSelectedText(NULL));
-    if (!find_query || strlen(find_query) == 0 || E.find.num_matches == 0) {
-        editorSetStatusMsg("Replace cancelled");
-        E.cursor.x = saved_cursor_x;
-        E.cursor.y = saved_cursor_y;
-        E.view.col_offset = saved_col_offset;
-        E.view.row_offset = saved_row_offset;
-        E.find.active = false;
-        free(find_query);
-        return;
+    *cursor = branch.cursor;
+    return branch.snap;
+}
+
+void editorJumpToBranch(int id) {
+    // the branch may hang off other parked branches, the path is walked from the current line down
+    int *path = safeMalloc(sizeof(int) * (history.num_branches + 1));
+    int depth = 0;
+    for (int cur = id; cur != history.line_id; ) {
+        int idx = editorFindBranch(cur);
+        if (idx < 0) {
+            free(path);
+            return;
+        }
+        path[depth++] = cur;
+        cur = history.branches[idx].parent;
+    }
+
+    ptReleaseSnapshot(history.tip);
+    history.tip = NULL;
+    PieceSnapshot *state = ptSnapshot(&E.buf.pt);
+    EditorCursor cursor = E.cursor;
+    for (int i = depth - 1; i >= 0; i--)
+        state = editorSwitchBranch(path[i], state, &cursor);
+    free(path);
+
+    // the document is one piece list swap away, nothing is replayed
+    E.sel.active = false;
+    E.cursor = cursor;
+    editorDocumentRestore(state);
+    ptReleaseSnapshot(state);
+    editorParseTreeSitter();
+    history.last_edit_time = 0;
+    history.in_transaction = false;
+    history.typing_time = 0;
+    editorTrimUndoMemory();
+    E.buf.dirty = (history.undo_top != history.save_point);
+
+    char msg[STATUS_LENGTH];
+    snprintf(msg, sizeof(msg), "Switched to branch #%d at edit %d of %d", id, history.undo_top + 1, history.undo_top + history.redo_top + 2);
+    editorSetStatusMsg(msg);
+}
+
+int editorUndoTreeOrder(int parent, int depth, int *order, int *depths, int count) {
+    // children are listed by the edit they fork at, each followed by its own subtree
+    int last = -1;
+    while (true) {
+        int next = -1;
+        for (int i = 0; i < history.num_branches; i++) {
+            UndoBranch *branch = &history.branches[i];
+            if (branch->parent != parent) continue;
+            if (last >= 0 && (branch->base < history.branches[last].base ||
+                              (branch->base == history.branches[last].base && branch->id <= history.branches[last].id)))
+                continue;
+            if (next < 0 || branch->base < history.branches[next].base ||
+                (branch->base == history.branches[next].base && branch->id < history.branches[next].id))
+                next = i;
+        }
+        if (next < 0) return count;
+
+        order[count] = next;
+        depths[count] = depth;
+        count = editorUndoTreeOrder(history.branches[next].id, depth + 1, order, depths, count + 1);
+        last = next;
+    }
+}
+
+void editorDrawUndoTree(const int *order, const int *depths, int count, int selected, int top) {
+    AppendBuffer ab = {NULL, 0, 0};
+    abAppend(&ab, HIDE_CURSOR CURSOR_RESET, sizeof(HIDE_CURSOR CURSOR_RESET) - 1);
+
+    char header[BUFFER_SIZE_256];
+    int len = snprintf(header, sizeof(header), " Undo tree - %d branch%s off the current line", count, count == 1 ? "" : "es");
+    if (len >= (int)sizeof(header)) len = sizeof(header) - 1;
+    abAppend(&ab, INVERTED_COLORS, sizeof(INVERTED_COLORS) - 1);
+    int used = editorAppendClipped(&ab, header, len, E.view.screen_cols);
+    for (; used < E.view.screen_cols; used++)
+        abAppend(&ab, " ", 1);
+    abAppend(&ab, REMOVE_GRAPHICS NEW_LINE, sizeof(REMOVE_GRAPHICS NEW_LINE) - 1);
+
+    time_t now = time(NULL);
+    for (int row = 0; row < E.view.screen_rows; row++) {
+        int idx = top + row;
+        if (idx <= count) {
+            // row 0 is the current line, the branches follow in tree order
+            char line[BUFFER_SIZE_256];
+            char sizebuf[BUFFER_SIZE_32];
+            if (idx == 0) {
+                humanReadableSize(E.buf.pt.logical_size, sizebuf, sizeof(sizebuf));
+                len = snprintf(line, sizeof(line), "* current line: at edit %d of %d, %s%s", history.undo_top + 1,
+                               history.undo_top + history.redo_top + 2, sizebuf, history.save_point != -2 ? ", saved state" : "");
+            } else {
+                UndoBranch *branch = &history.branches[order[idx - 1]];
+                long age = (long)(now - branch->parked);
+                char when[BUFFER_SIZE_32];
+                if (age < 60) snprintf(when, sizeof(when), "%lds", age);
+                else if (age < 3600) snprintf(when, sizeof(when), "%ldm", age / 60);
+                else if (age < 86400) snprintf(when, sizeof(when), "%ldh", age / 3600);
+                else snprintf(when, sizeof(when), "%ldd", age / 86400);
+                humanReadableSize(branch->snap->logical_size, sizebuf, sizeof(sizebuf));
+                len = snprintf(line, sizeof(line), "%*s#%d forks at edit %d: %d edit%s, at %d, %s, left %s ago%s", depths[idx - 1] * 2 + 2, "",
+                               branch->id, branch->base, branch->num_cmds, branch->num_cmds == 1 ? "" : "s", branch->base + branch->position,
+                               sizebuf, when, branch->save_point != -2 ? ", saved state" : "");
+            }
+            if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+            if (idx == selected) abAppend(&ab, LIGHT_GRAY_BG_COLOR, sizeof(LIGHT_GRAY_BG_COLOR) - 1);
+            used = editorAppendClipped(&ab, line, len, E.view.screen_cols);
+            if (idx == selected) {
+                for (; used < E.view.screen_cols; used++)
+                    abAppend(&ab, " ", 1);
+                abAppend(&ab, RESET_BG_COLOR, sizeof(RESET_BG_COLOR) - 1);
+            }
+        }
+        abAppend(&ab, CLEAR_LINE NEW_LINE, sizeof(CLEAR_LINE NEW_LINE) - 1);
     }
 
-    char *replace_query = editorPrompt("Replace - With: %s (ESC to cancel)", NULL, NULL);
-    if (!replace_query) {
-        editorSetStatusMsg("Replace cancelled");
-        free(find_query);
-        free(replace_query);
-        editorResetFind();
+    const char *help = "Enter: switch to branch  Arrows/PgUp/PgDn/Home/End: move  ESC: close";
+    editorAppendClipped(&ab, help, strlen(help), E.view.screen_cols);
+    abAppend(&ab, CLEAR_LINE, sizeof(CLEAR_LINE) - 1);
+
+    write(STDOUT_FILENO, ab.b, ab.len);
+    abFree(&ab);
+}
+
+void editorUndoTree() {
+    if (history.num_branches == 0) {
+        editorSetStatusMsg("No undo branches yet, undo and edit to start one");
         return;
     }
 
-    int replaced = 0;
+    int *order = safeMalloc(sizeof(int) * history.num_branches);
+    int *depths = safeMalloc(sizeof(int) * history.num_branches);
+    int count = editorUndoTreeOrder(history.line_id, 0, order, depths, 0);
+    int selected = count > 0 ? 1 : 0;
+    int top = 0;
+    int chosen = -1;
     bool done = false;
-    int idx = E.find.current_idx < 0 ? 0 : E.find.current_idx;
-    bool needs_refresh = true;
-    while (!done && E.find.num_matches > 0) {
+    while (!done) {
         if (E.view.resized) {
             E.view.resized = 0;
             if (getWindowSize(&E.view.screen_rows, &E.view.screen_cols) == -1) die("getWindowSize");
             E.view.screen_rows -= UI_RESERVED_ROWS;
-            needs_refresh = true;
         }
 
-        if (needs_refresh) {
-            editorCenterViewOnMatch();
-            editorSetStatusMsg("Arrows: navigate, Enter: replace, A: all, ESC: cancel");
-            editorRefreshScreen();
-            needs_refresh = false;
-        }
+        if (selected > count) selected = count;
+        if (selected < 0) selected = 0;
+        if (selected < top) top = selected;
+        if (selected >= top + E.view.screen_rows) top = selected - E.view.screen_rows + 1;
+        editorDrawUndoTree(order, depths, count, selected, top);
 
-        int key = editorReadKey();
-        if (key == 0) continue;
-        needs_refresh = true;
-        switch (key) {
-            case ESCAPE_CHAR:
-                done = true;
-                E.sel.active = false;
+        int ch = editorReadKey();
+        switch (ch) {
+            case ARROW_UP:
+                selected--;
                 break;
             case ARROW_DOWN:
-            case ARROW_RIGHT:
-                idx = (idx + 1) % E.find.num_matches;
-                E.find.current_idx = idx;
-                editorCenterViewOnMatch();
+                selected++;
                 break;
-            case ARROW_UP:
-            case ARROW_LEFT:
-                idx = (idx + E.find.num_matches - 1) % E.find.num_matches;
-                E.find.current_idx = idx;
-                editorCenterViewOnMatch();
+            case PAGE_UP:
+                selected -= E.view.screen_rows;
                 break;
-            case 'a':
-            case 'A':
-                replaced += editorReplaceAll(replace_query);
-                done = true;
+            case PAGE_DOWN:
+                selected += E.view.screen_rows;
+                break;
+            case HOME_KEY:
+                selected = 0;
+                break;
+            case END_KEY:
+                selected = count;
                 break;
             case '\r':
-            case '\n':
-                if (editorReplaceCurrent(find_query, replace_query)) {
-                    replaced++;
-                    editorBuildMatchList(find_query);
-                    if (E.find.num_matches == 0) {
-                        done = true;
-                    } else {
-                        int line = E.cursor.y;
-                        int next_idx = -1;
-                        int cursor_pos = E.cursor.x;
-                        for (int i = 0; i < E.find.num_matches; i++) {
-                            if (E.find.match_lines[i] == line && E.find.match_cols[i] > cursor_pos) {
-                                next_idx = i;
-                                break;
-                            }
-                        }
-                        if (next_idx == -1) {
-                            for (int i = 0; i < E.find.num_matches; i++) {
-                                if (E.find.match_lines[i] > line) {
-                                    next_idx = i;
-                                    break;
-                                }
-                            }
-                        }
-
-                        if (next_idx == -1)
-                            next_idx = 0;
-                        E.find.current_idx = next_idx;
-                        editorCenterViewOnMatch();
-                    }
-                }
-                editorReplaceCallback(find_query, 0);
+                if (selected > 0) chosen = history.branches[order[selected - 1]].id;
+                done = true;
                 break;
-            default:
+            case ESCAPE_CHAR:
+            case CTRL_KEY('q'):
+                done = true;
                 break;
         }
-        char msg[STATUS_LENGTH];
-        snprintf(msg, sizeof(msg), "Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
-        editorSetStatusMsg(msg);
     }
-    editorResetFind();
+    free(order);
+    free(depths);
+
+    write(STDOUT_FILENO, CLEAR_SCREEN CURSOR_RESET SHOW_CURSOR, sizeof(CLEAR_SCREEN CURSOR_RESET SHOW_CURSOR) - 1);
+    editorInvalidateFrameCache();
+    if (chosen > 0)
+        editorJumpToBranch(chosen);
+    else
+        editorSetStatusMsg("");
 }
 
-void editorReplaceCallback(const char *query, int key) {
-    (void)key;
-    if (query == NULL || !query[0]) {
-        editorResetFind();
-        return;
+char getMatchingBracket(char ch) {
+    switch (ch) {
+        case '(': return ')';
+        case ')': return '(';
+        case '{': return '}';
+        case '}': return '{';
+        case '[': return ']';
+        case ']': return '[';
     }
+    return 0;
+}
 
-    if (E.find.query == NULL || strcmp(E.find.query, query) != 0) {
-        free(E.find.query);
-        E.find.query = safeStrdup(query);
-
-        editorBuildMatchList(E.find.query);
-        if (E.find.num_matches > 0) {
-            E.find.current_idx = 0;
-            editorCenterViewOnMatch();
-        }
-        E.find.active = true;
+int getBracketFamily(char ch) {
+    switch (ch) {
+        case '(': case ')': return 0;
+        case '{': case '}': return 1;
+        case '[': case ']': return 2;
     }
+    return -1;
 }
 
-bool editorReplaceCurrent(const char *find_str, const char *replace_str) {
-    if (!find_str || !replace_str || E.find.num_matches == 0 || E.find.current_idx < 0) return false;
-
-    int row = E.find.match_lines[E.find.current_idx];
-    int col = E.find.match_cols[E.find.current_idx];
-    size_t offset = editorGetLogicalOffset(&E.buf, row, col);
-
-    int find_len = strlen(find_str);
-    int replace_len = strlen(replace_str);
-
-    editorBeginMacro();
-    executeDelete(offset, find_len);
-    executeInsert(offset, replace_str, replace_len);
-    editorEndMacro();
-
-    E.buf.dirty = true;
-    E.cursor.y = row;
-    E.cursor.x = col + replace_len;
-    E.cursor.preferred_x = E.cursor.x;
-    return true;
+signed char bracketStep(char ch, size_t offset) {
+    // brackets in strings and comments never pair, the tree still knows those while it waits for a reparse
+    if (editorIsOffsetInStringOrComment(offset)) return 0;
+    return (ch == '(' || ch == '{' || ch == '[') ? 1 : -1;
 }
 
-int editorReplaceAll(const char *replace_str) {
-    if (!E.find.query || !replace_str) return 0;
-    int replaced_count = 0;
-
-    editorBeginMacro();
-    int find_len = strlen(E.find.query);
-    int replace_len = strlen(replace_str);
-    for (int i = E.find.num_matches - 1; i >= 0; i--) {
-        int row = E.find.match_lines[i];
-        int col = E.find.match_cols[i];
-        size_t offset = editorGetLogicalOffset(&E.buf, row, col);
+void bracketIndexBuild(BracketIndex *idx, PieceTable *pt) {
+    bracketIndexFree(idx);
 
-        executeDelete(offset, find_len);
-        executeInsert(offset, replace_str, replace_len);
-        replaced_count++;
+    size_t logical_pos = 0;
+    for (size_t i = 0; i < pt->num_pieces; i++) {
+        Piece p = pt->pieces[i];
+        const char *buf = ((p.source == BUFFER_ORIGINAL) ? pt->orig_buf : pt->add_buf) + p.start;
+        for (size_t j = 0; j < p.length; j++) {
+            int family = getBracketFamily(buf[j]);
+            if (family < 0) continue;
+
+            BracketFamily *f = &idx->families[family];
+            BracketBlock *blk = f->num_blocks > 0 ? &f->blocks[f->num_blocks - 1] : NULL;
+            if (!blk || blk->count >= BRACKET_BLOCK_SIZE) {
+                blk = bracketFamilyNewBlock(f, f->num_blocks);
+                blk->base = logical_pos + j;
+            }
+            bracketBlockReserve(blk, blk->count + 1);
+            blk->offsets[blk->count] = logical_pos + j - blk->base;
+            blk->steps[blk->count] = bracketStep(buf[j], logical_pos + j);
+            blk->count++;
+        }
+        logical_pos += p.length;
     }
 
-    editorEndMacro();
-    if (replaced_count > 0)
-        E.buf.dirty = true;
-    return replaced_count;
+    for (int family = 0; family < BRACKET_FAMILIES; family++) {
+        BracketFamily *f = &idx->families[family];
+        for (int b = 0; b < f->num_blocks; b++)
+            bracketBlockSummarize(&f->blocks[b]);
+    }
+    idx->valid = true;
 }
 
-void editorCenterViewOnMatch() {
-    if (E.find.num_matches > 0 && E.find.current_idx >= 0 && E.find.current_idx < E.find.num_matches) {
-        int row = E.find.match_lines[E.find.current_idx];
-        int col = E.find.match_cols[E.find.current_idx];
-        E.cursor.x = col;
-        E.cursor.y = row;
-        E.cursor.preferred_x = E.cursor.x;
-        if (row < E.view.row_offset || row >= E.view.row_offset + E.view.screen_rows) {
-            E.view.row_offset = row - (E.view.screen_rows / 2);
-            if (E.view.row_offset < 0)
-                E.view.row_offset = 0;
-        }
-
-        size_t render_line_len;
-        char *render_line_text = editorGetLine(&E.buf, row, &render_line_len);
-        int render_pos = editorLineCxToRx(render_line_text, render_line_len, E.cursor.x);
-        free(render_line_text);
-
-        if (render_pos < E.view.col_offset || render_pos >= E.view.col_offset + E.view.screen_cols) {
-            E.view.col_offset = render_pos - (E.view.screen_cols / 2);
-            if (E.view.col_offset < 0)
-                E.view.col_offset = 0;
+void bracketIndexFree(BracketIndex *idx) {
+    for (int i = 0; i < BRACKET_FAMILIES; i++) {
+        BracketFamily *f = &idx->families[i];
+        for (int b = 0; b < f->num_blocks; b++) {
+            free(f->blocks[b].offsets);
+            free(f->blocks[b].steps);
         }
+        free(f->blocks);
+        free(f->seg_sum);
+        free(f->seg_min_prefix);
+        free(f->seg_max_suffix);
+        memset(f, 0, sizeof(BracketFamily));
+        f->seg_dirty = true;
     }
+    idx->valid = false;
 }
 
-void editorResetFind() {
-    free(E.find.query);
-    free(E.find.match_lines);
-    free(E.find.match_cols);
-    E.find.query = NULL;
-    E.find.match_lines = NULL;
-    E.find.match_cols = NULL;
-    E.find.num_matches = 0;
-    E.find.current_idx = -1;
-    E.find.active = false;
-}
-
-void freeEditCommand(EditCommand *cmd) {
-    free(cmd->text);
-    cmd->text = NULL;
-}
-
-void editorBeginMacro() {
-    history.in_transaction = true;
-    history.current_transaction_id++;
-}
-
-void editorEndMacro() {
-    history.in_transaction = false;
-}
-
-void recordCommand(CommandType type, size_t offset, const char *text, size_t len, EditorCursor cursor) {
-    long now = currentMillis();
-    for (int i = 0; i <= history.redo_top; i++)
-        freeEditCommand(&history.redo_stack[i]);
-    history.redo_top = -1;
+void bracketIndexInsert(BracketIndex *idx, size_t offset, const char *text, size_t len) {
+    if (!idx->valid || len == 0) return;
 
-    if (history.save_point > history.undo_top)
-        history.save_point = -2;
+    int added[BRACKET_FAMILIES] = {0};
+    for (size_t i = 0; i < len; i++) {
+        int family = getBracketFamily(text[i]);
+        if (family >= 0) added[family]++;
+    }
 
-    bool merged = false;
-    if (history.undo_top >= 0) {
-        EditCommand *last_cmd = &history.undo_stack[history.undo_top];
-        long time_elapsed = now - history.last_edit_time;
+    for (int family = 0; family < BRACKET_FAMILIES; family++) {
+        BracketFamily *f = &idx->families[family];
+        int b, k;
+        bracketFamilyLocate(f, offset, &b, &k);
+        bracketFamilyShift(f, b, k, (long)len);
+        if (added[family] == 0) continue;
 
-        int current_txn = history.in_transaction ? history.current_transaction_id : 0;
-        if (time_elapsed < UNDO_TIMEOUT_MS && last_cmd->type == type && last_cmd->transaction_id == current_txn) {
-            if (type == CMD_INSERT && offset == last_cmd->offset + last_cmd->len) {
-                if (last_cmd->len + len + 1 > last_cmd->capacity) {
-                    last_cmd->capacity = last_cmd->capacity == 0 ? BUFFER_SIZE_32 : last_cmd->capacity * 2;
-                    while (last_cmd->capacity < last_cmd->len + len + 1) last_cmd->capacity *= 2;
-                    last_cmd->text = safeRealloc(last_cmd->text, last_cmd->capacity);
-                }
-                memcpy(last_cmd->text + last_cmd->len, text, len);
-                last_cmd->len += len;
-                last_cmd->text[last_cmd->len] = '\0';
-                merged = true;
-            } else if (type == CMD_DELETE) {
-                if (offset + len == last_cmd->offset) {
-                    char *new_text = safeMalloc(last_cmd->len + len + 1);
-                    memcpy(new_text, text, len);
-                    memcpy(new_text + len, last_cmd->text, last_cmd->len);
-                    new_text[last_cmd->len + len] = '\0';
-                    free(last_cmd->text);
-                    last_cmd->text = new_text;
-                    last_cmd->offset = offset;
-                    last_cmd->len += len;
-                    merged = true;
-                } else if (offset == last_cmd->offset) {
-                    last_cmd->text = safeRealloc(last_cmd->text, last_cmd->len + len + 1);
-                    memcpy(last_cmd->text + last_cmd->len, text, len);
-                    last_cmd->len += len;
-                    last_cmd->text[last_cmd->len] = '\0';
-                    merged = true;
+        size_t *offsets = safeMalloc(sizeof(size_t) * added[family]);
+        signed char *steps = safeMalloc(added[family]);
+        int n = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (getBracketFamily(text[i]) != family) continue;
+            offsets[n] = offset + i;
+            steps[n] = bracketStep(text[i], offset + i);
+            n++;
+        }
+        bracketFamilyInsertAt(f, b, k, offsets, steps, n);
+        free(offsets);
+        free(steps);
+    }
+}
+
+void bracketIndexDelete(BracketIndex *idx, size_t offset, size_t len) {
+    if (!idx->valid || len == 0) return;
+
+    for (int family = 0; family < BRACKET_FAMILIES; family++) {
+        BracketFamily *f = &idx->families[family];
+        int b, k;
+        bracketFamilyLocate(f, offset, &b, &k);
+        while (b < f->num_blocks) {
+            BracketBlock *blk = &f->blocks[b];
+            int end = offset + len > blk->base ? bracketBlockLowerBound(blk, offset + len - blk->base) : 0;
+            if (end <= k) break;
+
+            memmove(&blk->offsets[k], &blk->offsets[end], sizeof(size_t) * (blk->count - end));
+            memmove(&blk->steps[k], &blk->steps[end], blk->count - end);
+            bool reached_end = end == blk->count;
+            blk->count -= end - k;
+            if (blk->count == 0) {
+                bracketFamilyRemoveBlock(f, b);
+            } else {
+                if (k == 0) {
+                    // the base stays on the first bracket, so shifting the block back never passes zero
+                    size_t first = blk->offsets[0];
+                    for (int i = 0; i < blk->count; i++)
+                        blk->offsets[i] -= first;
+                    blk->base += first;
                 }
+                bracketBlockSummarize(blk);
+                bracketFamilyUpdateTree(f, b);
+                if (!reached_end) break;
+                b++;
             }
+            if (b < f->num_blocks) bracketFamilySettle(f, b);
+            k = 0;
         }
-    }
 
-    if (!merged) {
-        if (history.undo_top >= history.undo_capacity - 1) {
-            history.undo_capacity *= 2;
-            history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+        bracketFamilyLocate(f, offset, &b, &k);
+        bracketFamilyShift(f, b, k, -(long)len);
+    }
+}
+
+void bracketIndexClassify(BracketIndex *idx, PieceTable *pt, size_t from, size_t to) {
+    if (!idx->valid) return;
+
+    // a reparse can move strings and comments, the brackets it touched are sorted out again
+    for (int family = 0; family < BRACKET_FAMILIES; family++) {
+        BracketFamily *f = &idx->families[family];
+        int b, k;
+        bracketFamilyLocate(f, from, &b, &k);
+        for (; b < f->num_blocks; b++, k = 0) {
+            bracketFamilySettle(f, b);
+            BracketBlock *blk = &f->blocks[b];
+            bool changed = false;
+            for (; k < blk->count && blk->base + blk->offsets[k] < to; k++) {
+                size_t offset = blk->base + blk->offsets[k];
+                signed char step = bracketStep(ptCharAt(pt, offset), offset);
+                if (step == blk->steps[k]) continue;
+                blk->steps[k] = step;
+                changed = true;
+            }
+            if (changed) {
+                bracketBlockSummarize(blk);
+                bracketFamilyUpdateTree(f, b);
+            }
+            if (k < blk->count) break;
         }
-
-        history.undo_top++;
-        EditCommand *cmd = &history.undo_stack[history.undo_top];
-        cmd->type = type;
-        cmd->offset = offset;
-        cmd->len = len;
-        cmd->capacity = len < BUFFER_SIZE_32 ? BUFFER_SIZE_32 : len * 2;
-        cmd->text = safeMalloc(cmd->capacity);
-        memcpy(cmd->text, text, len);
-        cmd->text[len] = '\0';
-        cmd->cursor = cursor;
-        cmd->transaction_id = history.in_transaction ? history.current_transaction_id : 0;
     }
-    history.last_edit_time = now;
 }
 
-void executeInsert(size_t offset, const char *text, size_t len) {
-    if (len == 0) return;
+void bracketBlockReserve(BracketBlock *blk, int count) {
+    if (count <= blk->capacity) return;
+    while (count > blk->capacity)
+        blk->capacity = blk->capacity == 0 ? BUFFER_SIZE_32 : blk->capacity * 2;
+    blk->offsets = safeRealloc(blk->offsets, sizeof(size_t) * blk->capacity);
+    blk->steps = safeRealloc(blk->steps, blk->capacity);
+}
 
-    recordCommand(CMD_INSERT, offset, text, len, E.cursor);
-    editorEditTreeSitter(offset, 0, len, text);
-    ptInsert(&E.buf.pt, offset, text, len);
-    if (!E.sel.is_pasting) E.ts.needs_reparse = true;
+void bracketBlockSummarize(BracketBlock *blk) {
+    int sum = 0, min_prefix = INT_MAX / 2, max_suffix = INT_MIN / 2;
+    for (int i = 0; i < blk->count; i++) {
+        sum += blk->steps[i];
+        if (sum < min_prefix) min_prefix = sum;
+    }
+    int suffix = 0;
+    for (int i = blk->count - 1; i >= 0; i--) {
+        suffix += blk->steps[i];
+        if (suffix > max_suffix) max_suffix = suffix;
+    }
+    blk->sum = sum;
+    blk->min_prefix = min_prefix;
+    blk->max_suffix = max_suffix;
+}
 
-    editorInsertLineOffsets(&E.buf, offset, text, len);
-    E.buf.dirty = true;
+int bracketBlockLowerBound(BracketBlock *blk, size_t rel) {
+    int lo = 0, hi = blk->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (blk->offsets[mid] < rel) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
 }
 
-void executeDelete(size_t offset, size_t len) {
-    if (len == 0) return;
+BracketBlock *bracketFamilyNewBlock(BracketFamily *f, int at) {
+    if (f->num_blocks >= f->capacity) {
+        f->capacity = f->capacity == 0 ? BUFFER_SIZE_32 : f->capacity * 2;
+        f->blocks = safeRealloc(f->blocks, sizeof(BracketBlock) * f->capacity);
+    }
+    // the new block gets a real base, so it has to land in front of the owing ones
+    bracketFamilySettle(f, at - 1);
+    memmove(&f->blocks[at + 1], &f->blocks[at], sizeof(BracketBlock) * (f->num_blocks - at));
+    f->num_blocks++;
+    f->owed_from++;
+    f->seg_dirty = true;
 
-    char *deleted_text = safeMalloc(len + 1);
-    ptReadLogical(&E.buf.pt, offset, len, deleted_text);
+    BracketBlock *blk = &f->blocks[at];
+    memset(blk, 0, sizeof(BracketBlock));
+    return blk;
+}
 
-    recordCommand(CMD_DELETE, offset, deleted_text, len, E.cursor);
-    editorEditTreeSitter(offset, len, 0, NULL);
-    ptDelete(&E.buf.pt, offset, len);
-    if (!E.sel.is_pasting) E.ts.needs_reparse = true;
+void bracketFamilyRemoveBlock(BracketFamily *f, int at) {
+    bracketFamilySettle(f, at);
+    free(f->blocks[at].offsets);
+    free(f->blocks[at].steps);
+    memmove(&f->blocks[at], &f->blocks[at + 1], sizeof(BracketBlock) * (f->num_blocks - at - 1));
+    f->num_blocks--;
+    f->owed_from--;
+    f->seg_dirty = true;
+}
 
-    editorDeleteLineOffsets(&E.buf, offset, deleted_text, len);
-    E.buf.dirty = true;
-    free(deleted_text);
+void bracketFamilySettle(BracketFamily *f, int block) {
+    // pays the shift the blocks up to this one owe, the rest keeps owing
+    while (f->owed_from <= block)
+        f->blocks[f->owed_from++].base += f->owed_shift;
 }
 
-void editorUndo() {
-    if (history.undo_top < 0) {
-        editorSetStatusMsg("Nothing to undo");
-        return;
+void bracketFamilyDefer(BracketFamily *f, int from_block, long shift) {
+    // every block from from_block on moves, only the blocks between this edit and the last one are touched
+    if (from_block >= f->num_blocks || shift == 0) return;
+    if (from_block >= f->owed_from) {
+        bracketFamilySettle(f, from_block - 1);
+    } else {
+        for (int b = from_block; b < f->owed_from; b++)
+            f->blocks[b].base += shift;
     }
+    f->owed_shift += shift;
+}
 
-    int target_transaction = history.undo_stack[history.undo_top].transaction_id;
-    bool is_macro = (target_transaction != 0);
-    do {
-        if (history.undo_top < 0) break;
-        EditCommand *cmd = &history.undo_stack[history.undo_top];
-        if (is_macro && cmd->transaction_id != target_transaction) break;
-
-        if (history.redo_top >= history.redo_capacity - 1) {
-            history.redo_capacity *= 2;
-            history.redo_stack = safeRealloc(history.redo_stack, sizeof(EditCommand) * history.redo_capacity);
-        }
+void bracketFamilyLocate(BracketFamily *f, size_t offset, int *block, int *k) {
+    // first block whose last bracket reaches the offset, past the end lands after the last bracket
+    int lo = 0, hi = f->num_blocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        BracketBlock *blk = &f->blocks[mid];
+        size_t base = blk->base + (mid >= f->owed_from ? f->owed_shift : 0);
+        if (base + blk->offsets[blk->count - 1] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == f->num_blocks) {
+        *block = f->num_blocks > 0 ? f->num_blocks - 1 : 0;
+        *k = f->num_blocks > 0 ? f->blocks[*block].count : 0;
+        if (f->num_blocks > 0) bracketFamilySettle(f, *block);
+        return;
+    }
 
-        history.redo_top++;
-        history.redo_stack[history.redo_top] = *cmd;
-        history.redo_stack[history.redo_top].text = safeStrdup(cmd->text);
+    bracketFamilySettle(f, lo);
+    BracketBlock *blk = &f->blocks[lo];
+    *block = lo;
+    *k = offset > blk->base ? bracketBlockLowerBound(blk, offset - blk->base) : 0;
+}
 
-        if (cmd->type == CMD_INSERT) {
-            editorEditTreeSitter(cmd->offset, cmd->len, 0, NULL);
-            ptDelete(&E.buf.pt, cmd->offset, cmd->len);
-            editorDeleteLineOffsets(&E.buf, cmd->offset, cmd->text, cmd->len);
-        } else if (cmd->type == CMD_DELETE) {
-            editorEditTreeSitter(cmd->offset, 0, cmd->len, cmd->text);
-            ptInsert(&E.buf.pt, cmd->offset, cmd->text, cmd->len);
-            editorInsertLineOffsets(&E.buf, cmd->offset, cmd->text, cmd->len);
+void bracketFamilyShift(BracketFamily *f, int block, int k, long delta) {
+    // brackets from position k of the block on move, the blocks after it only owe the shift
+    if (block >= f->num_blocks) return;
+    BracketBlock *blk = &f->blocks[block];
+    if (k == 0) {
+        blk->base += delta;
+    } else {
+        for (int i = k; i < blk->count; i++)
+            blk->offsets[i] += delta;
+    }
+    bracketFamilyDefer(f, block + 1, delta);
+}
+
+void bracketFamilyInsertAt(BracketFamily *f, int block, int k, const size_t *offsets, const signed char *steps, int n) {
+    if (f->num_blocks == 0) {
+        bracketFamilyNewBlock(f, 0);
+        block = 0;
+        k = 0;
+    }
+
+    // the block is laid out again around the new brackets, split into several when it grows too big
+    BracketBlock *blk = &f->blocks[block];
+    int total = blk->count + n;
+    size_t *merged = safeMalloc(sizeof(size_t) * total);
+    signed char *merged_steps = safeMalloc(total);
+    for (int i = 0; i < total; i++) {
+        int from = i < k ? i : i - n;
+        merged[i] = i >= k && i < k + n ? offsets[i - k] : blk->base + blk->offsets[from];
+        merged_steps[i] = i >= k && i < k + n ? steps[i - k] : blk->steps[from];
+    }
+
+    int chunks = total > 2 * BRACKET_BLOCK_SIZE ? (total + BRACKET_BLOCK_SIZE - 1) / BRACKET_BLOCK_SIZE : 1;
+    for (int c = 0, from = 0; c < chunks; c++) {
+        int count = (total - from) / (chunks - c);
+        if (c > 0) bracketFamilyNewBlock(f, block + c);
+        blk = &f->blocks[block + c];
+        bracketBlockReserve(blk, count);
+        blk->base = merged[from];
+        for (int i = 0; i < count; i++)
+            blk->offsets[i] = merged[from + i] - blk->base;
+        memcpy(blk->steps, &merged_steps[from], count);
+        blk->count = count;
+        bracketBlockSummarize(blk);
+        bracketFamilyUpdateTree(f, block + c);
+        from += count;
+    }
+    free(merged);
+    free(merged_steps);
+}
+
+void bracketFamilyBuildTree(BracketFamily *f) {
+    // the tree sits over the blocks, each leaf carries its block's summary
+    int leaves = 1;
+    while (leaves < f->num_blocks) leaves *= 2;
+    if (leaves != f->seg_leaves) {
+        f->seg_leaves = leaves;
+        f->seg_sum = safeRealloc(f->seg_sum, sizeof(int) * 2 * leaves);
+        f->seg_min_prefix = safeRealloc(f->seg_min_prefix, sizeof(int) * 2 * leaves);
+        f->seg_max_suffix = safeRealloc(f->seg_max_suffix, sizeof(int) * 2 * leaves);
+    }
+
+    // padding leaves can never satisfy a seek
+    for (int i = 0; i < leaves; i++) {
+        int node = leaves + i;
+        if (i < f->num_blocks) {
+            f->seg_sum[node] = f->blocks[i].sum;
+            f->seg_min_prefix[node] = f->blocks[i].min_prefix;
+            f->seg_max_suffix[node] = f->blocks[i].max_suffix;
+        } else {
+            f->seg_sum[node] = 0;
+            f->seg_min_prefix[node] = INT_MAX / 2;
+            f->seg_max_suffix[node] = INT_MIN / 2;
         }
+    }
 
-        E.cursor = cmd->cursor;
-        freeEditCommand(cmd);
-        history.undo_top--;
-    } while (is_macro);
-
-    editorParseTreeSitter();
-    E.buf.dirty = (history.undo_top != history.save_point);
-    editorSetStatusMsg("Undid");
+    for (int node = leaves - 1; node >= 1; node--)
+        bracketFamilyPullNode(f, node);
+    f->seg_dirty = false;
 }
 
-void editorRedo() {
-    if (history.redo_top < 0) {
-        editorSetStatusMsg("Nothing to redo");
-        return;
-    }
+void bracketFamilyPullNode(BracketFamily *f, int node) {
+    int l = 2 * node, r = 2 * node + 1;
+    int from_right = f->seg_sum[l] + f->seg_min_prefix[r];
+    int from_left = f->seg_sum[r] + f->seg_max_suffix[l];
+    f->seg_sum[node] = f->seg_sum[l] + f->seg_sum[r];
+    f->seg_min_prefix[node] = f->seg_min_prefix[l] < from_right ? f->seg_min_prefix[l] : from_right;
+    f->seg_max_suffix[node] = f->seg_max_suffix[r] > from_left ? f->seg_max_suffix[r] : from_left;
+}
 
-    int target_transaction = history.redo_stack[history.redo_top].transaction_id;
-    bool is_macro = (target_transaction != 0);
-    do {
-        if (history.redo_top < 0) break;
-        EditCommand *cmd = &history.redo_stack[history.redo_top];
-        if (is_macro && cmd->transaction_id != target_transaction) break;
+void bracketFamilyUpdateTree(BracketFamily *f, int block) {
+    // one block changed, only its path to the root is recomputed
+    if (f->seg_dirty) return;
+    int node = f->seg_leaves + block;
+    f->seg_sum[node] = f->blocks[block].sum;
+    f->seg_min_prefix[node] = f->blocks[block].min_prefix;
+    f->seg_max_suffix[node] = f->blocks[block].max_suffix;
+    for (node /= 2; node >= 1; node /= 2)
+        bracketFamilyPullNode(f, node);
+}
 
-        if (history.undo_top >= history.undo_capacity - 1) {
-            history.undo_capacity *= 2;
-            history.undo_stack = safeRealloc(history.undo_stack, sizeof(EditCommand) * history.undo_capacity);
+int bracketFamilySeekForward(BracketFamily *f, int node, int lo, int hi, int from, int *depth) {
+    if (hi < from) return -1;
+    if (lo >= from) {
+        if (*depth + f->seg_min_prefix[node] > -1) {
+            *depth += f->seg_sum[node];
+            return -1;
         }
+        if (lo == hi) return lo;
+    }
 
-        history.undo_top++;
-        history.undo_stack[history.undo_top] = *cmd;
-        history.undo_stack[history.undo_top].text = safeStrdup(cmd->text);
+    int mid = lo + (hi - lo) / 2;
+    int found = bracketFamilySeekForward(f, 2 * node, lo, mid, from, depth);
+    if (found >= 0) return found;
+    return bracketFamilySeekForward(f, 2 * node + 1, mid + 1, hi, from, depth);
+}
 
-        if (cmd->type == CMD_INSERT) {
-            editorEditTreeSitter(cmd->offset, 0, cmd->len, cmd->text);
-            ptInsert(&E.buf.pt, cmd->offset, cmd->text, cmd->len);
-            editorInsertLineOffsets(&E.buf, cmd->offset, cmd->text, cmd->len);
-        } else if (cmd->type == CMD_DELETE) {
-            editorEditTreeSitter(cmd->offset, cmd->len, 0, NULL);
-            ptDelete(&E.buf.pt, cmd->offset, cmd->len);
-            editorDeleteLineOffsets(&E.buf, cmd->offset, cmd->text, cmd->len);
+int bracketFamilySeekBackward(BracketFamily *f, int node, int lo, int hi, int to, int *depth) {
+    if (lo > to) return -1;
+    if (hi <= to) {
+        if (*depth + f->seg_max_suffix[node] < 1) {
+            *depth += f->seg_sum[node];
+            return -1;
         }
+        if (lo == hi) return lo;
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    int found = bracketFamilySeekBackward(f, 2 * node + 1, mid + 1, hi, to, depth);
+    if (found >= 0) return found;
+    return bracketFamilySeekBackward(f, 2 * node, lo, mid, to, depth);
+}
+
+bool bracketIndexFindMatch(BracketIndex *idx, PieceTable *pt, size_t offset, char bracket, size_t *match_offset) {
+    int family = getBracketFamily(bracket);
+    if (family < 0) return false;
+    if (!idx->valid) bracketIndexBuild(idx, pt);
+
+    BracketFamily *f = &idx->families[family];
+    int b, k;
+    bracketFamilyLocate(f, offset, &b, &k);
+    if (b >= f->num_blocks || k >= f->blocks[b].count) return false;
+    BracketBlock *blk = &f->blocks[b];
+    if (blk->base + blk->offsets[k] != offset || blk->steps[k] == 0) return false;
+    if (f->seg_dirty) bracketFamilyBuildTree(f);
+
+    // the rest of the bracket's own block first, then the tree finds the block holding the partner
+    int depth = 0;
+    int dir = blk->steps[k] > 0 ? 1 : -1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = k + dir; i >= 0 && i < blk->count; i += dir) {
+            depth += blk->steps[i];
+            if (depth == -dir) {
+                *match_offset = blk->base + blk->offsets[i];
+                return true;
+            }
+        }
+        if (pass == 1) break;
 
-        freeEditCommand(cmd);
-        history.redo_top--;
-    } while (is_macro);
+        b = dir > 0
+            ? bracketFamilySeekForward(f, 1, 0, f->seg_leaves - 1, b + 1, &depth)
+            : bracketFamilySeekBackward(f, 1, 0, f->seg_leaves - 1, b - 1, &depth);
+        if (b < 0 || b >= f->num_blocks) return false;
+        bracketFamilySettle(f, b);
+        blk = &f->blocks[b];
+        k = dir > 0 ? -1 : blk->count;
+    }
+    return false;
+}
 
-    editorParseTreeSitter();
-    E.buf.dirty = (history.undo_top != history.save_point);
-    editorSetStatusMsg("Redid");
+bool editorIsBracketLeaf(TSNode node, char bracket) {
+    if (ts_node_is_null(node) || ts_node_end_byte(node) != ts_node_start_byte(node) + 1) return false;
+    const char *type = ts_node_type(node);
+    return type && type[0] == bracket && type[1] == '\0';
 }
 
-char getMatchingBracket(char ch) {
-    switch (ch) {
-        case '(': return ')';
-        case ')': return '(';
-        case '{': return '}';
-        case '}': return '{';
-        case '[': return ']';
-        case ']': return '[';
+bool editorFindMatchingBracketInTree(size_t offset, char bracket, size_t *match_offset) {
+    TSNode root = ts_tree_root_node(E.ts.tree);
+    TSTreeCursor cursor = ts_tree_cursor_new(root);
+    while (ts_tree_cursor_goto_first_child_for_byte(&cursor, offset) >= 0);
+
+    TSNode leaf = ts_tree_cursor_current_node(&cursor);
+    if (ts_node_start_byte(leaf) != offset || !editorIsBracketLeaf(leaf, bracket) || !ts_tree_cursor_goto_parent(&cursor)) {
+        ts_tree_cursor_delete(&cursor);
+        return false;
     }
-    return 0;
+
+    char match = getMatchingBracket(bracket);
+    bool forward = (bracket == '(' || bracket == '{' || bracket == '[');
+    TSNode parent = ts_tree_cursor_current_node(&cursor);
+    uint32_t p_start = ts_node_start_byte(parent);
+    uint32_t p_end = ts_node_end_byte(parent);
+
+    // well-formed pairs delimit their enclosing node, so the partner is its first or last leaf
+    TSNode partner = forward
+        ? ts_node_descendant_for_byte_range(parent, p_end - 1, p_end)
+        : ts_node_descendant_for_byte_range(parent, p_start, p_start + 1);
+    if ((forward ? offset == p_start : offset + 1 == p_end) && editorIsBracketLeaf(partner, match)) {
+        *match_offset = ts_node_start_byte(partner);
+        ts_tree_cursor_delete(&cursor);
+        return true;
+    }
+
+    // otherwise (error recovery, flattened tokens) balance the sibling brackets
+    size_t *openers = NULL;
+    int num_openers = 0, openers_cap = 0;
+    int depth = 0;
+    bool found = false;
+    bool passed_leaf = false;
+    ts_tree_cursor_goto_first_child(&cursor);
+    do {
+        TSNode child = ts_tree_cursor_current_node(&cursor);
+        size_t child_start = ts_node_start_byte(child);
+        if (child_start == offset) {
+            if (!forward) {
+                found = num_openers > 0;
+                if (found) *match_offset = openers[num_openers - 1];
+                break;
+            }
+            passed_leaf = true;
+            continue;
+        }
+
+        if (forward && passed_leaf) {
+            if (editorIsBracketLeaf(child, bracket)) {
+                depth++;
+            } else if (editorIsBracketLeaf(child, match)) {
+                if (depth == 0) {
+                    *match_offset = child_start;
+                    found = true;
+                    break;
+                }
+                depth--;
+            }
+        } else if (!forward) {
+            if (editorIsBracketLeaf(child, match)) {
+                if (num_openers >= openers_cap) {
+                    openers_cap = openers_cap == 0 ? BUFFER_SIZE_32 : openers_cap * 2;
+                    openers = safeRealloc(openers, sizeof(size_t) * openers_cap);
+                }
+                openers[num_openers++] = child_start;
+            } else if (editorIsBracketLeaf(child, bracket) && num_openers > 0) {
+                num_openers--;
+            }
+        }
+    } while (ts_tree_cursor_goto_next_sibling(&cursor));
+
+    free(openers);
+    ts_tree_cursor_delete(&cursor);
+    return found;
 }
 
 bool findMatchingBracketPosition(int cursor_y, int cursor_x, int *match_y, int *match_x) {
@@ -4026,33 +11784,17 @@ bool findMatchingBracketPosition(int cursor_y, int cursor_x, int *match_y, int *
     if (editorIsOffsetInStringOrComment(current_offset))
         return false;
 
-    char match = getMatchingBracket(bracket);
-    int direction = (bracket == '(' || bracket == '{' || bracket == '[') ? 1 : -1;
-    int count = 1;
-
-    while (true) {
-        if (direction == 1) {
-            current_offset++;
-            if (current_offset >= E.buf.pt.logical_size) break;
-        } else {
-            if (current_offset == 0) break;
-            current_offset--;
-        }
-
-        char ch = ptCharAt(&E.buf.pt, current_offset);
-        if (ch == bracket || ch == match) {
-            if (!editorIsOffsetInStringOrComment(current_offset)) {
-                if (ch == bracket) count++;
-                else if (ch == match) count--;
-            }
-        }
+    // a tree awaiting its debounced reparse misses the latest edits, the index never does
+    size_t match_offset;
+    bool found;
+    if (E.ts.tree && !E.ts.needs_reparse)
+        found = editorFindMatchingBracketInTree(current_offset, bracket, &match_offset);
+    else
+        found = bracketIndexFindMatch(&E.buf.brackets, &E.buf.pt, current_offset, bracket, &match_offset);
+    if (!found) return false;
 
-        if (count == 0) {
-            editorOffsetToRowCol(&E.buf, current_offset, match_y, match_x);
-            return true;
-        }
-    }
-    return false;
+    editorOffsetToRowCol(&E.buf, match_offset, match_y, match_x);
+    return true;
 }
 
 void editorJumpToMatchingBracket() {
@@ -4173,12 +11915,14 @@ void editorReadFromPipe(int fd, const char *filename) {
     editorUpdateLineOffsets(&E.buf);
 
     E.buf.dirty = true;
+    E.buf.edited.all = true;
     history.save_point = -1;
 }
 
 void editorOpen(const char *filename) {
     free(E.buf.filename);
     E.buf.filename = safeStrdup(filename);
+    dirtyRangesClear(&E.buf.edited);
 
     FILE *fp = fopen(filename, "r");
     if (!fp) {
@@ -4191,6 +11935,9 @@ void editorOpen(const char *filename) {
         die("fopen");
     }
 
+    // the stamp read here is what a saved history is matched against
+    struct stat st;
+    bool stamped = fstat(fileno(fp), &st) == 0;
     fseek(fp, 0, SEEK_END);
     long file_size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
@@ -4209,10 +11956,141 @@ void editorOpen(const char *filename) {
     editorUpdateLineOffsets(&E.buf);
     E.buf.dirty = false;
     history.save_point = history.undo_top;
+    editorLoadUndoHistory(filename, stamped ? &st : NULL);
+}
+
+bool editorSwitchFile(const char *filename) {
+    if (E.buf.dirty) {
+        editorSetStatusMsg("Unsaved changes, save (Ctrl-S) before opening another file");
+        return false;
+    }
+
+    editorResetFind();
+    editorFreeTreeSitter();
+    ptFree(&E.buf.pt);
+    bracketIndexFree(&E.buf.brackets);
+    free(E.buf.line_offsets);
+    E.buf.line_offsets = NULL;
+    E.buf.num_lines = 0;
+    E.buf.line_capacity = 0;
+    E.buf.save_times = SAVE_TIMES;
+    E.buf.quit_times = QUIT_TIMES;
+
+    // the history belongs to the old buffer
+    editorClearHistory();
+
+    E.cursor.x = 0;
+    E.cursor.y = 0;
+    E.cursor.render_x = 0;
+    E.cursor.preferred_x = 0;
+    E.view.row_offset = 0;
+    E.view.col_offset = 0;
+    E.sel.active = false;
+    E.sys.has_bracket = false;
+    E.ts.needs_reparse = false;
+
+    editorOpen(filename);
+    editorUpdateWindowTitle();
+    editorInitTreeSitter();
+    editorInvalidateFrameCache();
+    return true;
+}
+
+void dirtyRangesClear(DirtyRanges *dr) {
+    dr->count = 0;
+    dr->all = false;
+}
+
+void dirtyRangesApply(DirtyRanges *dr, const ReplaceSpan *spans, size_t num_spans) {
+    if (dr->all || num_spans == 0) return;
+
+    // old ranges move past the spans and collapse inside them, the new text joins the set,
+    // both lists are sorted by old offset so they are merged in one sweep
+    DirtyRange *out = safeMalloc(sizeof(DirtyRange) * (dr->count + num_spans));
+    size_t out_count = 0;
+    size_t r = 0, i = 0, map_span = 0;
+    long span_delta = 0, map_delta = 0;
+    while (r < dr->count || i < num_spans) {
+        DirtyRange next;
+        if (i < num_spans && (r >= dr->count || spans[i].offset <= dr->ranges[r].start)) {
+            size_t start = (size_t)((long)spans[i].offset + span_delta);
+            next = (DirtyRange){ start, start + spans[i].new_len };
+            span_delta += (long)spans[i].new_len - (long)spans[i].old_len;
+            i++;
+        } else {
+            next = dr->ranges[r++];
+            size_t *points[2] = { &next.start, &next.end };
+            for (int k = 0; k < 2; k++) {
+                size_t pos = *points[k];
+                while (map_span < num_spans && pos >= spans[map_span].offset + spans[map_span].old_len) {
+                    map_delta += (long)spans[map_span].new_len - (long)spans[map_span].old_len;
+                    map_span++;
+                }
+                if (map_span < num_spans && pos > spans[map_span].offset) pos = spans[map_span].offset;
+                *points[k] = (size_t)((long)pos + map_delta);
+            }
+        }
+
+        if (out_count > 0 && next.start <= out[out_count - 1].end) {
+            if (next.end > out[out_count - 1].end) out[out_count - 1].end = next.end;
+        } else {
+            out[out_count++] = next;
+        }
+    }
+
+    free(dr->ranges);
+    dr->ranges = out;
+    dr->capacity = dr->count + num_spans;
+    dr->count = out_count;
+}
+
+void dirtyRangesTrackEdit(DirtyRanges *dr, size_t offset, size_t removed, size_t inserted) {
+    if (dr->all) return;
+
+    // ranges ending before the edit are untouched
+    size_t lo = 0, hi = dr->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dr->ranges[mid].end < offset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    long delta = (long)inserted - (long)removed;
+    for (size_t i = lo; i < dr->count; i++) {
+        size_t *points[2] = { &dr->ranges[i].start, &dr->ranges[i].end };
+        for (int k = 0; k < 2; k++) {
+            if (*points[k] >= offset + removed) *points[k] = (size_t)((long)*points[k] + delta);
+            else if (*points[k] > offset) *points[k] = offset;
+        }
+    }
+
+    // the edited text joins every range it now touches
+    DirtyRange merged = { offset, offset + inserted };
+    size_t end = lo;
+    while (end < dr->count && dr->ranges[end].start <= merged.end) {
+        if (dr->ranges[end].start < merged.start) merged.start = dr->ranges[end].start;
+        if (dr->ranges[end].end > merged.end) merged.end = dr->ranges[end].end;
+        end++;
+    }
+
+    if (end == lo) {
+        if (dr->count >= dr->capacity) {
+            dr->capacity = dr->capacity == 0 ? INIT_DIRTY_RANGE_CAP : dr->capacity * 2;
+            dr->ranges = safeRealloc(dr->ranges, sizeof(DirtyRange) * dr->capacity);
+        }
+        memmove(&dr->ranges[lo + 1], &dr->ranges[lo], sizeof(DirtyRange) * (dr->count - lo));
+        dr->count++;
+    } else if (end > lo + 1) {
+        memmove(&dr->ranges[lo + 1], &dr->ranges[end], sizeof(DirtyRange) * (dr->count - end));
+        dr->count -= end - lo - 1;
+    }
+    dr->ranges[lo] = merged;
 }
 
 void editorSave() {
-    editorTrimTrailingWhitespace();
+    const char *trim = getenv("CYPHER_TRIM_WHITESPACE");
+    if (!trim || strcmp(trim, "off") != 0)
+        editorTrimTrailingWhitespace(trim && strcmp(trim, "all") == 0);
     if (!E.buf.dirty) {
         editorSetStatusMsg("No changes to save");
         return;
@@ -4273,21 +12151,36 @@ void editorSave() {
     }
 
     int total_bytes = E.buf.pt.logical_size;
+    uint64_t content_hash = FNV_OFFSET_64;
     bool success = true;
     if (total_bytes > 0) {
-        size_t bytes_written = 0;
-        for (size_t i = 0; i < E.buf.pt.num_pieces; i++) {
+        // small pieces are gathered into one chunk, a fragmented document is not written a piece per call
+        char *chunk = safeMalloc(SAVE_CHUNK_SIZE);
+        size_t chunk_len = 0, bytes_written = 0;
+        for (size_t i = 0; i < E.buf.pt.num_pieces && success; i++) {
             Piece p = E.buf.pt.pieces[i];
             if (p.length == 0) continue;
 
             char *source = (p.source == BUFFER_ORIGINAL) ? E.buf.pt.orig_buf : E.buf.pt.add_buf;
-            ssize_t written = write(fd, source + p.start, p.length);
-            if (written != (ssize_t)p.length) {
-                success = false;
-                break;
+            content_hash = hashBytes(content_hash, source + p.start, p.length);
+            if (chunk_len + p.length > SAVE_CHUNK_SIZE) {
+                success = editorWriteAt(fd, (const unsigned char *)chunk, chunk_len, (off_t)bytes_written);
+                bytes_written += chunk_len;
+                chunk_len = 0;
+            }
+            if (p.length >= SAVE_CHUNK_SIZE) {
+                success = success && editorWriteAt(fd, (const unsigned char *)source + p.start, p.length, (off_t)bytes_written);
+                bytes_written += p.length;
+            } else {
+                memcpy(chunk + chunk_len, source + p.start, p.length);
+                chunk_len += p.length;
             }
-            bytes_written += written;
         }
+        if (success && chunk_len > 0) {
+            success = editorWriteAt(fd, (const unsigned char *)chunk, chunk_len, (off_t)bytes_written);
+            bytes_written += chunk_len;
+        }
+        free(chunk);
         if (bytes_written != (size_t)total_bytes) success = false;
     }
 
@@ -4322,9 +12215,21 @@ void editorSave() {
             }
 
             E.buf.dirty = false;
+            dirtyRangesClear(&E.buf.edited);
             E.buf.quit_times = QUIT_TIMES;
+            // a history loaded on the file's stamp alone has to match before the saved state moves past it
+            if (!editorCheckUndoBase()) editorClearHistory();
             history.save_point = history.undo_top;
-            ptSquash(&E.buf.pt);
+            for (int i = 0; i < history.num_branches; i++)
+                history.branches[i].save_point = -2;
+            // undo entries and branch snapshots point into the current buffers, so they are only squashed without a history
+            if (history.undo_top < 0 && history.redo_top < 0 && history.num_branches == 0)
+                ptSquash(&E.buf.pt);
+            else if (E.buf.pt.add_len >= ADD_COMPACT_MIN && E.buf.pt.add_len > 2 * E.buf.pt.add_kept)
+                editorCompactAddBuffer();
+            struct stat saved_st;
+            bool stamped = stat(actual_filename, &saved_st) == 0;
+            editorSaveUndoHistory(actual_filename, content_hash, total_bytes, stamped ? &saved_st : NULL);
 
             char msg[STATUS_LENGTH];
             snprintf(msg, sizeof(msg), "%s written to disk", sizebuf);
@@ -4394,6 +12299,12 @@ long currentMillis() {
     return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+long currentMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 char getClosingChar(char ch) {
     switch (ch) {
         case '(':  return ')';
@@ -4601,40 +12512,51 @@ void getEditorClipboardCmd() {
     }
 }
 
-void editorTrimTrailingWhitespace() {
-    if (E.buf.num_lines == 0) return;
+bool editorTrimLine(int y) {
+    // only the tail of the line is read, from the piece table directly
+    size_t line_start = E.buf.line_offsets[y];
+    size_t line_len = editorGetLineLength(&E.buf, y);
+    size_t keep = line_len;
+    while (keep > 0) {
+        char c = ptCharAt(&E.buf.pt, line_start + keep - 1);
+        if (c != ' ' && c != '\t') break;
+        keep--;
+    }
+    if (keep == line_len) return false;
 
-    bool trimmed_any = false;
-    editorBeginMacro();
-    for (int y = E.buf.num_lines - 1; y >= 0; y--) {
-        size_t line_len;
-        char *line_text = editorGetLine(&E.buf, y, &line_len);
-        if (!line_text || line_len == 0) {
-            free(line_text);
-            continue;
-        }
+    editorBatchReplace(line_start + keep, line_len - keep, NULL, 0);
+    if (E.cursor.y == y && E.cursor.x > (int)keep) {
+        E.cursor.x = keep;
+        E.cursor.preferred_x = E.cursor.x;
+    }
+    return true;
+}
 
-        int trailing_spaces = 0;
-        for (int i = line_len - 1; i >= 0; i--) {
-            if (line_text[i] == ' ' || line_text[i] == '\t')
-                trailing_spaces++;
-            else
-                break;
-        }
+void editorTrimTrailingWhitespace(bool whole_file) {
+    if (E.buf.num_lines == 0) return;
 
-        if (trailing_spaces > 0) {
-            size_t offset = editorGetLogicalOffset(&E.buf, y, line_len - trailing_spaces);
-            executeDelete(offset, trailing_spaces);
-            trimmed_any = true;
-            if (E.cursor.y == y && E.cursor.x > (int)(line_len - trailing_spaces)) {
-                E.cursor.x = line_len - trailing_spaces;
-                E.cursor.preferred_x = E.cursor.x;
-            }
+    // only lines edited since the last save are looked at unless the whole file is asked for
+    DirtyRanges *edited = &E.buf.edited;
+    bool all = whole_file || edited->all;
+    bool trimmed_any = false;
+    int done_from = E.buf.num_lines;
+    editorBeginBatch();
+    for (size_t i = all ? 1 : edited->count; i > 0; i--) {
+        int y1 = 0, y2 = E.buf.num_lines - 1, col;
+        if (!all) {
+            editorOffsetToRowCol(&E.buf, edited->ranges[i - 1].start, &y1, &col);
+            editorOffsetToRowCol(&E.buf, edited->ranges[i - 1].end, &y2, &col);
         }
-        free(line_text);
+        // neighbouring ranges can share a line
+        if (y2 >= done_from) y2 = done_from - 1;
+        for (int y = y2; y >= y1; y--)
+            if (editorTrimLine(y)) trimmed_any = true;
+        if (y1 < done_from) done_from = y1;
     }
 
-    editorEndMacro();
+    editorCaretsMapBatch();
+    editorCommitBatch();
+    editorNormalizeCarets();
     if (trimmed_any)
         editorParseTreeSitter();
 }
@@ -4706,42 +12628,22 @@ void abFree(AppendBuffer *ab) {
 }
 
 void editorInitTreeSitter() {
-    E.ts.parser = ts_parser_new();
-    TSLanguage *lang = editorLoadLanguage(E.buf.filename);
-    if (!lang) {
-        ts_parser_delete(E.ts.parser);
+    LanguageEntry *entry = editorLoadLanguage(E.buf.filename);
+    if (!entry) {
         E.ts.parser = NULL;
         E.ts.tree = NULL;
         E.ts.query = NULL;
+        E.ts.language = NULL;
         editorLoadTheme(NULL);
         return;
     }
 
-    ts_parser_set_language(E.ts.parser, lang);
-    const char *lang_name = editorGetLanguageName(E.buf.filename);
-
-    char exe_dir[PATH_MAX];
-    getEditorDirectory(exe_dir, sizeof(exe_dir));
-
-    char query_path[PATH_MAX + BUFFER_SIZE_PADDING];
-    snprintf(query_path, sizeof(query_path), "%s/queries/%s/highlights.scm", exe_dir, lang_name);
-
-    char *query_string = editorReadFileIntoString(query_path);
-    if (query_string) {
-        uint32_t error_offset;
-        TSQueryError error_type;
-        E.ts.query = ts_query_new(lang, query_string, strlen(query_string), &error_offset, &error_type);
-        free(query_string);
-        editorLoadTheme(E.ts.query);
-        if (!E.ts.query) {
-            char msg[STATUS_LENGTH];
-            snprintf(msg, sizeof(msg), "TS Query Error at offset %u", error_offset);
-            editorSetStatusMsg(msg);
-        }
-    } else {
-        E.ts.query = NULL;
-        editorLoadTheme(NULL);
-    }
+    E.ts.parser = ts_parser_new();
+    ts_parser_set_language(E.ts.parser, entry->language);
+    E.ts.language = entry;
+    E.ts.query = NULL;
+    editorLoadTheme(NULL);
+    editorPollLanguage();   // attach right away if the query is already compiled
 
     E.ts.query_cursor = ts_query_cursor_new();
     if (E.buf.pt.logical_size > 0) {
@@ -4751,6 +12653,7 @@ void editorInitTreeSitter() {
             .encoding = TSInputEncodingUTF8
         };
         E.ts.tree = ts_parser_parse(E.ts.parser, NULL, input);
+        E.buf.brackets.valid = false;
     } else {
         E.ts.tree = NULL;
     }
@@ -4799,10 +12702,21 @@ void editorParseTreeSitter() {
         .encoding = TSInputEncodingUTF8
     };
 
-    TSTree *new_tree = ts_parser_parse(E.ts.parser, E.ts.tree, input);
-    if (E.ts.tree)
-        ts_tree_delete(E.ts.tree);
-    E.ts.tree = new_tree;
+    TSTree *old_tree = E.ts.tree;
+    E.ts.tree = ts_parser_parse(E.ts.parser, old_tree, input);
+    if (!old_tree) {
+        // the bracket index was built without knowing where strings and comments are
+        E.buf.brackets.valid = false;
+        return;
+    }
+
+    // brackets the reparse moved into or out of a string or comment are sorted out again
+    uint32_t num_ranges = 0;
+    TSRange *ranges = E.ts.tree ? ts_tree_get_changed_ranges(old_tree, E.ts.tree, &num_ranges) : NULL;
+    for (uint32_t i = 0; i < num_ranges; i++)
+        bracketIndexClassify(&E.buf.brackets, &E.buf.pt, ranges[i].start_byte, ranges[i].end_byte);
+    free(ranges);
+    ts_tree_delete(old_tree);
 }
 
 const char *readPieceTable(void *payload, uint32_t byte_index, TSPoint position, uint32_t *bytes_read) {
@@ -4827,9 +12741,34 @@ const char *readPieceTable(void *payload, uint32_t byte_index, TSPoint position,
     return source_buf + p.start + piece_offset;
 }
 
+uint32_t editorResolveThemeColor(const char *name, uint32_t length) {
+    uint32_t color = E.ts.default_fg;
+    int best_match_len = 0;
+    for (int r = 0; r < E.ts.num_theme_rules; r++) {
+        if (length >= (uint32_t)E.ts.theme_rules[r].len && strncmp(name, E.ts.theme_rules[r].prefix, E.ts.theme_rules[r].len) == 0) {
+            if (length == (uint32_t)E.ts.theme_rules[r].len || name[E.ts.theme_rules[r].len] == '.') {
+                if (E.ts.theme_rules[r].len > best_match_len) {
+                    color = E.ts.theme_rules[r].color;
+                    best_match_len = E.ts.theme_rules[r].len;
+                }
+            }
+        }
+    }
+    return color;
+}
+
+PassTarget editorCaptureTarget(const char *name, uint32_t length) {
+    if (length >= 6 && strncmp(name, "string", 6) == 0 && (length == 6 || name[6] == '.')) return PASS_TARGET_STRING;
+    if (length >= 7 && strncmp(name, "comment", 7) == 0 && (length == 7 || name[7] == '.')) return PASS_TARGET_COMMENT;
+    return PASS_TARGET_NONE;
+}
+
 void editorLoadTheme(TSQuery *query) {
     free(E.ts.theme_colors);
+    free(E.ts.capture_targets);
     E.ts.theme_colors = NULL;
+    E.ts.capture_targets = NULL;
+    E.ts.pass_mask = 0;
     if (!query) {
         E.ts.theme_color_count = 0;
         return;
@@ -4837,23 +12776,19 @@ void editorLoadTheme(TSQuery *query) {
 
     E.ts.theme_color_count = ts_query_capture_count(query);
     E.ts.theme_colors = safeMalloc(sizeof(uint32_t) * E.ts.theme_color_count);
+    E.ts.capture_targets = safeMalloc(E.ts.theme_color_count);
     for (uint32_t i = 0; i < E.ts.theme_color_count; i++) {
         uint32_t length;
         const char *name = ts_query_capture_name_for_id(query, i, &length);
+        E.ts.theme_colors[i] = editorResolveThemeColor(name, length);
+        E.ts.capture_targets[i] = editorCaptureTarget(name, length);
+    }
 
-        uint32_t color = E.ts.default_fg;
-        int best_match_len = 0;
-        for (int r = 0; r < E.ts.num_theme_rules; r++) {
-            if (length >= (uint32_t)E.ts.theme_rules[r].len && strncmp(name, E.ts.theme_rules[r].prefix, E.ts.theme_rules[r].len) == 0) {
-                if (length == (uint32_t)E.ts.theme_rules[r].len || name[E.ts.theme_rules[r].len] == '.') {
-                    if (E.ts.theme_rules[r].len > best_match_len) {
-                        color = E.ts.theme_rules[r].color;
-                        best_match_len = E.ts.theme_rules[r].len;
-                    }
-                }
-            }
-        }
-        E.ts.theme_colors[i] = color;
+    const char *lang = E.ts.language ? E.ts.language->name : NULL;
+    for (int p = 0; p < editorNumHighlightPasses() && p < MAX_HIGHLIGHT_PASSES; p++) {
+        if (!editorPassAppliesTo(g_highlight_passes[p].languages, lang)) continue;
+        E.ts.pass_colors[p] = editorResolveThemeColor(g_highlight_passes[p].theme_key, strlen(g_highlight_passes[p].theme_key));
+        E.ts.pass_mask |= 1u << p;
     }
 }
 
@@ -4963,14 +12898,19 @@ const char *editorGetLanguageName(const char *filename) {
     return NULL;
 }
 
-TSLanguage *editorLoadLanguage(const char *filename) {
+LanguageEntry *editorLoadLanguage(const char *filename) {
     const char *lang_name = editorGetLanguageName(filename);
     if (!lang_name) return NULL;
 
-    if (E.ts.language_lib) {
-        dlclose(E.ts.language_lib);
-        E.ts.language_lib = NULL;
-    }
+    for (int i = 0; i < g_num_languages; i++)
+        if (strcmp(g_languages[i]->name, lang_name) == 0)
+            return g_languages[i]->language ? g_languages[i] : NULL;
+
+    LanguageEntry *entry = safeCalloc(1, sizeof(LanguageEntry));
+    entry->name = safeStrdup(lang_name);
+    entry->query_state = QUERY_PENDING;
+    g_languages = safeRealloc(g_languages, sizeof(LanguageEntry *) * (g_num_languages + 1));
+    g_languages[g_num_languages++] = entry;
 
     char exe_dir[PATH_MAX];
     getEditorDirectory(exe_dir, sizeof(exe_dir));
@@ -4978,8 +12918,9 @@ TSLanguage *editorLoadLanguage(const char *filename) {
     char lib_path[PATH_MAX + BUFFER_SIZE_PADDING];
     snprintf(lib_path, sizeof(lib_path), "%s/parsers/tree-sitter-%s.so", exe_dir, lang_name);
 
-    E.ts.language_lib = dlopen(lib_path, RTLD_LAZY);
-    if (!E.ts.language_lib) {
+    long load_start = currentMicros();
+    entry->lib = dlopen(lib_path, RTLD_LAZY);
+    if (!entry->lib) {
         editorSetStatusMsg(dlerror());
         return NULL;
     }
@@ -4989,22 +12930,115 @@ TSLanguage *editorLoadLanguage(const char *filename) {
 
     dlerror();
     TSLanguage *(*get_language)(void);
-    *(void **)(&get_language) = dlsym(E.ts.language_lib, func_name);
+    *(void **)(&get_language) = dlsym(entry->lib, func_name);
 
     const char *dlsym_err = dlerror();
     if (dlsym_err) {
         editorSetStatusMsg(dlsym_err);
-        dlclose(E.ts.language_lib);
-        E.ts.language_lib = NULL;
+        dlclose(entry->lib);
+        entry->lib = NULL;
         return NULL;
     }
 
-    return get_language();
+    entry->language = get_language();
+    entry->load_us = currentMicros() - load_start;
+
+    char query_path[PATH_MAX + BUFFER_SIZE_PADDING];
+    snprintf(query_path, sizeof(query_path), "%s/queries/%s/highlights.scm", exe_dir, lang_name);
+    entry->query_path = safeStrdup(query_path);
+
+    // compiling highlights.scm is the slow part of startup, so it runs off the main thread
+    if (pthread_create(&entry->worker, NULL, editorCompileQueryWorker, entry) == 0)
+        entry->worker_running = true;
+    else
+        editorCompileQueryWorker(entry);
+
+    return entry;
+}
+
+void *editorCompileQueryWorker(void *arg) {
+    LanguageEntry *entry = arg;
+    long compile_start = currentMicros();
+
+    TSQuery *query = NULL;
+    QueryState state = QUERY_MISSING;
+    uint32_t error_offset = 0;
+    char *query_string = editorReadFileIntoString(entry->query_path);
+    if (query_string) {
+        TSQueryError error_type;
+        query = ts_query_new(entry->language, query_string, strlen(query_string), &error_offset, &error_type);
+        state = query ? QUERY_READY : QUERY_FAILED;
+        free(query_string);
+    }
+
+    pthread_mutex_lock(&g_languages_lock);
+    entry->query = query;
+    entry->query_error_offset = error_offset;
+    entry->compile_us = currentMicros() - compile_start;
+    entry->query_state = state;
+    pthread_mutex_unlock(&g_languages_lock);
+    return NULL;
+}
+
+bool editorPollLanguage() {
+    LanguageEntry *entry = E.ts.language;
+    if (!entry || E.ts.query) return false;
+
+    pthread_mutex_lock(&g_languages_lock);
+    QueryState state = entry->query_state;
+    pthread_mutex_unlock(&g_languages_lock);
+    if (state == QUERY_PENDING) return false;
+
+    if (entry->worker_running) {
+        pthread_join(entry->worker, NULL);
+        entry->worker_running = false;
+    }
+
+    if (!entry->timings_reported) {
+        entry->timings_reported = true;
+        char msg[STATUS_LENGTH];
+        if (state == QUERY_FAILED)
+            snprintf(msg, sizeof(msg), "TS Query Error at offset %u", entry->query_error_offset);
+        else
+            snprintf(msg, sizeof(msg), "%s: parser %.1f ms, query %.1f ms", entry->name, entry->load_us / 1000.0, entry->compile_us / 1000.0);
+        editorSetStatusMsg(msg);
+    }
+
+    if (state != QUERY_READY) {
+        E.ts.language = NULL;   // no highlights for this buffer, stop polling
+        return false;
+    }
+
+    E.ts.query = entry->query;
+    editorLoadTheme(E.ts.query);
+    return true;
+}
+
+void editorFreeLanguageRegistry() {
+    for (int i = 0; i < g_num_languages; i++) {
+        LanguageEntry *entry = g_languages[i];
+        if (entry->worker_running)
+            pthread_join(entry->worker, NULL);
+        if (entry->query)
+            ts_query_delete(entry->query);
+        if (entry->lib)
+            dlclose(entry->lib);
+        free(entry->query_path);
+        free(entry->name);
+        free(entry);
+    }
+    free(g_languages);
+    g_languages = NULL;
+    g_num_languages = 0;
 }
 
 void editorDebugSyntaxUnderCursor() {
+    char undo[BUFFER_SIZE_128];
+    char msg[STATUS_LENGTH];
+    editorUndoMemoryText(undo, sizeof(undo));
     if (!E.ts.tree || !E.ts.query || !E.ts.query_cursor) {
-        editorSetStatusMsg("Debug: Tree-sitter not active.");
+        snprintf(msg, sizeof(msg), "Debug: Tree-sitter not active. | %s", undo);
+        editorSetStatusMsg(msg);
         return;
     }
 
@@ -5030,13 +13064,11 @@ void editorDebugSyntaxUnderCursor() {
         }
     }
 
-    if (best_length > 0) {
-        char msg[STATUS_LENGTH];
-        snprintf(msg, sizeof(msg), "TS Capture: %.*s", best_length, best_name);
-        editorSetStatusMsg(msg);
-    } else {
-        editorSetStatusMsg("TS Capture: none");
-    }
+    if (best_length > 0)
+        snprintf(msg, sizeof(msg), "TS Capture: %.*s | %s", best_length, best_name, undo);
+    else
+        snprintf(msg, sizeof(msg), "TS Capture: none | %s", undo);
+    editorSetStatusMsg(msg);
 }
 
 bool editorIsOffsetInStringOrComment(size_t offset) {
@@ -5053,16 +13085,13 @@ bool editorIsOffsetInStringOrComment(size_t offset) {
 }
 
 void editorFreeTreeSitter() {
-    free(E.ts.theme_colors);
-    E.ts.theme_colors = NULL;
+    editorLoadTheme(NULL);
     if (E.ts.query_cursor) {
         ts_query_cursor_delete(E.ts.query_cursor);
         E.ts.query_cursor = NULL;
     }
-    if (E.ts.query) {
-        ts_query_delete(E.ts.query);
-        E.ts.query = NULL;
-    }
+    E.ts.query = NULL;
+    E.ts.language = NULL;
     if (E.ts.tree) {
         ts_tree_delete(E.ts.tree);
         E.ts.tree = NULL;
@@ -5071,8 +13100,4 @@ void editorFreeTreeSitter() {
         ts_parser_delete(E.ts.parser);
         E.ts.parser = NULL;
     }
-    if (E.ts.language_lib) {
-        dlclose(E.ts.language_lib);
-        E.ts.language_lib = NULL;
-    }
 }
\ No newline at end of file